@@ -29,23 +29,77 @@ Free Software Foundation, Inc.,
 
 #include <sconex/ScriptTypes.h>
 #include <sconex/Log.h>
+#include <sconex/utils.h>
 
 namespace http {
 
 #define LOG(msg) scx::Log("http").submit(msg);
 
+//=============================================================================
+// SipHash-2-4 keyed hash, used so that passwords aren't held in the cache
+//
+#define SIP_ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND \
+  v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+  v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+  v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+  v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32);
+
+static uint64_t siphash(const unsigned char key[16],
+                        const std::string& data)
+{
+  uint64_t k0 = 0;
+  uint64_t k1 = 0;
+  for (int i=0; i<8; ++i) {
+    k0 |= (uint64_t)key[i] << (8*i);
+    k1 |= (uint64_t)key[i+8] << (8*i);
+  }
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  const unsigned char* p = (const unsigned char*)data.data();
+  size_t len = data.size();
+  size_t end = len - (len % 8);
+  for (size_t i=0; i<end; i+=8) {
+    uint64_t m = 0;
+    for (int j=0; j<8; ++j) m |= (uint64_t)p[i+j] << (8*j);
+    v3 ^= m;
+    SIP_ROUND; SIP_ROUND;
+    v0 ^= m;
+  }
+
+  uint64_t b = (uint64_t)len << 56;
+  for (size_t j=0; j<len%8; ++j) b |= (uint64_t)p[end+j] << (8*j);
+  v3 ^= b;
+  SIP_ROUND; SIP_ROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIP_ROUND; SIP_ROUND; SIP_ROUND; SIP_ROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
 //=============================================================================
 AuthRealm::AuthRealm(HTTPModule* module)
   : m_module(module), 
-    m_hash_method(scx::PasswordHash::create("",0))
+    m_hash_method(scx::PasswordHash::create("",0)),
+    m_cache_max(256),
+    m_cache_ttl(60),
+    m_cache_hits(0),
+    m_cache_misses(0)
 {
   DEBUG_COUNT_CONSTRUCTOR(AuthRealm);
   m_parent = module;
+
+  for (int i=0; i<16; ++i) m_cache_secret[i] = scx::random_byte();
 }
 
 //=============================================================================
 AuthRealm::~AuthRealm()
 {
+  invalidate();
   DEBUG_COUNT_DESTRUCTOR(AuthRealm);
 }
 
@@ -59,6 +113,24 @@ void AuthRealm::set_name(const std::string& name)
 scx::ScriptRef* AuthRealm::authenticate(const std::string& username,
 					const std::string& password)
 {
+  if (username.empty()) return 0;
+  std::string key = cache_key(username,password);
+
+  m_cache_mutex.lock();
+  CacheMap::iterator it = m_cache.find(username);
+  if (it != m_cache.end() && it->second.key == key) {
+    if (it->second.expires > scx::Date::now()) {
+      ++m_cache_hits;
+      // Each request gets its own copy, the cached data is never shared
+      scx::ScriptRef* data =
+        new scx::ScriptRef(it->second.data->object()->new_copy());
+      m_cache_mutex.unlock();
+      return data;
+    }
+  }
+  ++m_cache_misses;
+  m_cache_mutex.unlock();
+
   std::string hash = lookup_hash(username);
   if (hash.empty()) return 0;
   
@@ -71,6 +143,7 @@ scx::ScriptRef* AuthRealm::authenticate(const std::string& username,
     // to the username string, this should keep everyone happy.
     data = scx::ScriptString::new_ref(username);
   }
+  cache_store(username,key,data);
 
   if (rehash) {
     hash = m_hash_method.object()->rehash(password);
@@ -83,6 +156,28 @@ scx::ScriptRef* AuthRealm::authenticate(const std::string& username,
   return data;
 }
 
+//=============================================================================
+void AuthRealm::invalidate(const std::string& username)
+{
+  scx::MutexLocker locker(m_cache_mutex);
+
+  if (username.empty()) {
+    for (CacheMap::iterator it = m_cache.begin(); it != m_cache.end(); ++it) {
+      delete it->second.data;
+    }
+    m_cache.clear();
+    m_cache_order.clear();
+    return;
+  }
+
+  CacheMap::iterator it = m_cache.find(username);
+  if (it != m_cache.end()) {
+    delete it->second.data;
+    m_cache.erase(it);
+    m_cache_order.remove(username);
+  }
+}
+
 //=============================================================================
 std::string AuthRealm::get_string() const
 {
@@ -100,13 +195,25 @@ scx::ScriptRef* AuthRealm::script_op(const scx::ScriptAuth& auth,
 
     // Properties
     if ("hash_method" == name) return m_hash_method.ref_copy();
+    if ("cache" == name) {
+      scx::MutexLocker locker(m_cache_mutex);
+      scx::ScriptMap* map = new scx::ScriptMap();
+      map->give("size",scx::ScriptInt::new_ref(m_cache.size()));
+      map->give("max",scx::ScriptInt::new_ref(m_cache_max));
+      map->give("ttl",scx::ScriptInt::new_ref(m_cache_ttl.seconds()));
+      map->give("hits",scx::ScriptInt::new_ref(m_cache_hits));
+      map->give("misses",scx::ScriptInt::new_ref(m_cache_misses));
+      return new scx::ScriptRef(map);
+    }
 
     // Methods
     if ("auth" == name ||
 	"set_hash_method" == name ||
 	"chpass" == name ||
 	"add_user" == name ||
-	"remove_user" == name) {
+	"remove_user" == name ||
+	"set_cache" == name ||
+	"clear_cache" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
   }
@@ -151,6 +258,7 @@ scx::ScriptRef* AuthRealm::script_method(const scx::ScriptAuth& auth,
       return scx::ScriptError::new_ref("Unknown hash method");
     
     m_hash_method = scx::PasswordHash::Ref(method);
+    invalidate();
     return 0;
   }
 
@@ -192,6 +300,7 @@ scx::ScriptRef* AuthRealm::script_method(const scx::ScriptAuth& auth,
 
     if (!update_hash(a_user->get_string(),hash)) 
       return scx::ScriptError::new_ref("Failed to update password");
+    invalidate(a_user->get_string());
 
     return 0;
   }
@@ -229,10 +338,40 @@ scx::ScriptRef* AuthRealm::script_method(const scx::ScriptAuth& auth,
 
     if (!remove_user(a_user->get_string()))
       return scx::ScriptError::new_ref("Failed to remove user");
+    invalidate(a_user->get_string());
 
     return 0;
   }
 
+  if ("set_cache" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_max =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"max");
+    if (!a_max)
+      return scx::ScriptError::new_ref("Must specify max entries");
+    int n_max = a_max->get_int();
+    if (n_max < 0)
+      return scx::ScriptError::new_ref("Max entries must be >= 0");
+
+    const scx::ScriptInt* a_ttl =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"ttl");
+    if (a_ttl && a_ttl->get_int() <= 0)
+      return scx::ScriptError::new_ref("TTL must be > 0");
+
+    invalidate();
+    scx::MutexLocker locker(m_cache_mutex);
+    m_cache_max = n_max;
+    if (a_ttl) m_cache_ttl = scx::Time(a_ttl->get_int());
+    return 0;
+  }
+
+  if ("clear_cache" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+    invalidate();
+    return 0;
+  }
+
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
 
@@ -243,6 +382,54 @@ bool AuthRealm::update_hash(const std::string& username,
   return false;
 }
 
+//=============================================================================
+std::string AuthRealm::cache_key(const std::string& username,
+                                 const std::string& password) const
+{
+  // Include the username so that equal passwords give different keys
+  std::string data = username;
+  data += '\0';
+  data += password;
+  uint64_t h = siphash(m_cache_secret,data);
+  return std::string((const char*)&h,sizeof(h));
+}
+
+//=============================================================================
+void AuthRealm::cache_store(const std::string& username,
+                            const std::string& key,
+                            scx::ScriptRef* data)
+{
+  scx::MutexLocker locker(m_cache_mutex);
+  if (m_cache_max <= 0) return;
+
+  scx::Date now = scx::Date::now();
+  CacheMap::iterator it = m_cache.find(username);
+  if (it != m_cache.end()) {
+    delete it->second.data;
+    m_cache.erase(it);
+    m_cache_order.remove(username);
+  }
+
+  // Entries all have the same TTL, so the oldest are at the front. Discard
+  // any which have expired, and the oldest if still full.
+  while (!m_cache_order.empty()) {
+    CacheMap::iterator oldest = m_cache.find(m_cache_order.front());
+    if (oldest->second.expires > now &&
+        (int)m_cache.size() < m_cache_max) {
+      break;
+    }
+    delete oldest->second.data;
+    m_cache.erase(oldest);
+    m_cache_order.pop_front();
+  }
+
+  CacheEntry& entry = m_cache[username];
+  entry.key = key;
+  entry.expires = now + m_cache_ttl;
+  entry.data = new scx::ScriptRef(data->object()->new_copy());
+  m_cache_order.push_back(username);
+}
+
 //=============================================================================
 scx::ScriptRef* AuthRealm::lookup_data(const std::string& username)
 {
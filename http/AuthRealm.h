@@ -47,6 +47,11 @@ class MessageStream;
 // via HTTP basic authentication, or queried directly from a script to provide
 // HTML-form based authentication.
 //
+// Since basic authentication sends the credentials with every request,
+// successful authentications are cached for a limited time, so repeated
+// requests don't need to lookup and verify the password hash each time.
+// Only a keyed hash of the password is kept in the cache.
+//
 class HTTP_API AuthRealm : public scx::ScriptObject {
 public:
 
@@ -62,6 +67,9 @@ public:
   scx::ScriptRef* authenticate(const std::string& username,
 			       const std::string& password);
 
+  // Discard cached authentications for a user, or all users if empty
+  void invalidate(const std::string& username = "");
+
   // ScriptObject methods
   virtual std::string get_string() const;
 
@@ -104,6 +112,33 @@ protected:
   std::string m_name;
   scx::PasswordHash::Ref m_hash_method;
 
+private:
+
+  // Keyed hash of a user's credentials for the cache
+  std::string cache_key(const std::string& username,
+                        const std::string& password) const;
+
+  void cache_store(const std::string& username,
+                   const std::string& key,
+                   scx::ScriptRef* data);
+
+  struct CacheEntry {
+    std::string key;
+    scx::Date expires;
+    scx::ScriptRef* data;
+  };
+  typedef std::map<std::string,CacheEntry> CacheMap;
+  CacheMap m_cache;
+
+  // Usernames in order of expiry
+  std::list<std::string> m_cache_order;
+
+  scx::Mutex m_cache_mutex;
+  unsigned char m_cache_secret[16];
+  int m_cache_max;
+  scx::Time m_cache_ttl;
+  unsigned long m_cache_hits;
+  unsigned long m_cache_misses;
 };
 
 
@@ -0,0 +1,312 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Byte ranges
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <http/ByteRange.h>
+#include <http/Request.h>
+#include <http/Response.h>
+#include <http/Status.h>
+#include <sconex/File.h>
+#include <sconex/Date.h>
+#include <sconex/utils.h>
+#include <algorithm>
+namespace http {
+
+// Uncomment to enable debug logging
+//#define BYTERANGE_DEBUG_LOG(m) STREAM_DEBUG_LOG(m)
+
+#ifndef BYTERANGE_DEBUG_LOG
+#  define BYTERANGE_DEBUG_LOG(m)
+#endif
+
+// Requests for more ranges than this are served in full
+#define MAX_BYTE_RANGES 32
+
+//=============================================================================
+static bool byte_range_less(const ByteRange& a, const ByteRange& b)
+{
+  return a.start < b.start;
+}
+
+//=============================================================================
+static bool parse_long(const std::string& str, long& value)
+{
+  if (str.empty() ||
+      str.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  value = atol(str.c_str());
+  return true;
+}
+
+//=============================================================================
+ByteRangeParser::Result ByteRangeParser::parse(const std::string& header,
+                                               long content_length,
+                                               ByteRangeList& ranges)
+{
+  ranges.clear();
+
+  const std::string bytes = "bytes=";
+  std::string::size_type ib = header.find(bytes);
+  if (ib == std::string::npos || content_length < 0) {
+    return None;
+  }
+
+  ByteRangeList found;
+  int num_specs = 0;
+  std::string::size_type start = ib + bytes.length();
+  std::string::size_type end;
+  do {
+    end = header.find_first_of(",",start);
+    std::string spec = header.substr(start,
+      (end == std::string::npos) ? std::string::npos : end-start);
+    start = end+1;
+
+    std::string::size_type s1 = spec.find_first_not_of(" \t");
+    std::string::size_type s2 = spec.find_last_not_of(" \t");
+    if (s1 == std::string::npos) continue;
+    spec = spec.substr(s1, s2-s1+1);
+
+    if (++num_specs > MAX_BYTE_RANGES) return None;
+
+    std::string::size_type ih = spec.find_first_of("-");
+    if (ih == std::string::npos) return None;
+    std::string before_str = spec.substr(0,ih);
+    std::string after_str = spec.substr(ih+1);
+
+    long first = 0;
+    long last = 0;
+    if (before_str.empty()) {
+      // Suffix range: last N bytes
+      long suffix = 0;
+      if (!parse_long(after_str,suffix)) return None;
+      if (suffix == 0 || content_length == 0) continue;
+      first = std::max(0L, content_length - suffix);
+      last = content_length - 1;
+
+    } else {
+      if (!parse_long(before_str,first)) return None;
+      if (after_str.empty()) {
+        last = content_length - 1;
+      } else {
+        if (!parse_long(after_str,last)) return None;
+        if (last < first) return None;
+        last = std::min(last, content_length - 1);
+      }
+      if (first >= content_length) continue;
+    }
+
+    found.push_back(ByteRange(first, last - first + 1));
+  } while (end != std::string::npos);
+
+  if (found.empty()) {
+    return (num_specs > 0) ? Unsatisfiable : None;
+  }
+
+  // Sort and coalesce overlapping or adjacent ranges
+  std::sort(found.begin(), found.end(), byte_range_less);
+  for (ByteRangeList::const_iterator it = found.begin();
+       it != found.end(); ++it) {
+    if (!ranges.empty()) {
+      ByteRange& prev = ranges.back();
+      if (it->start <= prev.start + prev.length) {
+        long end_pos = std::max(prev.start + prev.length,
+                                it->start + it->length);
+        prev.length = end_pos - prev.start;
+        continue;
+      }
+    }
+    ranges.push_back(*it);
+  }
+
+  return Satisfiable;
+}
+
+//=============================================================================
+bool ByteRangeParser::if_range(const Request& request,
+                               const Response& response)
+{
+  std::string if_range = request.get_header("If-Range");
+  if (if_range.empty()) return true;
+
+  if (if_range[0] == '"' || if_range.find("W/") == 0) {
+    // Entity tag, must be a strong match
+    std::string etag = response.get_header("ETag");
+    return (!etag.empty() &&
+            etag.find("W/") != 0 &&
+            etag == if_range);
+  }
+
+  // HTTP date, must exactly match the last modified date
+  std::string lastmod = response.get_header("Last-Modified");
+  if (lastmod.empty()) return false;
+  return (scx::Date(lastmod) == scx::Date(if_range));
+}
+
+
+//=============================================================================
+ByteRangeStream::ByteRangeStream(scx::File* file,
+                                 const ByteRangeList& ranges,
+                                 long content_length,
+                                 const std::string& content_type)
+  : scx::Stream("http:byterange"),
+    m_file(file),
+    m_ranges(ranges),
+    m_content_length(content_length),
+    m_content_type(content_type),
+    m_index(0),
+    m_started(false),
+    m_remaining(0),
+    m_done(false)
+{
+  if (m_ranges.size() > 1) {
+    m_boundary = scx::random_hex_string(24);
+  }
+}
+
+//=============================================================================
+ByteRangeStream::~ByteRangeStream()
+{
+
+}
+
+//=============================================================================
+void ByteRangeStream::set_headers(Response& response) const
+{
+  response.set_status(Status::PartialContent);
+
+  long length = 0;
+  std::ostringstream oss;
+  if (m_ranges.size() == 1) {
+    const ByteRange& range = m_ranges.front();
+    length = range.length;
+    oss << "bytes " << range.start << "-" << (range.start + range.length - 1)
+        << "/" << m_content_length;
+    response.set_header("Content-Range",oss.str());
+
+  } else {
+    for (ByteRangeList::const_iterator it = m_ranges.begin();
+         it != m_ranges.end(); ++it) {
+      length += part_header(*it).size() + it->length;
+    }
+    length += final_boundary().size();
+    response.remove_header("Content-Range");
+    response.set_header("Content-Type",
+                        "multipart/byteranges; boundary=" + m_boundary);
+  }
+
+  oss.str("");
+  oss << length;
+  response.set_header("Content-Length",oss.str());
+}
+
+//=============================================================================
+scx::Condition ByteRangeStream::read(void* buffer,int n,int& na)
+{
+  na = 0;
+  char* cbuf = (char*)buffer;
+
+  while (na < n) {
+
+    if (!m_pending.empty()) {
+      // Send any pending multipart headers
+      int len = std::min((int)m_pending.size(), n - na);
+      memcpy(cbuf + na, m_pending.data(), len);
+      m_pending.erase(0, len);
+      na += len;
+      continue;
+    }
+
+    if (m_index >= m_ranges.size()) {
+      if (!m_done) {
+        m_done = true;
+        if (!m_boundary.empty()) m_pending = final_boundary();
+        continue;
+      }
+      break;
+    }
+
+    const ByteRange& range = m_ranges[m_index];
+    if (!m_started) {
+      // Seek straight to the start of the next range
+      BYTERANGE_DEBUG_LOG("Seek to range " << range.start <<
+                          " length " << range.length);
+      if (m_file->seek(range.start) != scx::Ok) {
+        return scx::Error;
+      }
+      m_started = true;
+      m_remaining = range.length;
+      if (!m_boundary.empty()) m_pending = part_header(range);
+      continue;
+    }
+
+    if (m_remaining <= 0) {
+      ++m_index;
+      m_started = false;
+      continue;
+    }
+
+    int nr = 0;
+    int max = (int)std::min((long)(n - na), m_remaining);
+    scx::Condition c = Stream::read(cbuf + na, max, nr);
+    na += nr;
+    m_remaining -= nr;
+    if (c != scx::Ok || nr <= 0) {
+      if (na > 0) return scx::Ok;
+      // Premature end of file is an error since we've promised the length
+      return (c == scx::End) ? scx::Error : c;
+    }
+  }
+
+  if (na == 0 && m_done) return scx::End;
+  return scx::Ok;
+}
+
+//=============================================================================
+std::string ByteRangeStream::stream_status() const
+{
+  std::ostringstream oss;
+  oss << "range:" << m_index << "/" << m_ranges.size()
+      << " rem:" << m_remaining;
+  if (!m_boundary.empty()) oss << " MULTI";
+  return oss.str();
+}
+
+//=============================================================================
+std::string ByteRangeStream::part_header(const ByteRange& range) const
+{
+  std::ostringstream oss;
+  oss << CRLF << "--" << m_boundary << CRLF;
+  if (!m_content_type.empty()) {
+    oss << "Content-Type: " << m_content_type << CRLF;
+  }
+  oss << "Content-Range: bytes " << range.start << "-"
+      << (range.start + range.length - 1) << "/" << m_content_length << CRLF
+      << CRLF;
+  return oss.str();
+}
+
+//=============================================================================
+std::string ByteRangeStream::final_boundary() const
+{
+  return std::string(CRLF) + "--" + m_boundary + "--" + CRLF;
+}
+
+};
@@ -0,0 +1,120 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Byte ranges
+
+Parsing of Range headers, and a stream for reading the requested ranges
+directly from a seekable file, producing a multipart/byteranges body when
+more than one range is requested.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef httpByteRange_h
+#define httpByteRange_h
+
+#include <http/http.h>
+#include <sconex/Stream.h>
+#include <vector>
+namespace scx { class File; };
+
+namespace http {
+
+class Request;
+class Response;
+
+//=============================================================================
+// ByteRange - A single satisfiable byte range within an entity
+//
+struct HTTP_API ByteRange {
+  ByteRange(long s, long l) : start(s), length(l) {};
+  long start;
+  long length;
+};
+
+typedef std::vector<ByteRange> ByteRangeList;
+
+//=============================================================================
+// ByteRangeParser - Decodes a Range header against an entity length.
+//
+class HTTP_API ByteRangeParser {
+public:
+
+  enum Result {
+    None,          // No (or unrecognised) range, send the full entity
+    Satisfiable,   // One or more ranges to send
+    Unsatisfiable  // Ranges present but none can be satisfied
+  };
+
+  // Parse header value (e.g. "bytes=0-99,200-") against entity length.
+  // Overlapping or adjacent ranges are coalesced.
+  static Result parse(const std::string& header,
+                      long content_length,
+                      ByteRangeList& ranges);
+
+  // Check an If-Range header value against the entity validators,
+  // returns true if the range request should be honoured.
+  static bool if_range(const Request& request,
+                       const Response& response);
+
+};
+
+//=============================================================================
+// ByteRangeStream - Reads the requested ranges from a file, seeking directly
+// to the start of each range. Add this to the file descriptor before the
+// transfer stream.
+//
+class HTTP_API ByteRangeStream : public scx::Stream {
+public:
+
+  // Create a stream to send the specified ranges from file.
+  // If there is more than one range, the content is sent as
+  // multipart/byteranges using the given content type for each part.
+  ByteRangeStream(scx::File* file,
+                  const ByteRangeList& ranges,
+                  long content_length,
+                  const std::string& content_type);
+
+  virtual ~ByteRangeStream();
+
+  // Set response headers (status, Content-Type, Content-Length and
+  // Content-Range) to describe the ranged content.
+  void set_headers(Response& response) const;
+
+  virtual scx::Condition read(void* buffer,int n,int& na);
+
+  virtual std::string stream_status() const;
+
+private:
+
+  std::string part_header(const ByteRange& range) const;
+  std::string final_boundary() const;
+
+  scx::File* m_file;
+  ByteRangeList m_ranges;
+  long m_content_length;
+  std::string m_content_type;
+  std::string m_boundary;
+
+  unsigned int m_index;
+  bool m_started;
+  long m_remaining;
+  std::string m_pending;
+  bool m_done;
+};
+
+};
+#endif
@@ -0,0 +1,103 @@
+/* SconeServer (http://www.sconemad.com)
+
+UNIT TESTS for ByteRange
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <http/ByteRange.h>
+#include <sconex/UnitTester.h>
+using namespace http;
+
+static bool has_range(const ByteRangeList& ranges,
+                      unsigned int i, long start, long length)
+{
+  return (i < ranges.size() &&
+          ranges[i].start == start &&
+          ranges[i].length == length);
+}
+
+void ByteRange_ut()
+{
+  ByteRangeList r;
+
+  UTSEC("single ranges");
+  UTEST(ByteRangeParser::parse("bytes=0-99",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,0,100));
+  UTEST(ByteRangeParser::parse("bytes=500-",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,500,500));
+  UTEST(ByteRangeParser::parse("bytes=900-2000",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,900,100));
+
+  UTSEC("suffix ranges");
+  UTEST(ByteRangeParser::parse("bytes=-100",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,900,100));
+  UTMSG("longer than the entity");
+  UTEST(ByteRangeParser::parse("bytes=-5000",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,0,1000));
+  UTMSG("zero length");
+  UTEST(ByteRangeParser::parse("bytes=-0",1000,r) ==
+        ByteRangeParser::Unsatisfiable);
+  UTEST(ByteRangeParser::parse("bytes=-10",0,r) ==
+        ByteRangeParser::Unsatisfiable);
+
+  UTSEC("multiple ranges");
+  UTEST(ByteRangeParser::parse("bytes=500-599, 0-99",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 2 && has_range(r,0,0,100) && has_range(r,1,500,100));
+
+  UTMSG("overlapping");
+  UTEST(ByteRangeParser::parse("bytes=0-99,50-149",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,0,150));
+  UTEST(ByteRangeParser::parse("bytes=100-199,0-999",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,0,1000));
+  UTEST(ByteRangeParser::parse("bytes=-100,850-",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,850,150));
+
+  UTMSG("adjacent");
+  UTEST(ByteRangeParser::parse("bytes=0-99,100-199,300-",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 2 && has_range(r,0,0,200) && has_range(r,1,300,700));
+
+  UTMSG("some unsatisfiable");
+  UTEST(ByteRangeParser::parse("bytes=2000-,0-9",1000,r) ==
+        ByteRangeParser::Satisfiable);
+  UTEST(r.size() == 1 && has_range(r,0,0,10));
+
+  UTSEC("unsatisfiable");
+  UTEST(ByteRangeParser::parse("bytes=1000-",1000,r) ==
+        ByteRangeParser::Unsatisfiable);
+  UTEST(r.empty());
+  UTEST(ByteRangeParser::parse("bytes=2000-2999,5000-",1000,r) ==
+        ByteRangeParser::Unsatisfiable);
+
+  UTSEC("invalid");
+  UTEST(ByteRangeParser::parse("",1000,r) == ByteRangeParser::None);
+  UTEST(ByteRangeParser::parse("lines=0-9",1000,r) == ByteRangeParser::None);
+  UTEST(ByteRangeParser::parse("bytes=9-0",1000,r) == ByteRangeParser::None);
+  UTEST(ByteRangeParser::parse("bytes=a-b",1000,r) == ByteRangeParser::None);
+  UTEST(ByteRangeParser::parse("bytes=10",1000,r) == ByteRangeParser::None);
+  UTEST(ByteRangeParser::parse("bytes=0-9",-1,r) == ByteRangeParser::None);
+}
@@ -39,7 +39,12 @@ Client::Client(HTTPModule* module,
   : m_module(module),
     m_request(new Request("")),
     m_response(new Response()),
-    m_error(false)
+    m_running(false),
+    m_error(false),
+    m_callback(0),
+    m_self(0),
+    m_reused(false),
+    m_retried(false)
 {
   DEBUG_COUNT_CONSTRUCTOR(HTTPClient);
   m_request.object()->set_method(method);
@@ -52,8 +57,14 @@ Client::Client(const Client& c)
     m_module(c.m_module),
     m_request(c.m_request),
     m_response(c.m_response),
+    m_request_data(c.m_request_data),
     m_response_data(c.m_response_data),
-    m_error(c.m_error)
+    m_running(false),
+    m_error(c.m_error),
+    m_callback(0),
+    m_self(0),
+    m_reused(false),
+    m_retried(false)
 {
   DEBUG_COUNT_CONSTRUCTOR(HTTPClient);
 }
@@ -92,12 +103,15 @@ scx::ScriptRef* Client::script_op(const scx::ScriptAuth& auth,
   if (op.type() == scx::ScriptOp::Lookup) {
     const std::string name = right->object()->get_string();
 
-    if (name == "run") 
+    if (name == "run" ||
+        name == "start" ||
+        name == "wait") 
       return new scx::ScriptMethodRef(ref,name);
 
     if (name == "request") return m_request.ref_copy(ref.reftype());
     if (name == "response") return m_response.ref_copy(ref.reftype());
     if (name == "data") return scx::ScriptString::new_ref(m_response_data);
+    if (name == "complete") return scx::ScriptBool::new_ref(is_complete());
   }    
 
   return scx::ScriptObject::script_op(auth,ref,op,right);
@@ -109,15 +123,20 @@ scx::ScriptRef* Client::script_method(const scx::ScriptAuth& auth,
 				      const std::string& name,
 				      const scx::ScriptRef* args)
 {
-  if ("run" == name) {
+  if ("run" == name ||
+      "start" == name) {
     const scx::ScriptObject* a_data = 
       scx::get_method_arg<scx::ScriptObject>(args,0,"data");
     std::string data = (a_data ? a_data->get_string() : "");
     
-    bool success = run(data);
+    bool success = ("run" == name) ? run(data) : start(data);
     return scx::ScriptInt::new_ref(success);
   }
 
+  if ("wait" == name) {
+    return scx::ScriptInt::new_ref(wait());
+  }
+
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
 
@@ -129,8 +148,148 @@ bool Client::run(const std::string& request_data)
     return false;
   }
 
+  if (!begin(request_data,0,false)) {
+    return false;
+  }
+  return wait();
+}
+
+//=============================================================================
+bool Client::start(const std::string& request_data,
+                   ClientCallback* callback)
+{
+  return begin(request_data,callback,true);
+}
+
+//=============================================================================
+bool Client::wait()
+{
+  scx::MutexLocker locker(m_mutex);
+  if (m_running && !scx::Kernel::get()->is_threaded()) {
+    DEBUG_LOG("http::Client cannot wait unless threading is enabled");
+    return false;
+  }
+  while (m_running) {
+    m_complete.wait(m_mutex);
+  }
+  return !m_error;
+}
+
+//=============================================================================
+bool Client::is_complete() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return !m_running;
+}
+
+//=============================================================================
+void Client::set_header(const std::string& name, const std::string& value)
+{
+  m_request.object()->set_header(name, value);
+}
+
+//=============================================================================
+const Response& Client::get_response() const
+{
+  return *m_response.object();
+}
+
+//=============================================================================
+const std::string& Client::get_response_data() const
+{
+  return m_response_data;
+}
+
+//=============================================================================
+void Client::event_complete(bool error, bool retry)
+{
+  if (error && retry && !m_retried) {
+    // The server closed an idle connection just as we reused it, try once
+    // more on a new connection.
+    DEBUG_LOG("Retrying request on new connection");
+    m_retried = true;
+    if (connect(false)) return;
+  }
+
+  m_module.object()->get_client_pool().record_request(
+    m_reused, error, scx::Date::now() - m_start);
+  
+  m_mutex.lock();
+  m_error = error;
+  m_running = false;
+  ClientCallback* callback = m_callback;
+  m_callback = 0;
+  Ref* self = m_self;
+  m_self = 0;
+  m_complete.broadcast();
+  m_mutex.unlock();
+
+  if (callback) {
+    callback->client_complete(*this,error);
+  }
+
+  // This may delete the client
+  delete self;
+}
+
+//=============================================================================
+bool Client::begin(const std::string& request_data,
+                   ClientCallback* callback,
+                   bool async)
+{
+  m_mutex.lock();
+  if (m_running) {
+    m_mutex.unlock();
+    DEBUG_LOG("http::Client request already running");
+    return false;
+  }
+  m_running = true;
+  m_error = false;
+  m_callback = callback;
+  m_self = async ? new Ref(this) : 0;
+  m_mutex.unlock();
+
+  m_request_data = request_data;
+  m_response = Response::Ref(new Response());
+  m_response_data = "";
+  m_start = scx::Date::now();
+  m_retried = false;
+
+  // Hold a reference while connecting, as an async request could complete
+  // (and release the client) before connect returns.
+  Ref* hold = async ? new Ref(this) : 0;
+  bool started = connect(true);
+  if (!started) {
+    m_mutex.lock();
+    m_running = false;
+    m_error = true;
+    m_callback = 0;
+    Ref* self = m_self;
+    m_self = 0;
+    m_mutex.unlock();
+    delete self;
+  }
+  delete hold;
+  return started;
+}
+
+//=============================================================================
+bool Client::connect(bool allow_reuse)
+{
+  HTTPModule* module = m_module.object();
+  ClientPool& pool = module->get_client_pool();
+  std::string key = ClientPool::make_key(m_request.object()->get_uri(),
+                                         module->get_client_proxy());
+
+  // Use an idle connection to this host if there is one
+  if (allow_reuse && pool.acquire(key,this)) {
+    m_reused = true;
+    return true;
+  }
+  m_reused = false;
+
   bool proxy = false;
-  scx::Uri addr_url = m_module.object()->get_client_proxy();
+  scx::Uri addr_url = module->get_client_proxy();
   if (addr_url.get_int()) {
     // Connect to proxy
     proxy = true;
@@ -162,15 +321,16 @@ bool Client::run(const std::string& request_data)
   // Create the socket  
   scx::StreamSocket* sock = new scx::StreamSocket();
 
-  // Set idle timeout
-  sock->set_timeout(scx::Time(m_module.object()->get_idle_timeout()));
+  // Set idle timeout, this also limits how long the connection stays
+  // in the pool once the request is complete.
+  sock->set_timeout(scx::Time(module->get_idle_timeout()));
   
   // Is this a secure http connection?
   if (m_request.object()->get_uri().get_scheme() == "https") {
     
     // If a proxy is in use, add a connect stream to setup the tunnel
     if (proxy) {
-      sock->add_stream( new ProxyConnectStream(m_module.object(),
+      sock->add_stream( new ProxyConnectStream(module,
 					       *m_request.object()) );
     }
     
@@ -188,131 +348,140 @@ bool Client::run(const std::string& request_data)
   }
 
   // Add client stream
-  ClientStream* cs = new ClientStream(m_module.object(),this,
-				      *m_request.object(),
-				      request_data,
-				      *m_response.object(),
-				      m_response_data);
+  ClientStream* cs = new ClientStream(module,key);
   sock->add_stream(cs);
 
   // Start the socket connection
   scx::Condition err = sock->connect(addr);
+  delete addr;
   if (err != scx::Ok && err != scx::Wait) {
     delete sock;
-    delete addr;
     DEBUG_LOG("Unable to initiate connection");
     return false;
   }
-  delete addr;
+
+  // From here on, any failure is reported through event_complete() 
+  pool.record_connect();
+  cs->attach(this);
 
   // Give to the kernel for async processing
   if (!scx::Kernel::get()->connect(sock)) {
-    delete sock;
     DEBUG_LOG("System failure");
-    return false;
+    delete sock;
   }
-
-  // Now wait for the completion signal
-  m_mutex.lock();
-  m_complete.wait(m_mutex);
-  m_mutex.unlock();
-
-  return !m_error;
+  return true;
 }
 
-//=============================================================================
-void Client::set_header(const std::string& name, const std::string& value)
-{
-  m_request.object()->set_header(name, value);
-}
 
 //=============================================================================
-const Response& Client::get_response() const
+ClientConnection::ClientConnection(const std::string& stream_name,
+                                   HTTPModule* module,
+                                   const std::string& pool_key)
+  : scx::LineBuffer(stream_name,1024),
+    m_response(0),
+    m_keep_alive(false),
+    m_received(false),
+    m_uses(0),
+    m_seq(Idle),
+    m_module(module),
+    m_pool(&module->get_client_pool()),
+    m_pool_key(pool_key),
+    m_retire(false),
+    m_chunked(false),
+    m_remaining(-1)
 {
-  return *m_response.object();
-}
 
-//=============================================================================
-const std::string& Client::get_response_data() const
-{
-  return m_response_data;
 }
 
 //=============================================================================
-void Client::event_complete(bool error)
+ClientConnection::~ClientConnection()
 {
-  m_mutex.lock();
-
-  m_error = error;
-  m_complete.signal();
-
-  m_mutex.unlock();
+  remove_from_pool();
+  delete m_response;
 }
 
-
 //=============================================================================
-ClientStream::ClientStream(HTTPModule* module,
-			   Client* client,
-			   Request& request,
-			   const std::string& request_data,
-			   Response& response,
-			   std::string& response_data)
-  : scx::LineBuffer("http:client",1024),
-    m_module(module),
-    m_client(client),
-    m_request(request),
-    m_request_data(request_data),
-    m_response(response),
-    m_response_data(response_data),
-    m_chunked(false),
-    m_remaining(-1),
-    m_seq(Send),
-    m_buffer(0)
+void ClientConnection::retire()
 {
-  build_request(m_request.get_method(),m_request.get_uri());
-  enable_event(scx::Stream::Writeable,true);
+  scx::MutexLocker locker(m_handover_mutex);
+  m_retire = true;
+  request_event(scx::Stream::Writeable);
+  scx::Kernel::get()->wakeup();
 }
 
 //=============================================================================
-ClientStream::~ClientStream()
+const std::string& ClientConnection::get_pool_key() const
 {
-  delete m_buffer;
-  if (m_client) {
-    signal_complete(true);
-  }
+  return m_pool_key;
 }
 
 //=============================================================================
-scx::Condition ClientStream::event(scx::Stream::Event e)
+scx::Condition ClientConnection::event(scx::Stream::Event e)
 {
   scx::Condition c = scx::Ok;
   switch (e) {
     
     case scx::Stream::Writeable: { // WRITEABLE
+      if (m_seq == Idle && !take_handover()) {
+        m_handover_mutex.lock();
+        bool retire = m_retire;
+        m_handover_mutex.unlock();
+        if (!retire) {
+          enable_event(scx::Stream::Writeable,false);
+          return scx::Ok;
+        }
+        // Retired from the pool
+        m_seq = End;
+      }
+
+      if (m_seq == End) {
+        return scx::End;
+      }
+
       if (m_seq == Send) {
         c = send_request();
+        if (c == scx::Wait) return c;
+        if (c != scx::Ok) return complete(true);
+        m_seq = ReceiveResponse;
+        enable_event(scx::Stream::Writeable,false);
+        enable_event(scx::Stream::Readable,true);
       }
     } break;
 
     case scx::Stream::Readable: { // READABLE
+      if (m_seq == Idle) {
+        // The server has closed an idle connection (or sent something
+        // unexpected), so close it unless it has just been reused.
+        if (m_pool.object()->remove(this)) {
+          enable_event(scx::Stream::Readable,false);
+          m_seq = End;
+          return scx::End;
+        }
+        return scx::Ok;
+      }
+
+      if (m_seq == End) {
+        return scx::End;
+      }
+
       if (m_seq == ReceiveResponse) {
         c = receive_response();
-        if (c != scx::Ok) return c;
+        if (c == scx::Wait) return c;
+        if (c != scx::Ok) return complete(true);
       }
 
       if (m_seq == ReceiveHeaders) {
         c = receive_headers();
-        if (c != scx::Ok) return c;
+        if (c == scx::Wait) return c;
+        if (c == scx::End) return complete(false); // No body
+        if (c != scx::Ok) return complete(true);
       }
 
       if (m_seq == ReceiveBody) {
         c = m_chunked ? receive_body_chunked() : receive_body();
-      }
-
-      if (c != scx::Ok && c != scx::Wait) {
-        enable_event(scx::Stream::Readable,false);
-        m_seq = End;
-        signal_complete(c == scx::Error);
+        if (c != scx::Ok && c != scx::Wait) {
+          return complete(c == scx::Error);
+        }
       }
     } break;
 
@@ -324,28 +493,18 @@ scx::Condition ClientStream::event(scx::Stream::Event e)
 }
 
 //=============================================================================
-scx::Condition ClientStream::read(void* buffer,int n,int& na)
-{
-  return scx::StreamTokenizer::read(buffer,n,na);
-}
-
-//=============================================================================
-scx::Condition ClientStream::write(const void* buffer,int n,int& na)
-{
-  return scx::StreamTokenizer::write(buffer,n,na);
-}
-
-//=============================================================================
-std::string ClientStream::stream_status() const
+std::string ClientConnection::stream_status() const
 {
   std::ostringstream oss;
   oss << scx::StreamTokenizer::stream_status()
+      << " uses:" << m_uses
       << " seq:";
   switch (m_seq) {
     case Send: oss << "SEND"; break;
     case ReceiveResponse: oss << "RECV-RESP"; break;
     case ReceiveHeaders: oss << "RECV-HEADERS"; break;
     case ReceiveBody: oss << "RECV-BODY"; break;
+    case Idle: oss << "IDLE"; break;
     case End: oss << "END"; break;
     default: oss << "UNKNOWN!"; break;
   }
@@ -353,195 +512,399 @@ std::string ClientStream::stream_status() const
 }
 
 //=============================================================================
-void ClientStream::build_request(const std::string& method, const scx::Uri& url)
+void ClientConnection::handover()
 {
-  if (m_buffer) {
-    // Clear existing buffer
-    delete m_buffer;
-    m_buffer = 0;
+  // Called from the thread handing the request over, so let the job owning
+  // the connection enable Writeable itself
+  request_event(scx::Stream::Writeable);
+
+  if (m_uses > 0) {
+    // This connection is already known to the kernel, make sure it notices
+    // that we now want to write.
+    scx::Kernel::get()->wakeup();
   }
+}
 
-  // Set version to HTTP/1.1
-  m_request.set_version(scx::VersionTag(1,1));
-
-  // Set method and url
-  m_request.set_method(method);
-  m_request.set_uri(url);
-
-  // Fill in the host header from the url
-  m_request.set_header("Host",url.get_host());
-
-  // Identify ourselves
-  m_request.set_header("User-Agent","SconeServer/" + scx::version().get_string());
+//=============================================================================
+void ClientConnection::remove_from_pool()
+{
+  m_pool.object()->remove(this);
+}
 
-  // Set content length for the request body if the method requires it
-  int body_len = 0;
-  if (method == "POST" || method == "PUT") {
-    body_len = m_request_data.length();
-    std::ostringstream oss;
-    oss << body_len;
-    m_request.set_header("Content-Length",oss.str());
-    m_request.set_header("Content-Type","application/x-www-form-urlencoded");
-  }
+//=============================================================================
+void ClientConnection::begin_request(const std::string& method)
+{
+  m_method = method;
+  delete m_response;
+  m_response = new Response();
+  m_status_line = "";
+  m_header_lines.clear();
+
+  m_chunked = false;
+  m_remaining = -1;
+  m_keep_alive = false;
+  m_received = false;
+  ++m_uses;
+
+  m_seq = Send;
+  enable_event(scx::Stream::Readable,false);
+  enable_event(scx::Stream::Writeable,true);
+}
 
-  // Other headers
-  m_request.set_header("Connection","close");
+//=============================================================================
+int ClientConnection::body_space()
+{
+  return 16384;
+}
 
-  // Push the request into a buffer ready for sending
-  std::string hdrs = m_request.build_header_string();
-  m_buffer = new scx::Buffer(hdrs.length() + body_len);
-  m_buffer->push_string(hdrs);
-  if (body_len > 0) {
-    m_buffer->push_string(m_request_data);
-  }
+//=============================================================================
+int ClientConnection::get_max_idle() const
+{
+  return -1;
 }
 
 //=============================================================================
-scx::Condition ClientStream::send_request()
+scx::Condition ClientConnection::complete(bool error)
 {
-  int na = 0;
-  scx::Condition c = Stream::write(m_buffer->head(),m_buffer->used(),na);
-  if (c != scx::Ok && c != scx::Wait) {
-    return c;
-  }
-  m_buffer->pop(na);
-  
-  if (m_buffer->used() == 0) {
-    // Finished sending request
-    delete m_buffer;
-    m_buffer = 0;
-    m_seq = ReceiveResponse;
-    enable_event(scx::Stream::Writeable,false);
+  enable_event(scx::Stream::Readable,false);
+  enable_event(scx::Stream::Writeable,false);
+
+  bool pooled = false;
+  if (!error && m_keep_alive) {
+    // Return the connection to the pool, watching for it being closed by
+    // the server while idle. Once released another thread may hand over a
+    // new request, but that is only started from our next event.
+    int max_idle = get_max_idle();
+    m_seq = Idle;
     enable_event(scx::Stream::Readable,true);
-  } else {
-    return scx::Wait;
+    pooled = m_pool.object()->release(this,max_idle);
+    if (!pooled) {
+      enable_event(scx::Stream::Readable,false);
+    }
   }
-  return c;
+  if (!pooled) {
+    m_seq = End;
+  }
+
+  response_complete(error);
+
+  return pooled ? scx::Ok : (error ? scx::Error : scx::End);
 }
-  
+
 //=============================================================================
-scx::Condition ClientStream::receive_response()
+scx::Condition ClientConnection::receive_response()
 {
   std::string line;
   scx::Condition c = tokenize(line);
-  if (c != scx::Ok) return c;
-  
-  if (m_response.parse_response(line)) {
-    m_seq = ReceiveHeaders;
-  } else {
-    // went wrong!
+  if (c != scx::Ok) return (c == scx::End) ? scx::Error : c;
+  m_received = true;
+
+  if (!m_response->parse_response(line)) {
     return scx::Error;
   }
-
+  m_status_line = line;
+  m_header_lines.clear();
+  m_seq = ReceiveHeaders;
   return scx::Ok;
 }
 
 //=============================================================================
-scx::Condition ClientStream::receive_headers()
+scx::Condition ClientConnection::receive_headers()
 {
   std::string line;
   scx::Condition c = scx::Ok;
   while (scx::Ok == (c = tokenize(line))) {
-    if (line.empty()) {
-      std::string method = m_request.get_method();
-      if (method != "HEAD") {
-        // Response has a body
-        m_seq = ReceiveBody;
-        m_remaining = -1;
-        m_chunked = 
-          (m_response.get_header("Transfer-Encoding") == "chunked");
-        if (!m_chunked) {
-          std::string cl = m_response.get_header("Content-Length");
-          if (!cl.empty()) {
-            m_remaining = strtoul(cl.c_str(),0,10);
-          }
-        }
-      } else {
-        enable_event(scx::Stream::Readable,false);
-        m_seq = End;
-        signal_complete(false);
-        return scx::End;
-      }
-      break;
-    } else {
-      if (!m_response.parse_header(line)) {
-        // went wrong!
+    if (!line.empty()) {
+      if (!m_response->parse_header(line)) {
         return scx::Error;
       }
+      m_header_lines.push_back(line);
       endpoint().reset_timeout();
+      continue;
+    }
+
+    int code = m_response->get_status().code();
+    if (code >= 100 && code < 200) {
+      // Interim response, wait for the final one
+      delete m_response;
+      m_response = new Response();
+      m_seq = ReceiveResponse;
+      c = receive_response();
+      if (c != scx::Ok) return c;
+      continue;
+    }
+
+    // Can the connection be kept open after this response
+    std::string conn = m_response->get_header("Connection");
+    scx::strlow(conn);
+    m_keep_alive = (conn.find("close") == std::string::npos) &&
+      (m_response->get_version() >= scx::VersionTag(1,1) ||
+       conn.find("keep-alive") != std::string::npos);
+
+    bool body = !(m_method == "HEAD" ||
+                  code == Status::NoContent ||
+                  code == Status::NotModified);
+    if (body) {
+      m_remaining = -1;
+      std::string te = m_response->get_header("Transfer-Encoding");
+      scx::strlow(te);
+      m_chunked = (te.find("chunked") != std::string::npos);
+      if (!m_chunked) {
+        std::string cl = m_response->get_header("Content-Length");
+        if (!cl.empty()) {
+          m_remaining = strtol(cl.c_str(),0,10);
+          if (m_remaining == 0) body = false;
+        } else {
+          // Body is delimited by the connection closing
+          m_keep_alive = false;
+        }
+      }
+    }
+
+    response_headers();
+
+    if (!body) {
+      return scx::End;
     }
+    m_seq = ReceiveBody;
+    return scx::Ok;
   }
-  return c;
+
+  // Connection closed before the end of the headers
+  return (c == scx::End) ? scx::Error : c;
 }
 
 //=============================================================================
-scx::Condition ClientStream::receive_body()
+scx::Condition ClientConnection::receive_body()
 {
-  scx::Condition c = receive_data();
-  if (c == scx::Ok && m_remaining == 0) c = scx::End;
-  if (c != scx::Ok && c != scx::Wait) {
-    enable_event(scx::Stream::Readable,false);
-    m_seq = End;
+  scx::Condition c = scx::Ok;
+  while (c == scx::Ok && m_remaining != 0) {
+    c = receive_data();
   }
+  if (c == scx::End) {
+    // Closed by the server, which is only correct if there's no length
+    m_keep_alive = false;
+    if (m_remaining > 0) c = scx::Error;
+  }
+  if (c == scx::Ok && m_remaining == 0) c = scx::End;
   return c;
 }
 
 //=============================================================================
-scx::Condition ClientStream::receive_body_chunked()
+scx::Condition ClientConnection::receive_body_chunked()
 {
   scx::Condition c = scx::Ok;
-  
-  if (m_remaining == -1) { // Read chunk header
-    std::string line;
-    c = tokenize(line);
-    if (c == scx::Ok) {
-      m_remaining = (int)strtoul(line.c_str(),0,16);
-      if (m_remaining == 0) c = scx::End; // Final chunk
-      //XXX Should we handle trailers?
+  std::string line;
+
+  while (c == scx::Ok) {
+    if (m_remaining == -1) { // Read chunk header
+      c = tokenize(line);
+      if (c == scx::Ok) {
+        m_remaining = strtol(line.c_str(),0,16);
+        if (m_remaining == 0) m_remaining = -2; // Final chunk
+      }
+
+    } else if (m_remaining == -2) { // Read trailers up to a blank line
+      c = tokenize(line);
+      if (c == scx::Ok && line.empty()) return scx::End;
+
+    } else if (m_remaining > 0) { // Read chunk data
+      c = receive_data();
+
+    } else { // Read chunk footer
+      c = tokenize(line);
+      if (c == scx::Ok) m_remaining = -1; // back to header
     }
   }
-  
-  if (c == scx::Ok && m_remaining > 0) { // Read chunk data
-    c = receive_data();
-  }
-  
-  if (c == scx::Ok && m_remaining == 0) { // Read chunk footer
-    std::string line;
-    c = tokenize(line);
-    if (c == scx::Ok) m_remaining = -1; // back to header
+
+  if (c == scx::End) {
+    // Closed by the server before the final chunk
+    m_keep_alive = false;
+    c = scx::Error;
   }
-  
   return c;
 }
 
 //=============================================================================
-scx::Condition ClientStream::receive_data()
+scx::Condition ClientConnection::receive_data()
 {
-  const int max_req = 4096;
-  int nreq = max_req;
-  if (m_remaining > 0 && m_remaining < nreq) nreq = m_remaining;
-  char* buffer = new char[nreq+1];
-  int na=0;
+  int space = body_space();
+  if (space <= 0) {
+    if (!has_readable()) return scx::Wait;
+    // Anything already buffered is read regardless, as we won't be told
+    // about it again.
+    space = 1;
+  }
+
+  char buffer[16384];
+  int nreq = std::min(space,(int)sizeof(buffer));
+  if (m_remaining > 0 && m_remaining < nreq) nreq = (int)m_remaining;
+  int na = 0;
   scx::Condition c = scx::StreamTokenizer::read(buffer,nreq,na);
   if (na > 0) {
     DEBUG_ASSERT(na <= nreq, "Read more than requested");
     if (m_remaining > 0) m_remaining -= na;
-    buffer[na] = '\0';
-    m_response_data += buffer;
+    endpoint().reset_timeout();
+    body_data(buffer,na);
   }
-  delete [] buffer;
   return c;
 }
 
+
 //=============================================================================
-void ClientStream::signal_complete(bool error)
+ClientStream::ClientStream(HTTPModule* module,
+			   const std::string& pool_key)
+  : ClientConnection("http:client",module,pool_key),
+    m_client(0),
+    m_handover(0),
+    m_buffer(0)
 {
-  if (m_client) {  
-    m_client->event_complete(error);
-  } else {
-    DEBUG_LOG("signal_complete called more than once!");
+
+}
+
+//=============================================================================
+ClientStream::~ClientStream()
+{
+  remove_from_pool();
+  delete m_buffer;
+
+  if (m_client) {
+    Client* client = m_client;
+    m_client = 0;
+    client->event_complete(true, m_uses > 1 && !m_received);
+  }
+
+  // A request handed over but never started can safely be retried if
+  // this was a reused connection.
+  m_handover_mutex.lock();
+  Client* client = m_handover;
+  m_handover = 0;
+  m_handover_mutex.unlock();
+  if (client) {
+    client->event_complete(true, m_uses > 0);
+  }
+}
+
+//=============================================================================
+void ClientStream::attach(Client* client)
+{
+  // The connection may be idle in the kernel, with its job running on
+  // another thread, so leave the request for that job to start rather
+  // than touching the connection state from here.
+  scx::MutexLocker locker(m_handover_mutex);
+  m_handover = client;
+  handover();
+}
+
+//=============================================================================
+bool ClientStream::take_handover()
+{
+  m_handover_mutex.lock();
+  Client* client = m_handover;
+  m_handover = 0;
+  m_handover_mutex.unlock();
+  if (!client) {
+    return false;
+  }
+
+  m_client = client;
+  build_request(client->m_request_data);
+  begin_request(client->m_request.object()->get_method());
+  return true;
+}
+
+//=============================================================================
+void ClientStream::build_request(const std::string& request_data)
+{
+  if (m_buffer) {
+    // Clear existing buffer
+    delete m_buffer;
+    m_buffer = 0;
+  }
+
+  Request* request = m_client->m_request.object();
+  const std::string& method = request->get_method();
+  const scx::Uri& url = request->get_uri();
+
+  // Set version to HTTP/1.1
+  request->set_version(scx::VersionTag(1,1));
+
+  // Fill in the host header from the url
+  request->set_header("Host",url.get_host());
+
+  // Identify ourselves
+  request->set_header("User-Agent","SconeServer/" + scx::version().get_string());
+
+  // Set content length for the request body if the method requires it
+  int body_len = 0;
+  if (method == "POST" || method == "PUT") {
+    body_len = request_data.length();
+    std::ostringstream oss;
+    oss << body_len;
+    request->set_header("Content-Length",oss.str());
+    request->set_header("Content-Type","application/x-www-form-urlencoded");
   }
+
+  // Other headers
+  request->set_header("Connection","keep-alive");
+
+  // Push the request into a buffer ready for sending
+  std::string hdrs = request->build_header_string();
+  m_buffer = new scx::Buffer(hdrs.length() + body_len);
+  m_buffer->push_string(hdrs);
+  if (body_len > 0) {
+    m_buffer->push_string(request_data);
+  }
+}
+
+//=============================================================================
+scx::Condition ClientStream::send_request()
+{
+  int na = 0;
+  scx::Condition c = Stream::write(m_buffer->head(),m_buffer->used(),na);
+  if (c != scx::Ok && c != scx::Wait) {
+    return c;
+  }
+  m_buffer->pop(na);
+  endpoint().reset_timeout();
+  
+  if (m_buffer->used() > 0) {
+    return scx::Wait;
+  }
+
+  // Finished sending request
+  delete m_buffer;
+  m_buffer = 0;
+  return scx::Ok;
+}
+
+//=============================================================================
+void ClientStream::response_headers()
+{
+  Response* response = m_client->m_response.object();
+  response->parse_response(m_status_line);
+  for (std::vector<std::string>::const_iterator it = m_header_lines.begin();
+       it != m_header_lines.end(); ++it) {
+    response->parse_header(*it);
+  }
+}
+
+//=============================================================================
+void ClientStream::body_data(const char* data, int n)
+{
+  m_client->m_response_data.append(data,n);
+}
+
+//=============================================================================
+void ClientStream::response_complete(bool error)
+{
+  Client* client = m_client;
   m_client = 0;
+  if (client) {
+    client->event_complete(error, error && m_uses > 1 && !m_received);
+  } else {
+    DEBUG_LOG("complete called more than once!");
+  }
 }
 
 //=============================================================================
@@ -25,16 +25,40 @@ Free Software Foundation, Inc.,
 #include <http/HTTPModule.h>
 #include <http/Request.h>
 #include <http/Response.h>
+#include <http/ClientPool.h>
 
 #include <sconex/ScriptBase.h>
 #include <sconex/LineBuffer.h>
 #include <sconex/Uri.h>
 #include <sconex/Mutex.h>
+#include <sconex/Date.h>
 namespace http {
 
+class Client;
 class ClientStream;
 
 //=============================================================================
+// ClientCallback - Interface for receiving completion of a non-blocking
+// client request.
+//
+class HTTP_API ClientCallback {
+public:
+
+  virtual ~ClientCallback() {};
+
+  // Called (from a kernel thread) when the request completes
+  virtual void client_complete(Client& client, bool error) =0;
+
+};
+
+//=============================================================================
+// Client - An HTTP client request.
+//
+// Requests are sent over persistent connections taken from the module's
+// client pool where possible. A request can either be run to completion,
+// blocking the calling thread, or started in the background, completing
+// through a callback or by waiting on it later.
+//
 class HTTP_API Client : public scx::ScriptObject {
 public:
 
@@ -63,30 +87,75 @@ public:
   typedef scx::ScriptRefTo<Client> Ref;
 
   // Client methods
+
+  // Run the request, blocking until it completes
   bool run(const std::string& request_data = "");
 
+  // Start the request without blocking. If a callback is given it is
+  // called on completion, otherwise use wait() to collect the result.
+  // The client must be heap allocated and referenced, as a reference is
+  // held until the request completes.
+  bool start(const std::string& request_data = "",
+             ClientCallback* callback = 0);
+
+  // Wait for a started request to complete
+  bool wait();
+
+  // Has the request completed
+  bool is_complete() const;
+
   void set_header(const std::string& name, const std::string& value);
 
   const Response& get_response() const;
   const std::string& get_response_data() const;
 
-  void event_complete(bool error);
+  // Called by the connection when the request completes. If retry is set
+  // the request was sent on a reused connection which closed before any
+  // response was received, so it is safe to send again.
+  void event_complete(bool error, bool retry);
 
 private:
 
+  friend class ClientStream;
+
+  // Start a request, holding a reference to the client if async is set
+  bool begin(const std::string& request_data,
+             ClientCallback* callback,
+             bool async);
+
+  // Send the request, on a pooled connection if allow_reuse is set
+  bool connect(bool allow_reuse);
+
   HTTPModule::Ref m_module;
 
   Request::Ref m_request;
   Response::Ref m_response;
+  std::string m_request_data;
   std::string m_response_data;
 
-  scx::Mutex m_mutex;
+  mutable scx::Mutex m_mutex;
   scx::ConditionEvent m_complete;
+  bool m_running;
   bool m_error;
+
+  ClientCallback* m_callback;
+  Ref* m_self;
+
+  scx::Date m_start;
+  bool m_reused;
+  bool m_retried;
 };
 
 //=============================================================================
-class HTTP_API ClientStream : public scx::LineBuffer {
+// ClientConnection - A connection to an HTTP server, which sends requests
+// and receives their responses, and may be kept open and returned to the
+// client pool after each response.
+//
+// Subclasses supply the requests and take the responses. While idle in the
+// pool the connection belongs to the kernel, so a request for it is handed
+// over under a lock, and started by the connection's own job.
+//
+class HTTP_API ClientConnection : public scx::LineBuffer {
 public:
 
   enum Sequence {
@@ -94,49 +163,127 @@ public:
     ReceiveResponse,
     ReceiveHeaders,
     ReceiveBody,
+    Idle,
     End
   };
 
-  ClientStream(HTTPModule* module,
-	       Client* client,
-	       Request& request,
-	       const std::string& request_data,
-	       Response& response,
-	       std::string& response_data);
-  
-  virtual ~ClientStream();
+  ClientConnection(const std::string& stream_name,
+                   HTTPModule* module,
+                   const std::string& pool_key);
 
-  virtual scx::Condition event(scx::Stream::Event e);
+  virtual ~ClientConnection();
 
-  virtual scx::Condition read(void* buffer,int n,int& na);
-  virtual scx::Condition write(const void* buffer,int n,int& na);
+  // Ask the job owning an idle connection to close it
+  void retire();
+
+  const std::string& get_pool_key() const;
+
+  virtual scx::Condition event(scx::Stream::Event e);
 
   virtual std::string stream_status() const;
-  
+
+protected:
+
+  // Wake the job owning the connection to take a request handed over by
+  // the subclass. Must be called with m_handover_mutex held.
+  void handover();
+
+  // Take and start any request handed over, called from the job owning
+  // the connection. Returns false if there is none.
+  virtual bool take_handover() =0;
+
+  // Remove the connection from the pool, so nothing more can be handed
+  // over. Subclasses must call this first when destroyed.
+  void remove_from_pool();
+
+  // Reset the response state and start sending a request for method
+  void begin_request(const std::string& method);
+
+  // Send (more of) the request, returning Ok once it has all been sent,
+  // Wait if there is more to send, or an error.
+  virtual scx::Condition send_request() =0;
+
+  // Called with the final response status line and headers
+  virtual void response_headers() =0;
+
+  // Amount of response body which can be taken now. If this returns 0
+  // the subclass must pause Readable events until there is space.
+  virtual int body_space();
+
+  // Take some of the response body
+  virtual void body_data(const char* data, int n) =0;
+
+  // Called when the request has completed or failed, after the connection
+  // has been returned to the pool if it can be reused.
+  virtual void response_complete(bool error) =0;
+
+  // Number of idle connections to keep for the pool key, or -1 to use the
+  // pool's own limit
+  virtual int get_max_idle() const;
+
+  // Finish the current request, returning the connection to the pool if
+  // possible
+  scx::Condition complete(bool error);
+
+  scx::Mutex m_handover_mutex;
+
+  Response* m_response;
+  std::string m_status_line;
+  std::vector<std::string> m_header_lines;
+
+  bool m_keep_alive;
+  bool m_received;
+  int m_uses;
+
+  Sequence m_seq;
+
 private:
 
-  void build_request(const std::string& method, const scx::Uri& url);
-  scx::Condition send_request();
   scx::Condition receive_response();
   scx::Condition receive_headers();
   scx::Condition receive_body();
   scx::Condition receive_body_chunked();
   scx::Condition receive_data();
-  void signal_complete(bool error);
-  
+
   HTTPModule::Ref m_module;
-  Client* m_client;
+  ClientPool::Ref m_pool;
+  std::string m_pool_key;
+  bool m_retire;
 
-  Request& m_request;
-  const std::string& m_request_data;
+  std::string m_method;
+  bool m_chunked;
+  long m_remaining;
+};
 
-  Response& m_response;
-  std::string& m_response_data;
+//=============================================================================
+// ClientStream - A client connection carrying Client requests.
+//
+class HTTP_API ClientStream : public ClientConnection {
+public:
 
-  bool m_chunked;
-  int m_remaining;
+  ClientStream(HTTPModule* module,
+               const std::string& pool_key);
+  
+  virtual ~ClientStream();
 
-  Sequence m_seq;
+  // Hand a request for client to this connection.
+  // Must only be called for a new or idle (pooled) connection.
+  void attach(Client* client);
+
+protected:
+
+  virtual bool take_handover();
+  virtual scx::Condition send_request();
+  virtual void response_headers();
+  virtual void body_data(const char* data, int n);
+  virtual void response_complete(bool error);
+
+private:
+
+  void build_request(const std::string& request_data);
+  
+  Client* m_client;
+  Client* m_handover;
   scx::Buffer* m_buffer;
 };
 
@@ -0,0 +1,306 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Client connection pool
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+
+#include <http/ClientPool.h>
+#include <http/Client.h>
+#include <http/ProxyStream.h>
+#include <http/HTTPModule.h>
+
+#include <sconex/ScriptTypes.h>
+namespace http {
+
+//=========================================================================
+ClientPool::ClientPool(HTTPModule& module)
+  : m_module(module),
+    m_num_idle(0),
+    m_max_idle(4),
+    m_connections(0),
+    m_requests(0),
+    m_reused(0),
+    m_errors(0),
+    m_latency_total(0.0),
+    m_latency_max(0.0)
+{
+  m_parent = &m_module;
+}
+
+//=========================================================================
+ClientPool::~ClientPool()
+{
+
+}
+
+//=========================================================================
+std::string ClientPool::make_key(const scx::Uri& url, const scx::Uri& proxy)
+{
+  std::ostringstream oss;
+  oss << url.get_scheme() << "://" << url.get_host() << ":" << url.get_port();
+  if (proxy.get_int()) {
+    oss << " via " << proxy.get_host() << ":" << proxy.get_port();
+  }
+  return oss.str();
+}
+
+//=========================================================================
+bool ClientPool::acquire(const std::string& key, Client* client)
+{
+  scx::MutexLocker locker(m_mutex);
+  ClientStream* stream = dynamic_cast<ClientStream*>(take_idle(key));
+  if (!stream) {
+    return false;
+  }
+
+  // The request is handed to the connection while the pool is locked, so
+  // it cannot be destroyed in the meantime. The job owning the connection
+  // starts the request, or fails it if the connection closes first.
+  stream->attach(client);
+  return true;
+}
+
+//=========================================================================
+bool ClientPool::acquire(const std::string& key, ProxyExchange* exchange)
+{
+  scx::MutexLocker locker(m_mutex);
+  ProxyUpstreamStream* stream =
+    dynamic_cast<ProxyUpstreamStream*>(take_idle(key));
+  if (!stream) {
+    return false;
+  }
+
+  // As above
+  stream->attach(exchange);
+  return true;
+}
+
+//=========================================================================
+bool ClientPool::release(ClientConnection* stream, int max_idle)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  if (max_idle < 0) max_idle = m_max_idle;
+  StreamList& streams = m_idle[stream->get_pool_key()];
+  if ((int)streams.size() >= max_idle) {
+    if (streams.empty()) m_idle.erase(stream->get_pool_key());
+    return false;
+  }
+
+  streams.push_back(stream);
+  ++m_num_idle;
+  return true;
+}
+
+//=========================================================================
+bool ClientPool::remove(ClientConnection* stream)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  IdleMap::iterator it = m_idle.find(stream->get_pool_key());
+  if (it == m_idle.end()) {
+    return false;
+  }
+
+  StreamList& streams = it->second;
+  for (StreamList::iterator its = streams.begin();
+       its != streams.end(); ++its) {
+    if (*its == stream) {
+      streams.erase(its);
+      if (streams.empty()) {
+        m_idle.erase(it);
+      }
+      --m_num_idle;
+      return true;
+    }
+  }
+  return false;
+}
+
+//=========================================================================
+void ClientPool::close_idle()
+{
+  scx::MutexLocker locker(m_mutex);
+
+  for (IdleMap::iterator it = m_idle.begin(); it != m_idle.end(); ++it) {
+    StreamList& streams = it->second;
+    for (StreamList::iterator its = streams.begin();
+         its != streams.end(); ++its) {
+      (*its)->retire();
+    }
+  }
+  m_idle.clear();
+  m_num_idle = 0;
+}
+
+//=========================================================================
+void ClientPool::close_idle(const std::string& key)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  IdleMap::iterator it = m_idle.find(key);
+  if (it == m_idle.end()) {
+    return;
+  }
+
+  StreamList& streams = it->second;
+  for (StreamList::iterator its = streams.begin();
+       its != streams.end(); ++its) {
+    (*its)->retire();
+  }
+  m_num_idle -= streams.size();
+  m_idle.erase(it);
+}
+
+//=========================================================================
+int ClientPool::count_idle(const std::string& key) const
+{
+  scx::MutexLocker locker(m_mutex);
+
+  IdleMap::const_iterator it = m_idle.find(key);
+  return (it == m_idle.end()) ? 0 : it->second.size();
+}
+
+//=========================================================================
+ClientConnection* ClientPool::take_idle(const std::string& key)
+{
+  IdleMap::iterator it = m_idle.find(key);
+  if (it == m_idle.end()) {
+    return 0;
+  }
+
+  // Use the most recently idle connection, as it is the least likely to
+  // have been closed by the server.
+  StreamList& streams = it->second;
+  ClientConnection* stream = streams.back();
+  streams.pop_back();
+  if (streams.empty()) {
+    m_idle.erase(it);
+  }
+  --m_num_idle;
+  return stream;
+}
+
+//=========================================================================
+void ClientPool::record_connect()
+{
+  scx::MutexLocker locker(m_mutex);
+  ++m_connections;
+}
+
+//=========================================================================
+void ClientPool::record_request(bool reused,
+                                bool error,
+                                const scx::Time& latency)
+{
+  scx::MutexLocker locker(m_mutex);
+  ++m_requests;
+  if (reused) ++m_reused;
+  if (error) ++m_errors;
+
+  double ms = latency.to_milliseconds();
+  m_latency_total += ms;
+  if (ms > m_latency_max) m_latency_max = ms;
+}
+
+//=========================================================================
+std::string ClientPool::get_string() const
+{
+  return "ClientPool";
+}
+
+//=========================================================================
+scx::ScriptRef* ClientPool::script_op(const scx::ScriptAuth& auth,
+				      const scx::ScriptRef& ref,
+				      const scx::ScriptOp& op,
+				      const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("set_max_idle" == name ||
+	"close_idle" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("idle" == name) return scx::ScriptInt::new_ref(m_num_idle);
+    if ("max_idle" == name) return scx::ScriptInt::new_ref(m_max_idle);
+    if ("connections" == name) return scx::ScriptInt::new_ref(m_connections);
+    if ("requests" == name) return scx::ScriptInt::new_ref(m_requests);
+    if ("reused" == name) return scx::ScriptInt::new_ref(m_reused);
+    if ("errors" == name) return scx::ScriptInt::new_ref(m_errors);
+    if ("reuse_ratio" == name) {
+      return scx::ScriptReal::new_ref(
+        m_requests ? (double)m_reused / m_requests : 0.0);
+    }
+    if ("mean_latency" == name) {
+      return scx::ScriptReal::new_ref(
+        m_requests ? m_latency_total / m_requests : 0.0);
+    }
+    if ("max_latency" == name) return scx::ScriptReal::new_ref(m_latency_max);
+    if ("hosts" == name) {
+      scx::ScriptMap* map = new scx::ScriptMap();
+      for (IdleMap::const_iterator it = m_idle.begin();
+	   it != m_idle.end(); ++it) {
+	map->give(it->first,scx::ScriptInt::new_ref(it->second.size()));
+      }
+      return new scx::ScriptRef(map);
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* ClientPool::script_method(const scx::ScriptAuth& auth,
+					  const scx::ScriptRef& ref,
+					  const std::string& name,
+					  const scx::ScriptRef* args)
+{
+  if ("set_max_idle" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_max =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"value");
+    if (!a_max)
+      return scx::ScriptError::new_ref("Must specify value");
+    int n_max = a_max->get_int();
+    if (n_max < 0)
+      return scx::ScriptError::new_ref("Value must be >= 0");
+
+    m_mutex.lock();
+    m_max_idle = n_max;
+    m_mutex.unlock();
+    if (n_max == 0) close_idle();
+    return 0;
+  }
+
+  if ("close_idle" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+    close_idle();
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+};
@@ -0,0 +1,123 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Client connection pool
+
+Keeps idle persistent client connections, so that further requests to the
+same host and port can be sent without setting up a new connection (or
+renegotiating TLS).
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef httpClientPool_h
+#define httpClientPool_h
+
+#include <http/http.h>
+#include <sconex/ScriptBase.h>
+#include <sconex/Mutex.h>
+#include <sconex/Uri.h>
+#include <sconex/Time.h>
+namespace http {
+
+class HTTPModule;
+class Client;
+class ClientConnection;
+class ProxyExchange;
+
+//=============================================================================
+// ClientPool - Idle keep-alive client connections, keyed on host and port
+// for client requests, or on upstream and backend for proxied requests.
+//
+class HTTP_API ClientPool : public scx::ScriptObject {
+public:
+
+  ClientPool(HTTPModule& module);
+  virtual ~ClientPool();
+
+  // Make the pool key for connections used to request url, optionally
+  // through a proxy
+  static std::string make_key(const scx::Uri& url, const scx::Uri& proxy);
+
+  // Start a request for client, or a proxied exchange, on an idle
+  // connection for key.
+  // Returns false if there are no idle connections available.
+  bool acquire(const std::string& key, Client* client);
+  bool acquire(const std::string& key, ProxyExchange* exchange);
+
+  // Return a connection to the pool once its response is complete,
+  // keeping up to max_idle connections for its key (or the pool's own
+  // limit if -1). Returns false if the pool is full, in which case the
+  // connection should be closed.
+  bool release(ClientConnection* stream, int max_idle = -1);
+
+  // Remove a connection from the pool, because it is closing.
+  // Returns true if the connection was idle in the pool.
+  bool remove(ClientConnection* stream);
+
+  // Close all idle connections, or those for key
+  void close_idle();
+  void close_idle(const std::string& key);
+
+  // Number of idle connections for key
+  int count_idle(const std::string& key) const;
+
+  // Record statistics for a new connection and a completed request
+  void record_connect();
+  void record_request(bool reused, bool error, const scx::Time& latency);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<ClientPool> Ref;
+
+private:
+
+  // Take the most recently idle connection for key (mutex must be held)
+  ClientConnection* take_idle(const std::string& key);
+
+  HTTPModule& m_module;
+  mutable scx::Mutex m_mutex;
+
+  typedef std::list<ClientConnection*> StreamList;
+  typedef std::map<std::string,StreamList> IdleMap;
+  IdleMap m_idle;
+  int m_num_idle;
+
+  // Maximum idle connections kept per host
+  int m_max_idle;
+
+  // Statistics
+  unsigned long m_connections;
+  unsigned long m_requests;
+  unsigned long m_reused;
+  unsigned long m_errors;
+  double m_latency_total;
+  double m_latency_max;
+};
+
+};
+#endif
@@ -26,115 +26,663 @@ Free Software Foundation, Inc.,
 #include <http/Status.h>
 
 #include <sconex/FileDir.h>
+#include <sconex/Uri.h>
+#include <sconex/utils.h>
+
+#include <algorithm>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+
 namespace http {
 
+// Events which indicate a change to a directory's contents
+#define DIRINDEX_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                               IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                               IN_DELETE_SELF | IN_MOVE_SELF)
+
+//=========================================================================
+// Sort entries with the parent directory first, then other directories,
+// then by the chosen key
+class DirEntryCompare {
+public:
+  DirEntryCompare(DirListing::SortKey key, bool descending)
+    : m_key(key), m_descending(descending) {}
+
+  template<class E> bool operator()(const E* a, const E* b) const
+  {
+    if (a->dir != b->dir) return a->dir;
+    if (a->name == ".." || b->name == "..") return (a->name == "..");
+    int c = 0;
+    switch (m_key) {
+      case DirListing::Size:
+        c = (a->size < b->size) ? -1 : (a->size > b->size ? 1 : 0);
+        break;
+      case DirListing::Date:
+        c = (a->mtime < b->mtime) ? -1 : (a->mtime > b->mtime ? 1 : 0);
+        break;
+      default:
+        break;
+    }
+    if (c == 0) c = a->name.compare(b->name);
+    return m_descending ? (c > 0) : (c < 0);
+  }
+
+private:
+  DirListing::SortKey m_key;
+  bool m_descending;
+};
+
+//=========================================================================
+static void json_escape(std::string& out, const std::string& str)
+{
+  for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+    unsigned char c = *it;
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char buf[8];
+          snprintf(buf,sizeof(buf),"\\u%04x",c);
+          out += buf;
+        } else {
+          out += c;
+        }
+        break;
+    }
+  }
+}
+
+//=========================================================================
+static void format_size(std::string& out, long size)
+{
+  char buf[32];
+  if (size < 1024) {
+    snprintf(buf,sizeof(buf),"%ld",size);
+  } else {
+    const char* units = "KMGT";
+    double s = size / 1024.0;
+    int u = 0;
+    while (s >= 1024.0 && u < 3) {
+      s /= 1024.0;
+      ++u;
+    }
+    snprintf(buf,sizeof(buf),"%.1f%c",s,units[u]);
+  }
+  out += buf;
+}
+
+
+//=========================================================================
+DirListing::DirListing(const scx::FilePath& path)
+  : m_path(path),
+    m_mtime(0),
+    m_stable(false)
+{
+
+}
+
+//=========================================================================
+DirListing::~DirListing()
+{
+
+}
+
+//=========================================================================
+bool DirListing::scan()
+{
+  scx::FileStat stat(m_path);
+  if (!stat.is_dir()) return false;
+  m_mtime = stat.time().epoch_seconds();
+  m_stable = (m_mtime < time(0));
+
+  scx::FileDir dir(m_path);
+  while (dir.next()) {
+    const std::string& name = dir.name();
+    if (name == ".") continue;
+    const scx::FileStat& fs = dir.stat();
+    Entry entry;
+    entry.name = name;
+    entry.dir = fs.is_dir();
+    entry.size = entry.dir ? 0 : fs.size();
+    entry.mtime = fs.time().epoch_seconds();
+    m_entries.push_back(entry);
+  }
+  return true;
+}
+
+//=========================================================================
+time_t DirListing::get_mtime() const
+{
+  return m_mtime;
+}
+
+//=========================================================================
+bool DirListing::is_stable() const
+{
+  return m_stable;
+}
+
+//=========================================================================
+int DirListing::num_entries() const
+{
+  return m_entries.size();
+}
+
+//=========================================================================
+const std::string& DirListing::render(Format format,
+                                      SortKey key,
+                                      bool descending,
+                                      const std::string& uripath)
+{
+  std::ostringstream oss;
+  oss << format << key << descending;
+  if (format == Html) oss << uripath;
+  std::string variant = oss.str();
+
+  scx::MutexLocker locker(m_mutex);
+  RenderMap::iterator it = m_rendered.find(variant);
+  if (it != m_rendered.end()) return it->second;
+
+  std::vector<const Entry*> entries;
+  entries.reserve(m_entries.size());
+  for (EntryList::const_iterator ie = m_entries.begin();
+       ie != m_entries.end(); ++ie) {
+    entries.push_back(&(*ie));
+  }
+  std::sort(entries.begin(),entries.end(),DirEntryCompare(key,descending));
+
+  std::string& out = m_rendered[variant];
+  out.reserve(128 + entries.size() * (format == Html ? 160 : 80));
+  if (format == Json) {
+    render_json(out,entries);
+  } else {
+    render_html(out,entries,key,descending,uripath);
+  }
+  return out;
+}
+
+//=========================================================================
+std::string DirListing::get_string() const
+{
+  return m_path.path();
+}
+
+//=========================================================================
+void DirListing::render_html(std::string& out,
+                             const std::vector<const Entry*>& entries,
+                             SortKey key,
+                             bool descending,
+                             const std::string& uripath) const
+{
+  std::string title = scx::escape_html(uripath);
+  out += "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\" "
+    "\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">"
+    "<html>\n"
+    "<head>\n"
+    "<title>Directory listing</title>\n"
+    "<link rel='stylesheet' href='/dir.css' type='text/css' />"
+    "</head>\n"
+    "<body>\n"
+    "<h1>Listing of " + title + "</h1>\n"
+    "<div class='box'>\n"
+    "<table>\n"
+    "<tr>";
+
+  // Column headings link to the listing sorted by that column, clicking
+  // the current sort column reverses the order
+  static const char* cols[3][2] = {
+    {"name","Name"}, {"size","Size"}, {"date","Modified"}
+  };
+  for (int i=0; i<3; ++i) {
+    bool desc = (i == key) ? !descending : false;
+    out += "<th><a href='?sort=";
+    out += cols[i][0];
+    if (desc) out += "&amp;order=desc";
+    out += "'>";
+    out += cols[i][1];
+    out += "</a></th>";
+  }
+  out += "</tr>\n";
+
+  char date[32];
+  struct tm tms;
+  for (std::vector<const Entry*>::const_iterator it = entries.begin();
+       it != entries.end(); ++it) {
+    const Entry& e = **it;
+    std::string name = scx::escape_html(e.name);
+    if (e.dir) name += "/";
+    out += "<tr><td><a href='";
+    out += scx::escape_html(scx::Uri::encode(e.name));
+    if (e.dir) out += "/";
+    out += "'>";
+    out += name;
+    out += "</a></td><td>";
+    if (e.dir) {
+      out += "-";
+    } else {
+      format_size(out,e.size);
+    }
+    out += "</td><td>";
+    time_t t = e.mtime;
+    if (gmtime_r(&t,&tms)) {
+      out.append(date,strftime(date,sizeof(date),"%Y-%m-%d %H:%M",&tms));
+    }
+    out += "</td></tr>\n";
+  }
+
+  out += "</table>\n"
+    "</div>\n"
+    "</body>\n"
+    "</html>\n";
+}
+
+//=========================================================================
+void DirListing::render_json(std::string& out,
+                             const std::vector<const Entry*>& entries) const
+{
+  char buf[64];
+  out += "[";
+  for (std::vector<const Entry*>::const_iterator it = entries.begin();
+       it != entries.end(); ++it) {
+    const Entry& e = **it;
+    if (it != entries.begin()) out += ",";
+    out += "\n{\"name\":\"";
+    json_escape(out,e.name);
+    out += e.dir ? "\",\"type\":\"dir\"" : "\",\"type\":\"file\"";
+    snprintf(buf,sizeof(buf),",\"size\":%ld,\"mtime\":%ld}",
+             e.size,(long)e.mtime);
+    out += buf;
+  }
+  out += "\n]\n";
+}
+
+
+//=========================================================================
+DirIndexCache::DirIndexCache(HTTPModule& module)
+  : m_module(module),
+    m_inotify(-1),
+    m_max_dirs(64),
+    m_hits(0),
+    m_scans(0),
+    m_events(0)
+{
+  m_parent = &m_module;
+#ifdef HAVE_SYS_INOTIFY_H
+  m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+//=========================================================================
+DirIndexCache::~DirIndexCache()
+{
+  clear();
+  if (m_inotify >= 0) ::close(m_inotify);
+}
+
+//=========================================================================
+DirListing::Ref* DirIndexCache::lookup(const scx::FilePath& path)
+{
+  const std::string& key = path.path();
+  unsigned int changes = 0;
+
+  {
+    scx::MutexLocker locker(m_mutex);
+    read_events();
+
+    SlotMap::iterator it = m_slots.find(key);
+    if (it != m_slots.end()) {
+      Slot& slot = it->second;
+      if (slot.listing) {
+        bool valid = false;
+        if (slot.wd >= 0) {
+          // Watched, so valid unless a change has been notified
+          valid = (slot.changes == slot.scanned);
+        } else {
+          // Otherwise check the directory modification time
+          DirListing* listing = slot.listing->object();
+          scx::FileStat stat(path);
+          valid = (listing->is_stable() &&
+                   stat.is_dir() &&
+                   stat.time().epoch_seconds() == listing->get_mtime());
+        }
+
+        if (valid) {
+          m_lru.splice(m_lru.begin(),m_lru,slot.lru);
+          ++m_hits;
+          return slot.listing->ref_copy();
+        }
+      }
+      changes = it->second.changes;
+
+    } else {
+      // New slot, start watching for changes before scanning, so that
+      // none are missed
+      Slot slot;
+      slot.listing = 0;
+      slot.wd = -1;
+      slot.changes = 0;
+      slot.scanned = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+      if (m_inotify >= 0) {
+        slot.wd = inotify_add_watch(m_inotify,key.c_str(),
+                                    DIRINDEX_WATCH_EVENTS);
+        if (slot.wd >= 0) m_watches[slot.wd] = key;
+      }
+#endif
+      m_lru.push_front(key);
+      slot.lru = m_lru.begin();
+      m_slots[key] = slot;
+      evict();
+    }
+    ++m_scans;
+  }
+
+  // Scan the directory without holding the lock
+  DirListing* listing = new DirListing(path);
+  if (!listing->scan()) {
+    delete listing;
+    return 0;
+  }
+  DirListing::Ref* ref = new DirListing::Ref(listing);
+
+  scx::MutexLocker locker(m_mutex);
+  SlotMap::iterator it = m_slots.find(key);
+  if (it != m_slots.end()) {
+    // Store the new listing, unless it has been evicted meanwhile
+    Slot& slot = it->second;
+    delete slot.listing;
+    slot.listing = ref->ref_copy();
+    slot.scanned = changes;
+    m_lru.splice(m_lru.begin(),m_lru,slot.lru);
+  }
+  return ref;
+}
+
+//=========================================================================
+void DirIndexCache::clear()
+{
+  scx::MutexLocker locker(m_mutex);
+  for (SlotMap::iterator it = m_slots.begin(); it != m_slots.end(); ++it) {
+    delete it->second.listing;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (it->second.wd >= 0) inotify_rm_watch(m_inotify,it->second.wd);
+#endif
+  }
+  m_slots.clear();
+  m_lru.clear();
+  m_watches.clear();
+}
+
+//=========================================================================
+std::string DirIndexCache::get_string() const
+{
+  return "DirIndexCache";
+}
+
+//=========================================================================
+scx::ScriptRef* DirIndexCache::script_op(const scx::ScriptAuth& auth,
+                                         const scx::ScriptRef& ref,
+                                         const scx::ScriptOp& op,
+                                         const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("set_max_dirs" == name ||
+        "clear" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("max_dirs" == name) return scx::ScriptInt::new_ref(m_max_dirs);
+    if ("dirs" == name) return scx::ScriptInt::new_ref(m_slots.size());
+    if ("watches" == name) return scx::ScriptInt::new_ref(m_watches.size());
+    if ("notify" == name) return scx::ScriptBool::new_ref(m_inotify >= 0);
+    if ("hits" == name) return scx::ScriptInt::new_ref(m_hits);
+    if ("scans" == name) return scx::ScriptInt::new_ref(m_scans);
+    if ("events" == name) return scx::ScriptInt::new_ref(m_events);
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* DirIndexCache::script_method(const scx::ScriptAuth& auth,
+                                             const scx::ScriptRef& ref,
+                                             const std::string& name,
+                                             const scx::ScriptRef* args)
+{
+  if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+  if ("set_max_dirs" == name) {
+    const scx::ScriptInt* a_max =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"value");
+    if (!a_max || a_max->get_int() < 0)
+      return scx::ScriptError::new_ref("Must specify a valid value");
+
+    scx::MutexLocker locker(m_mutex);
+    m_max_dirs = a_max->get_int();
+    evict();
+    return 0;
+  }
+
+  if ("clear" == name) {
+    clear();
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+//=========================================================================
+void DirIndexCache::read_events()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if (m_inotify < 0) return;
+
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    int len = ::read(m_inotify,buffer,sizeof(buffer));
+    if (len <= 0) break;
+
+    for (char* p = buffer; p < buffer + len; ) {
+      const struct inotify_event* event = (const struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + event->len;
+      ++m_events;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, so treat everything as changed
+        for (SlotMap::iterator it = m_slots.begin();
+             it != m_slots.end(); ++it) {
+          ++it->second.changes;
+        }
+        continue;
+      }
+
+      WatchMap::iterator iw = m_watches.find(event->wd);
+      if (iw == m_watches.end()) continue;
+      SlotMap::iterator it = m_slots.find(iw->second);
+      if (it != m_slots.end()) ++it->second.changes;
+
+      if (event->mask & IN_IGNORED) {
+        // The watch has gone (directory removed), fall back to checking
+        // the modification time
+        if (it != m_slots.end()) it->second.wd = -1;
+        m_watches.erase(iw);
+      }
+    }
+  }
+#endif
+}
+
+//=========================================================================
+void DirIndexCache::evict()
+{
+  while ((int)m_slots.size() > m_max_dirs && !m_lru.empty()) {
+    SlotMap::iterator it = m_slots.find(m_lru.back());
+    m_lru.pop_back();
+    if (it == m_slots.end()) continue;
+    delete it->second.listing;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (it->second.wd >= 0) {
+      inotify_rm_watch(m_inotify,it->second.wd);
+      m_watches.erase(it->second.wd);
+    }
+#endif
+    m_slots.erase(it);
+  }
+}
+
+
 //=========================================================================
 scx::Condition DirIndexHandler::handle_message(MessageStream* message)
 {
   message->add_stream(new DirIndexStream(m_module.object(), message));
   return scx::Ok;
 }
-  
+
+//=========================================================================
+DirIndexStream::DirIndexStream(HTTPModule* module,
+                               MessageStream* message)
+  : http::ResponseStream("dirindex"),
+    m_module(module),
+    m_message(message),
+    m_listing(0),
+    m_body(0),
+    m_sent(0)
+{
+
+}
+
+//=========================================================================
+DirIndexStream::~DirIndexStream()
+{
+  delete m_listing;
+}
+
 //=========================================================================
 scx::Condition DirIndexStream::send_response()
+{
+  if (!m_body) {
+    if (!start_response()) return scx::Close;
+  }
+
+  // Send the pre-rendered listing
+  while (m_sent < (int)m_body->size()) {
+    int na = 0;
+    scx::Condition c = write(m_body->data() + m_sent,
+                             m_body->size() - m_sent, na);
+    m_sent += na;
+    if (c == scx::Wait || (c == scx::Ok && na <= 0)) {
+      // Continue when writeable
+      return scx::Ok;
+    }
+    if (c != scx::Ok) return c;
+  }
+  return scx::Close;
+}
+
+//=========================================================================
+bool DirIndexStream::start_response()
 {
   const http::Request& req = m_message->get_request();
   const scx::Uri& uri = req.get_uri();
   const http::Host* host = req.get_host();
-  
-  if (req.get_method() != "GET" && 
+
+  if (req.get_method() != "GET" &&
       req.get_method() != "HEAD" ) {
       // Don't understand the method
     m_message->get_response().set_status(http::Status::NotImplemented);
-    return scx::Close;
+    return false;
   }
-  
+
   const scx::FilePath& path = req.get_path();
   scx::FileStat stat(path);
-  
-  if (stat.is_dir()) {
-    const scx::ScriptRef* a_default_page = 
-      host->get_param("default_page");
-    std::string s_default_page = (BAD_SCRIPTREF(a_default_page) ? 
-				  "index.html" : 
-				  a_default_page->object()->get_string());
-    
-    std::string url = uri.get_string();
-    std::string uripath = uri.get_path();
-    
-    if (scx::FileStat(path + s_default_page).exists()) {
-      // Redirect to default page
-      if (url[url.size()-1] != '/') url += "/";
-      m_message->log("Redirect '" + url + "' to '" + url + s_default_page + "'"); 
-      url += s_default_page;
-      
-      m_message->get_response().set_status(http::Status::Found);
-      m_message->get_response().set_header("Content-Type","text/html");
-      m_message->get_response().set_header("Location",url);
-      return scx::Close;
-    }
-    
-    if (!uripath.empty() && uripath[uripath.size()-1] != '/') {
-      // Redirect to directory URL ending in '/'
-      scx::Uri new_uri = uri;
-      new_uri.set_path(uripath + "/");
-      m_message->log("Redirect '" + uri.get_string() + 
-               "' to '" + new_uri.get_string() + "'"); 
-      
-      m_message->get_response().set_status(http::Status::Found);
-      m_message->get_response().set_header("Content-Type","text/html");
-      m_message->get_response().set_header("Location",new_uri.get_string());
-      return scx::Close;
-    }
-    
-    const scx::ScriptRef* a_allow_list = host->get_param("allow_list");
-    bool allow_list = (a_allow_list ? 
-		       a_allow_list->object()->get_int() : 
-		       false);
-    
-    if (allow_list) {
-      // Send directory listing if allowed
-      m_message->log("Listing directory '" + url + "'"); 
-      
-      m_message->get_response().set_status(http::Status::Ok);
-      m_message->get_response().set_header("Content-Type","text/html");
-      
-      if (req.get_method() == "GET") {
-	write("<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\" "
-	      "\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">"
-	      "<html>\n"
-	      "<head>\n"
-	      "<title>Directory listing</title>\n"
-	      "<link rel='stylesheet' href='/dir.css' type='text/css' />"
-	      "</head>\n"
-	      "<body>\n"
-	      "<h1>Listing of " + url + "</h1>\n"
-	      "<div class='box'>\n"
-	      "<ul>\n");
-	
-	scx::FileDir dir(req.get_path());
-	while (dir.next()) {
-	  std::string name = dir.name();
-	  if (name != ".") {
-	    write("<li><a href='" + name + "'>" + name + "</a></li>\n");
-	  }
-	}
-        
-	write("</ul>\n"
-	      "</div>\n"
-	      "</body>\n"
-	      "</html>\n");
-      }
-      return scx::Close;
-    }
-    
+  if (!stat.is_dir()) return false;
+
+  const scx::ScriptRef* a_default_page =
+    host->get_param("default_page");
+  std::string s_default_page = (BAD_SCRIPTREF(a_default_page) ?
+                                "index.html" :
+                                a_default_page->object()->get_string());
+
+  std::string url = uri.get_string();
+  std::string uripath = uri.get_path();
+
+  if (scx::FileStat(path + s_default_page).exists()) {
+    // Redirect to default page
+    if (url[url.size()-1] != '/') url += "/";
+    m_message->log("Redirect '" + url + "' to '" + url + s_default_page + "'");
+    url += s_default_page;
+
+    m_message->get_response().set_status(http::Status::Found);
+    m_message->get_response().set_header("Content-Type","text/html");
+    m_message->get_response().set_header("Location",url);
+    return false;
+  }
+
+  if (!uripath.empty() && uripath[uripath.size()-1] != '/') {
+    // Redirect to directory URL ending in '/'
+    scx::Uri new_uri = uri;
+    new_uri.set_path(uripath + "/");
+    m_message->log("Redirect '" + uri.get_string() +
+                   "' to '" + new_uri.get_string() + "'");
+
+    m_message->get_response().set_status(http::Status::Found);
+    m_message->get_response().set_header("Content-Type","text/html");
+    m_message->get_response().set_header("Location",new_uri.get_string());
+    return false;
+  }
+
+  const scx::ScriptRef* a_allow_list = host->get_param("allow_list");
+  bool allow_list = (a_allow_list ?
+                     a_allow_list->object()->get_int() :
+                     false);
+  if (!allow_list) {
     // Otherwise respond unauthorised
     m_message->get_response().set_status(http::Status::Unauthorized);
-    return scx::Close;
-    
+    return false;
   }
-  
-  return scx::Close;
+
+  // Send directory listing if allowed
+  m_message->log("Listing directory '" + url + "'");
+
+  m_listing = m_module.object()->get_dirindex().lookup(path);
+  if (!m_listing) {
+    m_message->get_response().set_status(http::Status::Forbidden);
+    return false;
+  }
+
+  // Listing options from the query string
+  DirListing::Format format =
+    (req.get_param("format") == "json") ? DirListing::Json : DirListing::Html;
+  std::string sort = req.get_param("sort");
+  DirListing::SortKey key = DirListing::Name;
+  if (sort == "size") key = DirListing::Size;
+  else if (sort == "date") key = DirListing::Date;
+  bool descending = (req.get_param("order") == "desc");
+
+  m_body = &m_listing->object()->render(format,key,descending,uripath);
+
+  http::Response& resp = m_message->get_response();
+  resp.set_status(http::Status::Ok);
+  resp.set_header("Content-Type",
+                  format == DirListing::Json ? "application/json" :
+                  "text/html");
+  std::ostringstream oss;
+  oss << m_body->size();
+  resp.set_header("Content-Length",oss.str());
+
+  return (req.get_method() == "GET");
 }
 
 };
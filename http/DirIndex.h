@@ -2,6 +2,11 @@
 
 HTTP Directory index
 
+Directory listings are cached per directory, and rendered listings (HTML or
+JSON, in each sort order requested) are kept with the cached listing, so a
+listing is only rebuilt when the directory changes. Changes are detected
+using inotify where available, otherwise by checking the directory mtime.
+
 Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
 
 This program is free software; you can redistribute it and/or modify
@@ -25,8 +30,147 @@ Free Software Foundation, Inc.,
 #include <http/ResponseStream.h>
 #include <http/HTTPModule.h>
 #include <sconex/Stream.h>
+#include <sconex/Mutex.h>
+#include <sconex/FilePath.h>
 namespace http {
 
+//=========================================================================
+// DirListing - The contents of a directory, and listings rendered from it.
+// The entries are fixed once scanned; a changed directory is scanned into
+// a new DirListing.
+//
+class HTTP_API DirListing : public scx::ScriptObject {
+public:
+
+  enum Format { Html, Json };
+  enum SortKey { Name, Size, Date };
+
+  DirListing(const scx::FilePath& path);
+  virtual ~DirListing();
+
+  // Read the directory, returns false if it could not be read
+  bool scan();
+
+  // Modification time of the directory when it was scanned
+  time_t get_mtime() const;
+
+  // Can this listing be reused if the directory mtime hasn't changed.
+  // This is not the case if the directory was modified within the same
+  // second that it was scanned.
+  bool is_stable() const;
+
+  int num_entries() const;
+
+  // Get the listing rendered in the specified form, rendering it if this
+  // hasn't been done already. The result remains valid for the lifetime
+  // of this object.
+  const std::string& render(Format format,
+                            SortKey key,
+                            bool descending,
+                            const std::string& uripath);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  typedef scx::ScriptRefTo<DirListing> Ref;
+
+private:
+
+  struct Entry {
+    std::string name;
+    bool dir;
+    long size;
+    time_t mtime;
+  };
+  typedef std::vector<Entry> EntryList;
+
+  void render_html(std::string& out,
+                   const std::vector<const Entry*>& entries,
+                   SortKey key,
+                   bool descending,
+                   const std::string& uripath) const;
+
+  void render_json(std::string& out,
+                   const std::vector<const Entry*>& entries) const;
+
+  scx::FilePath m_path;
+  time_t m_mtime;
+  bool m_stable;
+  EntryList m_entries;
+
+  scx::Mutex m_mutex;
+  typedef std::map<std::string,std::string> RenderMap;
+  RenderMap m_rendered;
+};
+
+//=========================================================================
+// DirIndexCache - LRU cache of directory listings, keyed on path.
+//
+class HTTP_API DirIndexCache : public scx::ScriptObject {
+public:
+
+  DirIndexCache(HTTPModule& module);
+  virtual ~DirIndexCache();
+
+  // Get the listing for a directory, scanning it if it isn't cached or has
+  // changed. Returns NULL if the directory could not be read.
+  DirListing::Ref* lookup(const scx::FilePath& path);
+
+  // Remove all cached listings
+  void clear();
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<DirIndexCache> Ref;
+
+private:
+
+  // Read any pending change notifications (cache must be locked)
+  void read_events();
+
+  // Remove least recently used listings until within the limit
+  // (cache must be locked)
+  void evict();
+
+  HTTPModule& m_module;
+  mutable scx::Mutex m_mutex;
+
+  typedef std::list<std::string> LRUList;
+  LRUList m_lru;
+
+  struct Slot {
+    DirListing::Ref* listing;
+    int wd;                 // Watch descriptor, or -1 if not watched
+    unsigned int changes;   // Number of change events seen
+    unsigned int scanned;   // Value of changes when listing was scanned
+    LRUList::iterator lru;
+  };
+  typedef HASH_TYPE<std::string,Slot> SlotMap;
+  SlotMap m_slots;
+
+  typedef std::map<int,std::string> WatchMap;
+  WatchMap m_watches;
+  int m_inotify;
+
+  int m_max_dirs;
+
+  // Statistics
+  unsigned long m_hits;
+  unsigned long m_scans;
+  unsigned long m_events;
+};
+
 //=========================================================================
 class HTTP_API DirIndexHandler : public Handler {
 public:
@@ -40,7 +184,7 @@ public:
 private:
 
   HTTPModule::Ref m_module;
-  
+
 };
 
 
@@ -49,21 +193,24 @@ class DirIndexStream : public http::ResponseStream {
 public:
 
   DirIndexStream(HTTPModule* module,
-                 MessageStream* message)
-    : http::ResponseStream("dirindex"),
-      m_module(module),
-      m_message(message) {}
-  virtual ~DirIndexStream() {}
-  
+                 MessageStream* message);
+  virtual ~DirIndexStream();
+
 protected:
 
   virtual scx::Condition send_response();
 
 private:
-    
+
+  // Setup the response, returns false if there is no body to send
+  bool start_response();
+
   scx::ScriptRefTo<HTTPModule> m_module;
   MessageStream* m_message;
 
+  DirListing::Ref* m_listing;
+  const std::string* m_body;
+  int m_sent;
 };
 
 };
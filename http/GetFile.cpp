@@ -24,8 +24,10 @@ Free Software Foundation, Inc.,
 #include <http/MessageStream.h>
 #include <http/Request.h>
 #include <http/Status.h>
+#include <http/ByteRange.h>
 
 #include <sconex/File.h>
+#include <sconex/FileStat.h>
 #include <sconex/Stream.h>
 #include <sconex/StreamTransfer.h>
 #include <sconex/Date.h>
@@ -47,39 +49,9 @@ scx::Condition GetFileHandler::handle_message(MessageStream* message)
     return scx::Close;
   }
   
-  // Open the file
   scx::FilePath path = request.get_path();
-  scx::File* file = new scx::File();
-  if (file->open(path,scx::File::Read) != scx::Ok) {
-    message->log("Cannot open file '" + path.path() + "'"); 
-    response.set_status(http::Status::Forbidden);
-    delete file;
-    return scx::Close;
-  } 
-  
-  // Find last modified date
-  scx::Date lastmod = file->stat().time();
-  response.set_header("Last-Modified",lastmod.string());
-  
-  std::string mod = request.get_header("If-Modified-Since");
-  if (!mod.empty()) {
-    scx::Date dmod = scx::Date(mod);
-    if (lastmod <= dmod) {
-      message->log("File is not modified"); 
-      response.set_status(http::Status::NotModified);
-      delete file;
-      return scx::Close;
-    }
-  }
-  
-  response.set_status(http::Status::Ok);
-  
-  // Set content length
-  int clength = file->size();
-  std::ostringstream oss;
-  oss << clength;
-  response.set_header("Content-Length",oss.str());
-  
+  scx::FileStat stat(path);
+
   // Lookup MIME type for file
   bool compressible = false;
   scx::Module::Ref mime = scx::Kernel::get()->get_module("mime");
@@ -95,46 +67,124 @@ scx::Condition GetFileHandler::handle_message(MessageStream* message)
     }
     // Decide if the file is compressible, this will be used to
     // determine whether to use gzip to send it.
-    compressible = (mimetype->get_type() == "text");
+    compressible = (mimetype && mimetype->get_type() == "text");
     delete ret;
   }
+
+  // Decide whether to use gzip
+  // This is based on whether the file is compressible (text)
+  // and if it is over a certain size (i.e. worth compressing).
+  // Byte ranges are only served from the unencoded file.
+  bool use_gzip = false;
+  if (compressible) {
+    // The representation depends on the client's accepted encodings
+    response.set_header("Vary","Accept-Encoding");
+    if (stat.size() > 1000 && request.get_header("Range").empty()) {
+      // Also check if the client accepts gzip encoding
+      scx::MimeHeader ae = request.get_header_parsed("Accept-Encoding");
+      for (int i=0; i<ae.num_values(); ++i) {
+        if (ae.get_value(i)->value() == "gzip") {
+          use_gzip = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // Check validators before opening the file, so that revalidation
+  // requests can be answered from a single stat. Each encoding has its
+  // own entity tag.
+  if (stat.is_file()) {
+    response.set_validators(Response::make_etag(stat,use_gzip ? "gzip" : ""),
+                            stat.time());
+    if (!response.check_preconditions(request)) {
+      message->log("File precondition " + response.get_status().string());
+      return scx::Close;
+    }
+  }
+
+  // Open the file
+  scx::File* file = new scx::File();
+  if (file->open(path,scx::File::Read) != scx::Ok) {
+    message->log("Cannot open file '" + path.path() + "'"); 
+    response.set_status(http::Status::Forbidden);
+    response.remove_header("ETag");
+    response.remove_header("Last-Modified");
+    response.remove_header("Vary");
+    response.remove_header("Content-Type");
+    delete file;
+    return scx::Close;
+  } 
   
+  response.set_status(http::Status::Ok);
+  
+  // Set content length
+  long clength = file->size();
+  std::ostringstream oss;
+  oss << clength;
+  response.set_header("Content-Length",oss.str());
+  response.set_header("Accept-Ranges","bytes");
+  
+  // Byte range requests are served by seeking directly to each range in the
+  // file, so only the bytes actually requested are read.
+  ByteRangeStream* ranges = 0;
+  std::string range = request.get_header("Range");
+  if (!range.empty() && ByteRangeParser::if_range(request,response)) {
+    ByteRangeList list;
+    switch (ByteRangeParser::parse(range,clength,list)) {
+      case ByteRangeParser::Satisfiable:
+        ranges = new ByteRangeStream(file,list,clength,
+                                     response.get_header("Content-Type"));
+        ranges->set_headers(response);
+        break;
+
+      case ByteRangeParser::Unsatisfiable:
+        message->log("Range not satisfiable");
+        oss.str("");
+        oss << "bytes */" << clength;
+        response.set_header("Content-Range",oss.str());
+        response.set_status(http::Status::RequestedRangeNotSatisfiable);
+        response.remove_header("Content-Length");
+        delete file;
+        return scx::Close;
+
+      case ByteRangeParser::None:
+        break;
+    }
+  }
+
   if (request.get_method() == "HEAD") {
     // Don't actually send the file, just the headers
     message->log("GetFile headers for '" + path.path() + "'"); 
+    delete ranges;
     delete file;
     return scx::Close;
   }
 
   message->log("GetFile '" + path.path() + "'");
 
-  // Decide whether to use gzip
-  // This is based on whether the file is compressible (text)
-  // and if it is over a certain size (i.e. worth compressing)
-  if (compressible && clength > 1000) {
-    // Also check if the client accepts gzip encoding
-    bool gzip_accepted = false;
-    scx::MimeHeader ae = request.get_header_parsed("Accept-Encoding");
-    for (int i=0; i<ae.num_values(); ++i) {
-      if (ae.get_value(i)->value() == "gzip") {
-        gzip_accepted = true;
-        break;
-      }
-    }
-    if (gzip_accepted) {
-      message->log("Using gzip");
-      message->add_stream(new scx::GzipStream(0,16384));
-      response.set_header("Content-Encoding","gzip");
-      // Unfortunately we have to remove the content-length, so 
-      // chunked encoding will be used for gzipped content.
-      response.remove_header("Content-Length");
-    }
+  if (use_gzip) {
+    message->log("Using gzip");
+    message->add_stream(new scx::GzipStream(0,16384));
+    response.set_header("Content-Encoding","gzip");
+    // Unfortunately we have to remove the content-length, so 
+    // chunked encoding will be used for gzipped content.
+    response.remove_header("Content-Length");
   }
   
-  const int MAX_BUFFER_SIZE = 65536;
-  
+  const long MAX_BUFFER_SIZE = 65536;
+
+  long send_length = clength;
+  if (ranges) {
+    // The range stream must be on the file before the transfer source
+    message->log("Sending byte ranges");
+    file->add_stream(ranges);
+    send_length = atol(response.get_header("Content-Length").c_str());
+  }
+
   scx::StreamTransfer* xfer =
-    new scx::StreamTransfer(file,std::min(clength,MAX_BUFFER_SIZE));
+    new scx::StreamTransfer(file,(int)std::max(1L,
+      std::min(send_length,MAX_BUFFER_SIZE)));
   xfer->set_close_when_finished(true);
   message->add_stream(xfer);
   
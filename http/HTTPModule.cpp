@@ -26,6 +26,7 @@ Free Software Foundation, Inc.,
 #include <http/WebSocket.h>
 #include <http/Host.h>
 #include <http/Client.h>
+#include <http/Proxy.h>
 
 #include <sconex/ScriptTypes.h>
 #include <sconex/ModuleInterface.h>
@@ -42,17 +43,30 @@ HTTPModule::HTTPModule()
     m_hosts(0),
     m_realms(0),
     m_sessions(0),
+    m_cache(0),
+    m_client_pool(0),
+    m_uploads(0),
+    m_proxies(0),
+    m_dirindex(0),
+    m_websockets(0),
     m_idle_timeout(30)
 {
   scx::Stream::register_stream("http",this);
   Handler::register_handler("getfile",this);
   Handler::register_handler("dirindex",this);
   Handler::register_handler("websocket",this);
+  Handler::register_handler("proxy",this);
   scx::StandardContext::register_type("HTTPClient",this);
 
   m_hosts = new HostMapper::Ref(new HostMapper(*this));
   m_realms = new AuthRealmManager::Ref(new AuthRealmManager(this));
   m_sessions = new SessionManager::Ref(new SessionManager(*this));
+  m_cache = new ResponseCache::Ref(new ResponseCache(*this));
+  m_client_pool = new ClientPool::Ref(new ClientPool(*this));
+  m_uploads = new UploadManager::Ref(new UploadManager(*this));
+  m_proxies = new ProxyManager::Ref(new ProxyManager(*this));
+  m_dirindex = new DirIndexCache::Ref(new DirIndexCache(*this));
+  m_websockets = new WebSocketManager::Ref(new WebSocketManager(*this));
 }
 
 //=========================================================================
@@ -62,7 +76,11 @@ HTTPModule::~HTTPModule()
   Handler::unregister_handler("getfile",this);
   Handler::unregister_handler("dirindex",this);
   Handler::unregister_handler("websocket",this);
+  Handler::unregister_handler("proxy",this);
   scx::StandardContext::unregister_type("HTTPClient",this);
+  delete m_client_pool;
+  delete m_uploads;
+  delete m_websockets;
 }
 
 //=========================================================================
@@ -85,6 +103,10 @@ bool HTTPModule::close()
   delete m_hosts; m_hosts=0;
   delete m_realms; m_realms=0;
   delete m_sessions; m_sessions=0;
+  delete m_cache; m_cache=0;
+  delete m_proxies; m_proxies=0;
+  delete m_dirindex; m_dirindex=0;
+  m_client_pool->object()->close_idle();
 
   return true;
 }
@@ -107,6 +129,42 @@ SessionManager& HTTPModule::get_sessions()
   return *m_sessions->object();
 }
 
+//=========================================================================
+ResponseCache& HTTPModule::get_cache()
+{
+  return *m_cache->object();
+}
+
+//=========================================================================
+ClientPool& HTTPModule::get_client_pool()
+{
+  return *m_client_pool->object();
+}
+
+//=========================================================================
+UploadManager& HTTPModule::get_uploads()
+{
+  return *m_uploads->object();
+}
+
+//=========================================================================
+ProxyManager& HTTPModule::get_proxies()
+{
+  return *m_proxies->object();
+}
+
+//=========================================================================
+DirIndexCache& HTTPModule::get_dirindex()
+{
+  return *m_dirindex->object();
+}
+
+//=========================================================================
+WebSocketManager& HTTPModule::get_websockets()
+{
+  return *m_websockets->object();
+}
+
 //=============================================================================
 unsigned int HTTPModule::get_idle_timeout() const
 {
@@ -145,6 +203,12 @@ scx::ScriptRef* HTTPModule::script_op(const scx::ScriptAuth& auth,
     if ("hosts" == name) return m_hosts->ref_copy();
     if ("realms" == name) return m_realms->ref_copy();
     if ("sessions" == name) return m_sessions->ref_copy();
+    if ("cache" == name) return m_cache->ref_copy();
+    if ("client_pool" == name) return m_client_pool->ref_copy();
+    if ("uploads" == name) return m_uploads->ref_copy();
+    if ("proxy" == name) return m_proxies->ref_copy();
+    if ("dirindex" == name) return m_dirindex->ref_copy();
+    if ("websockets" == name) return m_websockets->ref_copy();
   }
 
   return scx::Module::script_op(auth,ref,op,right);
@@ -219,7 +283,16 @@ void HTTPModule::provide(const std::string& type,
     const scx::ScriptString* a_chain =
       scx::get_method_arg<scx::ScriptString>(args,0,"chain");
     if (!a_chain) return;
-    object = new WebSocketHandler(this,a_chain->get_string());
+    const scx::ScriptString* a_channel =
+      scx::get_method_arg<scx::ScriptString>(args,1,"channel");
+    object = new WebSocketHandler(this,a_chain->get_string(),
+                                  a_channel ? a_channel->get_string() : "");
+
+  } else if ("proxy" == type) {
+    const scx::ScriptString* a_upstream =
+      scx::get_method_arg<scx::ScriptString>(args,0,"upstream");
+    if (!a_upstream) return;
+    object = new ProxyHandler(this,a_upstream->get_string());
   }
 }
   
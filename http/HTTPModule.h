@@ -26,6 +26,9 @@ Free Software Foundation, Inc.,
 #include <http/HostMapper.h>
 #include <http/AuthRealm.h>
 #include <http/Session.h>
+#include <http/ResponseCache.h>
+#include <http/ClientPool.h>
+#include <http/Multipart.h>
 #include <http/Handler.h>
 #include <sconex/Module.h>
 #include <sconex/Descriptor.h>
@@ -34,6 +37,10 @@ Free Software Foundation, Inc.,
 
 namespace http {
 
+class ProxyManager;
+class DirIndexCache;
+class WebSocketManager;
+
 //=============================================================================
 // HTTPModule - Implements a HyperText Transfer Protocol client and server.
 //
@@ -54,6 +61,12 @@ public:
   HostMapper& get_hosts();
   AuthRealmManager& get_realms();
   SessionManager& get_sessions();
+  ResponseCache& get_cache();
+  ClientPool& get_client_pool();
+  UploadManager& get_uploads();
+  ProxyManager& get_proxies();
+  DirIndexCache& get_dirindex();
+  WebSocketManager& get_websockets();
 
   unsigned int get_idle_timeout() const;
 
@@ -94,6 +107,12 @@ private:
   HostMapper::Ref* m_hosts;
   AuthRealmManager::Ref* m_realms;
   SessionManager::Ref* m_sessions;
+  ResponseCache::Ref* m_cache;
+  ClientPool::Ref* m_client_pool;
+  UploadManager::Ref* m_uploads;
+  scx::ScriptRefTo<ProxyManager>* m_proxies;
+  scx::ScriptRefTo<DirIndexCache>* m_dirindex;
+  scx::ScriptRefTo<WebSocketManager>* m_websockets;
 
   unsigned int m_idle_timeout;
   scx::Uri m_client_proxy;
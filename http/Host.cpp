@@ -26,6 +26,7 @@ Free Software Foundation, Inc.,
 #include <http/Request.h>
 #include <http/AuthRealm.h>
 #include <http/Session.h>
+#include <http/ResponseCache.h>
 #include <sconex/ConfigFile.h>
 #include <sconex/Uri.h>
 #include <sconex/Base64.h>
@@ -126,7 +127,22 @@ scx::Condition Host::connect_request(MessageStream* message,
     }
   }
 
-  check_session(request,response);
+  // Anonymous GET and HEAD requests on cached paths can be answered from
+  // the response cache. These don't get an automatic session, since the
+  // response they receive may be shared with other clients.
+  int cache_ttl = (h ? lookup_cache_map(uripath) : 0);
+  if (cache_ttl > 0 &&
+      (request.get_method() == "GET" || request.get_method() == "HEAD") &&
+      request.get_header("Authorization").empty() &&
+      request.get_header("Cookie").find("scxid=") == std::string::npos) {
+    if (check_cache(message,request,response,cache_ttl)) {
+      return (request.get_method() == "GET" &&
+              response.get_status().code() == http::Status::Ok) ?
+        scx::Ok : scx::Close;
+    }
+  } else {
+    check_session(request,response);
+  }
 
   scx::Log log("http.hosts");
   log.attach("id", m_id);
@@ -278,6 +294,35 @@ std::string Host::lookup_realm_map(const std::string& name) const
   return "";
 }
 
+//=========================================================================
+void Host::add_cache_map(const std::string& pattern,
+                         int ttl)
+{
+  std::ostringstream oss;
+  oss << "Mapping path '" << pattern << "' to cache ttl " << ttl;
+  LOG(oss.str());
+  m_cache_maps[pattern] = ttl;
+}
+
+//=========================================================================
+int Host::lookup_cache_map(const std::string& name) const
+{
+  std::string key="/"+name;
+
+  // Use the longest matching pattern
+  int ttl = 0;
+  std::string::size_type len = 0;
+  for (CacheMap::const_iterator it = m_cache_maps.begin();
+       it != m_cache_maps.end();
+       ++it) {
+    if (key.find(it->first) == 0 && it->first.size() >= len) {
+      len = it->first.size();
+      ttl = it->second;
+    }
+  }
+  return ttl;
+}
+
 //=============================================================================
 const scx::ScriptRef* Host::get_param(const std::string& name) const
 {
@@ -309,7 +354,8 @@ scx::ScriptRef* Host::script_op(const scx::ScriptAuth& auth,
     if ("map" == name ||
 	"map_path" == name ||
 	"add_realm" == name ||
-	"map_realm" == name) {
+	"map_realm" == name ||
+	"map_cache" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
 
@@ -406,6 +452,28 @@ scx::ScriptRef* Host::script_method(const scx::ScriptAuth& auth,
     add_realm_map(s_pattern,s_realm);
     return 0;
   }
+
+  if ("map_cache" == name) {
+    const scx::ScriptString* a_pattern =
+      scx::get_method_arg<scx::ScriptString>(args,0,"pattern");
+    if (!a_pattern) {
+      return scx::ScriptError::new_ref("map_cache() No pattern specified");
+    }
+    std::string s_pattern = a_pattern->get_string();
+
+    const scx::ScriptInt* a_ttl =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"ttl");
+    if (!a_ttl) {
+      return scx::ScriptError::new_ref("map_cache() No ttl specified");
+    }
+    int n_ttl = a_ttl->get_int();
+    if (n_ttl < 0) {
+      return scx::ScriptError::new_ref("map_cache() ttl must be >= 0");
+    }
+
+    add_cache_map(s_pattern,n_ttl);
+    return 0;
+  }
     
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
@@ -533,4 +601,56 @@ void Host::check_session(Request& request, Response& response)
   }
 }
 
+//=============================================================================
+bool Host::check_cache(MessageStream* message,
+                       Request& request,
+                       Response& response,
+                       int ttl)
+{
+  ResponseCache& cache = m_module.get_cache();
+  std::string key = cache.make_key(request);
+
+  std::string cc = request.get_header("Cache-Control") +
+    request.get_header("Pragma");
+  bool revalidate = (cc.find("no-cache") != std::string::npos);
+
+  CachedResponse::Ref* entry = 0;
+  switch (cache.lookup(key,revalidate,entry)) {
+
+    case ResponseCache::Hit: {
+      const CachedResponse* cr = entry->object();
+      cr->apply(response);
+      std::ostringstream oss;
+      oss << (scx::Date::now() - cr->get_created()).seconds();
+      response.set_header("Age",oss.str());
+      response.set_header("X-Cache","HIT");
+      LOGGER().attach("message",request.get_id()).submit("Cache hit");
+      if (!response.check_preconditions(request)) {
+        // Revalidated, no body to send
+        response.remove_header("Content-Length");
+        delete entry;
+      } else if (request.get_method() == "GET") {
+        message->add_stream(new CachedResponseStream(entry));
+      } else {
+        delete entry;
+      }
+      return true;
+    }
+
+    case ResponseCache::Fill:
+      if (request.get_method() == "GET") {
+        response.set_header("X-Cache","MISS");
+        message->add_stream(new ResponseCacheStream(m_module,message,
+                                                    key,ttl));
+      } else {
+        cache.abandon(key);
+      }
+      break;
+
+    case ResponseCache::Bypass:
+      break;
+  }
+  return false;
+}
+
 };
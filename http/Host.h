@@ -93,6 +93,13 @@ public:
 
   // Lookup authentication realm to use for path
   std::string lookup_realm_map(const std::string& name) const;
+
+  // Map a path to a response cache lifetime (in seconds)
+  void add_cache_map(const std::string& pattern,
+                     int ttl);
+
+  // Lookup response cache lifetime to use for path (0 if not cached)
+  int lookup_cache_map(const std::string& name) const;
   
   // Get/set parameter stored with this profile
   const scx::ScriptRef* get_param(const std::string& name) const;
@@ -129,6 +136,12 @@ protected:
   // Lookup/create/update the session for this request if required.
   void check_session(Request& request, Response& response);
 
+  // Check the response cache for this request.
+  // Returns true if the request has been answered from the cache, otherwise
+  // a stream may have been added to capture the response for caching.
+  bool check_cache(MessageStream* message, Request& request,
+                   Response& response, int ttl);
+
 private:
 
   HTTPModule& m_module;
@@ -145,6 +158,9 @@ private:
   typedef std::map<std::string,std::string> RealmMap;
   RealmMap m_realm_maps;
 
+  typedef std::map<std::string,int> CacheMap;
+  CacheMap m_cache_maps;
+
   scx::ScriptMap::Ref m_params;
 };
 
@@ -54,7 +54,8 @@ MessageStream::MessageStream(HTTPModule* module,
     m_bytes_written(0),
     m_write_chunked(false),
     m_write_remaining(0),
-    m_finished(false)
+    m_finished(false),
+    m_discard_body(false)
 {
   // Set HTTP version to match request
   m_response.object()->set_version(request->get_version());
@@ -182,6 +183,11 @@ scx::Condition MessageStream::write(const void* buffer,int n,int& na)
   }
 
   if (m_transparent) return Stream::write(buffer,n,na);
+
+  if (m_discard_body) {
+    na = n;
+    return c;
+  }
   
   if (m_headers_sent) {
     if (m_write_chunked) {
@@ -209,6 +215,35 @@ scx::Condition MessageStream::write(const void* buffer,int n,int& na)
   return c;
 }
 
+//=============================================================================
+scx::Condition MessageStream::write_file(int fd,int n,int& na)
+{
+  na = 0;
+
+  if (!m_headers_sent) {
+    if (!m_buffer) {
+      build_header();
+    }
+    scx::Condition c = write_header();
+    if (!m_headers_sent) {
+      // Wait until the header has been sent
+      return (c == scx::Error) ? c : scx::Wait;
+    }
+  }
+
+  if (m_transparent) return chain_write_file(fd,n,na);
+
+  // Chunked encoding requires the length of the data up front, and a
+  // discarded body is dropped by write()
+  if (m_write_chunked || m_discard_body) return scx::End;
+
+  scx::Condition c = chain_write_file(fd,n,na);
+
+  m_bytes_written += na;
+  m_write_remaining -= na;
+  return c;
+}
+
 //=============================================================================
 std::string MessageStream::stream_status() const
 {
@@ -318,6 +353,30 @@ scx::Condition MessageStream::handle_request()
 //=============================================================================
 bool MessageStream::build_header()
 {
+  Response& response = *m_response.object();
+  const Request& request = *m_request.object();
+
+  // Evaluate conditional requests against any validators the handler set,
+  // unless it has already done so (the status won't be 200 if they failed)
+  const std::string& method = request.get_method();
+  if (!m_transparent &&
+      response.get_status().code() == Status::Ok &&
+      (method == "GET" || method == "HEAD") &&
+      (!request.get_header("If-Match").empty() ||
+       !request.get_header("If-None-Match").empty() ||
+       !request.get_header("If-Modified-Since").empty() ||
+       !request.get_header("If-Unmodified-Since").empty()) &&
+      !response.check_preconditions(request)) {
+    log("Precondition " + response.get_status().string());
+    m_discard_body = true;
+    response.remove_header("Content-Encoding");
+    response.remove_header("Content-Range");
+    response.remove_header("Content-Length");
+    if (response.get_status().has_body()) {
+      response.set_header("Content-Length","0");
+    }
+  }
+
   // Should a persistant connection be used?
   // Used by default for HTTP versions greater than 1.0
   bool persist = (m_response.object()->get_version() > scx::VersionTag(1,0));
@@ -57,6 +57,7 @@ public:
 
   virtual scx::Condition read(void* buffer,int n,int& na);
   virtual scx::Condition write(const void* buffer,int n,int& na);
+  virtual scx::Condition write_file(int fd,int n,int& na);
 
   virtual std::string stream_status() const;
  
@@ -104,6 +105,10 @@ private:
   bool m_write_chunked;
   int m_write_remaining;
   bool m_finished;
+
+  // Set if the request's preconditions failed after the handler started
+  // the response, so the body it writes is discarded
+  bool m_discard_body;
 };
 
 };
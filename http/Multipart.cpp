@@ -0,0 +1,487 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Multipart message body parser
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+
+#include <http/Multipart.h>
+#include <http/Request.h>
+#include <http/HTTPModule.h>
+#include <sconex/ScriptTypes.h>
+#include <string.h>
+namespace http {
+
+// Maximum size of the headers for a part
+#define MULTIPART_MAX_HEADER_SIZE 16384
+
+// Time to keep progress for finished uploads
+#define UPLOAD_PROGRESS_KEEP 60
+
+//=============================================================================
+MultipartSink::MultipartSink(long limit)
+  : m_limit(limit),
+    m_size(0),
+    m_exceeded(false)
+{
+
+}
+
+//=============================================================================
+MultipartSink::~MultipartSink()
+{
+
+}
+
+//=============================================================================
+bool MultipartSink::receive(const char* data, int n)
+{
+  m_size += n;
+  if (m_limit > 0 && m_size > m_limit) {
+    m_exceeded = true;
+    return false;
+  }
+  return write(data,n);
+}
+
+//=============================================================================
+bool MultipartSink::finish()
+{
+  return true;
+}
+
+//=============================================================================
+bool MultipartSink::exceeded() const
+{
+  return m_exceeded;
+}
+
+
+//=============================================================================
+MultipartParamSink::MultipartParamSink(Request& request,
+                                       const std::string& name,
+                                       long limit)
+  : MultipartSink(limit),
+    m_request(request),
+    m_name(name)
+{
+
+}
+
+//=============================================================================
+MultipartParamSink::~MultipartParamSink()
+{
+
+}
+
+//=============================================================================
+bool MultipartParamSink::finish()
+{
+  m_request.set_param(m_name,m_value);
+  return true;
+}
+
+//=============================================================================
+bool MultipartParamSink::write(const char* data, int n)
+{
+  m_value.append(data,n);
+  return true;
+}
+
+
+//=============================================================================
+MultipartFileSink::MultipartFileSink(const scx::FilePath& path, long limit)
+  : MultipartSink(limit),
+    m_path(path),
+    m_complete(false)
+{
+  m_file.open(m_path,
+              scx::File::Write | scx::File::Create | scx::File::Truncate,
+              00660);
+}
+
+//=============================================================================
+MultipartFileSink::~MultipartFileSink()
+{
+  if (m_file.is_open()) m_file.close();
+  if (!m_complete) scx::FilePath::rmfile(m_path);
+}
+
+//=============================================================================
+bool MultipartFileSink::is_open() const
+{
+  return m_file.is_open();
+}
+
+//=============================================================================
+bool MultipartFileSink::finish()
+{
+  m_file.close();
+  m_complete = true;
+  return true;
+}
+
+//=============================================================================
+bool MultipartFileSink::write(const char* data, int n)
+{
+  while (n > 0) {
+    int na = 0;
+    if (m_file.write(data,n,na) != scx::Ok || na <= 0) return false;
+    data += na;
+    n -= na;
+  }
+  return true;
+}
+
+
+//=============================================================================
+MultipartParser::MultipartParser(const std::string& boundary,
+                                 MultipartListener& listener)
+  : m_listener(listener),
+    m_state(Preamble),
+    m_delim("\r\n--" + boundary),
+    m_header_size(0),
+    m_sink(0),
+    m_num_parts(0)
+{
+  // Horspool bad character shift table
+  int m = m_delim.size();
+  for (int i=0; i<256; ++i) m_skip[i] = m;
+  for (int i=0; i<m-1; ++i) m_skip[(unsigned char)m_delim[i]] = m-1-i;
+}
+
+//=============================================================================
+MultipartParser::~MultipartParser()
+{
+  delete m_sink;
+}
+
+//=============================================================================
+MultipartParser::Status MultipartParser::parse(const char* data,
+                                               int len,
+                                               int& used,
+                                               bool end)
+{
+  used = 0;
+  const int m = m_delim.size();
+
+  while (used < len || m_state == Epilogue) {
+    const char* p = data + used;
+    int n = len - used;
+
+    switch (m_state) {
+
+      case Preamble: {
+        // The first boundary doesn't have to be preceded by CRLF
+        if (n < m-2) return end ? Malformed : Ok;
+        if (0 == memcmp(p,m_delim.data()+2,m-2)) {
+          used += m-2;
+          m_state = BoundaryEnd;
+          break;
+        }
+        int i = find_delimiter(p,n);
+        if (i < 0) {
+          // Discard the preamble, keeping any partial delimiter
+          used += find_partial(p,n);
+          return end ? Malformed : Ok;
+        }
+        used += i + m;
+        m_state = BoundaryEnd;
+      } break;
+
+      case BoundaryEnd: {
+        // Skip any transport padding
+        if (*p == ' ' || *p == '\t') {
+          ++used;
+          break;
+        }
+        if (n < 2) return end ? Malformed : Ok;
+        if (p[0] == '-' && p[1] == '-') {
+          used += 2;
+          m_state = Epilogue;
+        } else if (p[0] == '\r' && p[1] == '\n') {
+          used += 2;
+          m_headers = scx::MimeHeaderTable();
+          m_header_size = 0;
+          m_state = Headers;
+        } else {
+          return Malformed;
+        }
+      } break;
+
+      case Headers: {
+        const char* eol = (const char*)memchr(p,'\n',n);
+        if (!eol) {
+          if (m_header_size + n > MULTIPART_MAX_HEADER_SIZE) return Malformed;
+          return end ? Malformed : Ok;
+        }
+        int line_len = eol - p + 1;
+        m_header_size += line_len;
+        if (m_header_size > MULTIPART_MAX_HEADER_SIZE) return Malformed;
+
+        std::string line(p,line_len-1);
+        if (!line.empty() && line[line.size()-1] == '\r') {
+          line.erase(line.size()-1);
+        }
+        used += line_len;
+
+        if (!line.empty()) {
+          m_headers.parse_line(line);
+        } else {
+          // End of headers
+          ++m_num_parts;
+          m_sink = m_listener.multipart_start(m_headers);
+          if (!m_sink) return Rejected;
+          m_state = Body;
+        }
+      } break;
+
+      case Body: {
+        int i = find_delimiter(p,n);
+        if (i >= 0) {
+          if (i > 0 && !m_sink->receive(p,i)) return TooLarge;
+          used += i + m;
+          Status status = end_part();
+          if (status != Ok) return status;
+          m_state = BoundaryEnd;
+          break;
+        }
+
+        // Pass on everything which can't be part of a delimiter
+        int safe = (end ? n : find_partial(p,n));
+        if (safe > 0 && !m_sink->receive(p,safe)) return TooLarge;
+        used += safe;
+        return end ? Malformed : Ok;
+      }
+
+      case Epilogue:
+        // Anything after the final boundary is ignored
+        used = len;
+        return Done;
+    }
+  }
+
+  return end ? Malformed : Ok;
+}
+
+//=============================================================================
+int MultipartParser::num_parts() const
+{
+  return m_num_parts;
+}
+
+//=============================================================================
+int MultipartParser::find_delimiter(const char* data, int len) const
+{
+  const int m = m_delim.size();
+  const unsigned char* p = (const unsigned char*)data;
+  const unsigned char* d = (const unsigned char*)m_delim.data();
+  const unsigned char last = d[m-1];
+
+  int i = 0;
+  while (i <= len - m) {
+    unsigned char c = p[i+m-1];
+    if (c == last && 0 == memcmp(p+i,d,m-1)) {
+      return i;
+    }
+    i += m_skip[c];
+  }
+  return -1;
+}
+
+//=============================================================================
+int MultipartParser::find_partial(const char* data, int len) const
+{
+  // Only the last m-1 bytes can hold the start of a delimiter, which must
+  // begin with CR.
+  const int m = m_delim.size();
+  int start = std::max(0,len-(m-1));
+  const char* p = data + start;
+  const char* end = data + len;
+  while (p < end) {
+    p = (const char*)memchr(p,'\r',end-p);
+    if (!p) break;
+    if (0 == memcmp(p,m_delim.data(),end-p)) {
+      return p - data;
+    }
+    ++p;
+  }
+  return len;
+}
+
+//=============================================================================
+MultipartParser::Status MultipartParser::end_part()
+{
+  bool ok = m_sink->finish();
+  delete m_sink;
+  m_sink = 0;
+  return ok ? Ok : TooLarge;
+}
+
+
+//=============================================================================
+UploadManager::UploadManager(HTTPModule& module)
+  : m_module(module),
+    m_max_field(1024*1024),
+    m_max_file(0)
+{
+  m_parent = &m_module;
+}
+
+//=============================================================================
+UploadManager::~UploadManager()
+{
+
+}
+
+//=============================================================================
+long UploadManager::get_max_field() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_max_field;
+}
+
+//=============================================================================
+long UploadManager::get_max_file() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_max_file;
+}
+
+//=============================================================================
+void UploadManager::begin(const std::string& id, long total)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  // Discard progress for uploads which finished a while ago
+  scx::Date now = scx::Date::now();
+  for (ProgressMap::iterator it = m_uploads.begin();
+       it != m_uploads.end(); ) {
+    if (it->second.done &&
+        it->second.finished + scx::Time(UPLOAD_PROGRESS_KEEP) < now) {
+      m_uploads.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+
+  Progress& progress = m_uploads[id];
+  progress.received = 0;
+  progress.total = total;
+  progress.done = false;
+  progress.error = false;
+}
+
+//=============================================================================
+void UploadManager::update(const std::string& id, long received)
+{
+  scx::MutexLocker locker(m_mutex);
+  ProgressMap::iterator it = m_uploads.find(id);
+  if (it != m_uploads.end()) it->second.received = received;
+}
+
+//=============================================================================
+void UploadManager::end(const std::string& id, bool error)
+{
+  scx::MutexLocker locker(m_mutex);
+  ProgressMap::iterator it = m_uploads.find(id);
+  if (it != m_uploads.end()) {
+    it->second.done = true;
+    it->second.error = error;
+    it->second.finished = scx::Date::now();
+  }
+}
+
+//=============================================================================
+std::string UploadManager::get_string() const
+{
+  return "UploadManager";
+}
+
+//=============================================================================
+scx::ScriptRef* UploadManager::script_op(const scx::ScriptAuth& auth,
+					 const scx::ScriptRef& ref,
+					 const scx::ScriptOp& op,
+					 const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("set_limits" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("max_field" == name) return scx::ScriptInt::new_ref(m_max_field);
+    if ("max_file" == name) return scx::ScriptInt::new_ref(m_max_file);
+    if ("list" == name) {
+      scx::ScriptList* list = new scx::ScriptList();
+      for (ProgressMap::const_iterator it = m_uploads.begin();
+	   it != m_uploads.end(); ++it) {
+	list->give(scx::ScriptString::new_ref(it->first));
+      }
+      return new scx::ScriptRef(list);
+    }
+
+    // Upload progress by id
+    ProgressMap::const_iterator it = m_uploads.find(name);
+    if (it != m_uploads.end()) {
+      const Progress& progress = it->second;
+      scx::ScriptMap* map = new scx::ScriptMap();
+      map->give("received",scx::ScriptInt::new_ref(progress.received));
+      map->give("total",scx::ScriptInt::new_ref(progress.total));
+      map->give("done",scx::ScriptBool::new_ref(progress.done));
+      map->give("error",scx::ScriptBool::new_ref(progress.error));
+      return new scx::ScriptRef(map);
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=============================================================================
+scx::ScriptRef* UploadManager::script_method(const scx::ScriptAuth& auth,
+					     const scx::ScriptRef& ref,
+					     const std::string& name,
+					     const scx::ScriptRef* args)
+{
+  if ("set_limits" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_field =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"field");
+    if (!a_field)
+      return scx::ScriptError::new_ref("Must specify field limit");
+    const scx::ScriptInt* a_file =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"file");
+
+    if (a_field->get_int() < 0 || (a_file && a_file->get_int() < 0))
+      return scx::ScriptError::new_ref("Limits must be >= 0");
+
+    scx::MutexLocker locker(m_mutex);
+    m_max_field = a_field->get_int();
+    if (a_file) m_max_file = a_file->get_int();
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+};
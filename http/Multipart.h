@@ -0,0 +1,253 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Multipart message body parser
+
+Parses multipart/form-data request bodies as they are received, passing
+the content of each part to a sink (e.g. a request parameter or a file)
+directly from the receive buffer.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef httpMultipart_h
+#define httpMultipart_h
+
+#include <http/http.h>
+#include <sconex/ScriptBase.h>
+#include <sconex/MimeHeader.h>
+#include <sconex/FilePath.h>
+#include <sconex/File.h>
+#include <sconex/Mutex.h>
+#include <sconex/Date.h>
+namespace http {
+
+class HTTPModule;
+class Request;
+
+//=============================================================================
+// MultipartSink - Receives the content of a part within a multipart body.
+//
+class HTTP_API MultipartSink {
+public:
+
+  // Limit is the maximum size of the part in bytes, or 0 for no limit
+  MultipartSink(long limit);
+  virtual ~MultipartSink();
+
+  // Receive some data for the part, returns false if the limit has been
+  // exceeded or the data could not be written.
+  bool receive(const char* data, int n);
+
+  // Called when the part is complete
+  virtual bool finish();
+
+  bool exceeded() const;
+
+protected:
+
+  virtual bool write(const char* data, int n) = 0;
+
+private:
+
+  long m_limit;
+  long m_size;
+  bool m_exceeded;
+};
+
+//=============================================================================
+// MultipartParamSink - Sets a request parameter to the content of a part.
+//
+class HTTP_API MultipartParamSink : public MultipartSink {
+public:
+
+  MultipartParamSink(Request& request, const std::string& name, long limit);
+  virtual ~MultipartParamSink();
+
+  virtual bool finish();
+
+protected:
+
+  virtual bool write(const char* data, int n);
+
+private:
+
+  Request& m_request;
+  std::string m_name;
+  std::string m_value;
+};
+
+//=============================================================================
+// MultipartFileSink - Writes the content of a part to a file.
+// The file is removed if the part is not completely received.
+//
+class HTTP_API MultipartFileSink : public MultipartSink {
+public:
+
+  MultipartFileSink(const scx::FilePath& path, long limit);
+  virtual ~MultipartFileSink();
+
+  // Check whether the file was opened successfully
+  bool is_open() const;
+
+  virtual bool finish();
+
+protected:
+
+  virtual bool write(const char* data, int n);
+
+private:
+
+  scx::FilePath m_path;
+  scx::File m_file;
+  bool m_complete;
+};
+
+//=============================================================================
+// MultipartListener - Interface for receiving parts from a MultipartParser.
+//
+class HTTP_API MultipartListener {
+public:
+
+  virtual ~MultipartListener() {};
+
+  // Called at the start of each part, return a sink to receive the part's
+  // content, or NULL to reject it (which aborts parsing). The parser takes
+  // ownership of the sink.
+  virtual MultipartSink* multipart_start(
+    const scx::MimeHeaderTable& headers) = 0;
+};
+
+//=============================================================================
+// MultipartParser - Incremental multipart body parser.
+//
+// The boundary delimiter is located using a Boyer-Moore-Horspool search,
+// and memchr is used to find where a delimiter could start at the end of
+// the data, so that everything before it can be passed on immediately.
+//
+class HTTP_API MultipartParser {
+public:
+
+  enum Status {
+    Ok,        // More data required
+    Done,      // Final boundary reached
+    Malformed, // Invalid multipart data
+    Rejected,  // The listener rejected a part
+    TooLarge   // A part exceeded its size limit, or could not be written
+  };
+
+  MultipartParser(const std::string& boundary,
+                  MultipartListener& listener);
+  ~MultipartParser();
+
+  // Parse the data, setting used to the number of bytes consumed. Any
+  // remaining data must be presented again, along with more data, in the
+  // next call. If end is set, there is no more data to come.
+  Status parse(const char* data, int len, int& used, bool end);
+
+  // Number of parts started so far
+  int num_parts() const;
+
+private:
+
+  // Find the delimiter within data, returning its offset or -1
+  int find_delimiter(const char* data, int len) const;
+
+  // Find the offset at which a partial delimiter could start at the end
+  // of data, or len if there is none
+  int find_partial(const char* data, int len) const;
+
+  Status end_part();
+
+  enum State {
+    Preamble,
+    BoundaryEnd,
+    Headers,
+    Body,
+    Epilogue
+  };
+
+  MultipartListener& m_listener;
+  State m_state;
+
+  // The delimiter is CRLF followed by "--" and the boundary
+  std::string m_delim;
+  int m_skip[256];
+
+  scx::MimeHeaderTable m_headers;
+  int m_header_size;
+  MultipartSink* m_sink;
+  int m_num_parts;
+};
+
+//=============================================================================
+// UploadManager - Limits for multipart uploads, and progress tracking.
+//
+// Clients can follow the progress of an upload by specifying an identifier
+// in the X-Progress-ID query parameter of the upload request, which can
+// then be looked up in this object.
+//
+class HTTP_API UploadManager : public scx::ScriptObject {
+public:
+
+  UploadManager(HTTPModule& module);
+  virtual ~UploadManager();
+
+  // Maximum size of non-file and file parts (0 = no limit)
+  long get_max_field() const;
+  long get_max_file() const;
+
+  // Progress tracking
+  void begin(const std::string& id, long total);
+  void update(const std::string& id, long received);
+  void end(const std::string& id, bool error);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<UploadManager> Ref;
+
+private:
+
+  HTTPModule& m_module;
+  mutable scx::Mutex m_mutex;
+
+  long m_max_field;
+  long m_max_file;
+
+  struct Progress {
+    long received;
+    long total;
+    bool done;
+    bool error;
+    scx::Date finished;
+  };
+  typedef std::map<std::string,Progress> ProgressMap;
+  ProgressMap m_uploads;
+};
+
+};
+#endif
@@ -0,0 +1,122 @@
+/* SconeServer (http://www.sconemad.com)
+
+UNIT TESTS for Multipart
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <http/Multipart.h>
+#include <sconex/UnitTester.h>
+using namespace http;
+
+// Collects the parts received from a parser into strings
+class TestListener : public MultipartListener {
+public:
+  std::vector<std::string> names;
+  std::vector<std::string> parts;
+
+  class Sink : public MultipartSink {
+  public:
+    Sink(std::string& part) : MultipartSink(0), m_part(part) {};
+  protected:
+    virtual bool write(const char* data, int n) {
+      m_part.append(data,n);
+      return true;
+    };
+  private:
+    std::string& m_part;
+  };
+
+  virtual MultipartSink* multipart_start(const scx::MimeHeaderTable& headers) {
+    std::string name;
+    headers.get_parsed("Content-Disposition").get_value()->
+      get_parameter("name",name);
+    names.push_back(name);
+    parts.push_back("");
+    return new Sink(parts.back());
+  };
+};
+
+// Parse a body presented in two reads, split at the given offset. Any data
+// the parser doesn't use is presented again with the next read.
+static MultipartParser::Status parse_split(const std::string& body,
+                                           unsigned int split,
+                                           TestListener& listener)
+{
+  // Reserve the parts so the sinks' strings aren't moved
+  listener.parts.reserve(16);
+  MultipartParser parser("XyZ",listener);
+  int used = 0;
+  MultipartParser::Status status =
+    parser.parse(body.data(),split,used,false);
+  if (status != MultipartParser::Ok) return status;
+  std::string rest = body.substr(used);
+  return parser.parse(rest.data(),rest.size(),used,true);
+}
+
+void Multipart_ut()
+{
+  const std::string body =
+    "preamble\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"a\"\r\n"
+    "\r\n"
+    "first\r\n--X part\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"b\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "second\r\n"
+    "--XyZ--\r\n"
+    "epilogue";
+
+  UTSEC("single read");
+  {
+    TestListener listener;
+    UTEST(parse_split(body,body.size(),listener) == MultipartParser::Done);
+    UTEST(listener.names.size() == 2);
+    UTEST(listener.names[0] == "a" && listener.names[1] == "b");
+    UTEST(listener.parts[0] == "first\r\n--X part");
+    UTEST(listener.parts[1] == "second");
+  }
+
+  UTSEC("boundary split across reads");
+  int good = 0;
+  for (unsigned int split = 0; split <= body.size(); ++split) {
+    TestListener listener;
+    if (parse_split(body,split,listener) == MultipartParser::Done &&
+        listener.parts.size() == 2 &&
+        listener.parts[0] == "first\r\n--X part" &&
+        listener.parts[1] == "second") {
+      ++good;
+    }
+  }
+  UTEST(good == (int)body.size() + 1);
+
+  UTSEC("malformed");
+  {
+    TestListener listener;
+    std::string truncated = body.substr(0,body.find("second"));
+    UTEST(parse_split(truncated,truncated.size(),listener) ==
+          MultipartParser::Malformed);
+  }
+  {
+    TestListener listener;
+    UTEST(parse_split("no boundary here",16,listener) ==
+          MultipartParser::Malformed);
+  }
+}
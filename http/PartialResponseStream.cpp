@@ -22,6 +22,7 @@ Free Software Foundation, Inc.,
 #include <http/PartialResponseStream.h>
 #include <http/MessageStream.h>
 #include <http/Request.h>
+#include <http/ByteRange.h>
 
 #include <sconex/sconex.h>
 
@@ -68,92 +69,75 @@ scx::Condition PartialResponseStream::write(const void* buffer,int n,int& na)
       // Not a partial request, so we don't need to go any further
       PARTIALSTREAM_DEBUG_LOG("No range header - not a partial response");
       m_position = -1;
-      return scx::End;
-
-    } else {
-      std::string content_len_str = resp.get_header("Content-Length");
-      if (!content_len_str.empty()) {
-	m_content_length = atoi(content_len_str.c_str());
-      }
-      
-      const std::string bytes = "bytes=";
-      std::string::size_type ib = range.find(bytes);
-      if (ib == std::string::npos) {
-	// Cannot find bytes header
-	DEBUG_LOG("Invalid range header - ignoring");
-	m_position = -1;
-	return scx::End;
-
-      } else {
-	range = range.substr(ib+bytes.length());
-	std::string::size_type ih = range.find_first_of("-");
-	if (ih == std::string::npos) {
-	  DEBUG_LOG("Invalid range header - ignoring");
-	  m_position = -1;
-	  return scx::End;
-
-	} else {
-	  std::string before_str = range.substr(0,ih);
-	  std::string after_str;
-	  if (ih < range.length()) after_str = range.substr(ih+1);
-	  
-	  if (!before_str.empty()) {
-	    m_range_start = atoi(before_str.c_str());
-	  }
-	  if (!after_str.empty()) {
-	    int after = atoi(after_str.c_str());
-	    if (before_str.empty()) {
-	      if (m_content_length < 0) {
-		DEBUG_LOG("Cannot calculate range as content length is unknown");
-		resp.set_status(Status::RequestedRangeNotSatisfiable);
-		m_error = true;
-	      }
-	      m_range_length = after;
-	      m_range_start = m_content_length - m_range_length;
-	    } else {
-	      m_range_length = after + 1 - m_range_start;
-	    }
-	  } else {
-	    if (m_content_length < 0) {
-	      DEBUG_LOG("Cannot calculate range as content length is unknown");
-	      resp.set_status(Status::RequestedRangeNotSatisfiable);
-	      m_error = true;
-	    }
-	    m_range_length = m_content_length - m_range_start;
-	  }
-	  PARTIALSTREAM_DEBUG_LOG("New range request: start:" << m_range_start 
-				  << ", length:" << m_range_length 
-				  << ", total: " << m_content_length);
-
-	  if (m_range_start < 0 || m_range_length < 0) {
-	    DEBUG_LOG("Invalid range specification");
-	    resp.set_status(Status::RequestedRangeNotSatisfiable);
-	    m_error = true;
-
-	  } else if ((m_content_length >= 0) && (m_range_start + m_range_length > m_content_length)) {
-	    DEBUG_LOG("Invalid range specification - exceeds content length");
-	    resp.set_status(Status::RequestedRangeNotSatisfiable);
-	    m_error = true;
-
-	  } else {
-
-	    // Set the status to indicate a partial response
-	    resp.set_status(Status::PartialContent);
-	    
-	    // Update the content length to what we are actually sending
-	    std::ostringstream oss;
-	    oss << m_range_length;
-	    resp.set_header("Content-Length",oss.str());
-	    
-	    // Add the content-range header to confirm the range
-	    oss.str("");
-	    oss << "bytes " << m_range_start << "-" << (m_range_start + m_range_length - 1);
-	    if (m_content_length >= 0) oss << "/" << m_content_length;
-	    resp.set_header("Content-Range",oss.str());
-	  }
-	}
-      }
-    }    
+      return Stream::write(buffer,n,na);
+    }
+
+    if (resp.get_status().code() != Status::Ok ||
+        !resp.get_header("Content-Range").empty()) {
+      // The handler has already dealt with the range (or it doesn't apply)
+      PARTIALSTREAM_DEBUG_LOG("Range handled elsewhere - passing through");
+      m_position = -1;
+      return Stream::write(buffer,n,na);
+    }
+
+    if (!ByteRangeParser::if_range(req,resp)) {
+      // Entity has changed, send all of it
+      PARTIALSTREAM_DEBUG_LOG("If-Range does not match - sending entity");
+      m_position = -1;
+      return Stream::write(buffer,n,na);
+    }
+
+    std::string content_len_str = resp.get_header("Content-Length");
+    if (!content_len_str.empty()) {
+      m_content_length = atoi(content_len_str.c_str());
+    }
+
+    // Ranges can only be applied to streamed content if the length is known,
+    // and only a single range is supported here. Otherwise we are allowed to
+    // ignore the range and send the full entity.
+    ByteRangeList ranges;
+    switch (ByteRangeParser::parse(range,m_content_length,ranges)) {
+
+      case ByteRangeParser::Satisfiable:
+        if (ranges.size() == 1) {
+          m_range_start = ranges.front().start;
+          m_range_length = ranges.front().length;
+          PARTIALSTREAM_DEBUG_LOG("New range request: start:" << m_range_start
+                                  << ", length:" << m_range_length
+                                  << ", total: " << m_content_length);
+
+          // Set the status to indicate a partial response
+          resp.set_status(Status::PartialContent);
+
+          // Update the content length to what we are actually sending
+          std::ostringstream oss;
+          oss << m_range_length;
+          resp.set_header("Content-Length",oss.str());
+
+          // Add the content-range header to confirm the range
+          oss.str("");
+          oss << "bytes " << m_range_start << "-"
+              << (m_range_start + m_range_length - 1)
+              << "/" << m_content_length;
+          resp.set_header("Content-Range",oss.str());
+          break;
+        }
+        // Fall through
+
+      case ByteRangeParser::None:
+        PARTIALSTREAM_DEBUG_LOG("Unsupported range - sending entity");
+        m_position = -1;
+        return Stream::write(buffer,n,na);
+
+      case ByteRangeParser::Unsatisfiable: {
+        DEBUG_LOG("Invalid range specification - exceeds content length");
+        resp.set_status(Status::RequestedRangeNotSatisfiable);
+        std::ostringstream oss;
+        oss << "bytes */" << m_content_length;
+        resp.set_header("Content-Range",oss.str());
+        m_error = true;
+      } break;
+    }
   }
 
   if (m_error) {
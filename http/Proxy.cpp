@@ -0,0 +1,1005 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Reverse proxy
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <http/Proxy.h>
+#include <http/ProxyStream.h>
+#include <http/HTTPModule.h>
+#include <http/MessageStream.h>
+#include <http/Status.h>
+
+#include <sconex/ScriptTypes.h>
+#include <sconex/ScriptContext.h>
+#include <sconex/StreamSocket.h>
+#include <sconex/Kernel.h>
+#include <sconex/Log.h>
+#include <sconex/utils.h>
+
+#include <netdb.h>
+namespace http {
+
+#define LOG(msg) scx::Log("http.proxy").submit(msg);
+
+// How often to look for due health checks
+#define PROXY_JOB_PERIOD 1
+
+//=========================================================================
+// ProxyHealthJob - A periodic job which runs the health checks for all
+// configured upstreams.
+//
+class ProxyHealthJob : public scx::PeriodicJob {
+public:
+
+  ProxyHealthJob(ProxyManager& manager, const scx::Time& period)
+    : scx::PeriodicJob("http Proxy health check",period),
+      m_manager(manager) {};
+
+  virtual ~ProxyHealthJob() {};
+
+  virtual bool run()
+  {
+    m_manager.check_health();
+    return false;
+  };
+
+protected:
+  ProxyManager& m_manager;
+};
+
+//=========================================================================
+// 64-bit FNV-1a hash, used to score backends for hash balancing
+static unsigned long long proxy_hash(const std::string& str)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  for (std::string::size_type i = 0; i < str.size(); ++i) {
+    h ^= (unsigned char)str[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//=========================================================================
+// Get the address of a socket as a numeric host string
+static std::string proxy_peer_address(const scx::Descriptor* endpoint)
+{
+  const scx::StreamSocket* sock =
+    dynamic_cast<const scx::StreamSocket*>(endpoint);
+  if (!sock || !sock->get_remote_addr()) return "";
+
+  const scx::SocketAddress* addr = sock->get_remote_addr();
+  char host[NI_MAXHOST];
+  if (0 != getnameinfo(addr->get_sockaddr(), addr->get_sockaddr_size(),
+                       host, sizeof(host), 0, 0, NI_NUMERICHOST)) {
+    return "";
+  }
+  return std::string(host);
+}
+
+
+//=========================================================================
+ProxyBackend::ProxyBackend(ProxyUpstream& upstream, const scx::Uri& uri)
+  : m_upstream(upstream),
+    m_uri(uri),
+    m_healthy(true),
+    m_removed(false),
+    m_active(0),
+    m_consecutive_failures(0),
+    m_checking(false),
+    m_check(0),
+    m_check_self(0),
+    m_check_upstream(0),
+    m_requests(0),
+    m_failures(0),
+    m_connections(0)
+{
+  m_parent = &m_upstream;
+  m_pool_key = "proxy " + m_upstream.get_name() + " " + m_uri.get_base();
+}
+
+//=========================================================================
+ProxyBackend::~ProxyBackend()
+{
+
+}
+
+//=========================================================================
+const scx::Uri& ProxyBackend::get_uri() const
+{
+  return m_uri;
+}
+
+//=========================================================================
+const std::string& ProxyBackend::get_pool_key() const
+{
+  return m_pool_key;
+}
+
+//=========================================================================
+void ProxyBackend::start_check(HTTPModule* module, const std::string& path)
+{
+  // Hold references to ourself and the upstream until the check completes
+  m_check_self = new Ref(this);
+  m_check_upstream = new scx::ScriptRef(&m_upstream);
+
+  scx::Uri url(m_uri.get_base() + path);
+  Client* client = new Client(module,"GET",url);
+  m_check = new Client::Ref(client);
+  if (!client->start("",this)) {
+    client_complete(*client,true);
+  }
+}
+
+//=========================================================================
+void ProxyBackend::client_complete(Client& client, bool error)
+{
+  bool healthy = false;
+  if (!error) {
+    int code = client.get_response().get_status().code();
+    healthy = (code >= 200 && code < 400);
+  }
+  m_upstream.check_complete(this,healthy);
+
+  Client::Ref* check = m_check;
+  scx::ScriptRef* upstream = m_check_upstream;
+  Ref* self = m_check_self;
+  m_check = 0;
+  m_check_upstream = 0;
+  m_check_self = 0;
+  delete check;
+  delete upstream;
+
+  // This may delete the backend
+  delete self;
+}
+
+//=========================================================================
+std::string ProxyBackend::get_string() const
+{
+  return m_uri.get_string();
+}
+
+//=========================================================================
+scx::ScriptRef* ProxyBackend::script_op(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const scx::ScriptOp& op,
+					const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Properties
+    if ("uri" == name) return new scx::ScriptRef(m_uri.new_copy());
+    if ("idle" == name) return scx::ScriptInt::new_ref(
+      m_upstream.get_module().get_client_pool().count_idle(m_pool_key));
+
+    scx::MutexLocker locker(m_upstream.m_mutex);
+    if ("healthy" == name) return scx::ScriptBool::new_ref(m_healthy);
+    if ("active" == name) return scx::ScriptInt::new_ref(m_active);
+    if ("requests" == name) return scx::ScriptInt::new_ref(m_requests);
+    if ("failures" == name) return scx::ScriptInt::new_ref(m_failures);
+    if ("connections" == name) return scx::ScriptInt::new_ref(m_connections);
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+
+//=========================================================================
+ProxyUpstream::ProxyUpstream(HTTPModule& module, const std::string& name)
+  : m_module(module),
+    m_name(name),
+    m_balance(LeastConn),
+    m_next(0),
+    m_max_idle(8),
+    m_max_fails(3),
+    m_fail_timeout(10),
+    m_health_interval(10),
+    m_requests(0),
+    m_errors(0),
+    m_unavailable(0)
+{
+  m_parent = &m_module;
+}
+
+//=========================================================================
+ProxyUpstream::~ProxyUpstream()
+{
+  for (BackendList::iterator it = m_backends.begin();
+       it != m_backends.end(); ++it) {
+    delete *it;
+  }
+  for (BackendList::iterator it = m_removed.begin();
+       it != m_removed.end(); ++it) {
+    delete *it;
+  }
+}
+
+//=========================================================================
+const std::string& ProxyUpstream::get_name() const
+{
+  return m_name;
+}
+
+//=========================================================================
+HTTPModule& ProxyUpstream::get_module()
+{
+  return m_module;
+}
+
+//=========================================================================
+ProxyBackend* ProxyUpstream::select(const std::string& key)
+{
+  scx::MutexLocker locker(m_mutex);
+  scx::Date now = scx::Date::now();
+  ProxyBackend* chosen = 0;
+  int n = m_backends.size();
+
+  if (m_balance == Hash) {
+    // Rendezvous hashing: each key goes to the available backend with the
+    // highest score, so only keys on a failed backend are redistributed.
+    unsigned long long best = 0;
+    for (int i = 0; i < n; ++i) {
+      ProxyBackend* backend = m_backends[i]->object();
+      if (!available(backend,now)) continue;
+      unsigned long long score =
+        proxy_hash(key + " " + backend->m_uri.get_string());
+      if (!chosen || score > best) {
+        chosen = backend;
+        best = score;
+      }
+    }
+
+  } else {
+    // Least active connections, starting from a rotating position so that
+    // equally loaded backends are used in turn.
+    for (int i = 0; i < n; ++i) {
+      ProxyBackend* backend = m_backends[(m_next + i) % n]->object();
+      if (!available(backend,now)) continue;
+      if (!chosen || backend->m_active < chosen->m_active) {
+        chosen = backend;
+      }
+    }
+    ++m_next;
+  }
+
+  if (!chosen) {
+    ++m_unavailable;
+    return 0;
+  }
+
+  ++chosen->m_active;
+  ++chosen->m_requests;
+  ++m_requests;
+  return chosen;
+}
+
+//=========================================================================
+std::string ProxyUpstream::get_hash_header() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return (m_balance == Hash) ? m_hash_header : "";
+}
+
+//=========================================================================
+bool ProxyUpstream::connect(ProxyExchange* exchange,
+                            ProxyBackend* backend,
+                            bool allow_reuse)
+{
+  // Use an idle connection to this backend if there is one
+  if (allow_reuse &&
+      m_module.get_client_pool().acquire(backend->get_pool_key(),exchange)) {
+    return true;
+  }
+
+  const scx::Uri& uri = backend->get_uri();
+
+  // Create a socket address
+  scx::ScriptList::Ref args(new scx::ScriptList());
+  args.object()->give( scx::ScriptString::new_ref(uri.get_host()) );
+  args.object()->give( scx::ScriptInt::new_ref(uri.get_port()) );
+
+  scx::ScriptObject* addr_obj =
+    scx::StandardContext::create_object("IP6Addr",&args);
+  scx::SocketAddress* addr = dynamic_cast<scx::SocketAddress*>(addr_obj);
+  if (addr == 0 || !addr->valid_for_connect()) {
+    delete addr_obj;
+    // Retry with ipv4
+    addr_obj = scx::StandardContext::create_object("IPAddr",&args);
+    addr = dynamic_cast<scx::SocketAddress*>(addr_obj);
+    if (addr == 0 || !addr->valid_for_connect()) {
+      delete addr_obj;
+      LOG("Unable to create address for backend " + uri.get_string());
+      return false;
+    }
+  }
+
+  scx::StreamSocket* sock = new scx::StreamSocket();
+  sock->set_timeout(scx::Time(m_module.get_idle_timeout()));
+
+  if (uri.get_scheme() == "https") {
+    scx::ScriptList::Ref ssl_args(new scx::ScriptList());
+    ssl_args.object()->give( scx::ScriptString::new_ref("client") );
+    scx::Stream* ssl = scx::Stream::create_new("ssl",&ssl_args);
+    if (!ssl) {
+      delete sock;
+      delete addr;
+      LOG("SSL support unavailable for backend " + uri.get_string());
+      return false;
+    }
+    sock->add_stream(ssl);
+  }
+
+  ProxyUpstreamStream* stream = new ProxyUpstreamStream(this,backend);
+  sock->add_stream(stream);
+
+  scx::Condition err = sock->connect(addr);
+  delete addr;
+  if (err != scx::Ok && err != scx::Wait) {
+    delete sock;
+    LOG("Unable to connect to backend " + uri.get_string());
+    return false;
+  }
+
+  m_mutex.lock();
+  ++backend->m_connections;
+  m_mutex.unlock();
+
+  // From here on, any failure is reported through the exchange
+  stream->attach(exchange);
+
+  if (!scx::Kernel::get()->connect(sock)) {
+    DEBUG_LOG("System failure");
+    delete sock;
+  }
+  return true;
+}
+
+//=========================================================================
+void ProxyUpstream::finished(ProxyBackend* backend, bool error)
+{
+  scx::MutexLocker locker(m_mutex);
+  --backend->m_active;
+
+  if (error) {
+    ++backend->m_failures;
+    ++m_errors;
+    // Take the backend out of use for a while after too many consecutive
+    // failures (or a failed trial request while it is out of use).
+    if (++backend->m_consecutive_failures >= m_max_fails ||
+        !backend->m_healthy) {
+      backend->m_retry_time = scx::Date::now() + m_fail_timeout;
+      if (backend->m_healthy) set_healthy(backend,false);
+    }
+
+  } else {
+    backend->m_consecutive_failures = 0;
+    if (!backend->m_healthy) set_healthy(backend,true);
+  }
+}
+
+//=========================================================================
+int ProxyUpstream::get_max_idle(const ProxyBackend* backend) const
+{
+  scx::MutexLocker locker(m_mutex);
+  return backend->m_removed ? 0 : m_max_idle;
+}
+
+//=========================================================================
+void ProxyUpstream::close_idle()
+{
+  scx::MutexLocker locker(m_mutex);
+  BackendList all = m_backends;
+  all.insert(all.end(),m_removed.begin(),m_removed.end());
+  ClientPool& pool = m_module.get_client_pool();
+  for (BackendList::iterator it = all.begin(); it != all.end(); ++it) {
+    pool.close_idle((*it)->object()->get_pool_key());
+  }
+}
+
+//=========================================================================
+void ProxyUpstream::rewrite_request(scx::MimeHeaderTable& headers) const
+{
+  scx::MutexLocker locker(m_mutex);
+  for (std::set<std::string>::const_iterator it = m_request_remove.begin();
+       it != m_request_remove.end(); ++it) {
+    headers.erase(*it);
+  }
+  for (HeaderMap::const_iterator it = m_request_set.begin();
+       it != m_request_set.end(); ++it) {
+    headers.set(it->first,it->second);
+  }
+}
+
+//=========================================================================
+void ProxyUpstream::rewrite_response(Response& response) const
+{
+  scx::MutexLocker locker(m_mutex);
+  for (std::set<std::string>::const_iterator it = m_response_remove.begin();
+       it != m_response_remove.end(); ++it) {
+    response.remove_header(*it);
+  }
+  for (HeaderMap::const_iterator it = m_response_set.begin();
+       it != m_response_set.end(); ++it) {
+    response.set_header(it->first,it->second);
+  }
+}
+
+//=========================================================================
+void ProxyUpstream::check_health()
+{
+  std::vector<ProxyBackend*> due;
+  std::string path;
+  {
+    scx::MutexLocker locker(m_mutex);
+    if (m_health_path.empty()) return;
+    path = m_health_path;
+
+    scx::Date now = scx::Date::now();
+    for (BackendList::iterator it = m_backends.begin();
+         it != m_backends.end(); ++it) {
+      ProxyBackend* backend = (*it)->object();
+      if (!backend->m_checking && now >= backend->m_next_check) {
+        backend->m_checking = true;
+        backend->m_next_check = now + m_health_interval;
+        due.push_back(backend);
+      }
+    }
+  }
+
+  for (std::vector<ProxyBackend*>::iterator it = due.begin();
+       it != due.end(); ++it) {
+    (*it)->start_check(&m_module,path);
+  }
+}
+
+//=========================================================================
+void ProxyUpstream::check_complete(ProxyBackend* backend, bool healthy)
+{
+  scx::MutexLocker locker(m_mutex);
+  backend->m_checking = false;
+  if (healthy) {
+    backend->m_consecutive_failures = 0;
+  }
+  if (healthy != backend->m_healthy && !backend->m_removed) {
+    set_healthy(backend,healthy);
+  }
+}
+
+//=========================================================================
+std::string ProxyUpstream::get_string() const
+{
+  return m_name;
+}
+
+//=========================================================================
+scx::ScriptRef* ProxyUpstream::script_op(const scx::ScriptAuth& auth,
+					 const scx::ScriptRef& ref,
+					 const scx::ScriptOp& op,
+					 const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("add_backend" == name ||
+	"remove_backend" == name ||
+	"set_balance" == name ||
+	"set_health_check" == name ||
+	"set_max_idle" == name ||
+	"set_max_fails" == name ||
+	"set_request_header" == name ||
+	"remove_request_header" == name ||
+	"set_response_header" == name ||
+	"remove_response_header" == name ||
+	"close_idle" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    if ("name" == name) return scx::ScriptString::new_ref(m_name);
+
+    scx::MutexLocker locker(m_mutex);
+    if ("balance" == name) {
+      return scx::ScriptString::new_ref(
+        m_balance == Hash ? "hash" : "least_conn");
+    }
+    if ("hash_header" == name) return scx::ScriptString::new_ref(m_hash_header);
+    if ("health_path" == name) return scx::ScriptString::new_ref(m_health_path);
+    if ("health_interval" == name)
+      return scx::ScriptInt::new_ref(m_health_interval.seconds());
+    if ("max_idle" == name) return scx::ScriptInt::new_ref(m_max_idle);
+    if ("max_fails" == name) return scx::ScriptInt::new_ref(m_max_fails);
+    if ("requests" == name) return scx::ScriptInt::new_ref(m_requests);
+    if ("errors" == name) return scx::ScriptInt::new_ref(m_errors);
+    if ("unavailable" == name) return scx::ScriptInt::new_ref(m_unavailable);
+
+    // Sub-objects
+    if ("backends" == name) {
+      scx::ScriptList* list = new scx::ScriptList();
+      scx::ScriptRef* list_ref = new scx::ScriptRef(list);
+      for (BackendList::const_iterator it = m_backends.begin();
+	   it != m_backends.end(); ++it) {
+	list->give((*it)->ref_copy(ref.reftype()));
+      }
+      return list_ref;
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* ProxyUpstream::script_method(const scx::ScriptAuth& auth,
+					     const scx::ScriptRef& ref,
+					     const std::string& name,
+					     const scx::ScriptRef* args)
+{
+  if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+  if ("add_backend" == name ||
+      "remove_backend" == name) {
+    scx::Uri uri;
+    const scx::Uri* a_uri = scx::get_method_arg<scx::Uri>(args,0,"uri");
+    if (a_uri) {
+      uri = *a_uri;
+    } else {
+      const scx::ScriptString* a_str =
+	scx::get_method_arg<scx::ScriptString>(args,0,"uri");
+      if (!a_str) return scx::ScriptError::new_ref("Must specify backend uri");
+      uri = scx::Uri(a_str->get_string());
+    }
+    if (uri.get_host().empty())
+      return scx::ScriptError::new_ref("Backend uri must specify a host");
+
+    scx::MutexLocker locker(m_mutex);
+    BackendList::iterator it = m_backends.begin();
+    for ( ; it != m_backends.end(); ++it) {
+      if ((*it)->object()->get_uri().get_base() == uri.get_base()) break;
+    }
+
+    if ("add_backend" == name) {
+      if (it != m_backends.end())
+	return scx::ScriptError::new_ref("Backend already exists");
+      LOG("Upstream '" + m_name + "' adding backend " + uri.get_base());
+      ProxyBackend* backend = new ProxyBackend(*this,uri);
+      m_backends.push_back(new ProxyBackend::Ref(backend));
+      return new ProxyBackend::Ref(backend);
+    }
+
+    if (it == m_backends.end())
+      return scx::ScriptError::new_ref("Backend not found");
+    LOG("Upstream '" + m_name + "' removing backend " + uri.get_base());
+    ProxyBackend* backend = (*it)->object();
+    backend->m_removed = true;
+    m_module.get_client_pool().close_idle(backend->get_pool_key());
+    m_removed.push_back(*it);
+    m_backends.erase(it);
+    return 0;
+  }
+
+  if ("set_balance" == name) {
+    const scx::ScriptString* a_mode =
+      scx::get_method_arg<scx::ScriptString>(args,0,"mode");
+    if (!a_mode) return scx::ScriptError::new_ref("Must specify mode");
+    const scx::ScriptString* a_header =
+      scx::get_method_arg<scx::ScriptString>(args,1,"header");
+
+    scx::MutexLocker locker(m_mutex);
+    if (a_mode->get_string() == "least_conn") {
+      m_balance = LeastConn;
+      m_hash_header = "";
+    } else if (a_mode->get_string() == "hash") {
+      m_balance = Hash;
+      m_hash_header = (a_header ? a_header->get_string() : "");
+    } else {
+      return scx::ScriptError::new_ref("Unknown balance mode");
+    }
+    return 0;
+  }
+
+  if ("set_health_check" == name) {
+    const scx::ScriptString* a_path =
+      scx::get_method_arg<scx::ScriptString>(args,0,"path");
+    if (!a_path) return scx::ScriptError::new_ref("Must specify path");
+    std::string path = a_path->get_string();
+    if (!path.empty() && path[0] != '/') path = "/" + path;
+
+    const scx::ScriptInt* a_interval =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"interval");
+    int interval = (a_interval ? a_interval->get_int() : 10);
+    if (interval <= 0)
+      return scx::ScriptError::new_ref("Interval must be > 0");
+
+    scx::MutexLocker locker(m_mutex);
+    m_health_path = path;
+    m_health_interval = scx::Time(interval);
+    return 0;
+  }
+
+  if ("set_max_idle" == name ||
+      "set_max_fails" == name) {
+    const scx::ScriptInt* a_value =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"value");
+    if (!a_value) return scx::ScriptError::new_ref("Must specify value");
+    int n_value = a_value->get_int();
+    if (n_value < 0) return scx::ScriptError::new_ref("Value must be >= 0");
+
+    if ("set_max_fails" == name) {
+      const scx::ScriptInt* a_timeout =
+	scx::get_method_arg<scx::ScriptInt>(args,1,"timeout");
+      scx::MutexLocker locker(m_mutex);
+      m_max_fails = n_value;
+      if (a_timeout) m_fail_timeout = scx::Time(a_timeout->get_int());
+      return 0;
+    }
+
+    m_mutex.lock();
+    m_max_idle = n_value;
+    m_mutex.unlock();
+    if (n_value == 0) close_idle();
+    return 0;
+  }
+
+  if ("set_request_header" == name ||
+      "set_response_header" == name) {
+    const scx::ScriptString* a_name =
+      scx::get_method_arg<scx::ScriptString>(args,0,"name");
+    if (!a_name) return scx::ScriptError::new_ref("Must specify header name");
+    const scx::ScriptString* a_value =
+      scx::get_method_arg<scx::ScriptString>(args,1,"value");
+    if (!a_value) return scx::ScriptError::new_ref("Must specify value");
+
+    scx::MutexLocker locker(m_mutex);
+    if ("set_request_header" == name) {
+      m_request_remove.erase(a_name->get_string());
+      m_request_set[a_name->get_string()] = a_value->get_string();
+    } else {
+      m_response_remove.erase(a_name->get_string());
+      m_response_set[a_name->get_string()] = a_value->get_string();
+    }
+    return 0;
+  }
+
+  if ("remove_request_header" == name ||
+      "remove_response_header" == name) {
+    const scx::ScriptString* a_name =
+      scx::get_method_arg<scx::ScriptString>(args,0,"name");
+    if (!a_name) return scx::ScriptError::new_ref("Must specify header name");
+
+    scx::MutexLocker locker(m_mutex);
+    if ("remove_request_header" == name) {
+      m_request_set.erase(a_name->get_string());
+      m_request_remove.insert(a_name->get_string());
+    } else {
+      m_response_set.erase(a_name->get_string());
+      m_response_remove.insert(a_name->get_string());
+    }
+    return 0;
+  }
+
+  if ("close_idle" == name) {
+    close_idle();
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+//=========================================================================
+bool ProxyUpstream::available(const ProxyBackend* backend,
+                              const scx::Date& now) const
+{
+  if (backend->m_healthy) return true;
+
+  // Without active health checks, allow a trial request through once the
+  // failure timeout has expired.
+  return (m_health_path.empty() && now >= backend->m_retry_time);
+}
+
+//=========================================================================
+void ProxyUpstream::set_healthy(ProxyBackend* backend, bool healthy)
+{
+  backend->m_healthy = healthy;
+  LOG("Upstream '" + m_name + "' backend " + backend->m_uri.get_base() +
+      (healthy ? " is up" : " is down"));
+}
+
+
+//=========================================================================
+ProxyManager::ProxyManager(HTTPModule& module)
+  : m_module(module)
+{
+  m_parent = &m_module;
+
+  m_job = scx::Kernel::get()->add_job(
+    new ProxyHealthJob(*this,scx::Time(PROXY_JOB_PERIOD)));
+}
+
+//=========================================================================
+ProxyManager::~ProxyManager()
+{
+  scx::Kernel::get()->end_job(m_job);
+
+  for (UpstreamMap::iterator it = m_upstreams.begin();
+       it != m_upstreams.end(); ++it) {
+    delete it->second;
+  }
+}
+
+//=========================================================================
+ProxyUpstream::Ref ProxyManager::lookup(const std::string& name)
+{
+  scx::MutexLocker locker(m_mutex);
+  UpstreamMap::iterator it = m_upstreams.find(name);
+  if (it == m_upstreams.end()) {
+    return ProxyUpstream::Ref(0);
+  }
+  return *it->second;
+}
+
+//=========================================================================
+void ProxyManager::check_health()
+{
+  std::list<ProxyUpstream::Ref> upstreams;
+  m_mutex.lock();
+  for (UpstreamMap::iterator it = m_upstreams.begin();
+       it != m_upstreams.end(); ++it) {
+    upstreams.push_back(*it->second);
+  }
+  m_mutex.unlock();
+
+  for (std::list<ProxyUpstream::Ref>::iterator it = upstreams.begin();
+       it != upstreams.end(); ++it) {
+    it->object()->check_health();
+  }
+}
+
+//=========================================================================
+void ProxyManager::close_idle()
+{
+  scx::MutexLocker locker(m_mutex);
+  for (UpstreamMap::iterator it = m_upstreams.begin();
+       it != m_upstreams.end(); ++it) {
+    it->second->object()->close_idle();
+  }
+}
+
+//=========================================================================
+std::string ProxyManager::get_string() const
+{
+  return "ProxyManager";
+}
+
+//=========================================================================
+scx::ScriptRef* ProxyManager::script_op(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const scx::ScriptOp& op,
+					const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("add" == name ||
+	"remove" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    scx::MutexLocker locker(m_mutex);
+
+    // Sub-objects
+    if ("list" == name) {
+      scx::ScriptList* list = new scx::ScriptList();
+      scx::ScriptRef* list_ref = new scx::ScriptRef(list);
+      for (UpstreamMap::const_iterator it = m_upstreams.begin();
+	   it != m_upstreams.end(); ++it) {
+	list->give(it->second->ref_copy(ref.reftype()));
+      }
+      return list_ref;
+    }
+
+    UpstreamMap::const_iterator it = m_upstreams.find(name);
+    if (it != m_upstreams.end()) {
+      return it->second->ref_copy(ref.reftype());
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* ProxyManager::script_method(const scx::ScriptAuth& auth,
+					    const scx::ScriptRef& ref,
+					    const std::string& name,
+					    const scx::ScriptRef* args)
+{
+  if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+  if ("add" == name) {
+    const scx::ScriptString* a_name =
+      scx::get_method_arg<scx::ScriptString>(args,0,"name");
+    if (!a_name)
+      return scx::ScriptError::new_ref("No upstream name specified");
+    std::string s_name = a_name->get_string();
+
+    scx::MutexLocker locker(m_mutex);
+    if (m_upstreams.find(s_name) != m_upstreams.end())
+      return scx::ScriptError::new_ref("Upstream already exists");
+
+    LOG("Adding upstream '" + s_name + "'");
+    ProxyUpstream* upstream = new ProxyUpstream(m_module,s_name);
+    m_upstreams[s_name] = new ProxyUpstream::Ref(upstream);
+    return new ProxyUpstream::Ref(upstream);
+  }
+
+  if ("remove" == name) {
+    const scx::ScriptString* a_name =
+      scx::get_method_arg<scx::ScriptString>(args,0,"name");
+    if (!a_name)
+      return scx::ScriptError::new_ref("No upstream name specified");
+    std::string s_name = a_name->get_string();
+
+    scx::MutexLocker locker(m_mutex);
+    UpstreamMap::iterator it = m_upstreams.find(s_name);
+    if (it == m_upstreams.end())
+      return scx::ScriptError::new_ref("Upstream not found");
+
+    LOG("Removing upstream '" + s_name + "'");
+    // Idle connections hold references to the upstream, so close them
+    it->second->object()->close_idle();
+    delete it->second;
+    m_upstreams.erase(it);
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+
+//=========================================================================
+ProxyHandler::ProxyHandler(HTTPModule* module, const std::string& upstream)
+  : m_module(module),
+    m_upstream(upstream)
+{
+
+}
+
+//=========================================================================
+ProxyHandler::~ProxyHandler()
+{
+
+}
+
+// Headers which only apply to a single connection, and so are not
+// forwarded by the proxy
+static const char* proxy_hop_headers[] = {
+  "Connection",
+  "Keep-Alive",
+  "Proxy-Authenticate",
+  "Proxy-Authorization",
+  "Proxy-Connection",
+  "TE",
+  "Trailer",
+  "Transfer-Encoding",
+  "Upgrade",
+  0
+};
+
+//=========================================================================
+scx::Condition ProxyHandler::handle_message(MessageStream* message)
+{
+  const Request& request = message->get_request();
+  Response& response = message->get_response();
+
+  ProxyUpstream::Ref upstream =
+    m_module.object()->get_proxies().lookup(m_upstream);
+  if (!upstream.valid()) {
+    message->log("Proxy upstream '" + m_upstream + "' not found");
+    response.set_status(http::Status::ServiceUnavailable);
+    return scx::Close;
+  }
+
+  // The message stream can only read bodies delimited by Content-Length
+  if (!request.get_header("Transfer-Encoding").empty()) {
+    response.set_status(http::Status::LengthRequired);
+    return scx::Close;
+  }
+
+  std::string client_addr = proxy_peer_address(message->get_endpoint());
+
+  // Choose a backend
+  std::string hash_header = upstream.object()->get_hash_header();
+  std::string key = hash_header.empty() ?
+    client_addr : request.get_header(hash_header);
+  ProxyBackend* backend = upstream.object()->select(key);
+  if (!backend) {
+    message->log("Proxy upstream '" + m_upstream + "' has no backends");
+    response.set_status(http::Status::ServiceUnavailable);
+    return scx::Close;
+  }
+
+  // Build the request headers to send, removing hop-by-hop headers
+  // (including any listed in the Connection header)
+  scx::MimeHeaderTable headers = request.get_headers();
+  std::string conn = request.get_header("Connection");
+  std::string::size_type start = 0;
+  while (start < conn.size()) {
+    std::string::size_type end = conn.find_first_of(",",start);
+    if (end == std::string::npos) end = conn.size();
+    std::string token = conn.substr(start,end-start);
+    std::string::size_type t1 = token.find_first_not_of(" \t");
+    std::string::size_type t2 = token.find_last_not_of(" \t");
+    if (t1 != std::string::npos) headers.erase(token.substr(t1,t2-t1+1));
+    start = end+1;
+  }
+  for (int i=0; proxy_hop_headers[i]; ++i) {
+    headers.erase(proxy_hop_headers[i]);
+  }
+
+  bool expect_continue = false;
+  std::string expect = headers.get("Expect");
+  scx::strlow(expect);
+  if (expect == "100-continue") {
+    headers.erase("Expect");
+    expect_continue = true;
+  }
+
+  std::string forwarded = request.get_header("X-Forwarded-For");
+  if (!client_addr.empty()) {
+    headers.set("X-Forwarded-For",
+                forwarded.empty() ? client_addr :
+                forwarded + ", " + client_addr);
+  }
+  headers.set("X-Forwarded-Proto", request.is_secure() ? "https" : "http");
+  const scx::Uri& backend_uri = backend->get_uri();
+  if (headers.get("Host").empty()) {
+    headers.set("Host",backend_uri.get_host());
+  }
+  upstream.object()->rewrite_request(headers);
+  headers.set("Connection","keep-alive");
+
+  const scx::Uri& uri = request.get_uri();
+  std::string target = "/" + uri.get_path();
+  if (!uri.get_query().empty()) target += "?" + uri.get_query();
+
+  std::string head = request.get_method() + " " + target + " HTTP/1.1" +
+    CRLF + headers.get_all() + CRLF;
+
+  long clength = atol(request.get_header("Content-Length").c_str());
+  ProxyExchange* exchange =
+    new ProxyExchange(request.get_method(),head,clength > 0);
+  exchange->m_key = key;
+
+  if (!upstream.object()->connect(exchange,backend,true)) {
+    upstream.object()->finished(backend,true);
+    exchange->release();
+    response.set_status(http::Status::BadGateway);
+    return scx::Close;
+  }
+
+  if (expect_continue) {
+    message->send_continue();
+  }
+
+  message->add_stream(new ProxyStream(message,upstream.object(),exchange));
+  return scx::Ok;
+}
+
+};
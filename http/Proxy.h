@@ -0,0 +1,278 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Reverse proxy
+
+Forwards requests to pools of upstream (backend) HTTP servers, balancing
+requests between the healthy backends in each pool and keeping persistent
+connections to them open between requests.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef httpProxy_h
+#define httpProxy_h
+
+#include <http/http.h>
+#include <http/Handler.h>
+#include <http/Client.h>
+#include <sconex/ScriptBase.h>
+#include <sconex/Mutex.h>
+#include <sconex/Uri.h>
+#include <sconex/Date.h>
+#include <sconex/MimeHeader.h>
+#include <sconex/Job.h>
+#include <set>
+namespace http {
+
+class ProxyUpstream;
+class ProxyExchange;
+class ProxyUpstreamStream;
+
+//=============================================================================
+// ProxyBackend - A backend server within an upstream pool.
+//
+// Counters and state are protected by the owning upstream's mutex.
+//
+class HTTP_API ProxyBackend : public scx::ScriptObject,
+                              public ClientCallback {
+public:
+
+  ProxyBackend(ProxyUpstream& upstream, const scx::Uri& uri);
+  virtual ~ProxyBackend();
+
+  const scx::Uri& get_uri() const;
+
+  // Client pool key for idle persistent connections to this backend
+  const std::string& get_pool_key() const;
+
+  // Start an active health check by requesting path from the backend
+  void start_check(HTTPModule* module, const std::string& path);
+
+  // ClientCallback method
+  virtual void client_complete(Client& client, bool error);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  typedef scx::ScriptRefTo<ProxyBackend> Ref;
+
+private:
+
+  friend class ProxyUpstream;
+
+  ProxyUpstream& m_upstream;
+  scx::Uri m_uri;
+  std::string m_pool_key;
+
+  bool m_healthy;
+  bool m_removed;
+  int m_active;
+  int m_consecutive_failures;
+  scx::Date m_retry_time;
+
+  // Active health checking
+  bool m_checking;
+  scx::Date m_next_check;
+  Client::Ref* m_check;
+  Ref* m_check_self;
+  scx::ScriptRef* m_check_upstream;
+
+  // Statistics
+  unsigned long m_requests;
+  unsigned long m_failures;
+  unsigned long m_connections;
+};
+
+//=============================================================================
+// ProxyUpstream - A named pool of backend servers.
+//
+// Requests are balanced between healthy backends either by least active
+// connections (round-robin between equally loaded backends), or by hashing
+// a request key (the client address or a header value), so that requests
+// with the same key go to the same backend while it remains healthy.
+//
+class HTTP_API ProxyUpstream : public scx::ScriptObject {
+public:
+
+  enum Balance {
+    LeastConn,
+    Hash
+  };
+
+  ProxyUpstream(HTTPModule& module, const std::string& name);
+  virtual ~ProxyUpstream();
+
+  const std::string& get_name() const;
+  HTTPModule& get_module();
+
+  // Select a backend for a request with the given hash key, counting it as
+  // active. Returns 0 if there are no backends available.
+  ProxyBackend* select(const std::string& key);
+
+  // Get the header used as the hash key, if empty the client address is
+  // used instead
+  std::string get_hash_header() const;
+
+  // Start the exchange on a connection to backend, using an idle
+  // connection if allow_reuse is set and one is available.
+  bool connect(ProxyExchange* exchange,
+               ProxyBackend* backend,
+               bool allow_reuse);
+
+  // Called when a request on backend completes
+  void finished(ProxyBackend* backend, bool error);
+
+  // Number of idle connections to keep for backend in the client pool
+  int get_max_idle(const ProxyBackend* backend) const;
+
+  // Close idle connections to all backends
+  void close_idle();
+
+  // Apply header rewrites
+  void rewrite_request(scx::MimeHeaderTable& headers) const;
+  void rewrite_response(Response& response) const;
+
+  // Run any health checks which are due
+  void check_health();
+
+  // Record the result of an active health check
+  void check_complete(ProxyBackend* backend, bool healthy);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<ProxyUpstream> Ref;
+
+private:
+
+  friend class ProxyBackend;
+
+  bool available(const ProxyBackend* backend, const scx::Date& now) const;
+  void set_healthy(ProxyBackend* backend, bool healthy);
+
+  HTTPModule& m_module;
+  std::string m_name;
+  mutable scx::Mutex m_mutex;
+
+  typedef std::vector<ProxyBackend::Ref*> BackendList;
+  BackendList m_backends;
+
+  // Removed backends are kept until the upstream is destroyed, since
+  // requests in progress may still refer to them.
+  BackendList m_removed;
+
+  Balance m_balance;
+  std::string m_hash_header;
+  unsigned int m_next;
+
+  int m_max_idle;
+  int m_max_fails;
+  scx::Time m_fail_timeout;
+
+  std::string m_health_path;
+  scx::Time m_health_interval;
+
+  typedef std::map<std::string,std::string> HeaderMap;
+  HeaderMap m_request_set;
+  std::set<std::string> m_request_remove;
+  HeaderMap m_response_set;
+  std::set<std::string> m_response_remove;
+
+  // Statistics
+  unsigned long m_requests;
+  unsigned long m_errors;
+  unsigned long m_unavailable;
+};
+
+//=============================================================================
+// ProxyManager - Manages the configured upstream pools, and runs their
+// health checks.
+//
+class HTTP_API ProxyManager : public scx::ScriptObject {
+public:
+
+  ProxyManager(HTTPModule& module);
+  virtual ~ProxyManager();
+
+  // Lookup an upstream by name, returns an invalid ref if not found
+  ProxyUpstream::Ref lookup(const std::string& name);
+
+  void check_health();
+
+  // Close idle connections to all upstreams
+  void close_idle();
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<ProxyManager> Ref;
+
+private:
+
+  HTTPModule& m_module;
+  mutable scx::Mutex m_mutex;
+
+  typedef std::map<std::string,ProxyUpstream::Ref*> UpstreamMap;
+  UpstreamMap m_upstreams;
+
+  scx::JobID m_job;
+};
+
+//=============================================================================
+// ProxyHandler - Forwards requests to the named upstream pool.
+//
+class HTTP_API ProxyHandler : public Handler {
+public:
+
+  ProxyHandler(HTTPModule* module, const std::string& upstream);
+  virtual ~ProxyHandler();
+
+  virtual scx::Condition handle_message(MessageStream* message);
+
+private:
+
+  HTTPModule::Ref m_module;
+  std::string m_upstream;
+};
+
+};
+#endif
@@ -0,0 +1,683 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Reverse proxy streams
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <http/ProxyStream.h>
+#include <http/MessageStream.h>
+#include <http/Status.h>
+
+#include <sconex/Kernel.h>
+#include <sconex/utils.h>
+#include <set>
+namespace http {
+
+// Maximum amount of body held in each direction before the sending side
+// is paused
+#define PROXY_BUFFER_SIZE 65536
+
+// Amount read or written in one go
+#define PROXY_BLOCK_SIZE 16384
+
+// Number of times a request without a body is tried
+#define PROXY_MAX_ATTEMPTS 2
+
+//=============================================================================
+// Is this a hop-by-hop header in a response, which should not be passed on
+// to the client
+static bool proxy_hop_header(const std::string& name,
+                             const std::string& connection)
+{
+  std::string lname = name;
+  scx::strlow(lname);
+  if (lname == "connection" ||
+      lname == "keep-alive" ||
+      lname == "proxy-authenticate" ||
+      lname == "proxy-connection" ||
+      lname == "te" ||
+      lname == "trailer" ||
+      lname == "transfer-encoding" ||
+      lname == "upgrade") {
+    return true;
+  }
+
+  // Also any headers listed in the Connection header
+  std::string conn = connection;
+  scx::strlow(conn);
+  std::string::size_type start = 0;
+  while (start < conn.size()) {
+    std::string::size_type end = conn.find_first_of(",",start);
+    if (end == std::string::npos) end = conn.size();
+    std::string token = conn.substr(start,end-start);
+    std::string::size_type t1 = token.find_first_not_of(" \t");
+    std::string::size_type t2 = token.find_last_not_of(" \t");
+    if (t1 != std::string::npos && token.substr(t1,t2-t1+1) == lname) {
+      return true;
+    }
+    start = end+1;
+  }
+  return false;
+}
+
+
+//=============================================================================
+ProxyExchange::ProxyExchange(const std::string& method,
+                             const std::string& request_head,
+                             bool request_body)
+  : m_method(method),
+    m_request_head(request_head),
+    m_has_body(request_body),
+    m_attempts(1),
+    m_request_done(!request_body),
+    m_headers_done(false),
+    m_response_done(false),
+    m_error(false),
+    m_aborted(false),
+    m_client_read_paused(false),
+    m_client_write_waiting(false),
+    m_upstream_read_paused(false),
+    m_upstream_write_waiting(false),
+    m_client(0),
+    m_upstream(0),
+    m_refs(1)
+{
+  DEBUG_COUNT_CONSTRUCTOR(ProxyExchange);
+}
+
+//=============================================================================
+ProxyExchange::~ProxyExchange()
+{
+  DEBUG_COUNT_DESTRUCTOR(ProxyExchange);
+}
+
+//=============================================================================
+void ProxyExchange::add_ref()
+{
+  scx::MutexLocker locker(m_mutex);
+  ++m_refs;
+}
+
+//=============================================================================
+void ProxyExchange::release()
+{
+  m_mutex.lock();
+  bool last = (--m_refs == 0);
+  m_mutex.unlock();
+  if (last) delete this;
+}
+
+//=============================================================================
+void ProxyExchange::notify_client(scx::Stream::Event event)
+{
+  if (m_client) {
+    m_client->notify(event);
+    scx::Kernel::get()->wakeup();
+  }
+}
+
+//=============================================================================
+void ProxyExchange::notify_upstream(scx::Stream::Event event)
+{
+  if (m_upstream) {
+    m_upstream->notify(event);
+    scx::Kernel::get()->wakeup();
+  }
+}
+
+
+//=============================================================================
+ProxyStream::ProxyStream(MessageStream* message,
+                         ProxyUpstream* upstream,
+                         ProxyExchange* exchange)
+  : scx::Stream("http:proxy"),
+    m_message(message),
+    m_upstream(upstream),
+    m_exchange(exchange),
+    m_headers_applied(false),
+    m_bytes_out(0)
+{
+  // Takes over the creator's reference to the exchange
+  scx::MutexLocker locker(m_exchange->m_mutex);
+  m_exchange->m_client = this;
+  enable_event(scx::Stream::Readable,!m_exchange->m_request_done);
+  enable_event(scx::Stream::Writeable,true);
+}
+
+//=============================================================================
+ProxyStream::~ProxyStream()
+{
+  m_exchange->m_mutex.lock();
+  m_exchange->m_client = 0;
+  if (!m_exchange->m_response_done && !m_exchange->m_error) {
+    // The client has gone away before the response was complete, so the
+    // upstream connection can't be reused
+    m_exchange->m_aborted = true;
+    m_exchange->notify_upstream(scx::Stream::Writeable);
+  }
+  m_exchange->m_mutex.unlock();
+  m_exchange->release();
+}
+
+//=============================================================================
+void ProxyStream::notify(scx::Stream::Event e)
+{
+  enable_event(e,true);
+}
+
+//=============================================================================
+scx::Condition ProxyStream::event(scx::Stream::Event e)
+{
+  switch (e) {
+
+    case scx::Stream::Readable: // READABLE
+      return read_request();
+
+    case scx::Stream::Writeable: // WRITEABLE
+      return write_response();
+
+    default:
+      break;
+  }
+
+  return scx::Ok;
+}
+
+//=============================================================================
+std::string ProxyStream::stream_status() const
+{
+  std::ostringstream oss;
+  oss << m_upstream.object()->get_name()
+      << " out:" << m_bytes_out;
+  if (m_headers_applied) oss << " HDRS";
+  return oss.str();
+}
+
+//=============================================================================
+scx::Condition ProxyStream::read_request()
+{
+  char buffer[PROXY_BLOCK_SIZE];
+  scx::Condition c = scx::Ok;
+
+  // Keep reading until there's nothing more available, as the end of the
+  // body is only seen on a read after it has all been received.
+  while (c == scx::Ok) {
+    m_exchange->m_mutex.lock();
+    int space = PROXY_BUFFER_SIZE - (int)m_exchange->m_request_body.size();
+    const scx::Stream* conn = find_stream("http:connection");
+    bool buffered = (conn && conn->has_readable());
+    if (m_exchange->m_request_done || (space <= 0 && !buffered)) {
+      // Wait for the upstream to take some of the body. Anything already
+      // buffered is read regardless, as we won't be told about it again.
+      m_exchange->m_client_read_paused = !m_exchange->m_request_done;
+      enable_event(scx::Stream::Readable,false);
+      m_exchange->m_mutex.unlock();
+      return scx::Ok;
+    }
+    m_exchange->m_mutex.unlock();
+
+    int na = 0;
+    int nreq = std::max(1,std::min(space,PROXY_BLOCK_SIZE));
+    c = Stream::read(buffer,nreq,na);
+    if (c == scx::Ok && na == 0) c = scx::Wait;
+
+    scx::MutexLocker locker(m_exchange->m_mutex);
+    if (na > 0) {
+      m_exchange->m_request_body.append(buffer,na);
+      endpoint().reset_timeout();
+    }
+    if (c == scx::End) {
+      // Message stream has read all of the request body
+      m_exchange->m_request_done = true;
+      enable_event(scx::Stream::Readable,false);
+    }
+    if ((na > 0 || m_exchange->m_request_done) &&
+        m_exchange->m_upstream_write_waiting) {
+      m_exchange->m_upstream_write_waiting = false;
+      m_exchange->notify_upstream(scx::Stream::Writeable);
+    }
+  }
+  return (c == scx::Error) ? scx::Error : scx::Ok;
+}
+
+//=============================================================================
+scx::Condition ProxyStream::write_response()
+{
+  if (!m_headers_applied) {
+    m_exchange->m_mutex.lock();
+    if (!m_exchange->m_headers_done) {
+      if (m_exchange->m_error) {
+        m_exchange->m_mutex.unlock();
+        m_message->log("Proxy upstream '" +
+                       m_upstream.object()->get_name() + "' failed");
+        if (!m_exchange->m_request_done) {
+          // Request body hasn't been read, so it can't be kept open
+          m_message->get_response().set_header("Connection","close");
+        }
+        m_message->send_simple_response(http::Status::BadGateway);
+        return scx::Close;
+      }
+      m_exchange->m_client_write_waiting = true;
+      enable_event(scx::Stream::Writeable,false);
+      m_exchange->m_mutex.unlock();
+      return scx::Ok;
+    }
+    std::string status_line = m_exchange->m_status_line;
+    std::vector<std::string> lines = m_exchange->m_header_lines;
+    bool empty = (m_exchange->m_response_done &&
+                  m_exchange->m_response_body.empty());
+    m_exchange->m_mutex.unlock();
+
+    apply_headers(status_line,lines);
+    m_headers_applied = true;
+
+    Response& response = m_message->get_response();
+    if (m_exchange->m_method == "HEAD" ||
+        !response.get_status().has_body() ||
+        !response.get_header("Content-Length").empty() ||
+        empty) {
+      // Send the headers now, as there may be no body writes to trigger
+      // them (an empty body would otherwise be sent as chunked).
+      if (response.get_header("Content-Length").empty() && empty &&
+          m_exchange->m_method != "HEAD") {
+        response.set_header("Content-Length","0");
+      }
+      int na = 0;
+      Stream::write("",0,na);
+    }
+  }
+
+  // Copy out a block of the response body, as the upstream can append to
+  // the buffer while we are writing.
+  char buffer[PROXY_BLOCK_SIZE];
+  int n = 0;
+  m_exchange->m_mutex.lock();
+  n = std::min((int)m_exchange->m_response_body.size(),PROXY_BLOCK_SIZE);
+  if (n == 0) {
+    bool done = m_exchange->m_response_done;
+    bool error = m_exchange->m_error;
+    if (!done && !error) {
+      m_exchange->m_client_write_waiting = true;
+      enable_event(scx::Stream::Writeable,false);
+    }
+    m_exchange->m_mutex.unlock();
+    if (done) return scx::Close;
+    if (error) {
+      // The response has been cut short, the only way to tell the client
+      // is to close the connection.
+      m_message->log("Proxy upstream '" +
+                     m_upstream.object()->get_name() + "' failed mid-response");
+      return scx::Error;
+    }
+    return scx::Ok;
+  }
+  memcpy(buffer,m_exchange->m_response_body.data(),n);
+  m_exchange->m_mutex.unlock();
+
+  int na = 0;
+  scx::Condition c = Stream::write(buffer,n,na);
+  if (c != scx::Ok && c != scx::Wait) {
+    return c;
+  }
+
+  if (na > 0) {
+    m_bytes_out += na;
+    endpoint().reset_timeout();
+
+    scx::MutexLocker locker(m_exchange->m_mutex);
+    m_exchange->m_response_body.erase(0,na);
+    if (m_exchange->m_upstream_read_paused) {
+      m_exchange->m_upstream_read_paused = false;
+      m_exchange->notify_upstream(scx::Stream::Readable);
+    }
+  }
+  return (na < n) ? scx::Wait : scx::Ok;
+}
+
+//=============================================================================
+void ProxyStream::apply_headers(const std::string& status_line,
+                                const std::vector<std::string>& lines)
+{
+  Response& response = m_message->get_response();
+
+  // Only the status is taken from the upstream's status line, the version
+  // of the response is that of our own connection to the client.
+  Response upstream_response;
+  upstream_response.parse_response(status_line);
+  response.set_status(upstream_response.get_status());
+
+  std::string connection;
+  for (std::vector<std::string>::const_iterator it = lines.begin();
+       it != lines.end(); ++it) {
+    std::string::size_type i = it->find_first_of(":");
+    if (i == std::string::npos) continue;
+    std::string name = it->substr(0,i);
+    scx::strlow(name);
+    if (name == "connection") {
+      connection += (connection.empty() ? "" : ",") + it->substr(i+1);
+    }
+  }
+
+  std::set<std::string> seen;
+  for (std::vector<std::string>::const_iterator it = lines.begin();
+       it != lines.end(); ++it) {
+    std::string::size_type i = it->find_first_of(":");
+    if (i == std::string::npos) continue;
+    std::string name = it->substr(0,i);
+    if (proxy_hop_header(name,connection)) continue;
+
+    // Upstream headers replace our own (e.g. Date). Repeated headers are
+    // passed on as they are, one line for each, as some (e.g. Set-Cookie)
+    // can't be combined into a list.
+    std::string lname = name;
+    scx::strlow(lname);
+    if (!seen.insert(lname).second) {
+      std::string value = it->substr(i+1);
+      std::string::size_type v = value.find_first_not_of(" ");
+      response.add_header(name, v == std::string::npos ? "" : value.substr(v));
+    } else {
+      response.parse_header(*it);
+    }
+  }
+
+  m_upstream.object()->rewrite_response(response);
+}
+
+
+//=============================================================================
+ProxyUpstreamStream::ProxyUpstreamStream(ProxyUpstream* upstream,
+                                         ProxyBackend* backend)
+  : ClientConnection("http:proxy-upstream",&upstream->get_module(),
+                     backend->get_pool_key()),
+    m_upstream(upstream),
+    m_backend(backend),
+    m_exchange(0),
+    m_handover(0)
+{
+
+}
+
+//=============================================================================
+ProxyUpstreamStream::~ProxyUpstreamStream()
+{
+  remove_from_pool();
+
+  if (m_exchange) {
+    // Connection lost, or failed to connect
+    ProxyExchange* exchange = m_exchange;
+    m_exchange = 0;
+    finish(exchange,true,m_uses > 1,m_received);
+  }
+
+  // An exchange handed over but never started
+  m_handover_mutex.lock();
+  ProxyExchange* exchange = m_handover;
+  m_handover = 0;
+  m_handover_mutex.unlock();
+  if (exchange) {
+    finish(exchange,true,m_uses > 0,false);
+  }
+}
+
+//=============================================================================
+void ProxyUpstreamStream::attach(ProxyExchange* exchange)
+{
+  exchange->add_ref();
+
+  // As for ClientStream, the exchange is started by the job owning the
+  // connection.
+  scx::MutexLocker locker(m_handover_mutex);
+  m_handover = exchange;
+  handover();
+}
+
+//=============================================================================
+ProxyBackend* ProxyUpstreamStream::get_backend()
+{
+  return m_backend.object();
+}
+
+//=============================================================================
+void ProxyUpstreamStream::notify(scx::Stream::Event e)
+{
+  enable_event(e,true);
+}
+
+//=============================================================================
+scx::Condition ProxyUpstreamStream::event(scx::Stream::Event e)
+{
+  if (m_exchange && (e == scx::Stream::Readable ||
+                     e == scx::Stream::Writeable)) {
+    m_exchange->m_mutex.lock();
+    bool aborted = m_exchange->m_aborted;
+    m_exchange->m_mutex.unlock();
+    if (aborted) {
+      // Client has gone away, give up on this connection
+      ProxyExchange* exchange = m_exchange;
+      m_exchange = 0;
+      m_seq = End;
+      finish(exchange,false,false,true);
+      return scx::End;
+    }
+  }
+
+  return ClientConnection::event(e);
+}
+
+//=============================================================================
+std::string ProxyUpstreamStream::stream_status() const
+{
+  return ClientConnection::stream_status() + " " +
+    m_upstream.object()->get_name();
+}
+
+//=============================================================================
+bool ProxyUpstreamStream::take_handover()
+{
+  m_handover_mutex.lock();
+  ProxyExchange* exchange = m_handover;
+  m_handover = 0;
+  m_handover_mutex.unlock();
+  if (!exchange) {
+    return false;
+  }
+
+  m_exchange = exchange;
+  m_exchange->m_mutex.lock();
+  m_exchange->m_upstream = this;
+  m_send = m_exchange->m_request_head;
+  m_exchange->m_mutex.unlock();
+
+  begin_request(m_exchange->m_method);
+  return true;
+}
+
+//=============================================================================
+scx::Condition ProxyUpstreamStream::send_request()
+{
+  if (!m_send.empty()) {
+    int na = 0;
+    scx::Condition c = Stream::write(m_send.data(),m_send.size(),na);
+    if (c != scx::Ok && c != scx::Wait) {
+      return c;
+    }
+    m_send.erase(0,na);
+    endpoint().reset_timeout();
+    if (!m_send.empty()) {
+      return scx::Wait;
+    }
+  }
+
+  char buffer[PROXY_BLOCK_SIZE];
+  while (true) {
+    m_exchange->m_mutex.lock();
+    int n = std::min((int)m_exchange->m_request_body.size(),PROXY_BLOCK_SIZE);
+    if (n == 0) {
+      if (m_exchange->m_request_done) {
+        // Request sent, now wait for the response
+        m_exchange->m_mutex.unlock();
+        return scx::Ok;
+      }
+      // Wait for more of the body from the client
+      m_exchange->m_upstream_write_waiting = true;
+      enable_event(scx::Stream::Writeable,false);
+      m_exchange->m_mutex.unlock();
+      return scx::Wait;
+    }
+    memcpy(buffer,m_exchange->m_request_body.data(),n);
+    m_exchange->m_mutex.unlock();
+
+    int na = 0;
+    scx::Condition c = Stream::write(buffer,n,na);
+    if (c != scx::Ok && c != scx::Wait) {
+      return c;
+    }
+
+    if (na > 0) {
+      endpoint().reset_timeout();
+      scx::MutexLocker locker(m_exchange->m_mutex);
+      m_exchange->m_request_body.erase(0,na);
+      if (m_exchange->m_client_read_paused) {
+        m_exchange->m_client_read_paused = false;
+        m_exchange->notify_client(scx::Stream::Readable);
+      }
+    }
+    if (na < n) return scx::Wait;
+  }
+}
+
+//=============================================================================
+void ProxyUpstreamStream::response_headers()
+{
+  // Pass the headers on to the client
+  scx::MutexLocker locker(m_exchange->m_mutex);
+  m_exchange->m_status_line = m_status_line;
+  m_exchange->m_header_lines = m_header_lines;
+  m_exchange->m_headers_done = true;
+  if (m_exchange->m_client_write_waiting) {
+    m_exchange->m_client_write_waiting = false;
+    m_exchange->notify_client(scx::Stream::Writeable);
+  }
+}
+
+//=============================================================================
+int ProxyUpstreamStream::body_space()
+{
+  scx::MutexLocker locker(m_exchange->m_mutex);
+  int space = PROXY_BUFFER_SIZE - (int)m_exchange->m_response_body.size();
+  if (space <= 0) {
+    // Wait for the client to take some of the body
+    m_exchange->m_upstream_read_paused = true;
+    enable_event(scx::Stream::Readable,false);
+    return 0;
+  }
+  return std::min(space,PROXY_BLOCK_SIZE);
+}
+
+//=============================================================================
+void ProxyUpstreamStream::body_data(const char* data, int n)
+{
+  scx::MutexLocker locker(m_exchange->m_mutex);
+  m_exchange->m_response_body.append(data,n);
+  if (m_exchange->m_client_write_waiting) {
+    m_exchange->m_client_write_waiting = false;
+    m_exchange->notify_client(scx::Stream::Writeable);
+  }
+}
+
+//=============================================================================
+void ProxyUpstreamStream::response_complete(bool error)
+{
+  if (!m_exchange) {
+    return;
+  }
+  ProxyExchange* exchange = m_exchange;
+  m_exchange = 0;
+  finish(exchange,error,m_uses > 1,m_received);
+}
+
+//=============================================================================
+int ProxyUpstreamStream::get_max_idle() const
+{
+  return m_upstream.object()->get_max_idle(m_backend.object());
+}
+
+//=============================================================================
+void ProxyUpstreamStream::finish(ProxyExchange* exchange,
+                                 bool error,
+                                 bool reused,
+                                 bool received)
+{
+  ProxyUpstream* upstream = m_upstream.object();
+  ProxyBackend* backend = m_backend.object();
+
+  // If nothing has been received and there's no request body to resend,
+  // the request can be tried once more.
+  exchange->m_mutex.lock();
+  if (exchange->m_upstream == this) {
+    exchange->m_upstream = 0;
+  }
+  bool resend = (error &&
+                 !received &&
+                 !exchange->m_aborted &&
+                 !exchange->m_has_body &&
+                 exchange->m_attempts < PROXY_MAX_ATTEMPTS);
+  std::string key = exchange->m_key;
+  if (resend) {
+    ++exchange->m_attempts;
+  } else {
+    if (error) {
+      exchange->m_error = true;
+    } else {
+      exchange->m_response_done = true;
+    }
+    exchange->notify_client(scx::Stream::Writeable);
+  }
+  exchange->m_mutex.unlock();
+
+  if (!resend) {
+    upstream->finished(backend,error);
+    exchange->release();
+    return;
+  }
+
+  bool started = false;
+  if (reused) {
+    // A reused connection was closed by the backend just as we sent the
+    // request, so try again on a new connection to it.
+    started = upstream->connect(exchange,backend,false);
+    if (!started) upstream->finished(backend,true);
+  } else {
+    // Fail over to another backend
+    upstream->finished(backend,true);
+    backend = upstream->select(key);
+    if (backend) {
+      started = upstream->connect(exchange,backend,true);
+      if (!started) upstream->finished(backend,true);
+    }
+  }
+  if (!started) {
+    exchange->m_mutex.lock();
+    exchange->m_error = true;
+    exchange->notify_client(scx::Stream::Writeable);
+    exchange->m_mutex.unlock();
+  }
+  exchange->release();
+}
+
+};
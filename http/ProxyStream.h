@@ -0,0 +1,193 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Reverse proxy streams
+
+A proxied request is handled by two streams running on different
+connections, which may be serviced by different kernel threads:
+
+ProxyStream sits on the client's message, reading the request body and
+writing the response back to the client.
+
+ProxyUpstreamStream sits on a connection to a backend server, sending the
+request and receiving the response.
+
+The two are joined by a ProxyExchange, which holds bounded buffers for the
+body in each direction, so bodies are streamed through without being held
+in memory in full.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef httpProxyStream_h
+#define httpProxyStream_h
+
+#include <http/Proxy.h>
+#include <http/Response.h>
+#include <sconex/Mutex.h>
+namespace http {
+
+class MessageStream;
+class ProxyStream;
+class ProxyUpstreamStream;
+
+//=============================================================================
+// ProxyExchange - State shared between the client and upstream sides of a
+// proxied request. All members are protected by the mutex.
+//
+class HTTP_API ProxyExchange {
+public:
+
+  ProxyExchange(const std::string& method,
+                const std::string& request_head,
+                bool request_body);
+
+  void add_ref();
+  void release();
+
+  // Wake the client or upstream side to handle event (mutex must be held)
+  void notify_client(scx::Stream::Event event);
+  void notify_upstream(scx::Stream::Event event);
+
+  scx::Mutex m_mutex;
+
+  std::string m_method;
+  std::string m_request_head;
+  bool m_has_body;
+
+  // Backend selection key, and number of attempts made
+  std::string m_key;
+  int m_attempts;
+
+  // Request body, from client to upstream
+  std::string m_request_body;
+  bool m_request_done;
+
+  // Response from upstream to client
+  std::string m_status_line;
+  std::vector<std::string> m_header_lines;
+  bool m_headers_done;
+  std::string m_response_body;
+  bool m_response_done;
+
+  // The upstream failed, or the client went away
+  bool m_error;
+  bool m_aborted;
+
+  // Which side is waiting for the other
+  bool m_client_read_paused;
+  bool m_client_write_waiting;
+  bool m_upstream_read_paused;
+  bool m_upstream_write_waiting;
+
+  ProxyStream* m_client;
+  ProxyUpstreamStream* m_upstream;
+
+private:
+
+  ~ProxyExchange();
+  int m_refs;
+};
+
+//=============================================================================
+// ProxyStream - Client side of a proxied request
+//
+class HTTP_API ProxyStream : public scx::Stream {
+public:
+
+  ProxyStream(MessageStream* message,
+              ProxyUpstream* upstream,
+              ProxyExchange* exchange);
+
+  virtual ~ProxyStream();
+
+  // Enable event, called by the exchange from another thread
+  void notify(scx::Stream::Event e);
+
+  virtual scx::Condition event(scx::Stream::Event e);
+
+  virtual std::string stream_status() const;
+
+private:
+
+  scx::Condition read_request();
+  scx::Condition write_response();
+  void apply_headers(const std::string& status_line,
+                     const std::vector<std::string>& lines);
+
+  MessageStream* m_message;
+  ProxyUpstream::Ref m_upstream;
+  ProxyExchange* m_exchange;
+  bool m_headers_applied;
+  long m_bytes_out;
+};
+
+//=============================================================================
+// ProxyUpstreamStream - A connection to a backend server, which may be
+// kept open in the client pool and reused for further requests to the same
+// backend.
+//
+class HTTP_API ProxyUpstreamStream : public ClientConnection {
+public:
+
+  ProxyUpstreamStream(ProxyUpstream* upstream,
+                      ProxyBackend* backend);
+
+  virtual ~ProxyUpstreamStream();
+
+  // Hand the exchange to this connection.
+  // Must only be called for a new or idle (pooled) connection.
+  void attach(ProxyExchange* exchange);
+
+  ProxyBackend* get_backend();
+
+  // Enable event, called by the exchange from another thread
+  void notify(scx::Stream::Event e);
+
+  virtual scx::Condition event(scx::Stream::Event e);
+
+  virtual std::string stream_status() const;
+
+protected:
+
+  virtual bool take_handover();
+  virtual scx::Condition send_request();
+  virtual void response_headers();
+  virtual int body_space();
+  virtual void body_data(const char* data, int n);
+  virtual void response_complete(bool error);
+  virtual int get_max_idle() const;
+
+private:
+
+  // Finish with exchange. A failed request is sent again if that is safe,
+  // on a new connection if this one was reused, otherwise to another
+  // backend.
+  void finish(ProxyExchange* exchange,
+              bool error,
+              bool reused,
+              bool received);
+
+  ProxyUpstream::Ref m_upstream;
+  ProxyBackend::Ref m_backend;
+  ProxyExchange* m_exchange;
+  ProxyExchange* m_handover;
+
+  std::string m_send;
+};
+
+};
+#endif
@@ -192,6 +192,12 @@ bool Request::parse_header(const std::string& str)
   return true;
 }
 
+//===========================================================================
+const scx::MimeHeaderTable& Request::get_headers() const
+{
+  return m_headers;
+}
+
 //=============================================================================
 void Request::set_host(Host* host)
 {
@@ -58,6 +58,7 @@ public:
   std::string get_header(const std::string& name) const;
   scx::MimeHeader get_header_parsed(const std::string& name) const;
   bool parse_header(const std::string& str);
+  const scx::MimeHeaderTable& get_headers() const;
 
   void set_host(Host* host);
   const Host* get_host() const;
@@ -21,13 +21,49 @@ Free Software Foundation, Inc.,
 
 
 #include <http/Response.h>
+#include <http/Request.h>
 
 #include <sconex/StreamSocket.h>
 #include <sconex/File.h>
 #include <sconex/Module.h>
 #include <sconex/ScriptTypes.h>
+#include <sconex/FileStat.h>
 namespace http {
 
+//===========================================================================
+// Does the entity tag list (from an If-Match or If-None-Match header)
+// match etag. Weak comparison ignores any W/ prefix.
+static bool etag_list_match(const std::string& list,
+                            const std::string& etag,
+                            bool weak)
+{
+  // "*" matches any current entity
+  std::string::size_type first = list.find_first_not_of(" \t");
+  if (first != std::string::npos && list[first] == '*') return true;
+  if (etag.empty()) return false;
+
+  bool etag_weak = (etag.find("W/") == 0);
+  if (etag_weak && !weak) return false;
+  std::string opaque = etag_weak ? etag.substr(2) : etag;
+
+  std::string::size_type start = 0;
+  while (start < list.size()) {
+    std::string::size_type end = list.find_first_of(",",start);
+    if (end == std::string::npos) end = list.size();
+    std::string::size_type s1 = list.find_first_not_of(" \t",start);
+    std::string::size_type s2 = list.find_last_not_of(" \t",end-1);
+    if (s1 != std::string::npos && s1 < end && s2 >= s1) {
+      std::string tag = list.substr(s1,s2-s1+1);
+      bool tag_weak = (tag.find("W/") == 0);
+      if (!tag_weak || weak) {
+        if ((tag_weak ? tag.substr(2) : tag) == opaque) return true;
+      }
+    }
+    start = end+1;
+  }
+  return false;
+}
+
 //===========================================================================
 Response::Response()
   : m_status(Status::Ok)
@@ -71,6 +107,12 @@ void Response::set_header(const std::string& name, const std::string& value)
   m_headers.set(name,value);
 }
 
+//===========================================================================
+void Response::add_header(const std::string& name, const std::string& value)
+{
+  m_headers.add(name,value);
+}
+
 //===========================================================================
 bool Response::remove_header(const std::string& name)
 {
@@ -83,6 +125,90 @@ std::string Response::get_header(const std::string& name) const
   return m_headers.get(name);
 }
 
+//===========================================================================
+void Response::set_validators(const std::string& etag,
+                              const scx::Date& lastmod)
+{
+  if (!etag.empty()) {
+    m_headers.set("ETag",etag);
+  }
+  if (lastmod.valid()) {
+    m_headers.set("Last-Modified",lastmod.string());
+  }
+}
+
+//===========================================================================
+bool Response::check_preconditions(const Request& request)
+{
+  const std::string& method = request.get_method();
+  bool safe = (method == "GET" || method == "HEAD");
+  std::string etag = m_headers.get("ETag");
+  std::string lastmod = m_headers.get("Last-Modified");
+
+  // If-Match takes precedence over If-Unmodified-Since
+  std::string if_match = request.get_header("If-Match");
+  if (!if_match.empty()) {
+    if (!etag_list_match(if_match,etag,false)) {
+      m_status = Status::PreconditionFailed;
+      return false;
+    }
+  } else if (!lastmod.empty()) {
+    std::string unmod = request.get_header("If-Unmodified-Since");
+    if (!unmod.empty() && unmod != lastmod &&
+        scx::Date(lastmod) > scx::Date(unmod)) {
+      m_status = Status::PreconditionFailed;
+      return false;
+    }
+  }
+
+  // If-None-Match takes precedence over If-Modified-Since
+  std::string if_none_match = request.get_header("If-None-Match");
+  if (!if_none_match.empty()) {
+    if (etag_list_match(if_none_match,etag,true)) {
+      m_status = safe ? Status::NotModified : Status::PreconditionFailed;
+      return false;
+    }
+  } else if (safe && !lastmod.empty()) {
+    std::string mod = request.get_header("If-Modified-Since");
+    // Clients usually echo back the exact Last-Modified value, so check
+    // for that before parsing any dates.
+    if (!mod.empty() &&
+        (mod == lastmod || scx::Date(lastmod) <= scx::Date(mod))) {
+      m_status = Status::NotModified;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//===========================================================================
+std::string Response::make_etag(const scx::FileStat& stat,
+                                const std::string& coding)
+{
+  std::ostringstream oss;
+  oss << "\"" << std::hex << (unsigned long)stat.inode()
+      << "-" << stat.size()
+      << "-" << stat.time().time().seconds();
+  if (!coding.empty()) oss << "-" << coding;
+  oss << "\"";
+  return oss.str();
+}
+
+//===========================================================================
+std::string Response::make_etag(const std::string& data)
+{
+  // 64-bit FNV-1a hash of the content
+  unsigned long long hash = 14695981039346656037ULL;
+  for (std::string::size_type i=0; i<data.size(); ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  std::ostringstream oss;
+  oss << "\"" << std::hex << hash << "-" << data.size() << "\"";
+  return oss.str();
+}
+
 //===========================================================================
 bool Response::parse_response(const std::string& str)
 {
@@ -182,7 +308,8 @@ scx::ScriptRef* Response::script_op(const scx::ScriptAuth& auth,
 
     // Methods
     if ("set_header" == name ||
-	"set_status" == name) {
+	"set_status" == name ||
+	"set_validators" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
     
@@ -230,6 +357,23 @@ scx::ScriptRef* Response::script_method(const scx::ScriptAuth& auth,
     return 0;
   }
 
+  if (name == "set_validators") {
+    const scx::ScriptObject* a_etag = 
+      scx::get_method_arg<scx::ScriptObject>(args,0,"etag");
+    if (!a_etag) 
+      return scx::ScriptError::new_ref("set_validators() No etag specified");
+
+    std::string etag = a_etag->get_string();
+    if (!etag.empty() && etag[0] != '"' && etag.find("W/") != 0) {
+      etag = "\"" + etag + "\"";
+    }
+    
+    const scx::Date* a_lastmod = 
+      scx::get_method_arg<scx::Date>(args,1,"lastmod");
+    set_validators(etag, a_lastmod ? *a_lastmod : scx::Date());
+    return 0;
+  }
+
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
 
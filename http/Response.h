@@ -27,8 +27,13 @@ Free Software Foundation, Inc.,
 #include <sconex/ScriptBase.h>
 #include <sconex/VersionTag.h>
 #include <sconex/MimeHeader.h>
+#include <sconex/Date.h>
+namespace scx { class FileStat; };
+
 namespace http {
 
+class Request;
+
 //=============================================================================
 // Resposne - Represents a response message from an HTTP server.
 //
@@ -46,9 +51,33 @@ public:
   const Status& get_status() const;
 
   void set_header(const std::string& name, const std::string& value);
+
+  // Add a further value for a repeatable header, sent on its own line
+  void add_header(const std::string& name, const std::string& value);
+
   bool remove_header(const std::string& name);
   std::string get_header(const std::string& name) const;
 
+  // Declare validators for the entity being returned, setting the ETag
+  // and/or Last-Modified headers (empty or invalid values are ignored).
+  void set_validators(const std::string& etag,
+                      const scx::Date& lastmod = scx::Date());
+
+  // Evaluate the request's conditional headers (If-Match, If-None-Match,
+  // If-Unmodified-Since, If-Modified-Since) against the declared
+  // validators. Returns false if the status has been set to 304 or 412,
+  // in which case no body should be sent.
+  bool check_preconditions(const Request& request);
+
+  // Make a strong entity tag for a file from its inode, size and mtime.
+  // If the file is sent with a content coding, it is added to the tag so
+  // that each coding has a different tag.
+  static std::string make_etag(const scx::FileStat& stat,
+                               const std::string& coding = "");
+
+  // Make a strong entity tag from the content of an entity
+  static std::string make_etag(const std::string& data);
+
   bool parse_response(const std::string& str);
   bool parse_header(const std::string& str);
   std::string build_header_string();
@@ -0,0 +1,710 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Response cache
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+
+#include <http/ResponseCache.h>
+#include <http/HTTPModule.h>
+#include <http/MessageStream.h>
+#include <http/Request.h>
+#include <http/Response.h>
+#include <http/Host.h>
+#include <sconex/Log.h>
+#include <sconex/utils.h>
+namespace http {
+
+// Headers which are stored with a cached response and replayed on a hit
+static const char* s_cached_headers[] = {
+  "Content-Type",
+  "Content-Language",
+  "Content-Disposition",
+  "Cache-Control",
+  "Expires",
+  "Last-Modified",
+  "ETag",
+  "Location",
+  "Vary",
+  0
+};
+
+//=========================================================================
+// Get the max-age specified in a Cache-Control header, or -1 if none.
+// no-store, no-cache and private all return 0.
+static int cache_control_max_age(const std::string& header)
+{
+  std::string cc = header;
+  scx::strlow(cc);
+  if (cc.find("no-store") != std::string::npos ||
+      cc.find("no-cache") != std::string::npos ||
+      cc.find("private") != std::string::npos) {
+    return 0;
+  }
+  std::string::size_type i = cc.find("s-maxage=");
+  if (i != std::string::npos) {
+    return atoi(cc.c_str() + i + 9);
+  }
+  i = cc.find("max-age=");
+  if (i != std::string::npos) {
+    return atoi(cc.c_str() + i + 8);
+  }
+  return -1;
+}
+
+//=========================================================================
+CachedResponse::CachedResponse(const std::string& host,
+                               const std::string& path)
+  : m_host(host),
+    m_path(path),
+    m_status(Status::Ok),
+    m_created(scx::Date::now())
+{
+  DEBUG_COUNT_CONSTRUCTOR(CachedResponse);
+}
+
+//=========================================================================
+CachedResponse::~CachedResponse()
+{
+  DEBUG_COUNT_DESTRUCTOR(CachedResponse);
+}
+
+//=========================================================================
+const std::string& CachedResponse::get_host() const
+{
+  return m_host;
+}
+
+//=========================================================================
+const std::string& CachedResponse::get_path() const
+{
+  return m_path;
+}
+
+//=========================================================================
+void CachedResponse::set_headers(const Response& response)
+{
+  for (int i=0; s_cached_headers[i]; ++i) {
+    std::string value = response.get_header(s_cached_headers[i]);
+    if (!value.empty()) m_headers[s_cached_headers[i]] = value;
+  }
+
+  // Give the entry a strong validator derived from its content, if the
+  // handler didn't declare one, so clients can revalidate against the cache
+  if (m_headers.find("ETag") == m_headers.end()) {
+    m_headers["ETag"] = Response::make_etag(m_body);
+  }
+}
+
+//=========================================================================
+void CachedResponse::apply(Response& response) const
+{
+  response.set_status(m_status);
+  for (HeaderMap::const_iterator it = m_headers.begin();
+       it != m_headers.end(); ++it) {
+    response.set_header(it->first, it->second);
+  }
+  std::ostringstream oss;
+  oss << m_body.size();
+  response.set_header("Content-Length", oss.str());
+}
+
+//=========================================================================
+void CachedResponse::set_status(const Status& status)
+{
+  m_status = status;
+}
+
+//=========================================================================
+const Status& CachedResponse::get_status() const
+{
+  return m_status;
+}
+
+//=========================================================================
+std::string& CachedResponse::body()
+{
+  return m_body;
+}
+
+//=========================================================================
+const std::string& CachedResponse::body() const
+{
+  return m_body;
+}
+
+//=========================================================================
+void CachedResponse::set_expires(const scx::Date& expires)
+{
+  m_expires = expires;
+}
+
+//=========================================================================
+const scx::Date& CachedResponse::get_expires() const
+{
+  return m_expires;
+}
+
+//=========================================================================
+const scx::Date& CachedResponse::get_created() const
+{
+  return m_created;
+}
+
+//=========================================================================
+bool CachedResponse::expired() const
+{
+  return scx::Date::now() >= m_expires;
+}
+
+//=========================================================================
+int CachedResponse::size() const
+{
+  int sz = sizeof(CachedResponse) + m_body.size() +
+    m_host.size() + m_path.size();
+  for (HeaderMap::const_iterator it = m_headers.begin();
+       it != m_headers.end(); ++it) {
+    sz += it->first.size() + it->second.size();
+  }
+  return sz;
+}
+
+//=========================================================================
+std::string CachedResponse::get_string() const
+{
+  return m_host + ":" + m_path;
+}
+
+
+//=========================================================================
+ResponseCache::ResponseCache(HTTPModule& module)
+  : m_module(module),
+    m_size(0),
+    m_max_size(16*1024*1024),
+    m_max_entry_size(1024*1024),
+    m_hits(0),
+    m_stale_hits(0),
+    m_misses(0),
+    m_bypasses(0),
+    m_stores(0),
+    m_evictions(0),
+    m_invalidations(0)
+{
+  m_parent = &m_module;
+}
+
+//=========================================================================
+ResponseCache::~ResponseCache()
+{
+  for (SlotMap::iterator it = m_slots.begin(); it != m_slots.end(); ++it) {
+    delete it->second.entry;
+  }
+}
+
+//=========================================================================
+std::string ResponseCache::make_key(const Request& request) const
+{
+  const Host* host = request.get_host();
+  const scx::Uri& uri = request.get_uri();
+  // Key on the decoded path, as used for routing and by invalidate()
+  std::string path = scx::Uri::decode(uri.get_path());
+  if (path.find_first_of("?\n") != std::string::npos) {
+    // Would be ambiguous with the key separators, so don't cache
+    return "";
+  }
+  std::string key = (host ? host->get_id() : std::string("")) +
+    " " + path + "?" + uri.get_query();
+
+  scx::MutexLocker locker(m_mutex);
+  for (std::list<std::string>::const_iterator it = m_vary.begin();
+       it != m_vary.end(); ++it) {
+    key += "\n" + (*it) + ":" + request.get_header(*it);
+  }
+  return key;
+}
+
+//=========================================================================
+ResponseCache::LookupResult ResponseCache::lookup(const std::string& key,
+                                                  bool revalidate,
+                                                  CachedResponse::Ref*& entry)
+{
+  entry = 0;
+  scx::MutexLocker locker(m_mutex);
+
+  if (key.empty()) {
+    ++m_bypasses;
+    return Bypass;
+  }
+
+  SlotMap::iterator it = m_slots.find(key);
+  if (it == m_slots.end()) {
+    // Not present, this request fills the slot
+    ++m_misses;
+    Slot& slot = m_slots[key];
+    slot.entry = 0;
+    slot.filling = true;
+    slot.invalidated = false;
+    m_lru.push_front(key);
+    slot.lru = m_lru.begin();
+    return Fill;
+  }
+
+  Slot& slot = it->second;
+  m_lru.splice(m_lru.begin(), m_lru, slot.lru);
+
+  if (slot.entry && !revalidate && !slot.entry->object()->expired()) {
+    ++m_hits;
+    entry = slot.entry->ref_copy();
+    return Hit;
+  }
+
+  if (!slot.filling) {
+    // Expired or revalidating, this request refills the slot
+    ++m_misses;
+    slot.filling = true;
+    slot.invalidated = false;
+    return Fill;
+  }
+
+  if (slot.entry && !revalidate) {
+    // Someone else is refilling, serve the stale copy meanwhile
+    ++m_stale_hits;
+    entry = slot.entry->ref_copy();
+    return Hit;
+  }
+
+  // Someone else is filling and there is nothing to serve, so render this
+  // one uncached rather than holding up the job thread
+  ++m_bypasses;
+  return Bypass;
+}
+
+//=========================================================================
+void ResponseCache::store(const std::string& key, CachedResponse* entry)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  SlotMap::iterator it = m_slots.find(key);
+  if (it == m_slots.end() || it->second.invalidated) {
+    // Slot was invalidated while filling, so the response may be out of
+    // date and is discarded
+    delete entry;
+    if (it != m_slots.end()) {
+      Slot& slot = it->second;
+      slot.filling = false;
+      slot.invalidated = false;
+      if (!slot.entry) {
+        m_lru.erase(slot.lru);
+        m_slots.erase(it);
+      }
+    }
+    return;
+  }
+
+  Slot& slot = it->second;
+  if (slot.entry) {
+    m_size -= slot.entry->object()->size();
+    delete slot.entry;
+  }
+  slot.entry = new CachedResponse::Ref(entry);
+  slot.filling = false;
+  m_size += entry->size();
+  ++m_stores;
+
+  evict();
+}
+
+//=========================================================================
+void ResponseCache::abandon(const std::string& key)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  SlotMap::iterator it = m_slots.find(key);
+  if (it != m_slots.end()) {
+    Slot& slot = it->second;
+    slot.filling = false;
+    slot.invalidated = false;
+    if (!slot.entry) {
+      m_lru.erase(slot.lru);
+      m_slots.erase(it);
+    }
+  }
+}
+
+//=========================================================================
+int ResponseCache::invalidate(const std::string& host,
+                              const std::string& path_prefix,
+                              bool subtree)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  int n = 0;
+  for (SlotMap::iterator it = m_slots.begin(); it != m_slots.end(); ) {
+    if (!key_matches(it->first, host, path_prefix, subtree)) {
+      ++it;
+      continue;
+    }
+
+    Slot& slot = it->second;
+    if (slot.entry) {
+      m_size -= slot.entry->object()->size();
+      delete slot.entry;
+      slot.entry = 0;
+      ++n;
+    }
+    if (slot.filling) {
+      // Keep the slot so requests bypass the cache until the fill is done,
+      // but don't let it store a response rendered before the change
+      slot.invalidated = true;
+      ++it;
+    } else {
+      m_lru.erase(slot.lru);
+      m_slots.erase(it++);
+    }
+  }
+  m_invalidations += n;
+  return n;
+}
+
+//=========================================================================
+void ResponseCache::clear()
+{
+  scx::MutexLocker locker(m_mutex);
+
+  for (SlotMap::iterator it = m_slots.begin(); it != m_slots.end(); ) {
+    Slot& slot = it->second;
+    if (slot.entry) {
+      m_size -= slot.entry->object()->size();
+      delete slot.entry;
+      slot.entry = 0;
+      ++m_invalidations;
+    }
+    if (slot.filling) {
+      slot.invalidated = true;
+      ++it;
+    } else {
+      m_lru.erase(slot.lru);
+      m_slots.erase(it++);
+    }
+  }
+}
+
+//=========================================================================
+int ResponseCache::get_max_entry_size() const
+{
+  return m_max_entry_size;
+}
+
+//=========================================================================
+std::string ResponseCache::get_string() const
+{
+  return "ResponseCache";
+}
+
+//=========================================================================
+scx::ScriptRef* ResponseCache::script_op(const scx::ScriptAuth& auth,
+					 const scx::ScriptRef& ref,
+					 const scx::ScriptOp& op,
+					 const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("set_max_size" == name ||
+	"set_max_entry_size" == name ||
+	"add_vary" == name ||
+	"invalidate" == name ||
+	"clear" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("count" == name) return scx::ScriptInt::new_ref(m_slots.size());
+    if ("size" == name) return scx::ScriptInt::new_ref(m_size);
+    if ("max_size" == name) return scx::ScriptInt::new_ref(m_max_size);
+    if ("max_entry_size" == name)
+      return scx::ScriptInt::new_ref(m_max_entry_size);
+    if ("hits" == name) return scx::ScriptInt::new_ref(m_hits);
+    if ("stale_hits" == name) return scx::ScriptInt::new_ref(m_stale_hits);
+    if ("misses" == name) return scx::ScriptInt::new_ref(m_misses);
+    if ("bypasses" == name) return scx::ScriptInt::new_ref(m_bypasses);
+    if ("stores" == name) return scx::ScriptInt::new_ref(m_stores);
+    if ("evictions" == name) return scx::ScriptInt::new_ref(m_evictions);
+    if ("invalidations" == name)
+      return scx::ScriptInt::new_ref(m_invalidations);
+    if ("vary" == name) {
+      scx::ScriptList* list = new scx::ScriptList();
+      for (std::list<std::string>::const_iterator it = m_vary.begin();
+	   it != m_vary.end(); ++it) {
+	list->give(scx::ScriptString::new_ref(*it));
+      }
+      return new scx::ScriptRef(list);
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* ResponseCache::script_method(const scx::ScriptAuth& auth,
+					     const scx::ScriptRef& ref,
+					     const std::string& name,
+					     const scx::ScriptRef* args)
+{
+  if ("set_max_size" == name ||
+      "set_max_entry_size" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_size =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"value");
+    if (!a_size)
+      return scx::ScriptError::new_ref("Must specify value");
+    int n_size = a_size->get_int();
+    if (n_size < 0)
+      return scx::ScriptError::new_ref("Size must be >= 0");
+
+    scx::MutexLocker locker(m_mutex);
+    if ("set_max_size" == name) {
+      m_max_size = n_size;
+      evict();
+    } else {
+      m_max_entry_size = n_size;
+    }
+    return 0;
+  }
+
+  if ("add_vary" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptString* a_header =
+      scx::get_method_arg<scx::ScriptString>(args,0,"header");
+    if (!a_header)
+      return scx::ScriptError::new_ref("Must specify header");
+
+    clear();
+    scx::MutexLocker locker(m_mutex);
+    m_vary.push_back(a_header->get_string());
+    return 0;
+  }
+
+  if ("invalidate" == name) {
+    if (!auth.trusted()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptString* a_host =
+      scx::get_method_arg<scx::ScriptString>(args,0,"host");
+    if (!a_host)
+      return scx::ScriptError::new_ref("Must specify host");
+
+    const scx::ScriptString* a_path =
+      scx::get_method_arg<scx::ScriptString>(args,1,"path");
+
+    int n = invalidate(a_host->get_string(),
+		       a_path ? a_path->get_string() : "");
+    return scx::ScriptInt::new_ref(n);
+  }
+
+  if ("clear" == name) {
+    if (!auth.trusted()) return scx::ScriptError::new_ref("Not permitted");
+    clear();
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+//=========================================================================
+bool ResponseCache::key_matches(const std::string& key,
+                                const std::string& host,
+                                const std::string& path,
+                                bool subtree)
+{
+  // Keys are "<host> <path>?<query>[\n<vary>...]"
+  std::string::size_type n = host.size();
+  if (key.compare(0, n, host) != 0 || key.size() <= n || key[n] != ' ') {
+    return false;
+  }
+  ++n;
+  if (key.compare(n, path.size(), path) != 0) return false;
+  if (subtree) return true;
+  n += path.size();
+  return (n < key.size() && key[n] == '?');
+}
+
+//=========================================================================
+void ResponseCache::evict()
+{
+  LRUList::iterator it = m_lru.end();
+  while (m_size > m_max_size && it != m_lru.begin()) {
+    --it;
+    SlotMap::iterator its = m_slots.find(*it);
+    DEBUG_ASSERT(its != m_slots.end(),"evict() LRU entry has no slot");
+    Slot& slot = its->second;
+    if (slot.filling || !slot.entry) continue;
+
+    m_size -= slot.entry->object()->size();
+    delete slot.entry;
+    m_slots.erase(its);
+    it = m_lru.erase(it);
+    ++m_evictions;
+  }
+}
+
+
+//=========================================================================
+ResponseCacheStream::ResponseCacheStream(HTTPModule& module,
+                                         MessageStream* message,
+                                         const std::string& key,
+                                         int ttl)
+  : scx::Stream("http:cache"),
+    m_module(&module),
+    m_message(message),
+    m_key(key),
+    m_ttl(ttl),
+    m_entry(0),
+    m_finished(false)
+{
+  const Request& req = message->get_request();
+  const Host* host = req.get_host();
+  m_entry = new CachedResponse(host ? host->get_id() : "",
+                               req.get_uri().get_path());
+}
+
+//=========================================================================
+ResponseCacheStream::~ResponseCacheStream()
+{
+  if (!m_finished) {
+    // Connection went away before the response was complete
+    m_module.object()->get_cache().abandon(m_key);
+  }
+  delete m_entry;
+}
+
+//=========================================================================
+scx::Condition ResponseCacheStream::event(scx::Stream::Event e)
+{
+  if (e == scx::Stream::Closing && !m_finished) {
+    finish();
+  }
+  return scx::Ok;
+}
+
+//=========================================================================
+scx::Condition ResponseCacheStream::write(const void* buffer,int n,int& na)
+{
+  scx::Condition c = Stream::write(buffer,n,na);
+
+  if (m_entry && na > 0) {
+    std::string& body = m_entry->body();
+    if ((int)body.size() + na >
+        m_module.object()->get_cache().get_max_entry_size()) {
+      // Too big to cache, stop capturing
+      delete m_entry;
+      m_entry = 0;
+    } else {
+      body.append((const char*)buffer, na);
+    }
+  }
+  return c;
+}
+
+//=========================================================================
+std::string ResponseCacheStream::stream_status() const
+{
+  std::ostringstream oss;
+  oss << "ttl:" << m_ttl;
+  if (m_entry) oss << " captured:" << m_entry->body().size();
+  else oss << " NOCAPTURE";
+  return oss.str();
+}
+
+//=========================================================================
+void ResponseCacheStream::finish()
+{
+  m_finished = true;
+  ResponseCache& cache = m_module.object()->get_cache();
+  const Response& resp = m_message->get_response();
+
+  int ttl = m_ttl;
+  if (m_entry) {
+    int max_age = cache_control_max_age(resp.get_header("Cache-Control"));
+    if (max_age >= 0) ttl = max_age;
+  }
+
+  // Only cache complete, successful, shareable responses
+  if (!m_entry ||
+      ttl <= 0 ||
+      resp.get_status().code() != Status::Ok ||
+      !resp.get_header("Set-Cookie").empty() ||
+      !resp.get_header("Content-Encoding").empty()) {
+    cache.abandon(m_key);
+    return;
+  }
+
+  m_entry->set_status(resp.get_status());
+  m_entry->set_headers(resp);
+  m_entry->set_expires(m_entry->get_created() + scx::Time(ttl));
+  cache.store(m_key, m_entry);
+  m_entry = 0;
+}
+
+
+//=========================================================================
+CachedResponseStream::CachedResponseStream(CachedResponse::Ref* entry)
+  : scx::Stream("http:cached"),
+    m_entry(entry),
+    m_sent(0)
+{
+  enable_event(scx::Stream::Writeable,true);
+}
+
+//=========================================================================
+CachedResponseStream::~CachedResponseStream()
+{
+  delete m_entry;
+}
+
+//=========================================================================
+scx::Condition CachedResponseStream::event(scx::Stream::Event e)
+{
+  if (e == scx::Stream::Writeable) {
+    const std::string& body = m_entry->object()->body();
+    while (m_sent < (int)body.size()) {
+      int na = 0;
+      scx::Condition c = write(body.data() + m_sent,
+                               body.size() - m_sent, na);
+      m_sent += na;
+      if (c != scx::Ok) return c;
+      if (na <= 0) return scx::Ok;
+    }
+    enable_event(scx::Stream::Writeable,false);
+    return scx::Close;
+  }
+  return scx::Ok;
+}
+
+//=========================================================================
+std::string CachedResponseStream::stream_status() const
+{
+  std::ostringstream oss;
+  oss << "sent:" << m_sent << "/" << m_entry->object()->body().size();
+  return oss.str();
+}
+
+};
@@ -0,0 +1,260 @@
+/* SconeServer (http://www.sconemad.com)
+
+HTTP Response cache
+
+Stores complete rendered responses from dynamic handlers in memory, so that
+repeat requests from anonymous clients can be answered without running the
+handler again.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef httpResponseCache_h
+#define httpResponseCache_h
+
+#include <http/http.h>
+#include <http/Status.h>
+#include <sconex/ScriptBase.h>
+#include <sconex/ScriptTypes.h>
+#include <sconex/Stream.h>
+#include <sconex/Mutex.h>
+#include <sconex/Date.h>
+namespace http {
+
+class HTTPModule;
+class MessageStream;
+class Request;
+class Response;
+class ResponseCache;
+
+//=============================================================================
+// CachedResponse - A complete response (status, headers and body) held in
+// the response cache.
+//
+class HTTP_API CachedResponse : public scx::ScriptObject {
+public:
+
+  CachedResponse(const std::string& host,
+                 const std::string& path);
+  virtual ~CachedResponse();
+
+  const std::string& get_host() const;
+  const std::string& get_path() const;
+
+  // Copy cacheable headers from a response. The body should be complete,
+  // as it is used to derive an ETag if the response doesn't have one.
+  void set_headers(const Response& response);
+
+  // Apply status and stored headers to a response
+  void apply(Response& response) const;
+
+  void set_status(const Status& status);
+  const Status& get_status() const;
+
+  std::string& body();
+  const std::string& body() const;
+
+  void set_expires(const scx::Date& expires);
+  const scx::Date& get_expires() const;
+  const scx::Date& get_created() const;
+
+  // Has the response passed its expiry time
+  bool expired() const;
+
+  // Approximate memory used by this entry
+  int size() const;
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  typedef scx::ScriptRefTo<CachedResponse> Ref;
+
+private:
+
+  std::string m_host;
+  std::string m_path;
+
+  Status m_status;
+  typedef std::map<std::string,std::string> HeaderMap;
+  HeaderMap m_headers;
+  std::string m_body;
+
+  scx::Date m_created;
+  scx::Date m_expires;
+};
+
+//=============================================================================
+// ResponseCache - Size-bounded LRU cache of rendered responses, keyed on
+// host, path, query and any configured Vary headers.
+//
+// Only one request is allowed to render (fill) a given key at a time;
+// concurrent requests for the same key either receive the previous (stale)
+// copy if there is one, or bypass the cache until the fill completes.
+//
+class HTTP_API ResponseCache : public scx::ScriptObject {
+public:
+
+  ResponseCache(HTTPModule& module);
+  virtual ~ResponseCache();
+
+  enum LookupResult {
+    Hit,     // entry returned
+    Fill,    // caller should render the response and store() or abandon()
+    Bypass   // caller should render the response without caching
+  };
+
+  // Build the cache key for a request, or an empty key (which always
+  // bypasses the cache) if the request can't be cached
+  std::string make_key(const Request& request) const;
+
+  // Lookup a response in the cache.
+  LookupResult lookup(const std::string& key,
+                      bool revalidate,
+                      CachedResponse::Ref*& entry);
+
+  // Complete a fill, storing the response (the cache takes ownership)
+  void store(const std::string& key, CachedResponse* entry);
+
+  // Abandon a fill without storing anything
+  void abandon(const std::string& key);
+
+  // Remove entries for host whose path starts with path_prefix, or only
+  // those whose path is path_prefix if subtree is false. Fills in progress
+  // for matching keys are marked so that what they store is discarded.
+  // Returns the number of entries removed.
+  int invalidate(const std::string& host,
+                 const std::string& path_prefix,
+                 bool subtree = true);
+
+  // Remove all entries
+  void clear();
+
+  // Largest response body which will be stored
+  int get_max_entry_size() const;
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<ResponseCache> Ref;
+
+private:
+
+  // Remove least recently used entries until within the size limit.
+  // Cache must be locked.
+  void evict();
+
+  // Does a cache key belong to host and path (or paths starting with path
+  // if subtree is set)
+  static bool key_matches(const std::string& key,
+                          const std::string& host,
+                          const std::string& path,
+                          bool subtree);
+
+  HTTPModule& m_module;
+  mutable scx::Mutex m_mutex;
+
+  typedef std::list<std::string> LRUList;
+  LRUList m_lru;
+
+  struct Slot {
+    CachedResponse::Ref* entry;
+    bool filling;
+    // Set if the slot was invalidated while filling, so the fill is stale
+    bool invalidated;
+    LRUList::iterator lru;
+  };
+  typedef HASH_TYPE<std::string,Slot> SlotMap;
+  SlotMap m_slots;
+
+  std::list<std::string> m_vary;
+
+  long m_size;
+  long m_max_size;
+  int m_max_entry_size;
+
+  // Statistics
+  unsigned long m_hits;
+  unsigned long m_stale_hits;
+  unsigned long m_misses;
+  unsigned long m_bypasses;
+  unsigned long m_stores;
+  unsigned long m_evictions;
+  unsigned long m_invalidations;
+};
+
+//=============================================================================
+// ResponseCacheStream - Captures a response body as it is written by the
+// handler, storing it in the cache once the message completes.
+//
+class HTTP_API ResponseCacheStream : public scx::Stream {
+public:
+
+  ResponseCacheStream(HTTPModule& module,
+                      MessageStream* message,
+                      const std::string& key,
+                      int ttl);
+  virtual ~ResponseCacheStream();
+
+  virtual scx::Condition event(scx::Stream::Event e);
+  virtual scx::Condition write(const void* buffer,int n,int& na);
+
+  virtual std::string stream_status() const;
+
+private:
+
+  void finish();
+
+  scx::ScriptRefTo<HTTPModule> m_module;
+  MessageStream* m_message;
+  std::string m_key;
+  int m_ttl;
+
+  CachedResponse* m_entry;
+  bool m_finished;
+};
+
+//=============================================================================
+// CachedResponseStream - Sends the body of a cached response.
+//
+class HTTP_API CachedResponseStream : public scx::Stream {
+public:
+
+  CachedResponseStream(CachedResponse::Ref* entry);
+  virtual ~CachedResponseStream();
+
+  virtual scx::Condition event(scx::Stream::Event e);
+
+  virtual std::string stream_status() const;
+
+private:
+
+  CachedResponse::Ref* m_entry;
+  int m_sent;
+};
+
+};
+#endif
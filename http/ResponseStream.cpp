@@ -30,10 +30,12 @@ Free Software Foundation, Inc.,
 #include <sconex/Kernel.h>
 #include <sconex/File.h>
 #include <sconex/ScriptExpr.h>
-#include <sconex/NullFile.h>
 
 namespace http {
 
+// Amount of a multipart body to buffer for parsing
+#define MULTIPART_BUFFER_SIZE 65536
+
 // Uncomment to enable debug logging
 //#define RESPONSE_DEBUG_LOG(m) STREAM_DEBUG_LOG(m)
 
@@ -77,45 +79,6 @@ static bool decode_param_string(const std::string& str, Request& request)
 }
 
   
-//=========================================================================
-// MimeHeaderStream - Stream for reading mime headers
-class MimeHeaderStream : public scx::LineBuffer {
-public:
-
-  MimeHeaderStream(ResponseStream& resp)
-    : scx::LineBuffer("http:mimeheader"),
-      m_resp(resp),
-      m_done(false)
-  {
-    enable_event(scx::Stream::Readable,true);
-  };
-
-  virtual scx::Condition event(scx::Stream::Event e)
-  {
-    if (!m_done && e == scx::Stream::Readable) {
-      scx::Condition c;
-      std::string line;
-    
-      while ( (c=tokenize(line)) == scx::Ok ) {
-        if (line.empty()) {
-          m_done = true;
-          enable_event(scx::Stream::Readable,false);
-          return m_resp.mimeheader_end();
-        } else {
-          m_resp.mimeheader_line(line);
-        }
-      }
-    }
-    
-    return scx::Ok;
-  };
-
-protected:
-  ResponseStream& m_resp;
-  bool m_done;
-};
-
-  
 //=========================================================================
 // ParamReaderStream - Stream for reading parameters in body sections
 class ParamReaderStream : public scx::Stream {
@@ -213,11 +176,11 @@ protected:
 ResponseStream::ResponseStream(const std::string& stream_name)
   : scx::Stream(stream_name),
     m_resp_seq(resp_Start),
-    m_buffer(1024),
-    m_mime_boundary_pos(-1),
-    m_mime_boundary_num(0),
-    m_section_headers(),
-    m_source_cond(scx::Ok)
+    m_parser(0),
+    m_buffer(0),
+    m_received(0),
+    m_total(0),
+    m_uploads(0)
 {
 
 }
@@ -225,7 +188,7 @@ ResponseStream::ResponseStream(const std::string& stream_name)
 //=========================================================================
 ResponseStream::~ResponseStream()
 {
-  
+  end_upload(true);
 }
 
 //=========================================================================
@@ -236,15 +199,16 @@ std::string ResponseStream::stream_status() const
   switch (m_resp_seq) {
     case resp_Start: oss << "S"; break;
     case resp_ReadSingle: oss << "RS"; break;
-    case resp_ReadMultiStart: oss << "RMS"; break;
-    case resp_ReadMultiBoundary: oss << "RMBnd"; break;
-    case resp_ReadMultiHeader: oss << "RMH"; break;
-    case resp_ReadMultiBody: oss << "RMB"; break;
+    case resp_ReadMulti: oss << "RM"; break;
     case resp_ReadEnd: oss << "RE"; break;
     case resp_Write: oss << "W"; break;
     case resp_WriteWait: oss << "WW"; break;
     case resp_End: oss << "E"; break;
   }
+  if (m_parser) {
+    oss << " parts:" << m_parser->num_parts()
+        << " recv:" << m_received << "/" << m_total;
+  }
   return oss.str();
 }
 
@@ -261,19 +225,38 @@ scx::Condition ResponseStream::event(scx::Stream::Event e)
     if (req.get_method() == "POST") {
       // Need to read message body
       std::string type;
+      std::string boundary;
       std::string content_type = req.get_header("Content-Type");
       std::string::size_type ic = content_type.find_first_of(";");
       if (ic != std::string::npos) {
         type = content_type.substr(0,ic);
         ic = content_type.find("boundary=");
         if (ic != std::string::npos) {
-          m_mime_boundary = std::string("--") + content_type.substr(ic+9);
-	  m_mime_boundary_len = m_mime_boundary.size();
+          boundary = content_type.substr(ic+9);
+          std::string::size_type ie = boundary.find_first_of("; ");
+          if (ie != std::string::npos) boundary.erase(ie);
+          if (boundary.size() >= 2 &&
+              boundary[0] == '"' && boundary[boundary.size()-1] == '"') {
+            boundary = boundary.substr(1,boundary.size()-2);
+          }
         }
       }
     
       if (type == "multipart/form-data") {
-        m_resp_seq = resp_ReadMultiStart;
+        if (boundary.empty()) {
+          msg->get_response().set_status(http::Status::BadRequest);
+          return scx::Close;
+        }
+        m_resp_seq = resp_ReadMulti;
+        m_parser = new MultipartParser(boundary,*this);
+        m_buffer = new scx::Buffer(MULTIPART_BUFFER_SIZE);
+        m_total = atol(req.get_header("Content-Length").c_str());
+        m_progress_id = req.get_param("X-Progress-ID");
+        if (!m_progress_id.empty()) {
+          UploadManager& uploads = msg->get_module().get_uploads();
+          m_uploads = new UploadManager::Ref(&uploads);
+          uploads.begin(m_progress_id,m_total);
+        }
         enable_event(scx::Stream::Readable,true);
         
       } else {
@@ -297,19 +280,9 @@ scx::Condition ResponseStream::event(scx::Stream::Event e)
 
   if (e == scx::Stream::Readable) {
     switch (m_resp_seq) {
-      case resp_ReadMultiStart: {
-        char buffer[100];
-        int na;
-        while (m_resp_seq == resp_ReadMultiStart) {
-          scx::Condition c = read(buffer,100,na);
-          RESPONSE_DEBUG_LOG("ReadMultiStart na=" << na << " c=" << c);
-          if (c == scx::End) {
-            enable_event(scx::Stream::Readable,false);
-            return scx::Close;
-          } else if (c != scx::Ok) {
-            return c;
-          }
-        }
+      case resp_ReadMulti: {
+        scx::Condition c = read_multipart();
+        if (c != scx::Ok) return c;
       } break;
 
       default:
@@ -338,14 +311,7 @@ scx::Condition ResponseStream::event(scx::Stream::Event e)
   
   if (e == scx::Stream::Closing) {
     RESPONSE_DEBUG_LOG("Response closing seq=" << m_resp_seq);
-    if (m_resp_seq == resp_ReadMultiBoundary) {
-      m_resp_seq = resp_ReadMultiHeader;
-      m_section_headers = scx::MimeHeaderTable();
-      MimeHeaderStream* mh = new MimeHeaderStream(*this);
-      endpoint().add_stream(mh);
-      return scx::End;
-
-    } else if (m_resp_seq == resp_ReadEnd) {
+    if (m_resp_seq == resp_ReadEnd) {
       m_resp_seq = resp_Write;
       enable_event(scx::Stream::Readable,false);
       enable_event(scx::Stream::Writeable,true);
@@ -375,104 +341,13 @@ scx::Condition ResponseStream::read(void* buffer,int n,int& na)
   }
 
   na = 0;
-  RESPONSE_DEBUG_LOG("read n=" << n <<
-                     " buf=" << m_buffer.used() <<
-                     " bpos=" << m_mime_boundary_pos);
-
-  if (m_resp_seq == resp_ReadMultiBoundary ||
-      m_resp_seq == resp_ReadEnd) {
-    RESPONSE_DEBUG_LOG("boundary already reached");
-    return scx::End;
-  }
-  
-  if (m_buffer.free()) {
-    // Try to fill the buffer from the source if there is some room
-    int nr = 0;
-    m_source_cond = scx::Stream::read(m_buffer.tail(),m_buffer.free(),nr);
-    RESPONSE_DEBUG_LOG("source read " << nr << " c=" << m_source_cond);
-    if (nr > 0) {
-      m_buffer.push(nr);
-      find_mime_boundary();
-    }
-  }
-
-  if (m_mime_boundary_pos == 0) {
-    // A mime boundary has been reached -
-    // pop the boundary and return end
-
-    int sz = m_mime_boundary_len + 2;
-
-    switch (m_mime_boundary_type) {
-
-      case bound_Initial:
-        RESPONSE_DEBUG_LOG("boundary (initial)");
-        m_resp_seq = resp_ReadMultiBoundary;
-        break;
-
-      case bound_Intermediate:
-        RESPONSE_DEBUG_LOG("boundary");
-	//	sz += 2;
-        m_resp_seq = resp_ReadMultiBoundary;
-        break;
-
-      case bound_Final:
-        RESPONSE_DEBUG_LOG("boundary (final)");
-	//	sz += 4;
-	sz += 2;
-        m_resp_seq = resp_ReadEnd;
-        break;
-    }
-    RESPONSE_DEBUG_LOG("popping boundary (" << sz << " bytes)");
-    m_buffer.pop(sz);
-    find_mime_boundary();
-    return scx::End;
-  }
-  
-  // Calculate how much of the buffer can be read
-  int allow_read = 0;
-  if (m_mime_boundary_pos > 0) {
-    // Read up to a detected mime boundary
-    allow_read = m_mime_boundary_pos;
-    RESPONSE_DEBUG_LOG("Read up to detected mime boundary (max=" << allow_read << ")");
-
-  } else if (m_source_cond == scx::End) {
-    // If the end of the buffer has been reached, then allow all to be read
-    allow_read = m_buffer.used();
-    RESPONSE_DEBUG_LOG("Read remaining buffer (max=" << allow_read << ")");
-
-  } else {
-    // Allow all that has been scanned to be read
-    allow_read = m_buffer.used() - (m_mime_boundary_len+4) + 1;
-    RESPONSE_DEBUG_LOG("Read scanned data (max=" << allow_read << ")");
-  }
-
-  if (allow_read <= 0) {
-    // Cannot return any data right now
-    RESPONSE_DEBUG_LOG("No data, allow_read=" << allow_read);
-    return scx::Wait;
-  }
-
-  // Reduce if the caller wanted less data than allowed
-  n = std::min(n,allow_read);
-  RESPONSE_DEBUG_LOG("n=" << n << " buffer used=" << m_buffer.used());
-
-  // Pop the required amount out of the buffer
-  na += m_buffer.pop_to(buffer,n);
-  m_buffer.compact();    
-  RESPONSE_DEBUG_LOG("pop " << na << " / " << n << " existing");
-
-  if (m_mime_boundary_pos > 0) {
-    // Update position of detected mime boundary
-    m_mime_boundary_pos -= na;
-  }
-  
-  return scx::Ok;
+  return scx::End;
 }
 
 //=========================================================================
 bool ResponseStream::has_readable() const
 {
-  return (m_buffer.used() > 0);
+  return false;
 }
   
 //=========================================================================
@@ -497,21 +372,63 @@ bool ResponseStream::handle_body()
 }
   
 //=========================================================================
-bool ResponseStream::handle_section(const scx::MimeHeaderTable& headers,
-                                    const std::string& name)
+MultipartSink* ResponseStream::handle_section(
+  const scx::MimeHeaderTable& headers,
+  const std::string& name)
 {
   MessageStream* msg = GET_HTTP_MESSAGE();
   Request& req = const_cast<Request&>(msg->get_request());
-  endpoint().add_stream(new ParamReaderStream(req, name));
-  return true;
+  return new MultipartParamSink(req, name,
+                                msg->get_module().get_uploads().get_max_field());
 }
   
 //=========================================================================
-bool ResponseStream::handle_file(const scx::MimeHeaderTable& headers,
-                                 const std::string& name,
-                                 const std::string& filename)
+MultipartSink* ResponseStream::handle_file(const scx::MimeHeaderTable& headers,
+                                           const std::string& name,
+                                           const std::string& filename)
 {
-  return false;
+  return 0;
+}
+
+//=========================================================================
+MultipartSink* ResponseStream::new_file_sink(const scx::FilePath& path)
+{
+  MessageStream* msg = GET_HTTP_MESSAGE();
+  MultipartFileSink* sink = new MultipartFileSink(
+    path, msg->get_module().get_uploads().get_max_file());
+  if (!sink->is_open()) {
+    delete sink;
+    return 0;
+  }
+  return sink;
+}
+
+//=========================================================================
+MultipartSink* ResponseStream::multipart_start(
+  const scx::MimeHeaderTable& headers)
+{
+  RESPONSE_DEBUG_LOG("multipart_start");
+
+  std::string name;
+  scx::MimeHeader disp = headers.get_parsed("Content-Disposition");
+  const scx::MimeHeaderValue* fdata = disp.get_value("form-data");
+  if (!fdata) return 0;
+  fdata->get_parameter("name",name);
+
+  std::string filename;
+  fdata->get_parameter("filename",filename);
+
+  MultipartSink* sink = 0;
+  if (filename != "") {
+    sink = handle_file(headers, name, filename);
+  } else {
+    sink = handle_section(headers, name);
+  }
+
+  if (!sink) {
+    STREAM_DEBUG_LOG("Unhandled POST data, closing");
+  }
+  return sink;
 }
   
 //=========================================================================
@@ -542,85 +459,93 @@ bool ResponseStream::send_file(const scx::FilePath& path)
 }
 
 //=========================================================================
-bool ResponseStream::find_mime_boundary()
+scx::Condition ResponseStream::read_multipart()
 {
-  m_mime_boundary_pos = -1;
-  int bmax = m_mime_boundary.length();
-  m_mime_boundary_len = bmax;
-  int max = m_buffer.used() - bmax - 2;
-
-  for (int i=0; i<max; ++i) {
-    char* cp = (char*)m_buffer.head()+i;
-    if (*cp == m_mime_boundary[0]) {
-      std::string bcmp(cp,bmax);
-      if (bcmp == m_mime_boundary) {
-        m_mime_boundary_pos = i;
-        if (m_mime_boundary_num == 0) {
-          m_mime_boundary_type = bound_Initial;
-	  m_mime_boundary = "\r\n" + m_mime_boundary;
-
-        } else if (*(cp+bmax) == '-') {
-          m_mime_boundary_type = bound_Final;
+  MessageStream* msg = GET_HTTP_MESSAGE();
 
-        } else {
-          m_mime_boundary_type = bound_Intermediate;
-        }
-        RESPONSE_DEBUG_LOG("found boundary at " << m_mime_boundary_pos);
-        ++m_mime_boundary_num;
-        return true;
+  scx::Condition c = scx::Ok;
+  while (true) {
+    // Fill the buffer from the source
+    bool end = false;
+    if (m_buffer->free()) {
+      int na = 0;
+      c = scx::Stream::read(m_buffer->tail(),m_buffer->free(),na);
+      RESPONSE_DEBUG_LOG("multipart read " << na << " c=" << c);
+      if (na > 0) {
+        m_buffer->push(na);
+        m_received += na;
+      }
+      if (c == scx::End) {
+        end = true;
+      } else if (c != scx::Ok) {
+        break;
       }
     }
-  }
-  return false;
-}
-
-//=========================================================================
-void ResponseStream::mimeheader_line(const std::string& line)
-{
-  if (m_resp_seq == resp_ReadMultiHeader) {
-    RESPONSE_DEBUG_LOG("mimeheader_line '" << line << "'");    
-    m_section_headers.parse_line(line);
-  }
-}
 
-//=========================================================================
-scx::Condition ResponseStream::mimeheader_end()
-{
-  if (m_resp_seq == resp_ReadMultiHeader) {
-    RESPONSE_DEBUG_LOG("mimeheader_end");
+    int used = 0;
+    MultipartParser::Status status =
+      m_parser->parse((const char*)m_buffer->head(),m_buffer->used(),
+                      used,end);
+    m_buffer->pop(used);
+    m_buffer->compact();
+
+    switch (status) {
+      case MultipartParser::Ok:
+        if (used == 0 && m_buffer->free() == 0) {
+          // No progress can be made with a full buffer
+          status = MultipartParser::Malformed;
+        }
+        break;
 
-    std::string name;
-    scx::MimeHeader disp = m_section_headers.get_parsed("Content-Disposition");
-    const scx::MimeHeaderValue* fdata = disp.get_value("form-data");
-    if (!fdata) return scx::Close;
-    fdata->get_parameter("name",name);
+      case MultipartParser::Done:
+        end_upload(false);
+        m_resp_seq = resp_Write;
+        enable_event(scx::Stream::Readable,false);
+        enable_event(scx::Stream::Writeable,true);
+        return scx::Ok;
 
-    m_resp_seq = resp_ReadMultiBody;
+      default:
+        break;
+    }
 
-    std::string filename;
-    fdata->get_parameter("filename",filename);
+    if (status != MultipartParser::Ok) {
+      Response& resp = msg->get_response();
+      if (status == MultipartParser::TooLarge) {
+        resp.set_status(http::Status::RequestEntityTooLarge);
+      } else if (status == MultipartParser::Malformed) {
+        resp.set_status(http::Status::BadRequest);
+      }
+      // (rejected parts will have set the status already)
 
-    bool handled = false;
-    if (filename != "") {
-      handled = handle_file(m_section_headers, name, filename);
-    } else {
-      handled = handle_section(m_section_headers, name);
-    }
-    
-    if (!handled) {
-      STREAM_DEBUG_LOG("Unhandled POST data, closing");
+      // The rest of the body won't be read, so the connection can't be reused
+      resp.set_header("Connection","close");
+      end_upload(true);
+      m_resp_seq = resp_End;
+      enable_event(scx::Stream::Readable,false);
       return scx::Close;
-
-      // Unhandled - transfer to a null file to discard the data
-      STREAM_DEBUG_LOG("Using NULL file to discard data");
-      scx::NullFile* file = new scx::NullFile();
-      scx::StreamTransfer* xfer = new scx::StreamTransfer(&endpoint());
-      xfer->set_close_when_finished(true);
-      file->add_stream(xfer);
-      scx::Kernel::get()->connect(file);
     }
+
+    if (end || c != scx::Ok) break;
   }
-  return scx::Ok;
+
+  if (m_uploads) m_uploads->object()->update(m_progress_id,m_received);
+  return c;
 }
-  
+
+//=========================================================================
+void ResponseStream::end_upload(bool error)
+{
+  if (!m_parser) return;
+  if (m_uploads) {
+    m_uploads->object()->update(m_progress_id,m_received);
+    m_uploads->object()->end(m_progress_id,error);
+    delete m_uploads;
+    m_uploads = 0;
+  }
+  delete m_parser;
+  m_parser = 0;
+  delete m_buffer;
+  m_buffer = 0;
+}
+
 };
@@ -28,13 +28,13 @@ Free Software Foundation, Inc.,
 #include <sconex/MimeHeader.h>
 #include <http/http.h>
 #include <http/MessageStream.h>
+#include <http/Multipart.h>
 
 namespace http {
 
-class MimeHeaderStream;
-  
 //=========================================================================
-class HTTP_API ResponseStream : public scx::Stream {
+class HTTP_API ResponseStream : public scx::Stream,
+                                public MultipartListener {
 
 public:
 
@@ -57,20 +57,28 @@ protected:
   virtual bool handle_body();
 
   // This is called at the start of each (non-file) section within a
-  // multipart message body. By default we read the content of the section
-  // and add it to the named parameter in the request object.
-  // Override and return true to handle the section, or false to discard
-  // the data.
-  virtual bool handle_section(const scx::MimeHeaderTable& headers,
-                              const std::string& name);
+  // multipart message body. By default the content of the section is
+  // added to the named parameter in the request object.
+  // Override and return a sink to receive the data, or NULL to reject the
+  // request.
+  virtual MultipartSink* handle_section(const scx::MimeHeaderTable& headers,
+                                        const std::string& name);
 
   // This is called at the start of each file section within a multipart
   // message body.
-  // Override and return true to handle the file section, or false to
-  // discard the data (default implementation returns false).
-  virtual bool handle_file(const scx::MimeHeaderTable& headers,
-                           const std::string& name,
-                           const std::string& filename);
+  // Override and return a sink to receive the data, or NULL to reject the
+  // request (default implementation returns NULL).
+  virtual MultipartSink* handle_file(const scx::MimeHeaderTable& headers,
+                                     const std::string& name,
+                                     const std::string& filename);
+
+  // Create a sink to write a file section to the specified path, subject
+  // to the configured upload size limit. Returns NULL if the file cannot
+  // be created.
+  MultipartSink* new_file_sink(const scx::FilePath& path);
+
+  // MultipartListener method
+  virtual MultipartSink* multipart_start(const scx::MimeHeaderTable& headers);
 
   // This is called when ready to send a response.
   virtual scx::Condition send_response();
@@ -82,41 +90,25 @@ private:
   enum ResponseSequence {
     resp_Start,
     resp_ReadSingle,
-    resp_ReadMultiStart,
-    resp_ReadMultiBoundary,
-    resp_ReadMultiHeader,
-    resp_ReadMultiBody,
+    resp_ReadMulti,
     resp_ReadEnd,
     resp_Write,
     resp_WriteWait,
     resp_End
   };
 
-  enum MimeBoundaryType {
-    bound_Initial,
-    bound_Intermediate,
-    bound_Final
-  };
-  
-  bool find_mime_boundary();
-  
-  friend class MimeHeaderStream;
-
-  void mimeheader_line(const std::string& line);
-  scx::Condition mimeheader_end();
+  scx::Condition read_multipart();
+  void end_upload(bool error);
 
   ResponseSequence m_resp_seq;
 
-  scx::Buffer m_buffer;
-  std::string m_mime_boundary;
-  int m_mime_boundary_pos;
-  int m_mime_boundary_len;
-  MimeBoundaryType m_mime_boundary_type;
-  int m_mime_boundary_num;
-
-  scx::MimeHeaderTable m_section_headers;
-  
-  scx::Condition m_source_cond;
+  // Multipart body parsing
+  MultipartParser* m_parser;
+  scx::Buffer* m_buffer;
+  long m_received;
+  long m_total;
+  std::string m_progress_id;
+  UploadManager::Ref* m_uploads;
 };
 
 };
@@ -26,11 +26,19 @@ Free Software Foundation, Inc.,
 #include <sconex/Kernel.h>
 #include <sconex/Log.h>
 #include <sconex/utils.h>
+#include <sconex/ScriptExpr.h>
+#include <memory>
 namespace http {
 
 class SessionManager;
 
-#define SESSION_JOB_TIMEOUT 30
+#define SESSION_JOB_TIMEOUT 10
+
+// How far the last used time of an otherwise unchanged session can move on
+// before it is saved again
+#define SESSION_SAVE_USED_INTERVAL 300
+
+#define LOG(msg) scx::Log("http").submit(msg);
 
 //=========================================================================
 // SessionCleanupJob - A periodic job which causes the session manager to
@@ -48,6 +56,7 @@ public:
   virtual bool run()
   {
     m_manager.check_sessions();
+    m_manager.save_sessions();
     return false;
   };
 
@@ -55,34 +64,93 @@ protected:
   SessionManager& m_manager;
 };
 
+//=========================================================================
+// SessionVarWriter - Collects the serialized form of session vars for
+// saving to the session store.
+//
+class SessionVarWriter : public scx::IOBase {
+public:
+
+  virtual scx::Condition read(void* buffer,int n,int& na)
+  {
+    na = 0;
+    return scx::Error;
+  };
+
+  virtual scx::Condition write(const void* buffer,int n,int& na)
+  {
+    m_str.append((const char*)buffer,n);
+    na = n;
+    return scx::Ok;
+  };
+
+  virtual int write(const char* string)
+  {
+    m_str.append(string);
+    return 0;
+  };
+
+  virtual int write(const std::string& string)
+  {
+    m_str.append(string);
+    return 0;
+  };
+
+  std::string m_str;
+};
+
+//=========================================================================
+// SessionSnapshot - The state of a session taken for saving to the
+// session store.
+//
+class SessionSnapshot {
+public:
+
+  SessionSnapshot(Session* session)
+    : m_session(new Session::Ref(session)) {};
+
+  ~SessionSnapshot() { delete m_session; };
+
+  Session::Ref* m_session;
+  bool m_dirty;
+  scx::Date m_last_used;
+  scx::Time m_timeout;
+  std::string m_perms;
+  std::string m_vars;
+};
+
+//=========================================================================
+static std::string new_session_id()
+{
+  // Create a new session ID, consisting of 48 chars as follows:
+  //  [8 chars] Current epoch time in hex
+  //  [6 chars] Server process ID in hex
+  //  [34 chars] Random data in base64url format
+  //  
+  std::ostringstream oss;
+  unsigned long t = scx::Date::now().epoch_seconds();
+  oss << std::setw(8) << std::setfill('0') << std::hex << t;
+  oss << std::setw(6) << std::setfill('0') << std::hex << getpid();
+  oss << scx::random_b64url_string(34);
+  return oss.str();
+}
+
 //=========================================================================
 Session::Session(SessionManager& manager,
                  const std::string& id)
   : m_manager(manager),
-    m_id(id),
+    m_id(id.empty() ? new_session_id() : id),
+    m_shard(manager.get_shard(m_id)),
     m_vars(new scx::ScriptMap()),
     m_timeout(DEFAULT_SESSION_TIMEOUT),
-    m_locked(false)
+    m_last_used(scx::Date::now()),
+    m_locked(false),
+    m_dirty(true),
+    m_used(false)
 {
   DEBUG_COUNT_CONSTRUCTOR(Session);
 
   m_parent = &m_manager;
-
-  if (id.empty()) {
-    // Create a new session ID, consisting of 48 chars as follows:
-    //  [8 chars] Current epoch time in hex
-    //  [6 chars] Server process ID in hex
-    //  [34 chars] Random data in base64url format
-    //  
-    std::ostringstream oss;
-    unsigned long t = scx::Date::now().epoch_seconds();
-    oss << std::setw(8) << std::setfill('0') << std::hex << t;
-    oss << std::setw(6) << std::setfill('0') << std::hex << getpid();
-    oss << scx::random_b64url_string(34);
-    m_id = oss.str();
-  }
-
-  set_last_used();
 }
 
 //=========================================================================
@@ -101,6 +169,7 @@ const std::string Session::get_id() const
 void Session::set_timeout(const scx::Time& time)
 {
   m_timeout = time;
+  reschedule();
 }
 
 //=========================================================================
@@ -112,7 +181,9 @@ const scx::Time& Session::get_timeout() const
 //=========================================================================
 void Session::set_last_used(const scx::Date& used)
 {
+  scx::MutexLocker locker(m_shard.m_mutex);
   m_last_used = used;
+  m_used = true;
 }
 
 //=========================================================================
@@ -136,7 +207,7 @@ bool Session::valid() const
 //=========================================================================
 bool Session::lock()
 {
-  scx::MutexLocker locker(m_manager.m_mutex);
+  scx::MutexLocker locker(m_shard.m_mutex);
   if (m_locked) return false;
   m_locked = true;
   return true;
@@ -145,7 +216,7 @@ bool Session::lock()
 //=========================================================================
 void Session::unlock()
 {
-  scx::MutexLocker locker(m_manager.m_mutex);
+  scx::MutexLocker locker(m_shard.m_mutex);
   m_locked = false;
 }
 
@@ -159,12 +230,14 @@ bool Session::has_permission(const std::string& permission) const
 void Session::add_permission(const std::string& permission)
 {
   m_perms.insert(permission);
+  set_dirty();
 }
 
 //=========================================================================
 void Session::remove_permission(const std::string& permission)
 {
   m_perms.erase(permission);
+  set_dirty();
 }
 
 //=========================================================================
@@ -230,6 +303,7 @@ scx::ScriptRef* Session::script_method(const scx::ScriptAuth& auth,
     m_last_used = scx::Date(0);
     m_perms.clear();
     m_vars.object()->clear();
+    reschedule();
     return 0;
   }
 
@@ -238,13 +312,13 @@ scx::ScriptRef* Session::script_method(const scx::ScriptAuth& auth,
     const scx::ScriptInt* a_timeout_int =
       scx::get_method_arg<scx::ScriptInt>(args,0,"timeout");
     if (a_timeout_int) {
-      m_timeout = scx::Time(a_timeout_int->get_int());
+      set_timeout(scx::Time(a_timeout_int->get_int()));
       return 0;
     }
     const scx::Time* a_timeout_time =
       scx::get_method_arg<scx::Time>(args,0,"timeout");
     if (a_timeout_time) {
-      m_timeout = *a_timeout_time;
+      set_timeout(*a_timeout_time);
       return 0;
     }    
     return scx::ScriptError::new_ref("set_timeout() Must specify timeout");
@@ -270,20 +344,43 @@ scx::ScriptRef* Session::script_method(const scx::ScriptAuth& auth,
 
 
 //=========================================================================
-SessionManager::SessionManager(HTTPModule& module)
-  : m_module(module)
+void Session::set_dirty()
 {
-  m_parent = &m_module;
+  scx::MutexLocker locker(m_shard.m_mutex);
+  m_dirty = true;
+}
 
-  m_job = scx::Kernel::get()->add_job(
-    new SessionCleanupJob(*this,scx::Time(SESSION_JOB_TIMEOUT)));
+//=========================================================================
+void Session::reschedule()
+{
+  scx::MutexLocker locker(m_shard.m_mutex);
+  m_dirty = true;
+
+  scx::Date expiry = get_expiry();
+  if (expiry >= m_check_time) return;
+
+  typedef SessionShard::ExpiryIndex::iterator Iter;
+  std::pair<Iter,Iter> range = m_shard.m_expiry.equal_range(m_check_time);
+  for (Iter it = range.first; it != range.second; ++it) {
+    if (it->second == m_id) {
+      m_shard.m_expiry.erase(it);
+      m_check_time = expiry;
+      m_shard.m_expiry.insert(std::make_pair(m_check_time,m_id));
+      return;
+    }
+  }
 }
 
+
 //=========================================================================
-SessionManager::~SessionManager()
+SessionShard::SessionShard()
 {
-  scx::Kernel::get()->end_job(m_job);
 
+}
+
+//=========================================================================
+SessionShard::~SessionShard()
+{
   for (SessionMap::iterator it = m_sessions.begin();
        it != m_sessions.end();
        ++it) {
@@ -292,12 +389,33 @@ SessionManager::~SessionManager()
   }
 }
 
+
+//=========================================================================
+SessionManager::SessionManager(HTTPModule& module)
+  : m_module(module),
+    m_store(0)
+{
+  m_parent = &m_module;
+
+  m_job = scx::Kernel::get()->add_job(
+    new SessionCleanupJob(*this,scx::Time(SESSION_JOB_TIMEOUT)));
+}
+
+//=========================================================================
+SessionManager::~SessionManager()
+{
+  scx::Kernel::get()->end_job(m_job);
+  save_sessions();
+  delete m_store;
+}
+
 //=========================================================================
 Session::Ref* SessionManager::lookup_session(const std::string& id)
 {
-  scx::MutexLocker locker(m_mutex);
-  SessionMap::iterator it = m_sessions.find(id);
-  if (it == m_sessions.end()) {
+  SessionShard& shard = get_shard(id);
+  scx::MutexLocker locker(shard.m_mutex);
+  SessionShard::SessionMap::iterator it = shard.m_sessions.find(id);
+  if (it == shard.m_sessions.end()) {
     return 0;
   }
   return new Session::Ref(it->second->object());
@@ -310,18 +428,19 @@ Session::Ref* SessionManager::new_session()
   while (true) {
     session = new Session(*this);
     
-    scx::MutexLocker locker(m_mutex);
+    SessionShard& shard = session->m_shard;
+    scx::MutexLocker locker(shard.m_mutex);
 
     // Check that a session with this ID doesn't already exist, and if it does,
     // try again (the chances of this happening are almost infinitely small!)
-    if (m_sessions.count(session->get_id())) {
+    if (shard.m_sessions.count(session->get_id())) {
       DEBUG_LOG("Session ID clash!");
       delete session;
       continue;
     }
 
     // Add the session and return
-    m_sessions[session->get_id()] = new Session::Ref(session);
+    insert_session(shard,session);
     return new Session::Ref(session);
   }
   return 0;
@@ -330,21 +449,258 @@ Session::Ref* SessionManager::new_session()
 //=========================================================================
 int SessionManager::check_sessions()
 {
-  scx::MutexLocker locker(m_mutex);
-
-  int n=0;
-  for (SessionMap::iterator it = m_sessions.begin(); 
-       it != m_sessions.end(); ) {
-    Session* session = it->second->object();
-    if (!session->valid() && session->num_refs() == 1) {
-      scx::Log("http").submit("Removing session " + session->get_id() +
-                              " due to timeout");
-      delete it->second;
-      m_sessions.erase(it++);
+  scx::Date now = scx::Date::now();
+  std::list<std::string> removed;
+
+  for (int i=0; i<NumShards; ++i) {
+    SessionShard& shard = m_shards[i];
+    scx::MutexLocker locker(shard.m_mutex);
+
+    // Only the sessions due to be checked are looked at, those which have
+    // been used since they were last checked are moved on.
+    while (!shard.m_expiry.empty()) {
+      SessionShard::ExpiryIndex::iterator ie = shard.m_expiry.begin();
+      if (ie->first > now) break;
+      std::string id = ie->second;
+      shard.m_expiry.erase(ie);
+
+      SessionShard::SessionMap::iterator it = shard.m_sessions.find(id);
+      if (it == shard.m_sessions.end()) continue;
+      Session* session = it->second->object();
+
+      if (!session->valid() && session->num_refs() == 1) {
+        LOG("Removing session " + id + " due to timeout");
+        delete it->second;
+        shard.m_sessions.erase(it);
+        removed.push_back(id);
+      } else {
+        // Check again when it's due to expire, or later if it is in use
+        session->m_check_time = session->get_expiry();
+        if (session->m_check_time <= now) {
+          session->m_check_time = now + scx::Time(SESSION_JOB_TIMEOUT);
+        }
+        shard.m_expiry.insert(std::make_pair(session->m_check_time,id));
+      }
+    }
+  }
+
+  int n = removed.size();
+  if (n > 0) {
+    scx::MutexLocker locker(m_store_mutex);
+    if (m_store) m_removed.splice(m_removed.end(),removed);
+  }
+  return n;
+}
+
+//=========================================================================
+int SessionManager::save_sessions()
+{
+  scx::MutexLocker store_locker(m_store_mutex);
+  if (!m_store) return 0;
+  scx::Database* db = m_store->object();
+
+  // Take snapshots of the sessions which have changed or been used. Each is
+  // locked only while its snapshot is taken, and sessions which are in use
+  // are left until next time.
+  std::list<SessionSnapshot*> changed;
+  for (int i=0; i<NumShards; ++i) {
+    SessionShard& shard = m_shards[i];
+    std::list<SessionSnapshot*> snapshots;
+    shard.m_mutex.lock();
+    for (SessionShard::SessionMap::iterator it = shard.m_sessions.begin();
+         it != shard.m_sessions.end(); ++it) {
+      Session* session = it->second->object();
+      if ((session->m_dirty || session->m_used) && !session->m_locked) {
+        SessionSnapshot* snapshot = new SessionSnapshot(session);
+        snapshot->m_dirty = session->m_dirty;
+        snapshot->m_last_used = session->m_last_used;
+        snapshot->m_timeout = session->m_timeout;
+        session->m_dirty = false;
+        session->m_used = false;
+        session->m_locked = true;
+        snapshots.push_back(snapshot);
+      }
+    }
+    shard.m_mutex.unlock();
+
+    for (std::list<SessionSnapshot*>::iterator it = snapshots.begin();
+         it != snapshots.end(); ++it) {
+      SessionSnapshot* snapshot = *it;
+      Session* session = snapshot->m_session->object();
+      for (std::set<std::string>::const_iterator itp =
+             session->m_perms.begin();
+           itp != session->m_perms.end(); ++itp) {
+        if (!snapshot->m_perms.empty()) snapshot->m_perms += " ";
+        snapshot->m_perms += *itp;
+      }
+      SessionVarWriter vars;
+      session->m_vars.object()->serialize(vars);
+      snapshot->m_vars = vars.m_str;
+      session->unlock();
+
+      // Only save a session which has just been used if its vars have
+      // changed, or it is a while since its last used time was saved.
+      if (snapshot->m_dirty ||
+          snapshot->m_vars != session->m_saved_vars ||
+          snapshot->m_last_used >= session->m_saved_last_used +
+            scx::Time(SESSION_SAVE_USED_INTERVAL)) {
+        changed.push_back(snapshot);
+      } else {
+        delete snapshot;
+      }
+    }
+  }
+
+  if (m_removed.empty() && changed.empty()) {
+    return 0;
+  }
+
+  // Write everything in a single transaction
+  db->simple_query("BEGIN");
+
+  for (std::list<std::string>::const_iterator it = m_removed.begin();
+       it != m_removed.end(); ++it) {
+    std::unique_ptr<scx::DbQuery> query(db->new_query(
+      "DELETE FROM session WHERE id = ?"));
+    scx::ScriptList::Ref args(new scx::ScriptList());
+    args.object()->give(scx::ScriptString::new_ref(*it));
+    query->exec(&args);
+  }
+  m_removed.clear();
+
+  int n = 0;
+  for (std::list<SessionSnapshot*>::iterator it = changed.begin();
+       it != changed.end(); ++it) {
+    SessionSnapshot* snapshot = *it;
+    Session* session = snapshot->m_session->object();
+
+    std::unique_ptr<scx::DbQuery> query(db->new_query(
+      "REPLACE INTO session (id,last_used,timeout,perms,vars) "
+      "VALUES (?,?,?,?,?)"));
+    scx::ScriptList::Ref args(new scx::ScriptList());
+    args.object()->give(scx::ScriptString::new_ref(session->get_id()));
+    args.object()->give(scx::ScriptInt::new_ref(
+      snapshot->m_last_used.epoch_seconds()));
+    args.object()->give(scx::ScriptInt::new_ref(
+      snapshot->m_timeout.seconds()));
+    args.object()->give(scx::ScriptString::new_ref(snapshot->m_perms));
+    args.object()->give(scx::ScriptString::new_ref(snapshot->m_vars));
+    if (query->exec(&args)) {
+      session->m_saved_vars = snapshot->m_vars;
+      session->m_saved_last_used = snapshot->m_last_used;
       ++n;
     } else {
-      ++it;
+      // Try again next time
+      session->set_dirty();
+    }
+    delete snapshot;
+  }
+
+  db->simple_query("COMMIT");
+  return n;
+}
+
+//=========================================================================
+SessionShard& SessionManager::get_shard(const std::string& id)
+{
+  return m_shards[std::hash<std::string>()(id) % NumShards];
+}
+
+//=========================================================================
+void SessionManager::insert_session(SessionShard& shard, Session* session)
+{
+  const std::string& id = session->m_id;
+  shard.m_sessions[id] = new Session::Ref(session);
+  session->m_check_time = session->get_expiry();
+  shard.m_expiry.insert(std::make_pair(session->m_check_time,id));
+}
+
+//=========================================================================
+bool SessionManager::open_store(const scx::ScriptRef* args)
+{
+  // Can either specify the database object directly, or the arguments
+  // required to open/create it.
+  scx::Database::Ref* db = 0;
+  const scx::Database* a_db =
+    dynamic_cast<const scx::Database*>(args->object());
+  if (a_db) {
+    db = new scx::Database::Ref(const_cast<scx::Database*>(a_db));
+
+  } else {
+    const scx::ScriptString* type =
+      scx::get_method_arg<scx::ScriptString>(args,0,"type");
+    if (type) {
+      db = scx::Database::open(type->get_string(),args);
+    }
+  }
+  if (!db) return false;
+
+  // Attempt to create session table if not present
+  db->object()->simple_query(
+    "CREATE TABLE IF NOT EXISTS session ( "
+    "id         VARCHAR(64) PRIMARY KEY, "
+    "last_used  INTEGER, "
+    "timeout    INTEGER, "
+    "perms      TEXT, "
+    "vars       TEXT )");
+
+  scx::MutexLocker locker(m_store_mutex);
+  delete m_store;
+  m_store = db;
+  m_removed.clear();
+  return true;
+}
+
+//=========================================================================
+int SessionManager::load_sessions()
+{
+  scx::MutexLocker store_locker(m_store_mutex);
+  if (!m_store) return 0;
+
+  std::unique_ptr<scx::DbQuery> query(m_store->object()->new_query(
+    "SELECT id,last_used,timeout,perms,vars FROM session"));
+  query->exec(0);
+
+  int n = 0;
+  while (query->next_result()) {
+    std::unique_ptr<scx::ScriptRef> row_ref(query->result_list());
+    scx::ScriptList* row = dynamic_cast<scx::ScriptList*>(row_ref->object());
+    if (!row || row->size() < 5) continue;
+
+    std::string id = row->get(0)->object()->get_string();
+    if (id.empty()) continue;
+
+    Session* session = new Session(*this,id);
+    session->m_last_used = scx::Date(row->get(1)->object()->get_int());
+    session->m_timeout = scx::Time(row->get(2)->object()->get_int());
+    if (!session->valid()) {
+      delete session;
+      m_removed.push_back(id);
+      continue;
+    }
+
+    std::istringstream perms(row->get(3)->object()->get_string());
+    std::string perm;
+    while (perms >> perm) session->m_perms.insert(perm);
+
+    scx::ScriptExpr expr(scx::ScriptAuth::Untrusted);
+    scx::ScriptRef* vars = expr.evaluate(row->get(4)->object()->get_string());
+    scx::ScriptMap* vars_map =
+      (vars ? dynamic_cast<scx::ScriptMap*>(vars->object()) : 0);
+    if (vars_map) session->m_vars = scx::ScriptMap::Ref(vars_map);
+    delete vars;
+    session->m_dirty = false;
+    session->m_saved_vars = row->get(4)->object()->get_string();
+    session->m_saved_last_used = session->m_last_used;
+
+    SessionShard& shard = session->m_shard;
+    scx::MutexLocker locker(shard.m_mutex);
+    if (shard.m_sessions.count(id)) {
+      delete session;
+      continue;
     }
+    insert_session(shard,session);
+    ++n;
   }
   return n;
 }
@@ -359,27 +715,41 @@ scx::ScriptRef* SessionManager::script_op(const scx::ScriptAuth& auth,
     const std::string name = right->object()->get_string();
 
     // Methods
-    if ("check" == name) {
+    if ("check" == name ||
+        "save" == name ||
+        "set_store" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
     
     // Properties
     if ("count" == name) {
-      scx::MutexLocker locker(m_mutex);
-      return scx::ScriptInt::new_ref(m_sessions.size());
+      int count = 0;
+      for (int i=0; i<NumShards; ++i) {
+        scx::MutexLocker locker(m_shards[i].m_mutex);
+        count += m_shards[i].m_sessions.size();
+      }
+      return scx::ScriptInt::new_ref(count);
     }
     if ("list" == name) {
       scx::ScriptList* list = new scx::ScriptList();
       scx::ScriptRef* list_ref = new scx::ScriptRef(list);
-      scx::MutexLocker locker(m_mutex);
-      for (SessionMap::const_iterator it = m_sessions.begin();
-	   it != m_sessions.end();
-	   ++it) {
-	Session::Ref* session_ref = it->second;
-	list->give(session_ref->ref_copy(ref.reftype()));
+      for (int i=0; i<NumShards; ++i) {
+        SessionShard& shard = m_shards[i];
+        scx::MutexLocker locker(shard.m_mutex);
+        for (SessionShard::SessionMap::const_iterator it =
+               shard.m_sessions.begin();
+             it != shard.m_sessions.end();
+             ++it) {
+          Session::Ref* session_ref = it->second;
+          list->give(session_ref->ref_copy(ref.reftype()));
+        }
       }
       return list_ref;
     }
+    if ("store" == name) {
+      scx::MutexLocker locker(m_store_mutex);
+      return (m_store ? m_store->ref_copy(ref.reftype()) : 0);
+    }
   }
   
   return scx::ScriptObject::script_op(auth,ref,op,right);
@@ -396,6 +766,25 @@ scx::ScriptRef* SessionManager::script_method(const scx::ScriptAuth& auth,
     return 0;
   }
 
+  if ("save" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+    return scx::ScriptInt::new_ref(save_sessions());
+  }
+
+  if ("set_store" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+    const scx::ScriptRef* a_store = scx::get_method_arg_ref(args,0,"store");
+    if (!a_store) return scx::ScriptError::new_ref("No store specified");
+    if (!open_store(a_store))
+      return scx::ScriptError::new_ref("Could not open session store");
+
+    int n = load_sessions();
+    std::ostringstream oss;
+    oss << "Loaded " << n << " sessions from store";
+    LOG(oss.str());
+    return scx::ScriptInt::new_ref(n);
+  }
+
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
 
@@ -26,10 +26,12 @@ Free Software Foundation, Inc.,
 #include <sconex/ScriptBase.h>
 #include <sconex/ScriptTypes.h>
 #include <sconex/Job.h>
+#include <sconex/Database.h>
 namespace http {
 
 class HTTPModule;
 class SessionManager;
+class SessionShard;
   
 const scx::Time DEFAULT_SESSION_TIMEOUT = scx::Time(60 * 60);
 
@@ -56,7 +58,8 @@ public:
   void set_timeout(const scx::Time& time);
   const scx::Time& get_timeout() const;
 
-  // Set/get when the session was last used
+  // Set/get when the session was last used. This alone doesn't cause the
+  // session to be saved straight away, see SessionManager::save_sessions.
   void set_last_used(const scx::Date& used = scx::Date::now());
   const scx::Date& get_last_used() const;
   
@@ -101,9 +104,18 @@ protected:
 
 private:
 
-  SessionManager& m_manager;
+  friend class SessionManager;
+
+  // Mark as changed since last written to the session store
+  void set_dirty();
+
+  // Move this session's entry in the shard expiry index if it now expires
+  // sooner than it is due to be checked
+  void reschedule();
 
+  SessionManager& m_manager;
   std::string m_id;
+  SessionShard& m_shard;
 
   scx::ScriptMap::Ref m_vars;
   std::set<std::string> m_perms;
@@ -111,12 +123,55 @@ private:
   scx::Time m_timeout;
   scx::Date m_last_used;
   bool m_locked;
-  
+
+  // These are protected by the shard mutex:
+  // Time this session is due to be checked in the shard's expiry index
+  scx::Date m_check_time;
+  // Changed since last written to the session store
+  bool m_dirty;
+  // Used (so its vars may have changed) since last checked for saving
+  bool m_used;
+
+  // State last written to the session store, protected by the manager's
+  // store mutex
+  std::string m_saved_vars;
+  scx::Date m_saved_last_used;
+};
+
+//=============================================================================
+// SessionShard - A portion of the session table, selected by session id
+// hash, with its own lock.
+//
+class HTTP_API SessionShard {
+public:
+
+  SessionShard();
+  ~SessionShard();
+
+  scx::Mutex m_mutex;
+
+  typedef HASH_TYPE<std::string,Session::Ref*> SessionMap;
+  SessionMap m_sessions;
+
+  // Sessions in order of the time they next need checking for expiry.
+  // Each session has one entry, which is moved on when the session is found
+  // to still be valid, so using a session doesn't need to update it.
+  typedef std::multimap<scx::Date,std::string> ExpiryIndex;
+  ExpiryIndex m_expiry;
 };
 
 //=============================================================================
 // SessionManager - Maintains a list of active HTTP sessions
 //
+// Sessions are split between a number of shards, so that requests for
+// different sessions don't contend for the same lock.
+//
+// Optionally, sessions can be saved to a database so they are preserved
+// across restarts. Changed sessions are written periodically in the
+// background, rather than on each request. A session which has only been
+// used, without its state changing, is written when its last used time
+// has moved on significantly.
+//
 class HTTP_API SessionManager : public scx::ScriptObject {
 public:
 
@@ -130,9 +185,13 @@ public:
   // Create a new session
   Session::Ref* new_session();
 
-  // Check through sessions, removing any that have timed-out
+  // Check for sessions which are due to expire, removing any that have
+  // timed-out
   int check_sessions();
 
+  // Write changed sessions to the session store, if there is one
+  int save_sessions();
+
   // ScriptObject methods
   virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
 				    const scx::ScriptRef& ref,
@@ -149,14 +208,27 @@ public:
  private:
 
   friend class Session;
-  
+
+  SessionShard& get_shard(const std::string& id);
+
+  // Add a session to its shard (shard mutex must be held)
+  void insert_session(SessionShard& shard, Session* session);
+
+  // Session store
+  bool open_store(const scx::ScriptRef* args);
+  int load_sessions();
+
   HTTPModule& m_module;
-  scx::Mutex m_mutex;
-  
-  typedef HASH_TYPE<std::string,Session::Ref*> SessionMap;
-  SessionMap m_sessions;
+
+  enum { NumShards = 16 };
+  SessionShard m_shards[NumShards];
+
   scx::JobID m_job;
-  
+
+  // Session store, and ids of sessions removed since last saved
+  scx::Mutex m_store_mutex;
+  scx::Database::Ref* m_store;
+  std::list<std::string> m_removed;
 };
  
 };
@@ -33,6 +33,7 @@ Free Software Foundation, Inc.,
 #include <server/ServerModule.h>
 
 #include <bitset>
+#include <zlib.h>
 
 namespace http {
 
@@ -53,17 +54,464 @@ const int WEBSOCKET_VERSION = 13;
 #define OPCODE_PING 0x09
 #define OPCODE_PONG 0x0A
 
+// Payloads smaller than this are copied into the write buffer, so that a
+// frame can be sent with a single write along with any others queued.
+#define WEBSOCKET_COALESCE_MAX 16384
+
+// Maximum data queued for sending on a stream
+#define WEBSOCKET_MAX_QUEUED 1048576
+
+// Messages smaller than this are not worth compressing
+#define WEBSOCKET_DEFLATE_MIN 128
+
+// Window size used for compression. As server_no_context_takeover is
+// always used, the window only needs to span a single message.
+#define WEBSOCKET_DEFLATE_WBITS 13
+#define WEBSOCKET_DEFLATE_MEMLEVEL 6
+
+//=========================================================================
+// Unmask data in place, where pos is the offset of data within the payload.
+// The bulk of the data is unmasked a 64-bit word at a time, which the
+// compiler is also able to vectorise.
+static void websocket_unmask(unsigned char* data,
+                             int n,
+                             const uint8_t* mask,
+                             unsigned long pos)
+{
+  int i = 0;
+  for (; i<n && ((uintptr_t)(data+i) & 7); ++i) {
+    data[i] ^= mask[(pos+i) & 3];
+  }
+
+  if (n - i >= 8) {
+    uint8_t wmask[8];
+    for (int k=0; k<8; ++k) wmask[k] = mask[(pos+i+k) & 3];
+    uint64_t m;
+    memcpy(&m,wmask,8);
+    for (; i+8 <= n; i += 8) {
+      uint64_t w;
+      memcpy(&w,data+i,8);
+      w ^= m;
+      memcpy(data+i,&w,8);
+    }
+  }
+
+  for (; i<n; ++i) {
+    data[i] ^= mask[(pos+i) & 3];
+  }
+}
+
+//=========================================================================
+// Encode a frame header, returning its length (at most 10 bytes)
+static int websocket_frame_header(uint8_t* hdr,
+                                  unsigned short opcode,
+                                  bool compressed,
+                                  unsigned long length)
+{
+  // Don't support continuation or masking here
+  hdr[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
+  if (length < 126) {
+    hdr[1] = (uint8_t)length;
+    return 2;
+  }
+  if (length < 65536) {
+    hdr[1] = 126;
+    hdr[2] = (uint8_t)(length >> 8);
+    hdr[3] = (uint8_t)length;
+    return 4;
+  }
+  hdr[1] = 127;
+  for (int i=0; i<8; ++i) {
+    hdr[2+i] = (uint8_t)((uint64_t)length >> (56 - 8*i));
+  }
+  return 10;
+}
+
+//=========================================================================
+static void websocket_trim(std::string& s)
+{
+  std::string::size_type first = s.find_first_not_of(" \t");
+  if (first == std::string::npos) {
+    s.clear();
+    return;
+  }
+  std::string::size_type last = s.find_last_not_of(" \t");
+  s = s.substr(first,last-first+1);
+}
+
+//=========================================================================
+static z_stream* websocket_new_deflater()
+{
+  z_stream* z = new z_stream;
+  memset(z,0,sizeof(z_stream));
+  if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   -WEBSOCKET_DEFLATE_WBITS, WEBSOCKET_DEFLATE_MEMLEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    delete z;
+    return 0;
+  }
+  return z;
+}
+
+//=========================================================================
+static void websocket_delete_deflater(z_stream* z)
+{
+  if (z) {
+    deflateEnd(z);
+    delete z;
+  }
+}
+
+//=========================================================================
+// Encode a message as a compressed frame, as described in RFC7692.
+// Returns false if the message is not worth compressing.
+static bool websocket_deflate(z_stream* z,
+                              unsigned short opcode,
+                              const void* data,
+                              int len,
+                              std::string& frame)
+{
+  if (!z || len < WEBSOCKET_DEFLATE_MIN) return false;
+
+  std::string out;
+  out.resize(deflateBound(z,len) + 16);
+
+  deflateReset(z);
+  z->next_in = (Bytef*)data;
+  z->avail_in = len;
+  z->next_out = (Bytef*)&out[0];
+  z->avail_out = out.size();
+  if (deflate(z,Z_SYNC_FLUSH) != Z_OK ||
+      z->avail_in != 0 || z->avail_out == 0) {
+    return false;
+  }
+
+  // Remove the 00 00 FF FF trailer added by the sync flush
+  int clen = out.size() - z->avail_out - 4;
+  if (clen <= 0 || clen >= len) return false;
+
+  uint8_t hdr[10];
+  int hlen = websocket_frame_header(hdr,opcode,true,clen);
+  frame.reserve(hlen + clen);
+  frame.assign((const char*)hdr,hlen);
+  frame.append(out,0,clen);
+  return true;
+}
+
+//=========================================================================
+WebSocketFrame::WebSocketFrame(unsigned short opcode,
+                               const void* data,
+                               int len,
+                               z_stream_s* deflater)
+  : m_refs(1)
+{
+  uint8_t hdr[10];
+  int hlen = websocket_frame_header(hdr,opcode,false,len);
+  m_plain.reserve(hlen + len);
+  m_plain.assign((const char*)hdr,hlen);
+  m_plain.append((const char*)data,len);
+
+  if (!websocket_deflate(deflater,opcode,data,len,m_deflated)) {
+    m_deflated.clear();
+  }
+}
+
+//=========================================================================
+void WebSocketFrame::add_ref()
+{
+  scx::MutexLocker locker(m_mutex);
+  ++m_refs;
+}
+
+//=========================================================================
+void WebSocketFrame::release()
+{
+  m_mutex.lock();
+  bool last = (--m_refs == 0);
+  m_mutex.unlock();
+  if (last) delete this;
+}
+
+//=========================================================================
+const std::string& WebSocketFrame::get_data(bool deflate) const
+{
+  if (deflate && !m_deflated.empty()) return m_deflated;
+  return m_plain;
+}
+
+//=========================================================================
+WebSocketFrame::~WebSocketFrame()
+{
+}
+
+  
+//=========================================================================
+WebSocketChannel::WebSocketChannel(WebSocketManager& manager,
+                                   const std::string& name)
+  : m_manager(manager),
+    m_name(name),
+    m_num_deflate(0),
+    m_deflater(0),
+    m_messages(0),
+    m_bytes(0),
+    m_overflows(0)
+{
+  m_parent = &m_manager;
+}
+
+//=========================================================================
+WebSocketChannel::~WebSocketChannel()
+{
+  websocket_delete_deflater(m_deflater);
+}
+
+//=========================================================================
+const std::string& WebSocketChannel::get_name() const
+{
+  return m_name;
+}
+
+//=========================================================================
+void WebSocketChannel::subscribe(WebSocketStream* stream)
+{
+  scx::MutexLocker locker(m_mutex);
+  if (m_streams.insert(stream).second && stream->is_deflate()) {
+    ++m_num_deflate;
+  }
+}
+
+//=========================================================================
+void WebSocketChannel::unsubscribe(WebSocketStream* stream)
+{
+  scx::MutexLocker locker(m_mutex);
+  if (m_streams.erase(stream) && stream->is_deflate()) {
+    --m_num_deflate;
+  }
+}
+
+//=========================================================================
+int WebSocketChannel::broadcast(const void* data, int len, bool binary)
+{
+  scx::MutexLocker locker(m_mutex);
+  if (m_streams.empty()) return 0;
+
+  // Only compress if there are subscribers that can use it
+  z_stream* deflater = 0;
+  if (m_num_deflate > 0) {
+    if (!m_deflater) m_deflater = websocket_new_deflater();
+    deflater = m_deflater;
+  }
+  
+  WebSocketFrame* frame = new WebSocketFrame(
+    binary ? OPCODE_BINARY : OPCODE_TEXT, data, len, deflater);
+
+  for (StreamSet::iterator it = m_streams.begin();
+       it != m_streams.end(); ++it) {
+    if (!(*it)->queue_frame(frame)) ++m_overflows;
+  }
+  frame->release();
+  scx::Kernel::get()->wakeup();
+
+  ++m_messages;
+  m_bytes += len;
+  return m_streams.size();
+}
+
+//=========================================================================
+std::string WebSocketChannel::get_string() const
+{
+  return m_name;
+}
+
+//=========================================================================
+scx::ScriptRef* WebSocketChannel::script_op(const scx::ScriptAuth& auth,
+                                            const scx::ScriptRef& ref,
+                                            const scx::ScriptOp& op,
+                                            const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("broadcast" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("name" == name) return scx::ScriptString::new_ref(m_name);
+    if ("subscribers" == name) 
+      return scx::ScriptInt::new_ref(m_streams.size());
+    if ("deflate_subscribers" == name) 
+      return scx::ScriptInt::new_ref(m_num_deflate);
+    if ("messages" == name) return scx::ScriptInt::new_ref(m_messages);
+    if ("bytes" == name) return scx::ScriptInt::new_ref(m_bytes);
+    if ("overflows" == name) return scx::ScriptInt::new_ref(m_overflows);
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* WebSocketChannel::script_method(const scx::ScriptAuth& auth,
+                                                const scx::ScriptRef& ref,
+                                                const std::string& name,
+                                                const scx::ScriptRef* args)
+{
+  if ("broadcast" == name) {
+    if (!auth.trusted()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptObject* a_msg =
+      scx::get_method_arg<scx::ScriptObject>(args,0,"message");
+    if (!a_msg)
+      return scx::ScriptError::new_ref("No message specified");
+    std::string msg = a_msg->get_string();
+
+    const scx::ScriptObject* a_binary =
+      scx::get_method_arg<scx::ScriptObject>(args,1,"binary");
+    bool binary = (a_binary && a_binary->get_int() != 0);
+
+    return scx::ScriptInt::new_ref(broadcast(msg.data(),msg.size(),binary));
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+  
+//=========================================================================
+WebSocketManager::WebSocketManager(HTTPModule& module)
+  : m_module(module),
+    m_deflate(true)
+{
+  m_parent = &m_module;
+}
+
+//=========================================================================
+WebSocketManager::~WebSocketManager()
+{
+  for (ChannelMap::iterator it = m_channels.begin();
+       it != m_channels.end(); ++it) {
+    delete it->second;
+  }
+}
+
+//=========================================================================
+WebSocketChannel::Ref* WebSocketManager::get_channel(const std::string& name)
+{
+  scx::MutexLocker locker(m_mutex);
+  ChannelMap::iterator it = m_channels.find(name);
+  if (it != m_channels.end()) return it->second->ref_copy();
+
+  WebSocketChannel::Ref* channel =
+    new WebSocketChannel::Ref(new WebSocketChannel(*this,name));
+  m_channels[name] = channel;
+  return channel->ref_copy();
+}
+
+//=========================================================================
+bool WebSocketManager::get_deflate() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_deflate;
+}
+
+//=========================================================================
+std::string WebSocketManager::get_string() const
+{
+  return "WebSocketManager";
+}
+
+//=========================================================================
+scx::ScriptRef* WebSocketManager::script_op(const scx::ScriptAuth& auth,
+                                            const scx::ScriptRef& ref,
+                                            const scx::ScriptOp& op,
+                                            const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("add" == name ||
+        "set_deflate" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    scx::MutexLocker locker(m_mutex);
+
+    // Properties
+    if ("deflate" == name) return scx::ScriptBool::new_ref(m_deflate);
+
+    // Sub-objects
+    if ("list" == name) {
+      scx::ScriptList* list = new scx::ScriptList();
+      scx::ScriptRef* list_ref = new scx::ScriptRef(list);
+      for (ChannelMap::const_iterator it = m_channels.begin();
+	   it != m_channels.end(); ++it) {
+	list->give(it->second->ref_copy(ref.reftype()));
+      }
+      return list_ref;
+    }
+
+    ChannelMap::const_iterator it = m_channels.find(name);
+    if (it != m_channels.end()) {
+      return it->second->ref_copy(ref.reftype());
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* WebSocketManager::script_method(const scx::ScriptAuth& auth,
+                                                const scx::ScriptRef& ref,
+                                                const std::string& name,
+                                                const scx::ScriptRef* args)
+{
+  if ("add" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptString* a_name =
+      scx::get_method_arg<scx::ScriptString>(args,0,"name");
+    if (!a_name)
+      return scx::ScriptError::new_ref("No channel name specified");
+
+    return get_channel(a_name->get_string());
+  }
+
+  if ("set_deflate" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptObject* a_deflate =
+      scx::get_method_arg<scx::ScriptObject>(args,0,"value");
+    if (!a_deflate)
+      return scx::ScriptError::new_ref("No value specified");
+
+    scx::MutexLocker locker(m_mutex);
+    m_deflate = (a_deflate->get_int() != 0);
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+  
 //=========================================================================
 WebSocketHandler::WebSocketHandler(HTTPModule* module,
-                                   const std::string& chain)
-  : m_module(module), m_chain(chain)
+                                   const std::string& chain,
+                                   const std::string& channel)
+  : m_module(module), m_chain(chain), m_channel(channel)
 {
 }
 
 //=========================================================================
 scx::Condition WebSocketHandler::handle_message(MessageStream* message)
 {
-  message->add_stream(new WebSocketStream(m_module.object(), message));
+  WebSocketChannel::Ref* channel = 0;
+  if (!m_channel.empty()) {
+    channel = m_module.object()->get_websockets().get_channel(m_channel);
+  }
+  message->add_stream(new WebSocketStream(m_module.object(), message,
+                                          channel));
 
   // Lookup the server module
   scx::Module::Ref server = scx::Kernel::get()->get_module("server");
@@ -79,21 +527,77 @@ scx::Condition WebSocketHandler::handle_message(MessageStream* message)
   
 //=============================================================================
 WebSocketStream::WebSocketStream(HTTPModule* module,
-                                 MessageStream* message)
+                                 MessageStream* message,
+                                 WebSocketChannel::Ref* channel)
   : scx::Stream("http:websocket"),
     m_module(module),
     m_message(message),
+    m_channel(channel),
     m_read_state(Header),
+    m_read_format(None),
     m_read_buffer(140),
     m_read_pos(0),
     m_read_len(0),
-    m_write_buffer(16)
+    m_read_fin(true),
+    m_deflate(false),
+    m_read_compressed(false),
+    m_read_trailer(false),
+    m_inflate_pending(false),
+    m_inflater(0),
+    m_deflater(0),
+    m_inflate_buffer(0),
+    m_write_buffer(16),
+    m_queue_bytes(0),
+    m_overflow(false)
 {
 }
 
 //=============================================================================
 WebSocketStream::~WebSocketStream()
 {
+  if (m_channel) {
+    m_channel->object()->unsubscribe(this);
+    delete m_channel;
+  }
+
+  for (std::list<WebSocketFrame*>::iterator it = m_queue.begin();
+       it != m_queue.end(); ++it) {
+    (*it)->release();
+  }
+
+  if (m_inflater) {
+    inflateEnd(m_inflater);
+    delete m_inflater;
+  }
+  websocket_delete_deflater(m_deflater);
+}
+
+//=============================================================================
+bool WebSocketStream::queue_frame(WebSocketFrame* frame)
+{
+  scx::MutexLocker locker(m_queue_mutex);
+  if (m_overflow) return false;
+
+  int size = frame->get_data(m_deflate).size();
+  if (m_queue_bytes + size > WEBSOCKET_MAX_QUEUED) {
+    // This client isn't keeping up, so drop the connection rather than
+    // silently losing messages
+    m_overflow = true;
+  } else {
+    frame->add_ref();
+    m_queue.push_back(frame);
+    m_queue_bytes += size;
+  }
+  // This stream's own job enables Writeable when it next runs, the channel
+  // wakes up the kernel once all subscribers have been queued to
+  request_event(scx::Stream::Writeable);
+  return !m_overflow;
+}
+
+//=============================================================================
+bool WebSocketStream::is_deflate() const
+{
+  return m_deflate;
 }
 
 //=============================================================================
@@ -106,6 +610,10 @@ scx::Condition WebSocketStream::read(void* buffer,int n,int& na)
   }
 
   if (m_read_state == Data) {
+    if (m_read_compressed) {
+      return read_inflate(buffer,n,na);
+    }
+    
     int rem = m_read_len - m_read_pos;
     if (n > rem) n = rem; 
     int a = m_read_buffer.used();
@@ -120,12 +628,8 @@ scx::Condition WebSocketStream::read(void* buffer,int n,int& na)
       na += nr;
     }
 
-    // Unmask
     if (m_read_usemask) {
-      unsigned int ir = m_read_pos;
-      for (int i=0; i<na; ++i, ++ir) {
-        *((unsigned char*)buffer+i) ^= m_read_mask[ir%4];
-      }
+      websocket_unmask((unsigned char*)buffer,na,m_read_mask,m_read_pos);
     }
     
     m_read_pos += na;
@@ -143,36 +647,48 @@ scx::Condition WebSocketStream::write(const void* buffer,int n,int& na)
 {
   scx::Condition c = scx::Ok;
   na = 0;
-  
-  if (m_write_buffer.used()) {
-    // Stuff still in the write buffer, try to write it
-    c = Stream::write(m_write_buffer);
+
+  if (m_write_buffer.used() >= WEBSOCKET_MAX_QUEUED) {
+    // Too much already buffered, try to send some of it first
+    c = flush();
+    if (c != scx::Ok) return c;
+    if (m_write_buffer.used() >= WEBSOCKET_MAX_QUEUED) return scx::Wait;
   }
 
-  if (m_write_buffer.used() == 0) {
-    // Write buffer is empty, start the next frame
-    m_write_buffer.compact();
-    scx::BufferWriter bw(m_write_buffer);
+  std::string frame;
+  if (m_deflate) {
+    if (!m_deflater) m_deflater = websocket_new_deflater();
+    websocket_deflate(m_deflater,OPCODE_TEXT,buffer,n,frame);
+  }
 
-    build_frame(bw,OPCODE_TEXT,n);
-    bw.done();
-    c = Stream::write(m_write_buffer);
+  if (!frame.empty()) {
+    m_write_buffer.ensure_free(frame.size());
+    m_write_buffer.push_from(frame.data(),frame.size());
     
-    if (m_write_buffer.used() == 0) {
-      // Wrote the entire frame header, try to write the data
-      c = Stream::write(buffer,n,na);
+  } else {
+    uint8_t hdr[10];
+    int hlen = websocket_frame_header(hdr,OPCODE_TEXT,false,n);
+    bool direct = (n >= WEBSOCKET_COALESCE_MAX && m_write_buffer.used() == 0);
+    m_write_buffer.ensure_free(hlen);
+    m_write_buffer.push_from(hdr,hlen);
+    if (direct) {
+      // Large payload with nothing else waiting, write it directly rather
+      // than copying it into the write buffer
+      c = Stream::write(m_write_buffer);
+      if (c == scx::Ok && m_write_buffer.used() == 0) {
+        c = Stream::write(buffer,n,na);
+      }
+      if (c != scx::Ok && c != scx::Wait) return c;
     }
 
-    if (na < n) {
-      // Couldn't write all of the data, buffer the rest
-      int rem = n - na;
-      m_write_buffer.resize(m_write_buffer.used() + rem);
-      m_write_buffer.push_from((unsigned char*)buffer + na, rem);
-      na += rem;
-      enable_event(scx::Stream::Writeable,true);
-    }
+    // Buffer whatever wasn't written
+    int rem = n - na;
+    m_write_buffer.ensure_free(rem);
+    m_write_buffer.push_from((const unsigned char*)buffer + na, rem);
   }
-  return c;
+  na = n;
+  
+  return flush();
 }
 
 //=============================================================================
@@ -186,6 +702,9 @@ scx::Condition WebSocketStream::event(scx::Stream::Event e)
     } break;
 
     case scx::Stream::Closing: { // CLOSING
+      if (m_channel) {
+        m_channel->object()->unsubscribe(this);
+      }
     } break;
     
     case scx::Stream::Readable: { // READABLE
@@ -195,12 +714,7 @@ scx::Condition WebSocketStream::event(scx::Stream::Event e)
     } break;
 
     case scx::Stream::Writeable: { // WRITEABLE
-      if (m_write_buffer.used()) {
-        c = Stream::write(m_write_buffer);
-      }
-      if (m_write_buffer.used() == 0) {
-        enable_event(scx::Stream::Writeable,false);
-      }
+      c = flush();
     } break;
 
     default:
@@ -213,8 +727,27 @@ scx::Condition WebSocketStream::event(scx::Stream::Event e)
 //=============================================================================
 bool WebSocketStream::has_readable() const
 {
-  return (m_read_state == Data &&
-          m_read_buffer.used());
+  if (m_read_state == Header) {
+    // Check for a complete frame header already buffered
+    int used = m_read_buffer.used();
+    if (used < 2) return false;
+    const uint8_t* h = (const uint8_t*)m_read_buffer.head();
+    int len = h[1] & 0x7f;
+    int need = 2 + ((h[1] & 0x80) ? 4 : 0);
+    if (len == 126) need += 2;
+    else if (len == 127) need += 8;
+    else if (h[0] & 0x08) need += len; // Control frame payload
+    return used >= need;
+  }
+  
+  if (m_read_compressed) {
+    // Compressed data or output may be held by the inflater
+    return (m_read_buffer.used() ||
+            m_inflate_pending ||
+            (m_inflater && m_inflater->avail_in) ||
+            m_read_pos == m_read_len);
+  }
+  return m_read_buffer.used();
 }
   
 //=============================================================================
@@ -223,11 +756,59 @@ std::string WebSocketStream::stream_status() const
   std::ostringstream oss;
   oss << "rb:" << m_read_buffer.status_string()
       << " rf:" << m_read_pos << "/" << m_read_len
-      << " (" << m_read_format << ")"
+      << " (" << m_read_format << (m_read_compressed ? "z" : "") << ")"
       << " wb:" << m_write_buffer.status_string();
+  if (m_deflate) oss << " deflate";
+  if (m_channel) {
+    oss << " ch:" << m_channel->object()->get_name()
+        << " q:" << m_queue_bytes;
+  }
   return oss.str();
 }
 
+//=============================================================================
+scx::Condition WebSocketStream::flush()
+{
+  {
+    // Move any queued broadcast frames into the write buffer, so they are
+    // sent together with anything else waiting
+    scx::MutexLocker locker(m_queue_mutex);
+    if (m_overflow) {
+      // Drop the connection, as a graceful close would wait for the
+      // client to read everything already sent
+      m_message->log("WebSocket client not keeping up, dropping");
+      return scx::Error;
+    }
+    while (!m_queue.empty() &&
+           m_write_buffer.used() < WEBSOCKET_MAX_QUEUED) {
+      WebSocketFrame* frame = m_queue.front();
+      const std::string& data = frame->get_data(m_deflate);
+      m_write_buffer.ensure_free(data.size());
+      m_write_buffer.push_from(data.data(),data.size());
+      m_queue_bytes -= data.size();
+      m_queue.pop_front();
+      frame->release();
+    }
+  }
+
+  scx::Condition c = scx::Ok;
+  if (m_write_buffer.used()) {
+    c = Stream::write(m_write_buffer);
+  }
+  if (m_write_buffer.used() == 0) {
+    // Don't hold on to a large buffer once it has been sent
+    if (m_write_buffer.size() > WEBSOCKET_COALESCE_MAX) {
+      m_write_buffer.resize(16);
+    }
+    m_write_buffer.compact();
+  }
+
+  scx::MutexLocker locker(m_queue_mutex);
+  enable_event(scx::Stream::Writeable,
+               m_write_buffer.used() || !m_queue.empty());
+  return (c == scx::Wait) ? scx::Ok : c;
+}
+
 //=============================================================================
 scx::Condition WebSocketStream::process_handshake()
 {
@@ -273,27 +854,109 @@ scx::Condition WebSocketStream::process_handshake()
   resp.set_header("Connection", "Upgrade");
   resp.set_header("Upgrade", "websocket");
   resp.set_header("Sec-WebSocket-Protocol", proto);
+
+  bool max_window = false;
+  if (m_module.object()->get_websockets().get_deflate() &&
+      negotiate_deflate(req.get_header("Sec-WebSocket-Extensions"),
+                        max_window)) {
+    // Always compress each message independently, so that broadcast
+    // frames can be compressed once for all subscribers
+    std::ostringstream ext;
+    ext << "permessage-deflate; server_no_context_takeover";
+    if (max_window) {
+      ext << "; server_max_window_bits=" << WEBSOCKET_DEFLATE_WBITS;
+    }
+    resp.set_header("Sec-WebSocket-Extensions", ext.str());
+    m_deflate = true;
+  }
+  
   resp.set_status(Status::SwitchingProtocols);
 
   m_message->log("Upgrading HTTP connection to WebSocket");
   m_message->set_transparent();
   enable_event(scx::Stream::Readable,true);
+
+  if (m_channel) {
+    m_channel->object()->subscribe(this);
+  }
   return scx::Ok;
 }
 
+//=============================================================================
+bool WebSocketStream::negotiate_deflate(const std::string& offers,
+                                        bool& max_window) const
+{
+  // Look for a permessage-deflate offer with parameters we can accept
+  std::string::size_type start = 0;
+  while (start < offers.size()) {
+    std::string::size_type end = offers.find(',',start);
+    if (end == std::string::npos) end = offers.size();
+    std::string offer = offers.substr(start,end-start);
+    start = end + 1;
+
+    bool ok = true;
+    bool first = true;
+    max_window = false;
+    std::string::size_type ps = 0;
+    while (ok && ps <= offer.size()) {
+      std::string::size_type pe = offer.find(';',ps);
+      if (pe == std::string::npos) pe = offer.size();
+      std::string param = offer.substr(ps,pe-ps);
+      ps = pe + 1;
+      websocket_trim(param);
+
+      std::string value;
+      std::string::size_type ieq = param.find('=');
+      if (ieq != std::string::npos) {
+        value = param.substr(ieq+1);
+        param = param.substr(0,ieq);
+        websocket_trim(param);
+        websocket_trim(value);
+        if (value.size() >= 2 && value[0] == '"') {
+          value = value.substr(1,value.size()-2);
+        }
+      }
+
+      if (first) {
+        ok = (param == "permessage-deflate");
+        first = false;
+      } else if (param == "server_no_context_takeover" ||
+                 param == "client_no_context_takeover" ||
+                 param == "client_max_window_bits") {
+        // Acceptable - the inflater always allows the full window
+      } else if (param == "server_max_window_bits") {
+        // Only accept if the limit isn't less than the window we use
+        ok = (atoi(value.c_str()) >= WEBSOCKET_DEFLATE_WBITS);
+        max_window = true;
+      } else {
+        ok = false;
+      }
+    }
+    if (ok && !first) return true;
+  }
+  return false;
+}
+
 //=============================================================================
 scx::Condition WebSocketStream::read_frame()
 {
   m_read_buffer.compact();
   scx::Condition c = Stream::read(m_read_buffer);
-  if (c != scx::Ok) return c;
+  // Frames may already be buffered from a previous read
+  if (c != scx::Ok && !(c == scx::Wait && m_read_buffer.used())) return c;
+  c = scx::Ok;
 
   try {
     scx::BufferReader br(m_read_buffer);
     
     uint8_t a = br.read_u8();
     bool fin = a & 0x80;
+    bool compressed = a & 0x40;
     unsigned short opcode = a & 0x0f;
+    if (a & 0x30) {
+      STREAM_DEBUG_LOG("Unsupported RSV bits set");
+      return scx::Error;
+    }
     
     uint8_t b = br.read_u8();
     m_read_usemask = b & 0x80;
@@ -321,20 +984,29 @@ scx::Condition WebSocketStream::read_frame()
       br.done();
       switch (opcode) {
         case OPCODE_CONT:
-          if (m_read_format == None) c = scx::Error;
+          // Compression is only indicated on the first frame of a message
+          if (m_read_format == None || compressed) c = scx::Error;
           break;
         case OPCODE_TEXT:
           m_read_format = Text;
+          m_read_compressed = compressed;
           break;
         case OPCODE_BINARY:
           m_read_format = Binary;
+          m_read_compressed = compressed;
           break;
         default:
           STREAM_DEBUG_LOG("Unsupported opcode " << opcode);
           c = scx::Error;
           break;
       }
+      if (m_read_compressed && !m_deflate) {
+        STREAM_DEBUG_LOG("Compressed frame without permessage-deflate");
+        c = scx::Error;
+      }
       if (c == scx::Ok) {
+        m_read_fin = fin;
+        m_read_trailer = false;
         m_read_state = Data;
         enable_event(scx::Stream::Readable,false);
       }
@@ -342,18 +1014,15 @@ scx::Condition WebSocketStream::read_frame()
     }
 
     // Control frame
-    if (!fin) return scx::Error;
+    if (!fin || compressed) return scx::Error;
     if (m_read_len > 125) return scx::Error;
     scx::Buffer data(128);
     if (m_read_len > 0) br.read_bytes((char*)data.tail(),m_read_len);
     data.push(m_read_len);
     br.done();
     
-    // Unmask
     if (m_read_usemask) {
-      for (unsigned int i=0; i<m_read_len; ++i) {
-        *((unsigned char*)data.head()+i) ^= m_read_mask[i%4];
-      }
+      websocket_unmask((unsigned char*)data.head(),m_read_len,m_read_mask,0);
     }
 
     switch (opcode) {
@@ -372,6 +1041,100 @@ scx::Condition WebSocketStream::read_frame()
   return c;
 }
 
+//=============================================================================
+scx::Condition WebSocketStream::read_inflate(void* buffer,int n,int& na)
+{
+  if (!m_inflater) {
+    m_inflater = new z_stream;
+    memset(m_inflater,0,sizeof(z_stream));
+    if (inflateInit2(m_inflater,-MAX_WBITS) != Z_OK) {
+      delete m_inflater;
+      m_inflater = 0;
+      return scx::Error;
+    }
+    m_inflate_buffer.resize(WEBSOCKET_COALESCE_MAX);
+  }
+
+  scx::Condition c = scx::Ok;
+  z_stream* z = m_inflater;
+  z->next_out = (Bytef*)buffer;
+  z->avail_out = n;
+  
+  while (z->avail_out > 0) {
+    if (z->avail_in == 0) fill_inflate(c);
+    uInt in = z->avail_in;
+    uInt out = z->avail_out;
+    int r = inflate(z,Z_SYNC_FLUSH);
+    if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+      STREAM_DEBUG_LOG("Inflate error " << r);
+      return scx::Error;
+    }
+    if (z->avail_in == in && z->avail_out == out) break; // No progress
+  }
+  na = n - z->avail_out;
+
+  // If the output buffer was filled, the inflater may be holding more
+  m_inflate_pending = (z->avail_out == 0);
+
+  if (m_read_pos == m_read_len && z->avail_in == 0 &&
+      (m_read_trailer || !m_read_fin) && !m_inflate_pending) {
+    // Frame complete
+    m_read_state = Header;
+    if (m_read_fin) m_read_compressed = false;
+    enable_event(scx::Stream::Readable,true);
+  }
+  
+  return (na > 0) ? scx::Ok : c;
+}
+
+//=============================================================================
+bool WebSocketStream::fill_inflate(scx::Condition& c)
+{
+  z_stream* z = m_inflater;
+  m_inflate_buffer.pop(m_inflate_buffer.used());
+  m_inflate_buffer.compact();
+
+  int rem = m_read_len - m_read_pos;
+  if (rem > 0) {
+    // Read more of the compressed payload
+    int want = m_inflate_buffer.free();
+    if (want > rem) want = rem;
+    int a = m_read_buffer.used();
+    if (a > want) a = want;
+    if (a) {
+      m_read_buffer.pop_to(m_inflate_buffer.tail(),a);
+      m_inflate_buffer.push(a);
+    }
+    if (a < want) {
+      int nr = 0;
+      c = Stream::read(m_inflate_buffer.tail(),want-a,nr);
+      m_inflate_buffer.push(nr);
+      a += nr;
+    }
+    if (a == 0) return false;
+    
+    unsigned char* data = (unsigned char*)m_inflate_buffer.head();
+    if (m_read_usemask) {
+      websocket_unmask(data,a,m_read_mask,m_read_pos);
+    }
+    m_read_pos += a;
+    z->next_in = data;
+    z->avail_in = a;
+    return true;
+  }
+
+  if (m_read_fin && !m_read_trailer) {
+    // End of message, add the trailer removed by the sender (RFC7692 7.2.2)
+    static unsigned char trailer[4] = {0x00,0x00,0xff,0xff};
+    z->next_in = trailer;
+    z->avail_in = 4;
+    m_read_trailer = true;
+    return true;
+  }
+  
+  return false;
+}
+
 //=============================================================================
 void WebSocketStream::handle_close(scx::Buffer& data)
 {
@@ -417,16 +1180,9 @@ void WebSocketStream::build_frame(scx::BufferWriter& bw,
                                   unsigned short opcode,
                                   unsigned int length)
 {
-  bw.write_u8(0x80 | opcode); // Don't support continuation or masking here
-  if (length < 126) {
-    bw.write_u8((uint8_t)length);
-  } else if (length < 65536) {
-    bw.write_u8(126);
-    bw.write_u16((uint16_t)length);
-  } else {
-    bw.write_u8(127);
-    bw.write_u64((uint64_t)length);
-  }
+  uint8_t hdr[10];
+  int hlen = websocket_frame_header(hdr,opcode,false,length);
+  bw.write_bytes((const char*)hdr,hlen);
 }
   
 };
@@ -2,6 +2,10 @@
 
 WebSocket server support
 
+Messages can be broadcast to all the WebSocket connections subscribed to a
+channel. Each message is framed (and compressed, if permessage-deflate is
+in use) once, and the encoded frame is shared between the connections.
+
 Copyright (c) 2000-2017 Andrew Wedgbury <wedge@sconemad.com>
 
 This program is free software; you can redistribute it and/or modify
@@ -28,15 +32,143 @@ Free Software Foundation, Inc.,
 #include <http/Handler.h>
 #include <sconex/Stream.h>
 #include <sconex/Buffer.h>
+#include <sconex/Mutex.h>
+
+struct z_stream_s;
 
 namespace http {
 
+class WebSocketStream;
+class WebSocketManager;
+
+//=============================================================================
+// WebSocketFrame - An encoded data frame, which can be queued for sending on
+// many streams. Frames are reference counted, and immutable once created.
+//
+class HTTP_API WebSocketFrame {
+public:
+
+  // If deflater is specified, a compressed version of the frame is also
+  // created for streams using permessage-deflate.
+  WebSocketFrame(unsigned short opcode,
+                 const void* data,
+                 int len,
+                 z_stream_s* deflater);
+
+  void add_ref();
+  void release();
+
+  // Get the encoded frame, compressed if requested and available
+  const std::string& get_data(bool deflate) const;
+
+private:
+
+  ~WebSocketFrame();
+
+  scx::Mutex m_mutex;
+  int m_refs;
+
+  std::string m_plain;
+  std::string m_deflated;
+};
+
+//=============================================================================
+// WebSocketChannel - A set of WebSocket streams which messages can be
+// broadcast to.
+//
+class HTTP_API WebSocketChannel : public scx::ScriptObject {
+public:
+
+  WebSocketChannel(WebSocketManager& manager, const std::string& name);
+  virtual ~WebSocketChannel();
+
+  const std::string& get_name() const;
+
+  void subscribe(WebSocketStream* stream);
+  void unsubscribe(WebSocketStream* stream);
+
+  // Send a message to all subscribers, returns the number of subscribers
+  int broadcast(const void* data, int len, bool binary);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<WebSocketChannel> Ref;
+
+private:
+
+  WebSocketManager& m_manager;
+  std::string m_name;
+
+  mutable scx::Mutex m_mutex;
+  typedef std::set<WebSocketStream*> StreamSet;
+  StreamSet m_streams;
+  int m_num_deflate;
+  z_stream_s* m_deflater;
+
+  // Stats
+  long m_messages;
+  long m_bytes;
+  long m_overflows;
+};
+
+//=============================================================================
+// WebSocketManager - WebSocket settings and broadcast channels.
+//
+class HTTP_API WebSocketManager : public scx::ScriptObject {
+public:
+
+  WebSocketManager(HTTPModule& module);
+  virtual ~WebSocketManager();
+
+  // Find the named channel, creating it if it doesn't exist
+  WebSocketChannel::Ref* get_channel(const std::string& name);
+
+  // Whether to offer permessage-deflate compression to clients
+  bool get_deflate() const;
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<WebSocketManager> Ref;
+
+private:
+
+  HTTPModule& m_module;
+
+  mutable scx::Mutex m_mutex;
+  typedef std::map<std::string,WebSocketChannel::Ref*> ChannelMap;
+  ChannelMap m_channels;
+  bool m_deflate;
+};
+
 //=========================================================================
 class HTTP_API WebSocketHandler : public Handler {
 public:
 
   WebSocketHandler(HTTPModule* module,
-                   const std::string& chain);
+                   const std::string& chain,
+                   const std::string& channel);
   virtual ~WebSocketHandler() {}
 
   virtual scx::Condition handle_message(MessageStream* message);
@@ -45,6 +177,7 @@ private:
 
   HTTPModule::Ref m_module;
   std::string m_chain;
+  std::string m_channel;
   
 };
   
@@ -52,9 +185,21 @@ private:
 class HTTP_API WebSocketStream : public scx::Stream {
 public:
 
-  WebSocketStream(HTTPModule* module, MessageStream* message);
+  // If channel is specified, the stream is subscribed to it once the
+  // connection has been upgraded (the stream takes ownership of the ref).
+  WebSocketStream(HTTPModule* module,
+                  MessageStream* message,
+                  WebSocketChannel::Ref* channel = 0);
   virtual ~WebSocketStream();
 
+  // Queue a broadcast frame for sending, called by the channel from another
+  // thread (which must then call Kernel::wakeup). Returns false if too much
+  // data is already queued.
+  bool queue_frame(WebSocketFrame* frame);
+
+  // Is permessage-deflate in use on this connection
+  bool is_deflate() const;
+
   // scx::Stream interface:
   virtual scx::Condition read(void* buffer,int n,int& na);
   virtual scx::Condition write(const void* buffer,int n,int& na);
@@ -65,7 +210,11 @@ public:
 private:
 
   scx::Condition process_handshake();
+  bool negotiate_deflate(const std::string& offers, bool& max_window) const;
   scx::Condition read_frame();
+  scx::Condition read_inflate(void* buffer,int n,int& na);
+  bool fill_inflate(scx::Condition& c);
+  scx::Condition flush();
 
   void handle_close(scx::Buffer& data);
   void handle_ping(scx::Buffer& data);
@@ -77,6 +226,7 @@ private:
   
   HTTPModule::Ref m_module;
   MessageStream* m_message;
+  WebSocketChannel::Ref* m_channel;
 
   enum ReadState { Header, Data };
   ReadState m_read_state;
@@ -87,8 +237,24 @@ private:
   unsigned long m_read_len;
   bool m_read_usemask;
   uint8_t m_read_mask[4];
+  bool m_read_fin;
+
+  // permessage-deflate state (the zlib streams are created when needed)
+  bool m_deflate;
+  bool m_read_compressed;
+  bool m_read_trailer;
+  bool m_inflate_pending;
+  z_stream_s* m_inflater;
+  z_stream_s* m_deflater;
+  scx::Buffer m_inflate_buffer;
 
   scx::Buffer m_write_buffer;
+
+  // Broadcast frames waiting to be sent
+  scx::Mutex m_queue_mutex;
+  std::list<WebSocketFrame*> m_queue;
+  int m_queue_bytes;
+  bool m_overflow;
 };
 
 };
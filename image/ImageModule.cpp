@@ -19,24 +19,26 @@ along with this program (see the file COPYING); if not, write to the
 Free Software Foundation, Inc.,
 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
 
+#include "ThumbnailPool.h"
+
 #include <sconesite/Article.h>
 
 #include <sconex/ModuleInterface.h>
 #include <sconex/Module.h>
 #include <sconex/FilePath.h>
-#include <sconex/FileStat.h>
+#include <sconex/FileDir.h>
 #include <sconex/ScriptTypes.h>
 #include <sconex/Log.h>
+#include <algorithm>
 
 #define MAGICKCORE_HDRI_ENABLE 0
 #define MAGICKCORE_QUANTUM_DEPTH 16
 #include <Magick++.h>
 using namespace Magick;
 
-const char* IMAGE_DIR = ".image";
-
 //=========================================================================
-class ImageModule : public scx::Module {
+class ImageModule : public scx::Module,
+                    public scx::Provider<http::Handler> {
 public:
 
   ImageModule();
@@ -57,25 +59,37 @@ public:
 					const std::string& name,
 					const scx::ScriptRef* args);
 
+  // Provider<Handler> method
+  virtual void provide(const std::string& type,
+		       const scx::ScriptRef* args,
+		       http::Handler*& object);
+
 protected:
 
+  // Is this the name of an image file which can have a thumbnail
+  static bool is_image(const std::string& name);
+
 private:
 
+  ThumbnailPool m_pool;
+
 };
 
 SCONEX_MODULE(ImageModule);
 
 //=========================================================================
 ImageModule::ImageModule(
-) : scx::Module("image",scx::version())
+) : scx::Module("image",scx::version()),
+    m_pool(*this)
 {
   ::InitializeMagick(NULL);
+  http::Handler::register_handler("thumbnail",this);
 }
 
 //=========================================================================
 ImageModule::~ImageModule()
 {
-
+  http::Handler::unregister_handler("thumbnail",this);
 }
 
 //=========================================================================
@@ -100,9 +114,34 @@ scx::ScriptRef* ImageModule::script_op(const scx::ScriptAuth& auth,
     const std::string name = right->object()->get_string();
     
     // Methods
-    if ("thumbnail" == name) {
+    if ("thumbnail" == name ||
+        "generate_thumbnails" == name ||
+        "allow_size" == name ||
+        "set_max_jobs" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
+
+    // Properties
+    if ("max_jobs" == name)
+      return scx::ScriptInt::new_ref(m_pool.get_max_jobs());
+    if ("sizes" == name) {
+      scx::ScriptList::Ref* list =
+        new scx::ScriptList::Ref(new scx::ScriptList());
+      std::set<std::string> sizes = m_pool.get_sizes();
+      for (std::set<std::string>::const_iterator it = sizes.begin();
+           it != sizes.end(); ++it) {
+        list->object()->give(scx::ScriptString::new_ref(*it));
+      }
+      return list;
+    }
+    if ("queued" == name)
+      return scx::ScriptInt::new_ref(m_pool.num_queued());
+    if ("running" == name)
+      return scx::ScriptInt::new_ref(m_pool.num_running());
+    if ("generated" == name)
+      return scx::ScriptInt::new_ref(m_pool.num_generated());
+    if ("failed" == name)
+      return scx::ScriptInt::new_ref(m_pool.num_failed());
   }
 
   return scx::Module::script_op(auth,ref,op,right);
@@ -126,35 +165,21 @@ scx::ScriptRef* ImageModule::script_method(const scx::ScriptAuth& auth,
     if (!a_image) 
       return scx::ScriptError::new_ref("No image specified");
 
-    const scx::FilePath& root = article->get_root();
-    scx::FilePath source = root + a_image->get_string();
-    scx::FileStat source_stat(source);
-    if (!source_stat.exists()) 
-      return scx::ScriptError::new_ref("Image does not exist");
-
     const scx::ScriptString* a_size = 
       scx::get_method_arg<scx::ScriptString>(args,2,"size");
     std::string size = "100x100";
     if (a_size) size = a_size->get_string();
+    if (!m_pool.allow_size(size))
+      return scx::ScriptError::new_ref("Invalid size");
 
+    // Queue the thumbnail to be generated if required, the markup can be
+    // returned straight away as the thumbnail handler waits for it
+    const scx::FilePath& root = article->get_root();
+    scx::FilePath source = root + a_image->get_string();
     scx::FilePath dest = root + IMAGE_DIR + size + a_image->get_string();
-    scx::FileStat dest_stat(dest);
-
-    if (!dest_stat.exists() || 
-	(dest_stat.time() < source_stat.time())) {
-      // Thumbnail needs to be generated
-      scx::FilePath::mkdir(root + IMAGE_DIR + size,true,0777);
-      scx::Log("image").submit("Generating " + size +
-                               " thumbnail for " + source.path());
-      try {
-	Image image;
-	image.read(source.path());
-	image.transform(size);
-	image.write(dest.path());
-      } catch (Exception& e) {
-	return scx::ScriptError::new_ref(e.what());
-      }
-    }
+    std::string error;
+    if (!m_pool.request(source,dest,size,error))
+      return scx::ScriptError::new_ref(error);
 
     // Generate markup
     std::string href_root = "/" + article->get_href_path();
@@ -166,5 +191,77 @@ scx::ScriptRef* ImageModule::script_method(const scx::ScriptAuth& auth,
       "<a href='"+img_href+"'><img src='"+thumb_href+"'/></a>");
   }
 
+  if (name == "generate_thumbnails") {
+    // Queue thumbnails to be generated for all images in an article
+
+    const scs::Article* article = 
+      scx::get_method_arg<scs::Article>(args,0,"article");
+    if (!article) 
+      return scx::ScriptError::new_ref("No article specified");
+
+    const scx::ScriptString* a_size = 
+      scx::get_method_arg<scx::ScriptString>(args,1,"size");
+    std::string size = "100x100";
+    if (a_size) size = a_size->get_string();
+    if (!m_pool.allow_size(size))
+      return scx::ScriptError::new_ref("Invalid size");
+
+    const scx::FilePath& root = article->get_root();
+    int num = 0;
+    scx::FileDir dir(root);
+    while (dir.next()) {
+      std::string file = dir.name();
+      if (!is_image(file) || !dir.stat().is_file()) continue;
+      std::string error;
+      if (!m_pool.request(root + file, root + IMAGE_DIR + size + file,
+                          size, error)) continue;
+      ++num;
+    }
+    return scx::ScriptInt::new_ref(num);
+  }
+
+  if (name == "allow_size") {
+    // Allow a thumbnail size to be generated when first requested, before
+    // any markup using it has been generated
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptString* a_size =
+      scx::get_method_arg<scx::ScriptString>(args,0,"size");
+    if (!a_size || !m_pool.allow_size(a_size->get_string()))
+      return scx::ScriptError::new_ref("Invalid size");
+    return 0;
+  }
+
+  if (name == "set_max_jobs") {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_max =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"value");
+    if (!a_max || a_max->get_int() < 1)
+      return scx::ScriptError::new_ref("Must be at least 1");
+    m_pool.set_max_jobs(a_max->get_int());
+    return 0;
+  }
+
   return scx::Module::script_method(auth,ref,name,args);
 }
+
+//=========================================================================
+void ImageModule::provide(const std::string& type,
+			  const scx::ScriptRef* args,
+			  http::Handler*& object)
+{
+  object = new ThumbnailHandler(*this,m_pool);
+}
+
+//=========================================================================
+bool ImageModule::is_image(const std::string& name)
+{
+  std::string::size_type idot = name.find_last_of(".");
+  if (idot == std::string::npos || idot == 0) return false;
+  std::string extn = name.substr(idot+1);
+  std::transform(extn.begin(),extn.end(),extn.begin(),::tolower);
+  return (extn == "jpg" || extn == "jpeg" || extn == "png" ||
+          extn == "gif" || extn == "bmp" || extn == "tif" ||
+          extn == "tiff" || extn == "webp");
+}
@@ -0,0 +1,389 @@
+/* SconeServer (http://www.sconemad.com)
+
+Image thumbnail pool
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include "ThumbnailPool.h"
+
+#include <http/MessageStream.h>
+#include <http/Request.h>
+#include <http/Status.h>
+#include <sconex/Kernel.h>
+#include <sconex/FileStat.h>
+#include <sconex/Log.h>
+
+#define MAGICKCORE_HDRI_ENABLE 0
+#define MAGICKCORE_QUANTUM_DEPTH 16
+#include <Magick++.h>
+using namespace Magick;
+
+const char* IMAGE_DIR = ".image";
+
+// Largest thumbnail width or height which can be requested
+const int MAX_THUMBNAIL_SIZE = 4096;
+
+// Maximum number of thumbnail sizes which can be allowed
+const unsigned int MAX_THUMBNAIL_SIZES = 64;
+
+// Maximum number of failed thumbnails to remember
+const unsigned int MAX_THUMBNAIL_FAILURES = 1000;
+
+//=========================================================================
+// Is this a valid thumbnail size, i.e. "100x80"
+static bool valid_size(const std::string& size)
+{
+  std::string::size_type ix = size.find("x");
+  if (ix == std::string::npos) return false;
+  std::string w = size.substr(0,ix);
+  std::string h = size.substr(ix+1);
+  if (w.empty() || h.empty() || w.size() > 4 || h.size() > 4) return false;
+  if (w.find_first_not_of("0123456789") != std::string::npos ||
+      h.find_first_not_of("0123456789") != std::string::npos) return false;
+  int iw = atoi(w.c_str());
+  int ih = atoi(h.c_str());
+  return (iw > 0 && ih > 0 &&
+          iw <= MAX_THUMBNAIL_SIZE && ih <= MAX_THUMBNAIL_SIZE);
+}
+
+//=========================================================================
+ThumbnailPool::ThumbnailPool(scx::Module& module)
+  : m_module(module),
+    m_max_jobs(2),
+    m_jobs(0),
+    m_running(0),
+    m_generated(0),
+    m_failed(0)
+{
+
+}
+
+//=========================================================================
+ThumbnailPool::~ThumbnailPool()
+{
+
+}
+
+//=========================================================================
+bool ThumbnailPool::allow_size(const std::string& size)
+{
+  if (!valid_size(size)) return false;
+  scx::MutexLocker locker(m_mutex);
+  if (m_sizes.count(size)) return true;
+  if (m_sizes.size() >= MAX_THUMBNAIL_SIZES) return false;
+  m_sizes.insert(size);
+  return true;
+}
+
+//=========================================================================
+bool ThumbnailPool::allowed_size(const std::string& size) const
+{
+  scx::MutexLocker locker(m_mutex);
+  return (m_sizes.count(size) > 0);
+}
+
+//=========================================================================
+std::set<std::string> ThumbnailPool::get_sizes() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_sizes;
+}
+
+//=========================================================================
+bool ThumbnailPool::request(const scx::FilePath& source,
+                            const scx::FilePath& dest,
+                            const std::string& size,
+                            std::string& error)
+{
+  if (!valid_size(size)) {
+    error = "Invalid size";
+    return false;
+  }
+
+  scx::FileStat source_stat(source);
+  if (!source_stat.is_file()) {
+    error = "Image does not exist";
+    return false;
+  }
+
+  scx::MutexLocker locker(m_mutex);
+  TaskMap::iterator it = m_tasks.find(dest.path());
+  if (it != m_tasks.end()) {
+    Task& task = it->second;
+    if (task.state == Queued || task.state == Running) {
+      // Already on its way
+      return true;
+    }
+    if (task.state == Failed && task.source_time == source_stat.time()) {
+      // Don't try again unless the source has changed
+      error = task.error;
+      return false;
+    }
+    m_tasks.erase(it);
+  }
+
+  scx::FileStat dest_stat(dest);
+  if (dest_stat.exists() && dest_stat.time() >= source_stat.time()) {
+    // Up to date
+    return true;
+  }
+
+  Task task;
+  task.source = source;
+  task.size = size;
+  task.state = Queued;
+  task.source_time = source_stat.time();
+  m_tasks[dest.path()] = task;
+  m_queue.push_back(dest.path());
+  schedule();
+  return true;
+}
+
+//=========================================================================
+bool ThumbnailPool::wait(const scx::FilePath& dest)
+{
+  scx::MutexLocker locker(m_mutex);
+  TaskMap::iterator it = m_tasks.find(dest.path());
+  if (it == m_tasks.end()) return true;
+
+  if (it->second.state == Queued) {
+    // Generate it now rather than waiting for a job to get to it, which
+    // also means waiting requests can't hold up the jobs
+    m_queue.remove(dest.path());
+    generate(locker,dest.path());
+  }
+
+  while (true) {
+    it = m_tasks.find(dest.path());
+    if (it == m_tasks.end()) return true;
+    if (it->second.state == Failed) return false;
+    m_done.wait(m_mutex);
+  }
+}
+
+//=========================================================================
+void ThumbnailPool::run_jobs()
+{
+  scx::MutexLocker locker(m_mutex);
+  while (!m_queue.empty()) {
+    std::string dest = m_queue.front();
+    m_queue.pop_front();
+    generate(locker,dest);
+  }
+  --m_jobs;
+}
+
+//=========================================================================
+void ThumbnailPool::set_max_jobs(int max_jobs)
+{
+  scx::MutexLocker locker(m_mutex);
+  m_max_jobs = max_jobs;
+  schedule();
+}
+
+//=========================================================================
+int ThumbnailPool::get_max_jobs() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_max_jobs;
+}
+
+//=========================================================================
+int ThumbnailPool::num_queued() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_queue.size();
+}
+
+//=========================================================================
+int ThumbnailPool::num_running() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_running;
+}
+
+//=========================================================================
+unsigned long ThumbnailPool::num_generated() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_generated;
+}
+
+//=========================================================================
+unsigned long ThumbnailPool::num_failed() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return m_failed;
+}
+
+//=========================================================================
+void ThumbnailPool::generate(scx::MutexLocker& locker,
+                             const std::string& dest)
+{
+  TaskMap::iterator it = m_tasks.find(dest);
+  if (it == m_tasks.end() || it->second.state != Queued) return;
+  it->second.state = Running;
+  scx::FilePath source = it->second.source;
+  std::string size = it->second.size;
+  ++m_running;
+  locker.unlock();
+
+  // Write to a temporary file alongside the thumbnail, keeping the same
+  // extension so the format is the same, then move it into place so that
+  // a partly written thumbnail is never served
+  scx::FilePath dir(dest);
+  std::string name = dir.pop();
+  scx::FilePath temp = dir + ("." + name);
+  scx::FilePath::mkdir(dir,true,0777);
+
+  scx::Log("image").submit("Generating " + size +
+                           " thumbnail for " + source.path());
+  std::string error;
+  try {
+    Image image;
+    image.read(source.path());
+    image.transform(size);
+    image.write(temp.path());
+    if (!scx::FilePath::move(temp,dest)) {
+      error = "Unable to write thumbnail";
+    }
+  } catch (Exception& e) {
+    error = e.what();
+  }
+
+  locker.lock();
+  --m_running;
+  it = m_tasks.find(dest);
+  if (error.empty()) {
+    ++m_generated;
+    m_tasks.erase(it);
+  } else {
+    scx::FilePath::rmfile(temp);
+    scx::Log("image").submit("Failed to generate thumbnail for " +
+                             source.path() + ": " + error);
+    ++m_failed;
+    it->second.state = Failed;
+    it->second.error = error;
+
+    // Forget the oldest failures once there are too many, they will be
+    // retried if requested again
+    m_failures.push_back(dest);
+    while (m_failures.size() > MAX_THUMBNAIL_FAILURES) {
+      it = m_tasks.find(m_failures.front());
+      if (it != m_tasks.end() && it->second.state == Failed) {
+        m_tasks.erase(it);
+      }
+      m_failures.pop_front();
+    }
+  }
+  m_done.broadcast();
+}
+
+//=========================================================================
+void ThumbnailPool::schedule()
+{
+  while (m_jobs < m_max_jobs && m_jobs < (int)m_queue.size()) {
+    ++m_jobs;
+    scx::Kernel::get()->add_job(new ThumbnailJob(m_module,*this));
+  }
+}
+
+
+//=========================================================================
+ThumbnailJob::ThumbnailJob(scx::Module& module, ThumbnailPool& pool)
+  : scx::Job("image Thumbnail"),
+    m_module(&module),
+    m_pool(pool)
+{
+
+}
+
+//=========================================================================
+ThumbnailJob::~ThumbnailJob()
+{
+
+}
+
+//=========================================================================
+bool ThumbnailJob::run()
+{
+  m_pool.run_jobs();
+  return true;
+}
+
+
+//=========================================================================
+ThumbnailHandler::ThumbnailHandler(scx::Module& module, ThumbnailPool& pool)
+  : m_module(&module),
+    m_pool(pool)
+{
+
+}
+
+//=========================================================================
+ThumbnailHandler::~ThumbnailHandler()
+{
+
+}
+
+//=========================================================================
+scx::Condition ThumbnailHandler::handle_message(http::MessageStream* message)
+{
+  const http::Request& req = message->get_request();
+  http::Response& resp = message->get_response();
+
+  // The path is "<article root>/.image/<size>/<image>"
+  const scx::FilePath& dest = req.get_path();
+  const std::string& path = dest.path();
+  std::string marker = std::string("/") + IMAGE_DIR + "/";
+  std::string::size_type im = path.find(marker);
+  std::string::size_type is = (im == std::string::npos) ?
+    std::string::npos : path.find("/",im + marker.size());
+  if (is == std::string::npos) {
+    resp.set_status(http::Status::NotFound);
+    return scx::Close;
+  }
+  std::string size = path.substr(im + marker.size(),
+                                 is - im - marker.size());
+  scx::FilePath source = scx::FilePath(path.substr(0,im)) +
+                         path.substr(is+1);
+
+  // Only generate sizes which the site uses, i.e. allowed when generating
+  // markup or by configuration, or already generated for this article
+  if (!m_pool.allowed_size(size) &&
+      !scx::FileStat(path.substr(0,is)).is_dir()) {
+    resp.set_status(http::Status::NotFound);
+    return scx::Close;
+  }
+
+  std::string error;
+  if (!m_pool.request(source,dest,size,error) || !m_pool.wait(dest)) {
+    resp.set_status(http::Status::NotFound);
+    return scx::Close;
+  }
+
+  // Serve the thumbnail using the getfile handler
+  http::Handler* getfile = http::Handler::create("getfile",0);
+  if (!getfile) {
+    resp.set_status(http::Status::InternalServerError);
+    return scx::Close;
+  }
+  scx::Condition c = getfile->handle_message(message);
+  delete getfile;
+  return c;
+}
@@ -0,0 +1,168 @@
+/* SconeServer (http://www.sconemad.com)
+
+Image thumbnail pool
+
+Thumbnails are generated in the background by kernel jobs, so rendering a
+page which refers to them isn't held up. Each thumbnail is generated at most
+once at a time, however many pages or requests ask for it, and the number
+of jobs generating thumbnails at once is limited. A request for a thumbnail
+which is still waiting to be generated generates it straight away, or waits
+for it if it is already being generated.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef imageThumbnailPool_h
+#define imageThumbnailPool_h
+
+#include <http/Handler.h>
+#include <sconex/Module.h>
+#include <sconex/Job.h>
+#include <sconex/FilePath.h>
+#include <sconex/Date.h>
+#include <sconex/Mutex.h>
+
+// Directory within an article which holds its thumbnails, in a
+// subdirectory for each size
+extern const char* IMAGE_DIR;
+
+//=========================================================================
+// ThumbnailPool - Queues and generates thumbnails
+//
+class ThumbnailPool {
+public:
+
+  ThumbnailPool(scx::Module& module);
+  ~ThumbnailPool();
+
+  // Allow thumbnails of a size to be generated when requested by the
+  // handler. Returns false if the size is invalid or the limit on the number
+  // of sizes has been reached.
+  bool allow_size(const std::string& size);
+  bool allowed_size(const std::string& size) const;
+  std::set<std::string> get_sizes() const;
+
+  // Queue a thumbnail to be generated, if it doesn't exist or is older
+  // than the source image. Returns false and sets error if the thumbnail
+  // can't be generated.
+  bool request(const scx::FilePath& source,
+               const scx::FilePath& dest,
+               const std::string& size,
+               std::string& error);
+
+  // Wait for a thumbnail to be generated, generating it in this thread if
+  // it is still queued. Returns false if it couldn't be generated.
+  bool wait(const scx::FilePath& dest);
+
+  // Generate queued thumbnails until the queue is empty (used by the jobs)
+  void run_jobs();
+
+  // Maximum number of jobs generating thumbnails at once
+  void set_max_jobs(int max_jobs);
+  int get_max_jobs() const;
+
+  // Statistics
+  int num_queued() const;
+  int num_running() const;
+  unsigned long num_generated() const;
+  unsigned long num_failed() const;
+
+private:
+
+  enum State { Queued, Running, Done, Failed };
+
+  struct Task {
+    scx::FilePath source;
+    std::string size;
+    State state;
+    scx::Date source_time;  // Source modification time when requested
+    std::string error;
+  };
+  typedef std::map<std::string,Task> TaskMap;
+
+  // Generate a queued thumbnail, the pool is unlocked while generating
+  // (pool must be locked)
+  void generate(scx::MutexLocker& locker, const std::string& dest);
+
+  // Add jobs to generate queued thumbnails, up to the limit
+  // (pool must be locked)
+  void schedule();
+
+  scx::Module& m_module;
+
+  mutable scx::Mutex m_mutex;
+  scx::ConditionEvent m_done;
+
+  // Thumbnails being generated or which failed, by destination path
+  TaskMap m_tasks;
+
+  // Failed thumbnails, oldest first, so that only a limited number are
+  // remembered
+  std::list<std::string> m_failures;
+
+  // Sizes which can be generated on request
+  std::set<std::string> m_sizes;
+
+  // Thumbnails waiting to be generated, in order
+  std::list<std::string> m_queue;
+
+  int m_max_jobs;
+  int m_jobs;
+  int m_running;
+
+  unsigned long m_generated;
+  unsigned long m_failed;
+};
+
+//=========================================================================
+// ThumbnailJob - Generates queued thumbnails
+//
+class ThumbnailJob : public scx::Job {
+public:
+
+  ThumbnailJob(scx::Module& module, ThumbnailPool& pool);
+  virtual ~ThumbnailJob();
+
+  virtual bool run();
+
+private:
+
+  // Keeps the module loaded while the job exists
+  scx::Module::Ref m_module;
+  ThumbnailPool& m_pool;
+};
+
+//=========================================================================
+// ThumbnailHandler - Serves a thumbnail once it has been generated. This
+// is used for files under the image directory of articles, by mapping
+// it as a sconesite file handler.
+//
+class ThumbnailHandler : public http::Handler {
+public:
+
+  ThumbnailHandler(scx::Module& module, ThumbnailPool& pool);
+  virtual ~ThumbnailHandler();
+
+  virtual scx::Condition handle_message(http::MessageStream* message);
+
+private:
+
+  scx::Module::Ref m_module;
+  ThumbnailPool& m_pool;
+};
+
+#endif
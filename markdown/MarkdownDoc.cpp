@@ -30,7 +30,7 @@ MarkdownDoc::MarkdownDoc(const std::string& name,
 			 const scx::FilePath& path,
 			 const std::string& file)
   : scs::Document(name, path, file),
-    m_doc(0)
+    m_open(false)
 {
 }
 
@@ -51,10 +51,16 @@ void MarkdownDoc::get_node_text(std::string& txt, cmark_node* node)
   }
 }
 
+//=========================================================================
+scs::Document* MarkdownDoc::new_version() const
+{
+  return new MarkdownDoc(m_name,m_root,m_file);
+}
+
 //=========================================================================
 bool MarkdownDoc::is_open() const
 {
-  return (m_doc != 0);
+  return m_open;
 }
 
 //=========================================================================
@@ -72,17 +78,25 @@ bool MarkdownDoc::handle_open()
   while (scx::Ok == file.read(buffer, 4096, na)) {
     cmark_parser_feed(parser, buffer, na);
   }
-  m_doc = cmark_parser_finish(parser);
+  cmark_node* doc = cmark_parser_finish(parser);
   cmark_parser_free(parser);
 
-  if (!m_doc) {
+  if (!doc) {
     report_error("Markdown parsing failed");
     return false;
   }
   
   int index = 0;
-  scan_headings(m_doc, index);
+  scan_headings(doc, index);
+
+  // The headings are kept, so the parse tree isn't needed once compiled
+  std::string markup;
+  compile_node(doc, markup);
+  compile_markup(markup);
+  cmark_node_free(doc);
 
+  prerender();
+  m_open = true;
   return true;
 }
 
@@ -91,8 +105,7 @@ bool MarkdownDoc::handle_process(scs::Context& context)
 {
   if (context.handle_doc_start(this)) {
     do {
-      indent = 0;
-      process_node(context, m_doc);
+      run_plan(context);
     } while (context.handle_doc_end(this));
   }
   return true;
@@ -101,14 +114,14 @@ bool MarkdownDoc::handle_process(scs::Context& context)
 //=========================================================================
 void MarkdownDoc::handle_close()
 {
-  if (m_doc) {
-    cmark_node_free(m_doc);
-    m_doc = 0;
-  }
+  m_plan.clear();
+  m_markup.clear();
+  m_prerendered = false;
+  m_open = false;
 }
 
 //=========================================================================
-void MarkdownDoc::process_node(scs::Context& context, cmark_node* node)
+void MarkdownDoc::compile_node(cmark_node* node, std::string& markup)
 {
   std::string html;
   scs::NodeAttrs attrs;
@@ -249,34 +262,38 @@ void MarkdownDoc::process_node(scs::Context& context, cmark_node* node)
   }
 
   // Start tag
-  if (!html.empty()) {
-    context.handle_start(html, attrs, empty, data);
+  bool dynamic = !html.empty() && is_dynamic_element(html);
+  size_t start_index = 0;
+  if (dynamic) {
+    compile_markup(markup);
+    start_index = compile_start(html, attrs, empty, 0, data);
+  } else if (!html.empty()) {
+    compile_start_tag(markup, html, attrs, empty);
   }
 
-  // Debug output node tree
-  //  const char* stype = cmark_node_get_type_string(node);
-  //  for (int i=0; i<indent; ++i) fprintf(stderr, "  ");
-  //  fprintf(stderr, "%s: %s\n", stype, text);
-
   if (!empty) {
 
-    // Text
+    // Text, leading newlines are dropped as they are by the context
     if (text) {
-      context.handle_text(text);
+      while (*text == '\n' || *text == '\r') ++text;
+      markup += text;
     }
     
     // Recurse to child nodes
-    ++indent;
     for ( ; child != 0; child = cmark_node_next(child)) {
-      process_node(context, child);
+      compile_node(child, markup);
     }
-    --indent;
 
     // End tag
-    if (!html.empty()) {
-      context.handle_end(html, attrs, data);
+    if (!html.empty() && !dynamic) {
+      markup += "</" + html + ">";
     }
   }
+
+  if (dynamic) {
+    compile_markup(markup);
+    compile_end(start_index);
+  }
 }
 
 //=========================================================================
@@ -33,6 +33,11 @@ class Context;
 //=========================================================================
 // MarkdownDoc - A Markdown document implementation
 //
+// When opened, the document is parsed and compiled into a render plan (see
+// scs::Document), and the parse tree is discarded. As a Markdown document
+// has no scripts, its whole markup is also pre-rendered, so templates can
+// embed it directly.
+//
 class MarkdownDoc : public scs::Document {
 public:
 
@@ -48,17 +53,18 @@ public:
   
 protected:
 
+  virtual scs::Document* new_version() const;
   virtual bool is_open() const;
   virtual bool handle_open();
   virtual bool handle_process(scs::Context& context);
   virtual void handle_close();
 
-  void process_node(scs::Context& context, cmark_node* node);
+  // Compile nodes into the render plan, accumulating rendered markup
+  void compile_node(cmark_node* node, std::string& markup);
 
   void scan_headings(cmark_node* node, int& index);
   
-  cmark_node* m_doc;
-  int indent;
+  bool m_open;
   
 };
 
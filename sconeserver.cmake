@@ -27,5 +27,7 @@ check_include_file_cxx(unordered_map HAVE_UNORDERED_MAP)
 check_include_file_cxx(tr1/unordered_map HAVE_TR1_UNORDERED_MAP)
 check_include_file_cxx(ext/hash_map HAVE_EXT_HASH_MAP)
 check_include_file_cxx(map HAVE_MAP)
+check_include_file_cxx(sys/inotify.h HAVE_SYS_INOTIFY_H)
+check_include_file_cxx(sys/sendfile.h HAVE_SYS_SENDFILE_H)
 set(HAVE_MSGHDR_MSG_CONTROL 1)
 
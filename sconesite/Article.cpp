@@ -132,6 +132,12 @@ Article::~Article()
   delete m_doc;
 }
 
+//=========================================================================
+int Article::get_id() const
+{
+  return m_id;
+}
+
 //=========================================================================
 const std::string& Article::get_name() const
 {
@@ -162,31 +168,23 @@ bool Article::process(Context& context)
 bool Article::set_meta(const std::string& name,
 		       scx::ScriptRef* value)
 {
-  return m_profile.set_meta(m_id,name,value);
+  bool result = m_profile.set_meta(m_id,name,value);
+  if (result) m_profile.invalidate_cache(m_link);
+  return result;
 }
 
 //=========================================================================
 scx::ScriptRef* Article::get_meta(const std::string& name,
 				  bool recurse) const
 {
-  scx::ScriptRef* a = m_profile.get_meta(m_id,name);
-  if (recurse && BAD_SCRIPTREF(a)) {
-    delete a; 
-    a = 0;
-    Article::Ref* parent = m_profile.lookup_article(m_parent_id);
-    if (parent) {
-      a = parent->object()->get_meta(name,recurse);
-      delete parent;
-    }
-  }
-  return a;
+  return m_profile.get_meta(m_id,name,recurse);
 }
 
 //=========================================================================
-const Heading* Article::get_headings() const
+Document::HeadingPtr Article::get_headings() const
 {
-  if (!m_doc) return 0;
-  return &m_doc->object()->get_headings();
+  if (!m_doc) return Document::HeadingPtr();
+  return m_doc->object()->get_headings();
 }
 
 //=========================================================================
@@ -270,7 +268,7 @@ scx::ScriptRef* Article::script_op(const scx::ScriptAuth& auth,
     }
 
     if ("headings" == name) {
-      const Heading* h = get_headings();
+      Document::HeadingPtr h = get_headings();
       if (!h) return scx::ScriptError::new_ref("Not available");
       return h->get_tree();
     }
@@ -279,7 +277,7 @@ scx::ScriptRef* Article::script_op(const scx::ScriptAuth& auth,
       if (!m_doc) return scx::ScriptError::new_ref("No document");
       scx::ScriptList* list = new scx::ScriptList();
       scx::ScriptRef* list_ref = new scx::ScriptRef(list);
-      const Document::ErrorList& errors = m_doc->object()->get_errors();
+      Document::ErrorList errors = m_doc->object()->get_errors();
       for (Document::ErrorList::const_iterator it = errors.begin();
            it != errors.end(); ++it) {
         list->give(scx::ScriptString::new_ref(*it));
@@ -322,6 +320,7 @@ scx::ScriptRef* Article::script_method(const scx::ScriptAuth& auth,
     if (!scx::FilePath::move(srcpath,dstpath))
       return scx::ScriptError::new_ref("Could not replace article");
 
+    m_profile.invalidate_cache(m_link);
     return 0;
   }
   
@@ -343,6 +342,7 @@ scx::ScriptRef* Article::script_method(const scx::ScriptAuth& auth,
     if (!scx::FilePath::move(srcpath,dstpath)) 
       return scx::ScriptError::new_ref("Could not move file");
 
+    m_profile.invalidate_cache(m_link);
     return 0;
   }
 
@@ -363,6 +363,7 @@ scx::ScriptRef* Article::script_method(const scx::ScriptAuth& auth,
       DEBUG_LOG_ERRNO("Cannot remove file '"+path.path()+"'");
       return scx::ScriptError::new_ref("Could not remove file");
     }
+    m_profile.invalidate_cache(m_link);
     return 0;
   }
 
@@ -418,4 +419,111 @@ scx::ScriptRef* Article::script_method(const scx::ScriptAuth& auth,
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
 
+
+//=========================================================================
+ArticleHandle::ArticleHandle(Profile& profile, int id)
+  : m_profile(profile),
+    m_id(id)
+{
+  m_parent = &m_profile;
+}
+
+//=========================================================================
+ArticleHandle::~ArticleHandle()
+{
+
+}
+
+//=========================================================================
+int ArticleHandle::get_id() const
+{
+  return m_id;
+}
+
+//=========================================================================
+scx::ScriptRef* ArticleHandle::get_meta(const std::string& name,
+					bool recurse) const
+{
+  return m_profile.get_meta(m_id,name,recurse);
+}
+
+//=========================================================================
+std::string ArticleHandle::get_string() const
+{
+  scx::ScriptRef* a_name = get_meta("path");
+  std::string name = BAD_SCRIPTREF(a_name) ? "" : a_name->object()->get_string();
+  delete a_name;
+  return name;
+}
+
+//=========================================================================
+scx::ScriptRef* ArticleHandle::script_op(const scx::ScriptAuth& auth,
+					 const scx::ScriptRef& ref,
+					 const scx::ScriptOp& op,
+					 const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("get_meta" == name ||
+	"lookup_meta" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    if ("id" == name) 
+      return scx::ScriptInt::new_ref(m_id);
+
+    if ("link" == name || "parent_id" == name) {
+      ArticleMetaStore::LinkIndexPtr index = 
+        m_profile.m_meta.get_link_index();
+      const ArticleLinkIndex::Entry* entry = index->find(m_id);
+      if (!entry) return scx::ScriptError::new_ref("No article");
+      if ("link" == name) return scx::ScriptString::new_ref(entry->link);
+      return scx::ScriptInt::new_ref(entry->parent);
+    }
+
+    if ("name" == name)
+      return scx::ScriptString::new_ref(get_string());
+
+    if ("title" == name) {
+      scx::ScriptRef* a_title = get_meta("title",false);
+      if (!BAD_SCRIPTREF(a_title)) {
+	std::string title = a_title->object()->get_string();
+	if (!title.empty()) {
+	  return a_title;
+	}
+      }
+      delete a_title;
+      return scx::ScriptString::new_ref(get_string());
+    }
+
+    if ("article" == name) {
+      return m_profile.lookup_article(m_id);
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=========================================================================
+scx::ScriptRef* ArticleHandle::script_method(const scx::ScriptAuth& auth,
+					     const scx::ScriptRef& ref,
+					     const std::string& name,
+					     const scx::ScriptRef* args)
+{
+  if (name == "get_meta" ||
+      name == "lookup_meta") {
+    const scx::ScriptString* a_name = 
+      scx::get_method_arg<scx::ScriptString>(args,0,"name");
+    if (!a_name) 
+      return scx::ScriptError::new_ref("No name specified");
+
+    return get_meta(a_name->get_string(),(name == "lookup_meta"));
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
 };
@@ -65,6 +65,7 @@ public:
   
   virtual ~Article();
 
+  int get_id() const;
   const std::string& get_name() const;
   const scx::FilePath& get_root() const;
   scx::FilePath get_filepath() const;
@@ -78,7 +79,7 @@ public:
   scx::ScriptRef* get_meta(const std::string& name,
 			   bool recurse=false) const;
 
-  const Heading* get_headings() const;
+  Document::HeadingPtr get_headings() const;
   std::string get_href_path() const;
   
   void refresh(const scx::Date& purge_time);
@@ -117,5 +118,43 @@ protected:
 
 };
 
+//=========================================================================
+// ArticleHandle - A lightweight reference to an article returned by article
+// queries, which answers metadata lookups from the profile's metadata store
+// and only loads the article itself when it is asked for
+//
+class ArticleHandle : public scx::ScriptObject {
+public:
+
+  ArticleHandle(Profile& profile, int id);
+  virtual ~ArticleHandle();
+
+  int get_id() const;
+
+  scx::ScriptRef* get_meta(const std::string& name,
+			   bool recurse=false) const;
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<ArticleHandle> Ref;
+
+protected:
+
+  Profile& m_profile;
+  int m_id;
+
+};
+
 };
 #endif
@@ -0,0 +1,764 @@
+/* SconeServer (http://www.sconemad.com)
+
+Sconesite article metadata store
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconesite/ArticleMetaStore.h>
+#include <sconex/ScriptTypes.h>
+#include <memory> // Using unique_ptr
+#include <algorithm>
+namespace scs {
+
+// Maximum number of properties to remember as unknown
+#define META_MAX_UNKNOWN 256
+
+//=========================================================================
+ArticleQuery::ArticleQuery()
+  : reverse(false),
+    offset(0),
+    limit(-1)
+{
+
+}
+
+//=========================================================================
+int ArticleLinkIndex::find_id(const std::string& link) const
+{
+  IdMap::const_iterator it = m_ids.find(link);
+  if (it == m_ids.end()) return 0;
+  return it->second;
+}
+
+//=========================================================================
+const ArticleLinkIndex::Entry* ArticleLinkIndex::find(int id) const
+{
+  EntryMap::const_iterator it = m_entries.find(id);
+  if (it == m_entries.end()) return 0;
+  return &it->second;
+}
+
+//=========================================================================
+int ArticleLinkIndex::size() const
+{
+  return m_entries.size();
+}
+
+
+//=========================================================================
+ArticleMetaStore::ArticleMetaStore(scx::Database* db)
+  : m_db(db),
+    m_loaded(false),
+    m_link_index(new ArticleLinkIndex()),
+    m_loads(0)
+{
+
+}
+
+//=========================================================================
+ArticleMetaStore::~ArticleMetaStore()
+{
+  for (RowMap::iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+    for (size_t i=0; i<it->second.values.size(); ++i) {
+      delete it->second.values[i];
+    }
+  }
+}
+
+//=========================================================================
+bool ArticleMetaStore::load()
+{
+  std::unique_ptr<scx::DbQuery> query(m_db->new_query(
+    "SELECT * FROM article"));
+  bool ok = query->exec(0);
+
+  scx::RWLocker locker(m_lock,true,scx::RWLock::Write);
+
+  for (RowMap::iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+    for (size_t i=0; i<it->second.values.size(); ++i) {
+      delete it->second.values[i];
+    }
+  }
+  m_rows.clear();
+  m_children.clear();
+  m_columns.clear();
+  m_column_map.clear();
+  m_unknown.clear();
+  clear_index(-1);
+  m_loaded = false;
+  if (!ok) {
+    build_link_index();
+    return false;
+  }
+
+  while (query->next_result()) {
+    scx::ScriptRef* row_ref = query->result();
+    scx::ScriptMap* row = dynamic_cast<scx::ScriptMap*>(row_ref->object());
+    if (row) read_row(*row);
+    delete row_ref;
+  }
+  compute_inherited(-1);
+  build_link_index();
+
+  m_loaded = true;
+  ++m_loads;
+  return true;
+}
+
+//=========================================================================
+bool ArticleMetaStore::loaded() const
+{
+  scx::RWLocker locker(m_lock);
+  return m_loaded;
+}
+
+//=========================================================================
+scx::ScriptRef* ArticleMetaStore::get(int id,
+                                      const std::string& property,
+                                      bool inherit,
+                                      bool& known) const
+{
+  scx::RWLocker locker(m_lock);
+  known = false;
+  if (!m_loaded) return 0;
+
+  ColumnMap::const_iterator it_c = m_column_map.find(property);
+  if (it_c == m_column_map.end()) {
+    known = (m_unknown.count(property) > 0);
+    return 0;
+  }
+  known = true;
+  int col = it_c->second;
+
+  RowMap::const_iterator it_r = m_rows.find(id);
+  if (it_r == m_rows.end()) return 0;
+
+  const scx::ScriptRef* value = it_r->second.values[col];
+  if (inherit && BAD_SCRIPTREF(value)) {
+    it_r = m_rows.find(it_r->second.inherited[col]);
+    if (it_r == m_rows.end()) return 0;
+    value = it_r->second.values[col];
+  }
+
+  if (!value) return 0;
+  return new scx::ScriptRef(value->object()->new_copy());
+}
+
+//=========================================================================
+bool ArticleMetaStore::valid_property(const std::string& property)
+{
+  if (property.empty()) return false;
+  for (std::string::size_type i = 0; i < property.size(); ++i) {
+    char c = property[i];
+    if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' ||
+          (i > 0 && c >= '0' && c <= '9'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//=========================================================================
+bool ArticleMetaStore::load_column(const std::string& property)
+{
+  // The name goes into the query, so it must be a plain identifier
+  if (!valid_property(property)) return false;
+
+  std::unique_ptr<scx::DbQuery> query(m_db->new_query(
+    "SELECT id,"+property+" FROM article"));
+  bool ok = query->exec(0);
+
+  scx::RWLocker locker(m_lock,true,scx::RWLock::Write);
+  if (!m_loaded) return false;
+  if (m_column_map.count(property)) return true;
+  if (!ok) {
+    add_unknown(property);
+    return false;
+  }
+
+  m_unknown.erase(property);
+  int col = add_column(property);
+  while (query->next_result()) {
+    scx::ScriptRef* row_ref = query->result_list();
+    scx::ScriptList* row = dynamic_cast<scx::ScriptList*>(row_ref->object());
+    const scx::ScriptRef* a_id = row ? row->get(0) : 0;
+    if (!BAD_SCRIPTREF(a_id) && row->size() == 2) {
+      RowMap::iterator it_r = m_rows.find(a_id->object()->get_int());
+      if (it_r != m_rows.end()) {
+        delete it_r->second.values[col];
+        it_r->second.values[col] = row->take(1);
+      }
+    }
+    delete row_ref;
+  }
+  clear_index(col);
+  compute_inherited(col);
+  return true;
+}
+
+//=========================================================================
+void ArticleMetaStore::set(int id,
+                           const std::string& property,
+                           const scx::ScriptRef* value)
+{
+  scx::RWLocker locker(m_lock,true,scx::RWLock::Write);
+  if (!m_loaded) return;
+
+  RowMap::iterator it_r = m_rows.find(id);
+  if (it_r == m_rows.end()) return;
+
+  m_unknown.erase(property);
+  int col = add_column(property);
+  Row& row = it_r->second;
+  delete row.values[col];
+  row.values[col] = value ? new scx::ScriptRef(value->object()->new_copy())
+                          : scx::ScriptError::new_ref("NULL");
+  clear_index(col);
+
+  // Only the article and its descendants can be affected
+  std::vector<int> ids;
+  if ("parent" == property) {
+    set_parent(id, value ? value->object()->get_int() : 0);
+    get_subtree(id,ids);
+    compute_inherited(-1,ids);
+    update_link_index(ids);
+  } else {
+    get_subtree(id,ids);
+    compute_inherited(col,ids);
+    if ("path" == property) update_link_index(ids);
+  }
+}
+
+//=========================================================================
+bool ArticleMetaStore::load_row(int id)
+{
+  std::unique_ptr<scx::DbQuery> query(m_db->new_query(
+    "SELECT * FROM article WHERE id = ?"));
+  scx::ScriptList::Ref args(new scx::ScriptList());
+  args.object()->give(scx::ScriptInt::new_ref(id));
+  query->exec(&args);
+
+  scx::RWLocker locker(m_lock,true,scx::RWLock::Write);
+  if (!m_loaded) return false;
+
+  bool found = false;
+  if (query->next_result()) {
+    scx::ScriptRef* row_ref = query->result();
+    scx::ScriptMap* row = dynamic_cast<scx::ScriptMap*>(row_ref->object());
+    if (row) {
+      read_row(*row);
+      found = true;
+    }
+    delete row_ref;
+  }
+  if (!found) return false;
+
+  // Only the article and its descendants can be affected
+  std::vector<int> ids;
+  get_subtree(id,ids);
+  clear_index(-1);
+  compute_inherited(-1,ids);
+  update_link_index(ids);
+  return true;
+}
+
+//=========================================================================
+void ArticleMetaStore::remove_row(int id)
+{
+  scx::RWLocker locker(m_lock,true,scx::RWLock::Write);
+  RowMap::iterator it_r = m_rows.find(id);
+  if (it_r == m_rows.end()) return;
+
+  // Any descendants are left without inherited values or links, but keep
+  // their parent id in case the article is reloaded
+  std::vector<int> ids;
+  get_subtree(id,ids);
+
+  for (size_t i=0; i<it_r->second.values.size(); ++i) {
+    delete it_r->second.values[i];
+  }
+  ChildMap::iterator it_ch = m_children.find(it_r->second.parent);
+  if (it_ch != m_children.end()) it_ch->second.erase(id);
+  m_rows.erase(it_r);
+
+  clear_index(-1);
+  compute_inherited(-1,ids);
+  update_link_index(ids);
+}
+
+//=========================================================================
+int ArticleMetaStore::query(const ArticleQuery& query,
+                            std::vector<int>& ids) const
+{
+  scx::RWLocker locker(m_lock);
+  if (!m_loaded) return 0;
+
+  // If no article has a value for the order property (i.e. it isn't a
+  // column) they are all ordered by id
+  ColumnMap::const_iterator it_c = m_column_map.find(query.order);
+  if (it_c == m_column_map.end()) it_c = m_column_map.find("id");
+  if (it_c == m_column_map.end()) return 0;
+  int order_col = it_c->second;
+
+  size_t first = std::max(query.offset,0);
+  size_t count = (query.limit < 0) ? m_rows.size() : query.limit;
+
+  if (query.match.empty()) {
+    // Read the page straight from the sorted index, with articles lacking
+    // a value following the others in either direction
+    const ColumnIndex& index = get_index(order_col,true);
+    size_t total = index.sorted.size() + index.nulls.size();
+    for (size_t i = first; i < total && ids.size() < count; ++i) {
+      if (i < index.sorted.size()) {
+        ids.push_back(query.reverse ? index.sorted[index.sorted.size()-1-i]
+                                    : index.sorted[i]);
+      } else {
+        size_t n = i - index.sorted.size();
+        ids.push_back(query.reverse ? index.nulls[index.nulls.size()-1-n]
+                                    : index.nulls[n]);
+      }
+    }
+    return total;
+  }
+
+  // Start with the smallest set of articles having one of the required
+  // values, then check the remaining values against each candidate
+  std::vector<int> match_cols;
+  const std::vector<int>* candidates = 0;
+  for (ArticleQuery::MatchList::const_iterator it_m = query.match.begin();
+       it_m != query.match.end(); ++it_m) {
+    it_c = m_column_map.find(it_m->first);
+    if (it_c == m_column_map.end()) return 0;
+    match_cols.push_back(it_c->second);
+
+    const ColumnIndex& index = get_index(it_c->second,false);
+    ColumnIndex::ValueMap::const_iterator it_v =
+      index.values.find(it_m->second);
+    if (it_v == index.values.end()) return 0;
+    if (!candidates || it_v->second.size() < candidates->size()) {
+      candidates = &it_v->second;
+    }
+  }
+
+  std::vector<int> matched;
+  for (std::vector<int>::const_iterator it_id = candidates->begin();
+       it_id != candidates->end(); ++it_id) {
+    const Row& row = m_rows.find(*it_id)->second;
+    bool ok = true;
+    for (size_t i=0; ok && i<match_cols.size(); ++i) {
+      const scx::ScriptRef* value = row.values[match_cols[i]];
+      ok = !BAD_SCRIPTREF(value) &&
+        value->object()->get_string() == query.match[i].second;
+    }
+    if (ok) matched.push_back(*it_id);
+  }
+
+  // Only the articles up to the end of the page need to be sorted
+  size_t total = matched.size();
+  if (first >= total) return total;
+  size_t last = std::min(total, first + count);
+  std::partial_sort(matched.begin(), matched.begin() + last, matched.end(),
+                    IdOrder(*this,order_col,query.reverse));
+  ids.insert(ids.end(), matched.begin() + first, matched.begin() + last);
+  return total;
+}
+
+//=========================================================================
+ArticleMetaStore::LinkIndexPtr ArticleMetaStore::get_link_index() const
+{
+  return std::atomic_load(&m_link_index);
+}
+
+//=========================================================================
+int ArticleMetaStore::num_rows() const
+{
+  scx::RWLocker locker(m_lock);
+  return m_rows.size();
+}
+
+//=========================================================================
+int ArticleMetaStore::num_columns() const
+{
+  scx::RWLocker locker(m_lock);
+  return m_columns.size();
+}
+
+//=========================================================================
+unsigned long ArticleMetaStore::num_loads() const
+{
+  scx::RWLocker locker(m_lock);
+  return m_loads;
+}
+
+//=========================================================================
+void ArticleMetaStore::read_row(const scx::ScriptMap& result)
+{
+  const scx::ScriptRef* a_id = result.lookup("id");
+  if (BAD_SCRIPTREF(a_id)) return;
+  int id = a_id->object()->get_int();
+
+  std::vector<std::string> keys;
+  result.keys(keys);
+  for (std::vector<std::string>::const_iterator it = keys.begin();
+       it != keys.end(); ++it) {
+    add_column(*it);
+  }
+
+  Row& row = m_rows[id];
+  for (size_t i=0; i<row.values.size(); ++i) {
+    delete row.values[i];
+  }
+  row.values.assign(m_columns.size(),0);
+  row.inherited.assign(m_columns.size(),0);
+
+  for (size_t i=0; i<m_columns.size(); ++i) {
+    const scx::ScriptRef* value = result.lookup(m_columns[i]);
+    if (value) row.values[i] = new scx::ScriptRef(value->object()->new_copy());
+  }
+
+  const scx::ScriptRef* a_parent = result.lookup("parent");
+  set_parent(id, BAD_SCRIPTREF(a_parent) ? 0 : a_parent->object()->get_int());
+}
+
+//=========================================================================
+int ArticleMetaStore::add_column(const std::string& name)
+{
+  ColumnMap::const_iterator it_c = m_column_map.find(name);
+  if (it_c != m_column_map.end()) return it_c->second;
+
+  int col = m_columns.size();
+  m_columns.push_back(name);
+  m_column_map[name] = col;
+  m_indexes.resize(m_columns.size());
+  for (RowMap::iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+    it->second.values.push_back(0);
+    it->second.inherited.push_back(0);
+  }
+  return col;
+}
+
+//=========================================================================
+void ArticleMetaStore::add_unknown(const std::string& property)
+{
+  if (m_unknown.size() >= META_MAX_UNKNOWN) m_unknown.clear();
+  m_unknown.insert(property);
+}
+
+//=========================================================================
+void ArticleMetaStore::set_parent(int id, int parent)
+{
+  Row& row = m_rows[id];
+  ChildMap::iterator it_ch = m_children.find(row.parent);
+  if (it_ch != m_children.end()) {
+    it_ch->second.erase(id);
+    if (it_ch->second.empty()) m_children.erase(it_ch);
+  }
+  row.parent = parent;
+  m_children[parent].insert(id);
+}
+
+//=========================================================================
+void ArticleMetaStore::get_subtree(int id, std::vector<int>& ids) const
+{
+  // Breadth first, so each article follows its parent. Articles already
+  // seen are skipped in case of a loop in the parent ids.
+  std::set<int> seen;
+  ids.push_back(id);
+  seen.insert(id);
+  for (size_t i=0; i<ids.size(); ++i) {
+    ChildMap::const_iterator it_ch = m_children.find(ids[i]);
+    if (it_ch == m_children.end()) continue;
+    for (std::set<int>::const_iterator it = it_ch->second.begin();
+         it != it_ch->second.end(); ++it) {
+      if (seen.insert(*it).second) ids.push_back(*it);
+    }
+  }
+}
+
+//=========================================================================
+void ArticleMetaStore::compute_inherited(int col, const std::vector<int>& ids)
+{
+  int first = (col < 0) ? 0 : col;
+  int last = (col < 0) ? (int)m_columns.size() - 1 : col;
+
+  for (std::vector<int>::const_iterator it = ids.begin();
+       it != ids.end(); ++it) {
+    RowMap::iterator it_r = m_rows.find(*it);
+    if (it_r == m_rows.end()) continue;
+    Row& row = it_r->second;
+    RowMap::const_iterator it_p = m_rows.find(row.parent);
+    if (row.parent == *it) it_p = m_rows.end();
+
+    // The parent's inherited value is already up to date, as it is either
+    // outside the subtree or precedes the article in it
+    for (int c = first; c <= last; ++c) {
+      if (!BAD_SCRIPTREF(row.values[c])) {
+        row.inherited[c] = *it;
+      } else {
+        row.inherited[c] = (it_p == m_rows.end()) ? 0 :
+          it_p->second.inherited[c];
+      }
+    }
+  }
+}
+
+//=========================================================================
+void ArticleMetaStore::compute_inherited(int col)
+{
+  int first = (col < 0) ? 0 : col;
+  int last = (col < 0) ? (int)m_columns.size() - 1 : col;
+  const int unknown = -1;
+
+  for (int c = first; c <= last; ++c) {
+    for (RowMap::iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+      it->second.inherited[c] = unknown;
+    }
+
+    std::vector<Row*> chain;
+    for (RowMap::iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+      // Walk up the ancestors until one is found with a value or whose
+      // inherited value is already known, then fill in the chain. The
+      // chain length is limited in case of a loop in the parent ids.
+      chain.clear();
+      int id = it->first;
+      int source = 0;
+      while (chain.size() <= m_rows.size()) {
+        RowMap::iterator it_p = m_rows.find(id);
+        if (it_p == m_rows.end()) break;
+        Row& row = it_p->second;
+        if (row.inherited[c] != unknown) {
+          source = row.inherited[c];
+          break;
+        }
+        if (!BAD_SCRIPTREF(row.values[c])) {
+          source = id;
+          break;
+        }
+        chain.push_back(&row);
+        id = row.parent;
+      }
+      for (size_t i=0; i<chain.size(); ++i) {
+        chain[i]->inherited[c] = source;
+      }
+      if (it->second.inherited[c] == unknown) {
+        it->second.inherited[c] = source;
+      }
+    }
+  }
+}
+
+//=========================================================================
+ArticleMetaStore::IdOrder::IdOrder(const ArticleMetaStore& store,
+                                   int col,
+                                   bool reverse)
+  : m_store(store),
+    m_col(col),
+    m_reverse(reverse)
+{
+
+}
+
+//=========================================================================
+bool ArticleMetaStore::IdOrder::operator()(int a, int b) const
+{
+  const scx::ScriptRef* a_ref = m_store.m_rows.find(a)->second.values[m_col];
+  const scx::ScriptRef* b_ref = m_store.m_rows.find(b)->second.values[m_col];
+
+  // Articles without a value come last whichever the direction
+  bool a_null = BAD_SCRIPTREF(a_ref);
+  bool b_null = BAD_SCRIPTREF(b_ref);
+  if (a_null != b_null) return b_null;
+  if (m_reverse) std::swap(a,b);
+  if (a_null) return a < b;
+
+  // Compare numerically if both values are integers, otherwise as strings
+  if (m_reverse) std::swap(a_ref,b_ref);
+  const scx::ScriptInt* a_int =
+    dynamic_cast<const scx::ScriptInt*>(a_ref->object());
+  const scx::ScriptInt* b_int =
+    dynamic_cast<const scx::ScriptInt*>(b_ref->object());
+  if (a_int && b_int) {
+    if (a_int->get_int() != b_int->get_int())
+      return a_int->get_int() < b_int->get_int();
+  } else {
+    int c = a_ref->object()->get_string().compare(
+      b_ref->object()->get_string());
+    if (c != 0) return c < 0;
+  }
+  return a < b;
+}
+
+//=========================================================================
+const ArticleMetaStore::ColumnIndex& ArticleMetaStore::get_index(
+  int col,
+  bool sorted
+) const
+{
+  // The index list is only resized by writers, so references to indexes
+  // remain valid while the store is locked
+  scx::MutexLocker locker(m_index_mutex);
+  ColumnIndex& index = m_indexes[col];
+
+  if (!sorted && !index.values_built) {
+    for (RowMap::const_iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+      const scx::ScriptRef* value = it->second.values[col];
+      if (!BAD_SCRIPTREF(value)) {
+        index.values[value->object()->get_string()].push_back(it->first);
+      }
+    }
+    for (ColumnIndex::ValueMap::iterator it = index.values.begin();
+         it != index.values.end(); ++it) {
+      std::sort(it->second.begin(), it->second.end());
+    }
+    index.values_built = true;
+  }
+
+  if (sorted && !index.sorted_built) {
+    for (RowMap::const_iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+      if (BAD_SCRIPTREF(it->second.values[col])) {
+        index.nulls.push_back(it->first);
+      } else {
+        index.sorted.push_back(it->first);
+      }
+    }
+    std::sort(index.sorted.begin(), index.sorted.end(),
+              IdOrder(*this,col,false));
+    std::sort(index.nulls.begin(), index.nulls.end());
+    index.sorted_built = true;
+  }
+
+  return index;
+}
+
+//=========================================================================
+void ArticleMetaStore::clear_index(int col)
+{
+  if (col < 0) {
+    m_indexes.assign(m_columns.size(),ColumnIndex());
+  } else if (col < (int)m_indexes.size()) {
+    m_indexes[col] = ColumnIndex();
+  }
+}
+
+//=========================================================================
+void ArticleMetaStore::build_link_index()
+{
+  ArticleLinkIndex* index = new ArticleLinkIndex();
+
+  ColumnMap::const_iterator it_c = m_column_map.find("path");
+  if (it_c != m_column_map.end()) {
+    int col = it_c->second;
+
+    // The root article has an empty link, other links are formed by
+    // appending the path to the parent's link
+    std::vector<int> chain;
+    for (RowMap::const_iterator it = m_rows.begin(); it != m_rows.end(); ++it) {
+      if (index->m_entries.count(it->first)) continue;
+
+      // Walk up to an article whose link is known, or the root
+      chain.clear();
+      int id = it->first;
+      std::string link;
+      bool found = false;
+      while (chain.size() <= m_rows.size()) {
+        ArticleLinkIndex::EntryMap::const_iterator it_e =
+          index->m_entries.find(id);
+        if (it_e != index->m_entries.end()) {
+          link = it_e->second.link;
+          found = true;
+          break;
+        }
+        RowMap::const_iterator it_r = m_rows.find(id);
+        if (it_r == m_rows.end()) break;
+        if (id == 1) {
+          ArticleLinkIndex::Entry& entry = index->m_entries[id];
+          entry.parent = it_r->second.parent;
+          index->m_ids[""] = id;
+          found = true;
+          break;
+        }
+        chain.push_back(id);
+        id = it_r->second.parent;
+      }
+      if (!found) continue;
+
+      // Fill in the links back down the chain
+      for (std::vector<int>::reverse_iterator it_ch = chain.rbegin();
+           it_ch != chain.rend(); ++it_ch) {
+        const Row& row = m_rows[*it_ch];
+        const scx::ScriptRef* path = row.values[col];
+        if (BAD_SCRIPTREF(path)) break;
+        link += path->object()->get_string() + "/";
+        ArticleLinkIndex::Entry& entry = index->m_entries[*it_ch];
+        entry.link = link;
+        entry.parent = row.parent;
+        index->m_ids[link] = *it_ch;
+      }
+    }
+  }
+
+  std::atomic_store(&m_link_index, LinkIndexPtr(index));
+}
+
+//=========================================================================
+void ArticleMetaStore::update_link_index(const std::vector<int>& ids)
+{
+  ArticleLinkIndex* index = new ArticleLinkIndex(*get_link_index());
+
+  for (std::vector<int>::const_iterator it = ids.begin();
+       it != ids.end(); ++it) {
+    ArticleLinkIndex::EntryMap::iterator it_e = index->m_entries.find(*it);
+    if (it_e == index->m_entries.end()) continue;
+    ArticleLinkIndex::IdMap::iterator it_id =
+      index->m_ids.find(it_e->second.link);
+    if (it_id != index->m_ids.end() && it_id->second == *it) {
+      index->m_ids.erase(it_id);
+    }
+    index->m_entries.erase(it_e);
+  }
+
+  ColumnMap::const_iterator it_c = m_column_map.find("path");
+  if (it_c != m_column_map.end()) {
+    int col = it_c->second;
+
+    // Parents outside the subtree keep their links, those inside it have
+    // already been recalculated
+    for (std::vector<int>::const_iterator it = ids.begin();
+         it != ids.end(); ++it) {
+      RowMap::const_iterator it_r = m_rows.find(*it);
+      if (it_r == m_rows.end()) continue;
+      const Row& row = it_r->second;
+      std::string link;
+      if (*it != 1) {
+        ArticleLinkIndex::EntryMap::const_iterator it_e =
+          index->m_entries.find(row.parent);
+        const scx::ScriptRef* path = row.values[col];
+        if (it_e == index->m_entries.end() || BAD_SCRIPTREF(path)) continue;
+        link = it_e->second.link + path->object()->get_string() + "/";
+      }
+      ArticleLinkIndex::Entry& entry = index->m_entries[*it];
+      entry.link = link;
+      entry.parent = row.parent;
+      index->m_ids[link] = *it;
+    }
+  }
+
+  std::atomic_store(&m_link_index, LinkIndexPtr(index));
+}
+
+};
@@ -0,0 +1,279 @@
+/* SconeServer (http://www.sconemad.com)
+
+Sconesite article metadata store
+
+An in-memory copy of the article table, loaded from the database in a
+single query and kept up to date as metadata is changed through the profile,
+so that metadata lookups (including when sorting articles) don't need to
+query the database. For each column, the article which provides the value
+inherited by each article (i.e. itself or its nearest ancestor with a value)
+is precomputed.
+
+The store also maintains an index mapping article links to ids and back,
+which is rebuilt whenever articles are added, moved or removed. Each index
+is immutable once published, so readers can use it without locking.
+
+Articles can be queried by metadata value, ordered by a property and paged
+using an offset and limit. Indexes of the values of each column are built
+when first queried and discarded when the column changes, so that a page of
+results can be found without examining every article.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef scsArticleMetaStore_h
+#define scsArticleMetaStore_h
+
+#include <sconex/ScriptTypes.h>
+#include <sconex/Database.h>
+#include <sconex/Mutex.h>
+#include <memory>
+namespace scs {
+
+//=========================================================================
+// ArticleLinkIndex - Maps article links (i.e. "blog/post/") to ids and back
+//
+class ArticleLinkIndex {
+public:
+
+  struct Entry {
+    std::string link;
+    int parent;
+  };
+
+  // Find the article with the specified link, returns 0 if none
+  int find_id(const std::string& link) const;
+
+  // Find the link and parent for an article, returns NULL if none
+  const Entry* find(int id) const;
+
+  int size() const;
+
+private:
+
+  friend class ArticleMetaStore;
+
+  typedef HASH_TYPE<std::string,int> IdMap;
+  IdMap m_ids;
+
+  typedef HASH_TYPE<int,Entry> EntryMap;
+  EntryMap m_entries;
+};
+
+//=========================================================================
+// ArticleQuery - Criteria for selecting a page of articles from the store
+//
+struct ArticleQuery {
+  ArticleQuery();
+
+  // Properties which the articles must have the specified value for
+  // (compared as strings)
+  typedef std::vector<std::pair<std::string,std::string> > MatchList;
+  MatchList match;
+
+  // Property to order the articles by (ascending, or descending if reverse
+  // is set), articles without a value for it come last. Articles with equal
+  // values are ordered by id.
+  std::string order;
+  bool reverse;
+
+  // Number of matching articles to skip, and maximum number to return
+  // (or -1 for no limit)
+  int offset;
+  int limit;
+};
+
+//=========================================================================
+// ArticleMetaStore
+//
+class ArticleMetaStore {
+public:
+
+  ArticleMetaStore(scx::Database* db);
+
+  ~ArticleMetaStore();
+
+  // Load the whole article table from the database, replacing any
+  // existing contents. Returns false if the table could not be read, in
+  // which case lookups are not answered until it is loaded successfully.
+  bool load();
+
+  // Is the table loaded
+  bool loaded() const;
+
+  // Get a copy of a metadata value for an article, or NULL if the article
+  // has no such value. If inherit is set, the value from the nearest
+  // ancestor is returned if the article has no value itself.
+  // known is set to false if the store can't answer, because the table
+  // isn't loaded or the property hasn't been looked up in the database.
+  scx::ScriptRef* get(int id,
+                      const std::string& property,
+                      bool inherit,
+                      bool& known) const;
+
+  // Is a property name safe to use as a column name in SQL, i.e. a plain
+  // identifier
+  static bool valid_property(const std::string& property);
+
+  // Read the values of a property for all articles from the database and
+  // add it as a column, i.e. for a column added since the table was loaded.
+  // Properties which aren't valid names are never looked up. If the
+  // database can't answer, the property is
+  // recorded as unknown so that lookups for it are answered as NULL without
+  // consulting the database again. Both are forgotten when the table is
+  // next loaded. Returns false if the property isn't available.
+  bool load_column(const std::string& property);
+
+  // Update a metadata value after it has been set in the database
+  void set(int id,
+           const std::string& property,
+           const scx::ScriptRef* value);
+
+  // Reload a single article's row after it has been added or changed in
+  // the database
+  bool load_row(int id);
+
+  // Remove an article's row after it has been removed from the database
+  void remove_row(int id);
+
+  // Find the ids of articles matching a query, returns the total number of
+  // matching articles (ignoring the offset and limit)
+  int query(const ArticleQuery& query, std::vector<int>& ids) const;
+
+  // Get the current link index, this remains valid for as long as the
+  // pointer is held, even if the index is replaced
+  typedef std::shared_ptr<const ArticleLinkIndex> LinkIndexPtr;
+  LinkIndexPtr get_link_index() const;
+
+  // Statistics
+  int num_rows() const;
+  int num_columns() const;
+  unsigned long num_loads() const;
+
+private:
+
+  // Read a row from a query result into the table (store must be locked
+  // for writing)
+  void read_row(const scx::ScriptMap& result);
+
+  // Get the index of a column, adding it if required (store must be
+  // locked for writing)
+  int add_column(const std::string& name);
+
+  // Record a property which isn't a column (store must be locked for
+  // writing)
+  void add_unknown(const std::string& property);
+
+  // Set an article's parent, keeping the child lists up to date (store
+  // must be locked for writing)
+  void set_parent(int id, int parent);
+
+  // Get an article and all its descendants, each following its parent
+  // (store must be locked)
+  void get_subtree(int id, std::vector<int>& ids) const;
+
+  // Recalculate the inherited values for one column, or for all columns
+  // if col is negative (store must be locked for writing)
+  void compute_inherited(int col);
+
+  // Recalculate the inherited values for the specified articles, which
+  // must follow their parents (store must be locked for writing)
+  void compute_inherited(int col, const std::vector<int>& ids);
+
+  // Build and publish a new link index (store must be locked for writing)
+  void build_link_index();
+
+  // Publish a copy of the link index with the links for the specified
+  // articles, which must follow their parents, recalculated (store must be
+  // locked for writing)
+  void update_link_index(const std::vector<int>& ids);
+
+  // Orders article ids by the value of a column, with articles which have
+  // no value last (store must be locked)
+  class IdOrder {
+  public:
+    IdOrder(const ArticleMetaStore& store, int col, bool reverse);
+    bool operator()(int a, int b) const;
+  private:
+    const ArticleMetaStore& m_store;
+    int m_col;
+    bool m_reverse;
+  };
+
+  // Get the value index for a column, building it if required (store must
+  // be locked)
+  struct ColumnIndex;
+  const ColumnIndex& get_index(int col, bool sorted) const;
+
+  // Discard the value indexes for one column, or for all columns if col is
+  // negative (store must be locked for writing)
+  void clear_index(int col);
+
+  scx::Database* m_db;
+
+  mutable scx::RWLock m_lock;
+  bool m_loaded;
+
+  typedef std::vector<std::string> ColumnList;
+  ColumnList m_columns;
+  typedef HASH_TYPE<std::string,int> ColumnMap;
+  ColumnMap m_column_map;
+
+  struct Row {
+    int parent;
+    std::vector<scx::ScriptRef*> values;
+    // For each column, the id of the article providing the inherited
+    // value, or 0 if there isn't one
+    std::vector<int> inherited;
+  };
+  typedef HASH_TYPE<int,Row> RowMap;
+  RowMap m_rows;
+
+  // Child article ids for each parent id
+  typedef HASH_TYPE<int,std::set<int> > ChildMap;
+  ChildMap m_children;
+
+  // Properties known not to be columns, limited in size as these may come
+  // from arbitrary requests
+  std::set<std::string> m_unknown;
+
+  // Query indexes for each column, built on demand by readers under the
+  // index mutex
+  struct ColumnIndex {
+    ColumnIndex() : values_built(false), sorted_built(false) {};
+
+    // Ids of articles having each value, in id order
+    bool values_built;
+    typedef HASH_TYPE<std::string,std::vector<int> > ValueMap;
+    ValueMap values;
+
+    // Ids of articles with a value in value order, and those without
+    bool sorted_built;
+    std::vector<int> sorted;
+    std::vector<int> nulls;
+  };
+  mutable scx::Mutex m_index_mutex;
+  mutable std::vector<ColumnIndex> m_indexes;
+
+  // Current link index, accessed atomically
+  LinkIndexPtr m_link_index;
+
+  unsigned long m_loads;
+};
+
+};
+#endif
@@ -0,0 +1,270 @@
+/* SconeServer (http://www.sconemad.com)
+
+UNIT TESTS for ArticleMetaStore
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconesite/ArticleMetaStore.h>
+#include <sconex/UnitTester.h>
+using namespace scs;
+
+// In-memory article table, answering only the queries made by the store
+class TestDatabase : public scx::Database {
+public:
+  TestDatabase() : fail(false) {};
+  virtual ~TestDatabase() {
+    for (size_t i=0; i<rows.size(); ++i) delete rows[i];
+  };
+
+  virtual scx::DbQuery* new_query(const std::string& query);
+
+  // Add an article row, returning it so further values can be added
+  scx::ScriptMap* add(int id, int parent, const std::string& path) {
+    scx::ScriptMap* row = new scx::ScriptMap();
+    row->give("id",scx::ScriptInt::new_ref(id));
+    row->give("parent",scx::ScriptInt::new_ref(parent));
+    row->give("path",scx::ScriptString::new_ref(path));
+    rows.push_back(row);
+    return row;
+  };
+
+  bool has_column(const std::string& name) const {
+    for (size_t i=0; i<rows.size(); ++i) {
+      if (rows[i]->lookup(name)) return true;
+    }
+    return false;
+  };
+
+  std::vector<scx::ScriptMap*> rows;
+  bool fail;
+};
+
+class TestQuery : public scx::DbQuery {
+public:
+  TestQuery(const TestDatabase& db, const std::string& sql)
+    : m_db(db), m_sql(sql), m_pos(-1) {};
+
+  virtual bool exec(const scx::ScriptRef* args) {
+    m_results.clear();
+    m_pos = -1;
+    if (m_db.fail) return false;
+
+    // "SELECT id,<column> FROM article" reads a single column
+    const std::string select_column = "SELECT id,";
+    if (0 == m_sql.find(select_column)) {
+      std::string::size_type end = m_sql.find(" FROM");
+      m_column = m_sql.substr(select_column.size(),
+                              end - select_column.size());
+      if (!m_db.has_column(m_column)) return false;
+    }
+
+    int id = 0;
+    if (std::string::npos != m_sql.find("WHERE id = ?")) {
+      const scx::ScriptList* list =
+        dynamic_cast<const scx::ScriptList*>(args->object());
+      id = list->get(0)->object()->get_int();
+    }
+    for (size_t i=0; i<m_db.rows.size(); ++i) {
+      if (!id || m_db.rows[i]->lookup("id")->object()->get_int() == id) {
+        m_results.push_back(m_db.rows[i]);
+      }
+    }
+    return true;
+  };
+
+  virtual bool next_result() {
+    return ++m_pos < (int)m_results.size();
+  };
+
+  virtual scx::ScriptRef* result() const {
+    return new scx::ScriptRef(m_results[m_pos]->new_copy());
+  };
+
+  virtual scx::ScriptRef* result_list() const {
+    scx::ScriptList* list = new scx::ScriptList();
+    const scx::ScriptRef* id = m_results[m_pos]->lookup("id");
+    const scx::ScriptRef* value = m_results[m_pos]->lookup(m_column);
+    list->give(new scx::ScriptRef(id->object()->new_copy()));
+    list->give(value ? new scx::ScriptRef(value->object()->new_copy())
+                     : scx::ScriptError::new_ref("NULL"));
+    return new scx::ScriptRef(list);
+  };
+
+  virtual int insert_id() const { return 0; };
+
+private:
+  const TestDatabase& m_db;
+  std::string m_sql;
+  std::string m_column;
+  std::vector<const scx::ScriptMap*> m_results;
+  int m_pos;
+};
+
+scx::DbQuery* TestDatabase::new_query(const std::string& query)
+{
+  return new TestQuery(*this,query);
+}
+
+// Get a metadata value as a string, or "NULL" if there isn't one
+static std::string meta(const ArticleMetaStore& store, int id,
+                        const std::string& property, bool inherit)
+{
+  bool known = false;
+  scx::ScriptRef* value = store.get(id,property,inherit,known);
+  std::string str = value ? value->object()->get_string() : "NULL";
+  delete value;
+  return known ? str : "UNKNOWN";
+}
+
+// Run a query, returning the ids as a string, i.e. "4,3,5"
+static std::string query(const ArticleMetaStore& store,
+                         const std::string& parent,
+                         const std::string& order,
+                         bool reverse,
+                         int offset = 0,
+                         int limit = -1)
+{
+  ArticleQuery q;
+  if (!parent.empty()) q.match.push_back(std::make_pair("parent",parent));
+  q.order = order;
+  q.reverse = reverse;
+  q.offset = offset;
+  q.limit = limit;
+  std::vector<int> ids;
+  store.query(q,ids);
+  std::ostringstream oss;
+  for (size_t i=0; i<ids.size(); ++i) oss << (i ? "," : "") << ids[i];
+  return oss.str();
+}
+
+void ArticleMetaStore_ut()
+{
+  TestDatabase* db = new TestDatabase();
+  scx::Database::Ref db_ref(db);
+
+  db->add(1,0,"")->give("title",scx::ScriptString::new_ref("Home"));
+  db->add(2,1,"blog")->give("title",scx::ScriptString::new_ref("Blog"));
+  db->add(3,2,"a")->give("date",scx::ScriptInt::new_ref(30));
+  db->add(4,2,"b")->give("date",scx::ScriptInt::new_ref(10));
+  db->add(5,2,"c");
+  db->add(6,1,"about")->give("date",scx::ScriptInt::new_ref(20));
+
+  UTSEC("load");
+  ArticleMetaStore store(db);
+  UTEST(!store.loaded());
+  UTEST(meta(store,3,"title",true) == "UNKNOWN");
+  UTCOD(db->fail = true);
+  UTEST(!store.load());
+  UTEST(!store.loaded());
+  UTCOD(db->fail = false);
+  UTEST(store.load());
+  UTEST(store.loaded());
+  UTEST(store.num_rows() == 6);
+
+  UTSEC("get");
+  UTEST(meta(store,2,"title",false) == "Blog");
+  UTEST(meta(store,3,"title",false) == "NULL");
+  UTMSG("inherited");
+  UTEST(meta(store,3,"title",true) == "Blog");
+  UTEST(meta(store,6,"title",true) == "Home");
+  UTEST(meta(store,1,"date",true) == "NULL");
+  UTMSG("not a column");
+  UTEST(meta(store,3,"author",true) == "UNKNOWN");
+
+  UTSEC("query");
+  UTMSG("children, ordered with no value last in either direction");
+  UTEST(query(store,"2","date",false) == "4,3,5");
+  UTEST(query(store,"2","date",true) == "3,4,5");
+  UTEST(query(store,"2","date",false,1,1) == "3");
+  UTEST(query(store,"2","date",false,5) == "");
+  UTMSG("all articles");
+  UTEST(query(store,"","date",false) == "4,6,3,1,2,5");
+  UTEST(query(store,"","date",true,0,2) == "3,6");
+  UTMSG("ordered by a missing column uses the id");
+  UTEST(query(store,"","author",false) == "1,2,3,4,5,6");
+  UTMSG("no matches");
+  UTEST(query(store,"99","date",false) == "");
+  UTEST(query(store,"5","date",false) == "");
+
+  UTSEC("link index");
+  ArticleMetaStore::LinkIndexPtr links = store.get_link_index();
+  UTEST(links->find_id("") == 1);
+  UTEST(links->find_id("blog/") == 2);
+  UTEST(links->find_id("blog/c/") == 5);
+  UTEST(links->find_id("about/") == 6);
+  UTEST(links->find_id("blog") == 0);
+  UTEST(links->find(3) && links->find(3)->link == "blog/a/");
+  UTEST(links->find(3) && links->find(3)->parent == 2);
+
+  UTSEC("load column");
+  UTMSG("added to the database since loading");
+  UTCOD(db->rows[3]->give("author",scx::ScriptString::new_ref("fred")));
+  UTEST(store.load_column("author"));
+  UTEST(meta(store,4,"author",false) == "fred");
+  UTEST(meta(store,3,"author",true) == "NULL");
+  UTEST(query(store,"","author",false) == "4,1,2,3,5,6");
+  UTMSG("not in the database");
+  UTEST(!store.load_column("nosuch"));
+  UTEST(meta(store,4,"nosuch",false) == "NULL");
+  UTMSG("not a plain identifier");
+  UTEST(ArticleMetaStore::valid_property("date_2"));
+  UTEST(ArticleMetaStore::valid_property("_x"));
+  UTEST(!ArticleMetaStore::valid_property(""));
+  UTEST(!ArticleMetaStore::valid_property("2date"));
+  UTEST(!ArticleMetaStore::valid_property("title FROM user --"));
+  UTEST(!ArticleMetaStore::valid_property("id,path"));
+  UTEST(!store.load_column("path FROM article; --"));
+  UTEST(meta(store,4,"path FROM article; --",false) == "UNKNOWN");
+
+  UTSEC("set");
+  UTCOD(scx::ScriptRef* path = scx::ScriptString::new_ref("news"));
+  UTCOD(store.set(2,"path",path));
+  links = store.get_link_index();
+  UTEST(links->find_id("blog/a/") == 0);
+  UTEST(links->find_id("news/a/") == 3);
+  UTEST(links->find_id("about/") == 6);
+  UTCOD(store.set(2,"title",0));
+  UTEST(meta(store,3,"title",true) == "Home");
+  UTMSG("move under another article");
+  UTCOD(scx::ScriptRef* parent = scx::ScriptInt::new_ref(6));
+  UTCOD(store.set(2,"parent",parent));
+  UTEST(store.get_link_index()->find_id("about/news/b/") == 4);
+  UTEST(meta(store,5,"date",true) == "20");
+  UTEST(query(store,"6","date",false) == "2");
+  delete path;
+  delete parent;
+
+  UTSEC("remove");
+  UTCOD(store.remove_row(2));
+  UTEST(store.num_rows() == 5);
+  links = store.get_link_index();
+  UTEST(links->find(2) == 0);
+  UTEST(links->find_id("about/news/a/") == 0);
+  UTEST(links->find_id("about/") == 6);
+  UTEST(meta(store,3,"date",true) == "30");
+  UTEST(meta(store,5,"date",true) == "NULL");
+  UTEST(query(store,"6","date",false) == "");
+
+  UTSEC("load row");
+  UTCOD(delete db->rows[1]; db->rows.erase(db->rows.begin()+1));
+  UTCOD(db->add(7,6,"faq"));
+  UTEST(store.load_row(7));
+  UTEST(store.get_link_index()->find_id("about/faq/") == 7);
+  UTEST(meta(store,7,"date",true) == "20");
+  UTEST(!store.load_row(99));
+}
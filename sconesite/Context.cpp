@@ -49,6 +49,12 @@ bool Context::handle_doc_end(Document* doc)
   return false;
 }
 
+//=========================================================================
+void Context::handle_markup(const std::string& markup)
+{
+  handle_text(markup.c_str());
+}
+
 //=========================================================================
 Document* Context::get_current_doc()
 {
@@ -55,6 +55,10 @@ public:
 
   virtual void handle_text(const char* text) =0;
 
+  // Handle a block of markup which the document has already rendered,
+  // (i.e. text and elements which don't need handling individually)
+  virtual void handle_markup(const std::string& markup);
+
   virtual void handle_comment(const char* text) =0;
 
 protected:
@@ -27,7 +27,6 @@ Free Software Foundation, Inc.,
 #include <sconex/Log.h>
 namespace scs {
 
-scx::Mutex* Document::m_clients_mutex = 0;
 scx::ProviderScheme<Document>* Document::s_document_providers = 0;
 
 //=========================================================================
@@ -72,18 +71,19 @@ Document::Document(const std::string& name,
   : m_name(name),
     m_root(root),
     m_file(file),
-    m_clients(0),
     m_opening(false),
-    m_headings(1,name,0)
+    m_watch(0),
+    m_stale(true),
+    m_headings(1,name,0),
+    m_prerendered(false)
 {
-  if (!m_clients_mutex) {
-    m_clients_mutex = new scx::Mutex();
-  }
+
 }
 
 //=========================================================================
 Document::~Document()
 {
+  delete m_watch;
 }
 
 //=========================================================================
@@ -111,23 +111,30 @@ scx::FilePath Document::get_filepath() const
 }
 
 //=========================================================================
-const Heading& Document::get_headings() const
+Document::HeadingPtr Document::get_headings() const
 {
-  const_cast<Document*>(this)->open();
-  return m_headings; 
+  VersionPtr version = const_cast<Document*>(this)->open();
+
+  // The empty headings of an unloaded document last as long as the
+  // document, so aren't owned by the pointer
+  if (!version) return HeadingPtr(HeadingPtr(),&m_headings);
+  return HeadingPtr(version,&version->m_headings);
 }
 
 //=========================================================================
-const Document::ErrorList& Document::get_errors() const
+Document::ErrorList Document::get_errors() const
 {
-  return m_errors; 
+  // Replaced under the lock when a new version is opened
+  scx::MutexLocker locker(m_mutex);
+  return m_errors;
 }
 
 //=========================================================================
 void Document::log_errors() const
 {
-  for (ErrorList::const_iterator it = m_errors.begin();
-       it != m_errors.end(); ++it) {
+  ErrorList errors = get_errors();
+  for (ErrorList::const_iterator it = errors.begin();
+       it != errors.end(); ++it) {
     scx::Log log("sconesite.doc");
     log.attach("file", get_filepath().path());
     log.submit(*it);
@@ -137,33 +144,28 @@ void Document::log_errors() const
 //=========================================================================
 bool Document::purge(const scx::Date& purge_time)
 {
-  if (!is_open()) return false;
+  VersionPtr version;
+  scx::MutexLocker locker(m_mutex);
+  if (!m_version || m_opening) return false;
   if (m_last_access > purge_time) return false;
 
-  scx::MutexLocker locker(*m_clients_mutex);
-  if (m_clients > 0) return false;
+  // Unload the current version, forcing the file to be checked (and so
+  // loaded) when the document is next used
+  version.swap(m_version);
+  m_stale = true;
   locker.unlock();
 
   DEBUG_LOG("Purging " + get_filepath().path());
-  handle_close();
   return true;
 }
 
 //=========================================================================
 bool Document::process(Context& context)
 {
-  m_clients_mutex->lock();
-  ++m_clients;
-  m_clients_mutex->unlock();
-
-  bool success = false;
-  if (open()) success = handle_process(context);
-
-  m_clients_mutex->lock();
-  --m_clients;
-  m_clients_mutex->unlock();
-  
-  return success;
+  // The version is held until processing is finished
+  VersionPtr version = open();
+  if (!version) return false;
+  return version->handle_process(context);
 }
 
 //=========================================================================
@@ -172,6 +174,140 @@ void Document::report_error(const std::string& error)
   m_errors.push_back(error);
 }
 
+//=========================================================================
+bool Document::is_dynamic_element(const std::string& name)
+{
+  // Elements which RenderMarkupContext modifies or interprets, or whose
+  // output depends on the article being rendered
+  return (name == "article" || name == "template" ||
+          name == "if" || name == "section" ||
+          name == "a" || name == "area" || name == "img" ||
+          name == "html" ||
+          name == "h1" || name == "h2" || name == "h3" ||
+          name == "h4" || name == "h5" || name == "h6");
+}
+
+//=========================================================================
+void Document::compile_start_tag(std::string& markup,
+                                 const std::string& name,
+                                 const NodeAttrs& attrs,
+                                 bool empty)
+{
+  markup += "<" + name;
+  for (NodeAttrs::const_iterator it = attrs.begin();
+       it != attrs.end();
+       ++it) {
+    markup += " " + it->first + "=\"" + it->second + "\"";
+  }
+  markup += (empty ? "/>" : ">");
+}
+
+//=========================================================================
+void Document::compile_markup(std::string& markup)
+{
+  if (markup.empty()) return;
+  RenderOp op;
+  op.type = RenderOp::Markup;
+  op.text = markup;
+  op.empty = true;
+  op.line = 0;
+  op.data = 0;
+  op.jump = 0;
+  m_plan.push_back(op);
+  markup.clear();
+}
+
+//=========================================================================
+size_t Document::compile_start(const std::string& name,
+                               const NodeAttrs& attrs,
+                               bool empty,
+                               int line,
+                               void* data)
+{
+  RenderOp op;
+  op.type = RenderOp::Start;
+  op.name = name;
+  op.attrs = attrs;
+  op.empty = empty;
+  op.line = line;
+  op.data = data;
+  op.jump = 0;
+  m_plan.push_back(op);
+  return m_plan.size() - 1;
+}
+
+//=========================================================================
+void Document::compile_end(size_t start_index)
+{
+  RenderOp op = m_plan[start_index];
+  op.type = RenderOp::End;
+  op.attrs.clear();
+  op.jump = start_index;
+  m_plan[start_index].jump = m_plan.size();
+  m_plan.push_back(op);
+}
+
+//=========================================================================
+void Document::prerender()
+{
+  m_markup.clear();
+  m_prerendered = false;
+
+  // Dynamic elements are rewritten by the context (i.e. links and heading
+  // anchors), so only plans made up entirely of markup can be pre-rendered
+  for (RenderPlan::const_iterator it = m_plan.begin();
+       it != m_plan.end(); ++it) {
+    if (it->type != RenderOp::Markup) {
+      m_markup.clear();
+      return;
+    }
+    m_markup += it->text;
+  }
+  m_prerendered = true;
+}
+
+//=========================================================================
+void Document::run_plan(Context& context)
+{
+  // The context may modify an element's attributes in handle_start and
+  // sees the same attributes in handle_end, so each element being rendered
+  // gets its own copy
+  std::vector<NodeAttrs> attrs;
+
+  size_t n = m_plan.size();
+  for (size_t i=0; i<n; ++i) {
+    const RenderOp& op = m_plan[i];
+    switch (op.type) {
+
+      case RenderOp::Markup: {
+        context.handle_markup(op.text);
+      } break;
+
+      case RenderOp::Start: {
+        attrs.push_back(op.attrs);
+        if (!context.handle_start(op.name,attrs.back(),op.empty,op.data)) {
+          // Skip the contents and end
+          attrs.pop_back();
+          i = op.jump;
+        }
+      } break;
+
+      case RenderOp::End: {
+        if (context.handle_end(op.name,attrs.back(),op.data)) {
+          // Repeat the contents
+          i = op.jump;
+        } else {
+          attrs.pop_back();
+        }
+      } break;
+
+      case RenderOp::Process: {
+        context.handle_process(op.name,op.text.c_str(),op.line,op.data);
+      } break;
+    }
+  }
+}
+
 //=========================================================================
 void Document::register_document_type(const std::string& type,
 				      scx::Provider<Document>* factory)
@@ -220,6 +356,13 @@ scx::ScriptRef* Document::script_op(const scx::ScriptAuth& auth,
       return scx::ScriptString::new_ref(m_name);
     }
 
+    if ("markup" == name) {
+      // The pre-rendered markup for the current version, if available
+      VersionPtr version = open();
+      if (!version || !version->m_prerendered) return 0;
+      return scx::ScriptString::new_ref(version->m_markup);
+    }
+
     if ("modtime" == name) {
       return new scx::ScriptRef(scx::FileStat(get_filepath()).time().new_copy());
     }
@@ -229,43 +372,67 @@ scx::ScriptRef* Document::script_op(const scx::ScriptAuth& auth,
 }
 
 //=========================================================================
-bool Document::open()
+Document::VersionPtr Document::open()
 {
+  scx::MutexLocker locker(m_mutex);
   m_last_access = scx::Date::now();
 
-  m_clients_mutex->lock();
-  bool open_wait = m_opening;
-  if (!m_opening) m_opening = true;
-  m_clients_mutex->unlock();
-  
-  if (open_wait) {
-    // Doc is being opened in another thread, wait for it to complete
-    DEBUG_LOG("Document::Open() Waiting for another thread to complete");
-    while (m_opening) { };
-    DEBUG_LOG("Document::Open() Other thread finished open, continuing");
-    return is_open();
+  while (m_opening) {
+    // Another thread is checking the file, use the current version if there
+    // is one, otherwise wait for it to be loaded
+    if (m_version) return m_version;
+    m_opened.wait(m_mutex);
+  }
+
+  if (!m_watch) m_watch = new scx::FileWatch(get_filepath());
+  if (!m_watch->changed() && !m_stale) {
+    // Unchanged since last checked
+    return m_version;
   }
- 
-  bool opened = is_open();
-  scx::FilePath path = get_filepath();
-  scx::FileStat stat(path);
-  if (stat.is_file()) {
-    if (!opened || m_modtime != stat.time()) {
-      if (opened) handle_close();
-      m_errors.clear();
-      m_headings.clear();
-      opened = handle_open();
-      m_modtime = stat.time();
+  m_opening = true;
+  m_stale = false;
+  bool loaded = (m_version != 0);
+
+  // If changes are being notified then the file is reloaded whenever it
+  // changes, otherwise only if its modification time has changed
+  bool notified = m_watch->monitored();
+  scx::Date modtime = m_modtime;
+  locker.unlock();
+
+  // Check and load the file without holding the lock
+  VersionPtr version;
+  ErrorList errors;
+  bool changed = false;
+  scx::FileStat stat(get_filepath());
+  if (!stat.is_file()) {
+    changed = loaded;
+  } else if (!loaded || notified || modtime != stat.time()) {
+    changed = true;
+    modtime = stat.time();
+    Document* doc = new_version();
+    bool opened = doc->handle_open() && doc->is_open();
+    errors = doc->m_errors;
+    if (opened) {
+      version.reset(doc);
+    } else {
+      delete doc;
     }
-  } else {
-    handle_close();
   }
 
-  m_clients_mutex->lock();
+  locker.lock();
+  if (changed) {
+    // The previous version is released once any threads processing it
+    // have finished
+    version.swap(m_version);
+    m_modtime = modtime;
+    m_errors = errors;
+  }
   m_opening = false;
-  m_clients_mutex->unlock();
+  m_opened.broadcast();
+  VersionPtr current = m_version;
+  locker.unlock();
 
-  return opened;
+  return current;
 }
 
 void Document::init()
@@ -24,11 +24,13 @@ Free Software Foundation, Inc.,
 
 #include <sconesite/Heading.h>
 #include <sconex/FilePath.h>
+#include <sconex/FileWatcher.h>
 #include <sconex/Date.h>
 #include <sconex/ScriptBase.h>
 #include <sconex/ScriptTypes.h>
 #include <sconex/Mutex.h>
 #include <sconex/Provider.h>
+#include <memory>
 namespace scs {
 
 class Context;
@@ -65,17 +67,20 @@ public:
   // Get the full path of the document's file
   scx::FilePath get_filepath() const;
 
-  // Get document headings
-  const Heading& get_headings() const;
+  // Get document headings. These belong to the loaded version of the
+  // document, which is kept for as long as the pointer is held.
+  typedef std::shared_ptr<const Heading> HeadingPtr;
+  HeadingPtr get_headings() const;
 
-  // Get document parse errors
-  const ErrorList& get_errors() const;
+  // Get a copy of the document parse errors
+  ErrorList get_errors() const;
   
   // Log any reported errors in processing the document
   void log_errors() const;
 
-  // Close the document if it isn't being processed and it was last
-  // accessed over purge_time ago. Designed to free up memory.
+  // Unload the document if it was last accessed over purge_time ago.
+  // Designed to free up memory. Any processing which is using the document
+  // continues to use the unloaded version until it finishes.
   bool purge(const scx::Date& purge_time);
 
   // Process the document within the specified context
@@ -87,7 +92,7 @@ public:
   static void unregister_document_type(const std::string& type,
 				       scx::Provider<Document>* factory);
   static const scx::ProviderScheme<Document>* get_document_providers();
-  
+
   // ScriptObject methods
   virtual std::string get_string() const;
 
@@ -100,11 +105,70 @@ public:
 
 protected:
 
-  bool open();
+  // Each time a document's file changes, a new instance of the document is
+  // created and opened to hold the new version, replacing the previous
+  // version once it has loaded. Threads processing the document continue
+  // to use the version they started with, so are not held up by reloading.
+  typedef std::shared_ptr<Document> VersionPtr;
+
+  // Get the current version of the document, loading it if required or if
+  // the file has changed. Returns NULL if the document couldn't be loaded.
+  VersionPtr open();
+
+  // Create a new unopened instance of the same type for the same file
+  virtual Document* new_version() const =0;
 
   // Report an error in processing the document
   void report_error(const std::string& error);
 
+  // Documents are compiled into a linear render plan when opened, in which
+  // text and ordinary elements are pre-rendered into blocks of markup,
+  // leaving only processing instructions and the elements which the
+  // context handles specially (see is_dynamic_element) to be dispatched to
+  // the context for each render.
+  struct RenderOp {
+    enum Type { Markup, Start, End, Process };
+    Type type;
+    std::string name;    // Element or processing instruction name
+    std::string text;    // Rendered markup or processing instruction data
+    NodeAttrs attrs;
+    bool empty;
+    int line;
+    void* data;
+    size_t jump;         // Index of the matching Start/End op
+  };
+  typedef std::vector<RenderOp> RenderPlan;
+
+  // Should the context handle this element itself, rather than it being
+  // pre-rendered into the plan
+  static bool is_dynamic_element(const std::string& name);
+
+  // Render an element's start tag, as the context would
+  static void compile_start_tag(std::string& markup,
+                                const std::string& name,
+                                const NodeAttrs& attrs,
+                                bool empty);
+
+  // Add any accumulated markup to the plan
+  void compile_markup(std::string& markup);
+
+  // Add Start and End ops for a dynamic element, returns the index of the
+  // Start op, which is passed to compile_end once its contents are added
+  size_t compile_start(const std::string& name,
+                       const NodeAttrs& attrs,
+                       bool empty,
+                       int line,
+                       void* data);
+  void compile_end(size_t start_index);
+
+  // Render the plan without a context, as the whole document's markup.
+  // Only possible if the plan has no processing instructions or dynamic
+  // elements, as these depend on the context.
+  void prerender();
+
+  // Run the render plan in the specified context
+  void run_plan(Context& context);
+
   virtual bool is_open() const =0;
   virtual bool handle_open() =0;
   virtual bool handle_process(Context& context) =0;
@@ -116,13 +180,30 @@ protected:
 
   scx::Date m_modtime;
   scx::Date m_last_access;
-  
-  int m_clients;
-  volatile bool m_opening;
-  static scx::Mutex* m_clients_mutex;
-  
+
+  // Loaded version of the document
+  VersionPtr m_version;
+
+  // Protects the version and opening state. Only one thread at a time
+  // checks and loads the file, other threads continue to use the loaded
+  // version, or wait for the first version to be loaded.
+  mutable scx::Mutex m_mutex;
+  scx::ConditionEvent m_opened;
+  bool m_opening;
+
+  // Watches the file for changes, so it is only checked when it has
+  // changed (or when the current version needs loading regardless)
+  scx::FileWatch* m_watch;
+  bool m_stale;
+
   Heading m_headings;
   ErrorList m_errors;
+
+  RenderPlan m_plan;
+
+  // Pre-rendered markup for the whole document, if available
+  bool m_prerendered;
+  std::string m_markup;
   
   static void init();
 
@@ -23,6 +23,7 @@ Free Software Foundation, Inc.,
 #include <sconesite/Article.h>
 #include <sconesite/Template.h>
 #include <sconesite/SconesiteModule.h>
+#include <http/HTTPModule.h>
 #include <sconex/Stream.h>
 #include <sconex/StreamTransfer.h>
 #include <sconex/Date.h>
@@ -47,6 +48,38 @@ namespace scs {
 const char* ARTDIR = "art";
 const char* TPLDIR = "tpl";
 
+// Maximum number of articles purged from the cache while it is locked
+const unsigned int PURGE_BATCH = 16;
+
+// Maximum number of listing pages tracked for cache invalidation
+const unsigned int MAX_LISTING_PAGES = 1024;
+
+// Set when the thread makes a site-wide article query
+static thread_local bool s_site_queries = false;
+
+//=========================================================================
+// ProfileWarmupJob - Loads queued articles into a profile's article cache
+//
+class ProfileWarmupJob : public scx::Job {
+public:
+
+  ProfileWarmupJob(Profile* profile)
+    : scx::Job("sconesite Warmup"),
+      m_module(&profile->get_module()),
+      m_profile(profile) {};
+
+  virtual bool run()
+  {
+    // Load one article each time the job is run, so that warming up
+    // doesn't hold up requests waiting for a thread
+    return !m_profile.object()->warmup_next();
+  };
+
+protected:
+  SconesiteModule::Ref m_module;
+  Profile::Ref m_profile;
+};
+
 //=========================================================================
 Profile::Profile(
   SconesiteModule& module,
@@ -57,16 +90,25 @@ Profile::Profile(
     m_name(name),
     m_host(new http::Host::Ref(host)),
     m_db(new scx::Database::Ref(db)),
-    m_use_default_templates(true)
+    m_meta(db),
+    m_use_default_templates(true),
+    m_all_listings(false),
+    m_warmup_jobs(0),
+    m_warmup_loaded(0)
 {
   m_parent = &m_module;
 
   check_database();
 
+  if (!m_meta.load()) {
+    LOG("Unable to load article metadata");
+  }
+
   // Map all requests to the sconesite module
   scx::ScriptList* ml = new scx::ScriptList();
   ml->give(scx::ScriptString::new_ref(m_name));
   m_host->object()->add_path_map("/",m_module.name(),new scx::ScriptRef(ml));
+  m_mounts.insert("");
   
   // Enable automation session allocation
   m_host->object()->set_param("auto_session", scx::ScriptInt::new_ref(1));
@@ -81,7 +123,7 @@ Profile::~Profile()
 {
   for (ArticleMap::iterator it_a = m_articles.begin();
        it_a != m_articles.end(); ++it_a) {
-    delete it_a->second;
+    delete it_a->second.article;
   }
 
   delete m_db;
@@ -93,25 +135,71 @@ void Profile::refresh()
 {
   m_templates.refresh();
 
+  // Retry loading the metadata if it failed previously, lookups are made
+  // directly from the database until it succeeds
+  if (!m_meta.loaded() && m_meta.load()) {
+    LOG("Loaded article metadata");
+  }
+
   // Calculate purge time for cached articles
   scx::Date purge_time;
   if (m_purge_threshold.seconds() != 0) {
     purge_time = scx::Date::now() - scx::Time(m_purge_threshold);
   }
-  
-  // Scan cached articles and purge
-  scx::RWLocker locker(m_cache_lock,true,scx::RWLock::Write);
-  for (ArticleMap::iterator it_a = m_articles.begin();
-       it_a != m_articles.end(); ) {
-    Article::Ref* article = it_a->second;
-    if (article->object()->get_access_time() < purge_time) {
-      LOG("Purging article: /" + article->object()->get_href_path());
-      m_articles.erase(it_a++);
-      delete article;
-    } else {
-      ++it_a;
+  purge_articles(purge_time);
+}
+
+//=========================================================================
+void Profile::warmup(int count, int jobs, const std::string& order)
+{
+  if (count == 0 || jobs <= 0) return;
+
+  ArticleQuery query;
+  query.order = order;
+  query.reverse = true;
+  query.limit = (count < 0) ? -1 : count;
+  std::vector<int> ids;
+  query_articles(query,ids);
+
+  scx::MutexLocker locker(m_warmup_mutex);
+  m_warmup.insert(m_warmup.end(),ids.begin(),ids.end());
+  std::ostringstream oss;
+  oss << "Warming up " << ids.size() << " articles";
+  LOG(oss.str());
+
+  while (m_warmup_jobs < jobs && m_warmup_jobs < (int)m_warmup.size()) {
+    ++m_warmup_jobs;
+    scx::Kernel::get()->add_job(new ProfileWarmupJob(this));
+  }
+}
+
+//=========================================================================
+bool Profile::warmup_next()
+{
+  scx::MutexLocker locker(m_warmup_mutex);
+  if (m_warmup.empty()) {
+    if (--m_warmup_jobs == 0) {
+      std::ostringstream oss;
+      oss << "Warm-up finished, " << m_warmup_loaded << " articles loaded";
+      LOG(oss.str());
+      m_warmup_loaded = 0;
     }
+    return false;
   }
+  int id = m_warmup.front();
+  m_warmup.pop_front();
+  locker.unlock();
+
+  Article::Ref* article = lookup_article(id);
+  if (article) {
+    // Open the document, so it is parsed ready for the first request
+    article->object()->get_headings();
+    delete article;
+
+    locker.lock();
+    ++m_warmup_loaded;
+  }
+  return true;
 }
 
 //=========================================================================
@@ -131,62 +219,34 @@ Article::Ref* Profile::lookup_article(int id)
 {
   // Look for article in cache
   scx::RWLocker locker(m_cache_lock);
-  ArticleMap::const_iterator id_it = m_articles.find(id);
+  ArticleMap::iterator id_it = m_articles.find(id);
   if (id_it != m_articles.end()) {
-    SCONESITEPROFILE_DEBUG_LOG("Article id cache hit for '" + id + "'");
-    Article::Ref* article = id_it->second;
-    article->object()->reset_access_time();
-    return article->ref_copy();
+    SCONESITEPROFILE_DEBUG_LOG("Article id cache hit for '" << id << "'");
+    touch_article(id_it->second);
+    return id_it->second.article->ref_copy();
   }
   locker.unlock();
 
-  // Look for article in database
-  std::unique_ptr<scx::DbQuery> query(m_db->object()->new_query(
-    "SELECT path,parent FROM article WHERE id = ?"));
-
+  // Find the article's link and parent from the index
   std::string link;
-  int cid = id;
   int pid = 0;
-
-  while (cid != 1) {
-
-    scx::ScriptList::Ref args(new scx::ScriptList());
-    args.object()->give(scx::ScriptInt::new_ref(cid));
-    query->exec(&args);
-    
-    if (!query->next_result()) {
-      return 0;
-
-    } else {
-      scx::ScriptRef* row_ref = query->result();
-      scx::ScriptMap* row = dynamic_cast<scx::ScriptMap*>(row_ref->object());
-      if (row) {
-	scx::ScriptRef* a_path = row->lookup("path");
-	if (a_path) {
-	  link = a_path->object()->get_string() + "/" + link;
-	}
-	
-	scx::ScriptRef* a_parent = row->lookup("parent");
-	if (a_parent) {
-	  // Save initial parent ID as it is needed when constructing article
-	  if (cid == id) pid = a_parent->object()->get_int();
-	  cid = a_parent->object()->get_int();
-	}
-      }
-      delete row_ref;
-    }
-  }
-
-  locker.lock();
-  ArticleLinkMap::iterator itL = m_article_links.find(link);
-  if (itL == m_article_links.end()) {
-    SCONESITEPROFILE_DEBUG_LOG("Article link cache add: " + id + 
-			       " -> '" + link + "'");
-    locker.lock(scx::RWLock::Write); // Relock for writing
-    m_article_links[link] = id;
+  if (m_meta.loaded()) {
+    ArticleMetaStore::LinkIndexPtr index = m_meta.get_link_index();
+    const ArticleLinkIndex::Entry* entry = index->find(id);
+    if (!entry) return 0;
+    link = entry->link;
+    pid = entry->parent;
+  } else if (!query_link(id,link,pid)) {
+    return 0;
   }
 
+  // Another thread may have loaded the article while the cache was unlocked
   locker.lock(scx::RWLock::Write);
+  id_it = m_articles.find(id);
+  if (id_it != m_articles.end()) {
+    touch_article(id_it->second);
+    return id_it->second.article->ref_copy();
+  }
   return new Article::Ref(load_article(id,pid,link));
 }
 
@@ -194,73 +254,48 @@ Article::Ref* Profile::lookup_article(int id)
 Article::Ref* Profile::lookup_article(const std::string& href,
 				      std::string& extra)
 {
-  // Look for article in cache
-  scx::RWLocker locker(m_cache_lock);
-  ArticleLinkMap::const_iterator it = m_article_links.find(href);
-  if (it != m_article_links.end()) {
-    SCONESITEPROFILE_DEBUG_LOG("Article link cache hit for '" + href + "'");
-    locker.unlock();
-    return lookup_article(it->second);
+  // Find the deepest article whose link is a prefix of href, made up of
+  // whole path components. The remainder of href is returned in extra.
+  if (!m_meta.loaded()) {
+    int id = query_link_id(href,extra);
+    return (id > 0) ? lookup_article(id) : 0;
   }
-  locker.unlock();
-
-  // Look for article in database
-  std::unique_ptr<scx::DbQuery> query(m_db->object()->new_query(
-    "SELECT id FROM article WHERE parent = ? AND path = ?"));
 
-  std::string key = href;
-  std::string path;
-  std::string link;
-  int id = 1;
-  int pid = 0;
+  ArticleMetaStore::LinkIndexPtr index = m_meta.get_link_index();
+  std::string::size_type end = href.size();
   while (true) {
-    std::string::size_type is = key.find_first_of("/");
-    path = key.substr(0,is);
-    scx::ScriptList::Ref args(new scx::ScriptList());
-    args.object()->give(scx::ScriptInt::new_ref(id));
-    args.object()->give(scx::ScriptString::new_ref(path));
-    query->exec(&args);
-    if (!query->next_result()) {
-      extra = key;
-      locker.lock();
-      ArticleLinkMap::iterator itL = m_article_links.find(link);
-      if (itL == m_article_links.end()) {
-	SCONESITEPROFILE_DEBUG_LOG("Article link cache add: " + id + 
-				   " -> '" + link + "'");
-	locker.lock(scx::RWLock::Write);
-	m_article_links[link] = id;
-      }
-      ArticleMap::iterator itA = m_articles.find(id);
-      if (itA != m_articles.end()) {
-	Article::Ref* article = itA->second;
-	article->object()->reset_access_time();
-	return article->ref_copy();
-      }
-      locker.lock(scx::RWLock::Write);
-      return new Article::Ref(load_article(id,pid,link));
-
+    std::string link;
+    if (end == href.size() && end > 0 && href[end-1] != '/') {
+      link = href + "/";
     } else {
-      scx::ScriptRef* row_ref = query->result();
-      scx::ScriptMap* row = dynamic_cast<scx::ScriptMap*>(row_ref->object());
-      if (row) {
-	scx::ScriptRef* a_id = row->lookup("id");
-	if (a_id) {
-	  pid = id; id = a_id->object()->get_int();
-	}
-      }
-      delete row_ref;
+      link = href.substr(0,end);
     }
-    if (is == std::string::npos) {
-      key = "";
-    } else {
-      key = key.substr(is+1);
+
+    int id = index->find_id(link);
+    if (id > 0) {
+      SCONESITEPROFILE_DEBUG_LOG("Article link index hit for '" << link <<
+                                 "'");
+      extra = (end < href.size()) ? href.substr(end) : "";
+      return lookup_article(id);
     }
-    link += path + "/";
+
+    // Move back to the start of the previous path component
+    if (end == 0) break;
+    std::string::size_type slash =
+      (end >= 2) ? href.rfind('/',end-2) : std::string::npos;
+    end = (slash == std::string::npos) ? 0 : slash+1;
   }
 
   return 0;
 }
 
+//=========================================================================
+int Profile::query_articles(const ArticleQuery& query,
+                            std::vector<int>& ids) const
+{
+  return m_meta.query(query,ids);
+}
+
 //=========================================================================
 Article::Ref* Profile::create_article(int pid,
 				      const std::string& name,
@@ -317,16 +352,16 @@ Article::Ref* Profile::create_article(int pid,
     return 0;
   }
 
+  m_meta.load_row(id);
+
   scx::RWLocker locker(m_cache_lock,true,scx::RWLock::Write);
 
   Article* article = load_article(id,pid,link,type);
 
-  SCONESITEPROFILE_DEBUG_LOG("Article link cache add: " << id <<
-			     " -> '" << link << "'");
-  m_article_links[link] = id;
-
   locker.unlock();
 
+  invalidate_cache("");
+
   scx::Log("sconesite").attach("id",m_name)
     .attach("aid",id).attach("link",link)
     .submit("Article created");
@@ -363,18 +398,20 @@ bool Profile::remove_article(int id)
   if (!query->exec(&args)) {
     LOG("Failed to remove article from db");
   }
+  m_meta.remove_row(id);
 
   // Remove from caches
   scx::RWLocker locker(m_cache_lock,true,scx::RWLock::Write);
 
-  article = m_articles[id];
-  m_articles.erase(id);
-  m_article_links.erase(link);
+  ArticleMap::iterator it_a = m_articles.find(id);
+  article = (it_a == m_articles.end()) ? 0 : uncache_article(it_a);
 
   locker.unlock();
 
   delete article;
 
+  invalidate_cache("");
+
   scx::Log("sconesite").attach("id",m_name)
     .attach("aid",id).attach("link",link)
     .submit("Article removed");
@@ -451,31 +488,27 @@ bool Profile::rename_article(int id,
       return false;
     }
   }  
+  m_meta.load_row(id);
 
-  // Remove from caches
+  // Remove the article and any child articles from the cache, as their
+  // links have changed
   scx::RWLocker locker(m_cache_lock,true,scx::RWLock::Write);
-  article = m_articles[id];
-  m_articles.erase(id);
-  m_article_links.erase(link);
-  delete article;
-
-  // Child articles also need to be removed and deleted
-  for (ArticleLinkMap::iterator itl = m_article_links.begin();
-       itl != m_article_links.end();
-       ++itl) {
-    if (itl->first.find(link) == 0) {
-      // i.e. if the link starts with our moved article link, it is a child
-      SCONESITEPROFILE_DEBUG_LOG("Removing " << itl->second << 
-				 ": " << itl->first);
-      article = m_articles[itl->second];
-      m_articles.erase(itl->second);
-      m_article_links.erase(itl);
-      delete article;
+  for (ArticleMap::iterator it_a = m_articles.begin();
+       it_a != m_articles.end(); ) {
+    article = it_a->second.article;
+    if (article->object()->get_href_path().find(link) == 0) {
+      SCONESITEPROFILE_DEBUG_LOG("Removing " << it_a->first << 
+				 ": " << article->object()->get_href_path());
+      delete uncache_article(it_a++);
+    } else {
+      ++it_a;
     }
   }
 
   locker.unlock();
 
+  invalidate_cache("");
+
   scx::Log("sconesite").attach("id",m_name)
     .attach("aid",id)
     .submit("Article renamed");
@@ -492,6 +525,70 @@ Template* Profile::lookup_template(const std::string& name)
   return t;
 }
 
+//=========================================================================
+void Profile::invalidate_cache(const std::string& link)
+{
+  scx::Module::Ref httpmod = scx::Kernel::get()->get_module("http");
+  http::HTTPModule* http = dynamic_cast<http::HTTPModule*>(httpmod.object());
+  if (!http) return;
+  http::ResponseCache& cache = http->get_cache();
+  const std::string& host = m_host->object()->get_id();
+
+  scx::MutexLocker locker(m_pages_mutex);
+  bool all = (link.empty() || m_all_listings);
+  for (std::set<std::string>::const_iterator it = m_mounts.begin();
+       it != m_mounts.end(); ++it) {
+    if (all) {
+      cache.invalidate(host, *it);
+      continue;
+    }
+
+    // The article, anything under it, and its parent's page which lists it
+    cache.invalidate(host, *it + link);
+    std::string::size_type i = link.rfind('/', link.size() - 2);
+    std::string parent =
+      (i == std::string::npos || link.size() < 2) ? "" : link.substr(0,i+1);
+    cache.invalidate(host, *it + parent, false);
+  }
+
+  if (!all) {
+    for (std::set<std::string>::const_iterator it = m_listing_pages.begin();
+         it != m_listing_pages.end(); ++it) {
+      cache.invalidate(host, *it, false);
+    }
+  }
+}
+
+//=========================================================================
+void Profile::add_mount(const std::string& mount)
+{
+  scx::MutexLocker locker(m_pages_mutex);
+  m_mounts.insert(mount);
+}
+
+//=========================================================================
+void Profile::rendered_page(const std::string& path, bool listing)
+{
+  scx::MutexLocker locker(m_pages_mutex);
+  if (!listing) {
+    m_listing_pages.erase(path);
+  } else if (!m_all_listings) {
+    m_listing_pages.insert(path);
+    if (m_listing_pages.size() > MAX_LISTING_PAGES) {
+      m_listing_pages.clear();
+      m_all_listings = true;
+    }
+  }
+}
+
+//=========================================================================
+bool Profile::take_site_queries()
+{
+  bool queries = s_site_queries;
+  s_site_queries = false;
+  return queries;
+}
+
 //=========================================================================
 std::string Profile::get_string() const
 {
@@ -509,12 +606,16 @@ scx::ScriptRef* Profile::script_op(const scx::ScriptAuth& auth,
 
     // Methods
     if ("set_purge_threshold" == name ||
+        "warmup" == name ||
 	"lookup" == name ||
+	"get_articles" == name ||
+	"count_articles" == name ||
 	"create_article" == name ||
 	"remove_article" == name ||
 	"rename_article" == name ||
         "add_templates" == name ||
-        "set_use_default_templates" == name) {
+        "set_use_default_templates" == name ||
+        "reload_meta" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
 
@@ -531,13 +632,15 @@ scx::ScriptRef* Profile::script_op(const scx::ScriptAuth& auth,
     if ("article_cache" == name) {
       scx::ScriptList::Ref* list = 
 	new scx::ScriptList::Ref(new scx::ScriptList());
+      // Listed most recently used first
       scx::RWLocker locker(m_cache_lock);
-      for (ArticleMap::iterator it_a = m_articles.begin();
-	   it_a != m_articles.end();
-	   ++it_a) {
+      scx::MutexLocker lru_locker(m_lru_mutex);
+      for (LRUList::const_iterator it_l = m_lru.begin();
+	   it_l != m_lru.end();
+	   ++it_l) {
 	scx::ScriptMap::Ref* map =
 	  new scx::ScriptMap::Ref(new scx::ScriptMap());
-	Article* article = it_a->second->object();
+	Article* article = m_articles.find(*it_l)->second.article->object();
 	map->object()->give("last_access",
           new scx::ScriptRef(article->get_access_time().new_copy()));
 	map->object()->give("article",
@@ -547,8 +650,24 @@ scx::ScriptRef* Profile::script_op(const scx::ScriptAuth& auth,
       return list;
     }
 
+    if ("warmup_queued" == name) {
+      scx::MutexLocker locker(m_warmup_mutex);
+      return scx::ScriptInt::new_ref(m_warmup.size());
+    }
+
     if ("use_default_templates" == name) 
       return scx::ScriptInt::new_ref(m_use_default_templates);
+
+    if ("article_meta" == name) {
+      scx::ScriptMap* map = new scx::ScriptMap();
+      map->give("loaded",scx::ScriptInt::new_ref(m_meta.loaded()));
+      map->give("rows",scx::ScriptInt::new_ref(m_meta.num_rows()));
+      map->give("columns",scx::ScriptInt::new_ref(m_meta.num_columns()));
+      map->give("loads",scx::ScriptInt::new_ref(m_meta.num_loads()));
+      map->give("links",
+                scx::ScriptInt::new_ref(m_meta.get_link_index()->size()));
+      return new scx::ScriptRef(map);
+    }
   }
 
   return scx::ScriptObject::script_op(auth,ref,op,right);
@@ -575,6 +694,28 @@ scx::ScriptRef* Profile::script_method(const scx::ScriptAuth& auth,
     return 0;
   }
 
+  if ("warmup" == name) {
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_count =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"count");
+    if (!a_count)
+      return scx::ScriptError::new_ref("Must specify count");
+
+    const scx::ScriptInt* a_jobs =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"jobs");
+    int jobs = a_jobs ? a_jobs->get_int() : SCONESITE_WARMUP_JOBS;
+    if (jobs <= 0)
+      return scx::ScriptError::new_ref("Jobs must be > 0");
+
+    const scx::ScriptString* a_order =
+      scx::get_method_arg<scx::ScriptString>(args,2,"order");
+    std::string order = a_order ? a_order->get_string() : "time";
+
+    warmup(a_count->get_int(),jobs,order);
+    return 0;
+  }
+
   if ("lookup" == name) {
 
     const scx::ScriptString* a_name = 
@@ -596,6 +737,35 @@ scx::ScriptRef* Profile::script_method(const scx::ScriptAuth& auth,
     return scx::ScriptError::new_ref("No name or id specified");
   }
 
+  if ("get_articles" == name ||
+      "count_articles" == name) {
+    ArticleQuery query;
+    if (!read_query(scx::get_method_arg<scx::ScriptMap>(args,0,"opts"),query))
+      return scx::ScriptError::new_ref("Invalid query options");
+    if ("count_articles" == name) query.limit = 0;
+
+    // Note queries other than listing the children of an article, as pages
+    // making them may list any article
+    bool children = false;
+    for (ArticleQuery::MatchList::const_iterator it = query.match.begin();
+         it != query.match.end(); ++it) {
+      if (it->first == "parent") children = true;
+    }
+    if (!children) s_site_queries = true;
+
+    std::vector<int> ids;
+    int total = query_articles(query,ids);
+    if ("count_articles" == name) return scx::ScriptInt::new_ref(total);
+
+    scx::ScriptList::Ref* list =
+      new scx::ScriptList::Ref(new scx::ScriptList());
+    for (std::vector<int>::const_iterator it = ids.begin();
+         it != ids.end(); ++it) {
+      list->object()->give(new ArticleHandle::Ref(new ArticleHandle(*this,*it)));
+    }
+    return list;
+  }
+
   if ("create_article" == name) {
     const scx::ScriptInt* a_pid = 
       scx::get_method_arg<scx::ScriptInt>(args,0,"pid");
@@ -680,6 +850,15 @@ scx::ScriptRef* Profile::script_method(const scx::ScriptAuth& auth,
     
     return 0;
   }
+
+  if ("reload_meta" == name) {
+    // Reload the metadata, i.e. after the article table has been modified
+    // directly in the database
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+    if (!m_meta.load())
+      return scx::ScriptError::new_ref("Unable to load article metadata");
+    return 0;
+  }
   
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
@@ -689,6 +868,11 @@ bool Profile::set_meta(int id,
 		       const std::string& property,
 		       scx::ScriptRef* value)
 {
+  if (!ArticleMetaStore::valid_property(property)) {
+    delete value;
+    return false;
+  }
+
   std::unique_ptr<scx::DbQuery> query(m_db->object()->new_query(
     "UPDATE article set "+property+" = ? WHERE id = ?"));
 
@@ -696,6 +880,7 @@ bool Profile::set_meta(int id,
   args.object()->give(value);
   args.object()->give(scx::ScriptInt::new_ref(id));
   bool result = query->exec(&args);
+  if (result) m_meta.set(id,property,value);
 
   SCONESITEPROFILE_DEBUG_LOG("set_meta " << id << 
    ":" << property << "=" << 
@@ -706,8 +891,28 @@ bool Profile::set_meta(int id,
 
 //=========================================================================
 scx::ScriptRef* Profile::get_meta(int id,
-				  const std::string& property) const
+				  const std::string& property,
+                                  bool inherit)
 {
+  bool known = false;
+  scx::ScriptRef* result = m_meta.get(id,property,inherit,known);
+  if (known) return result;
+
+  // The store can't answer until it has been loaded
+  if (!m_meta.loaded()) return query_meta(id,property);
+
+  // Not looked up yet, so read it for all articles from the database in
+  // case it has been added since the metadata was loaded
+  if (!m_meta.load_column(property)) return 0;
+  return m_meta.get(id,property,inherit,known);
+}
+
+//=========================================================================
+scx::ScriptRef* Profile::query_meta(int id,
+				    const std::string& property) const
+{
+  if (!ArticleMetaStore::valid_property(property)) return 0;
+
   std::unique_ptr<scx::DbQuery> query(m_db->object()->new_query(
     "SELECT "+property+" FROM article WHERE id = ?"));
 
@@ -723,12 +928,123 @@ scx::ScriptRef* Profile::get_meta(int id,
     delete row_ref;
   }
   
-  SCONESITEPROFILE_DEBUG_LOG("get_meta " << id << 
+  SCONESITEPROFILE_DEBUG_LOG("query_meta " << id << 
 			     ":" << property << "=" <<
 			     (result?result->object()->get_string():"NULL"));
   return result;
 }
 
+//=========================================================================
+bool Profile::query_link(int id,
+                         std::string& link,
+                         int& pid) const
+{
+  std::unique_ptr<scx::DbQuery> query(m_db->object()->new_query(
+    "SELECT path,parent FROM article WHERE id = ?"));
+
+  // Walk up to the root article, which has an empty link. The number of
+  // steps is limited in case of a loop in the parent ids.
+  link = "";
+  pid = 0;
+  int cid = id;
+  for (int depth = 0; cid != 1; ++depth) {
+    if (depth > 256) return false;
+    scx::ScriptList::Ref args(new scx::ScriptList());
+    args.object()->give(scx::ScriptInt::new_ref(cid));
+    query->exec(&args);
+    if (!query->next_result()) return false;
+
+    scx::ScriptRef* row_ref = query->result();
+    scx::ScriptMap* row = dynamic_cast<scx::ScriptMap*>(row_ref->object());
+    const scx::ScriptRef* a_path = row ? row->lookup("path") : 0;
+    const scx::ScriptRef* a_parent = row ? row->lookup("parent") : 0;
+    bool ok = !BAD_SCRIPTREF(a_path) && !BAD_SCRIPTREF(a_parent);
+    if (ok) {
+      link = a_path->object()->get_string() + "/" + link;
+      if (cid == id) pid = a_parent->object()->get_int();
+      cid = a_parent->object()->get_int();
+    }
+    delete row_ref;
+    if (!ok) return false;
+  }
+
+  SCONESITEPROFILE_DEBUG_LOG("query_link " << id << "='" << link << "'");
+  return true;
+}
+
+//=========================================================================
+int Profile::query_link_id(const std::string& href,
+                           std::string& extra) const
+{
+  std::unique_ptr<scx::DbQuery> query(m_db->object()->new_query(
+    "SELECT id FROM article WHERE parent = ? AND path = ?"));
+
+  // Walk down from the root article one path component at a time
+  int id = 1;
+  std::string::size_type start = 0;
+  while (start < href.size()) {
+    std::string::size_type end = href.find('/',start);
+    if (end == std::string::npos) end = href.size();
+
+    scx::ScriptList::Ref args(new scx::ScriptList());
+    args.object()->give(scx::ScriptInt::new_ref(id));
+    args.object()->give(scx::ScriptString::new_ref(
+      href.substr(start,end-start)));
+    query->exec(&args);
+    if (!query->next_result()) break;
+
+    scx::ScriptRef* row_ref = query->result();
+    scx::ScriptMap* row = dynamic_cast<scx::ScriptMap*>(row_ref->object());
+    const scx::ScriptRef* a_id = row ? row->lookup("id") : 0;
+    int cid = BAD_SCRIPTREF(a_id) ? 0 : a_id->object()->get_int();
+    delete row_ref;
+    if (cid <= 0) break;
+
+    id = cid;
+    start = end + 1;
+  }
+
+  extra = (start < href.size()) ? href.substr(start) : "";
+  SCONESITEPROFILE_DEBUG_LOG("query_link_id '" << href << "'=" << id);
+  return id;
+}
+
+//=========================================================================
+bool Profile::read_query(const scx::ScriptMap* opts,
+                         ArticleQuery& query) const
+{
+  if (!opts) return true;
+  const scx::ScriptRef* opt = 0;
+
+  if ((opt = opts->lookup("parent")))
+    query.match.push_back(
+      std::make_pair("parent",opt->object()->get_string()));
+
+  if ((opt = opts->lookup("where"))) {
+    const scx::ScriptMap* where =
+      dynamic_cast<const scx::ScriptMap*>(opt->object());
+    if (!where) return false;
+    std::vector<std::string> keys;
+    where->keys(keys);
+    for (std::vector<std::string>::const_iterator it = keys.begin();
+         it != keys.end(); ++it) {
+      query.match.push_back(
+        std::make_pair(*it,where->lookup(*it)->object()->get_string()));
+    }
+  }
+
+  if ((opt = opts->lookup("order")))
+    query.order = opt->object()->get_string();
+  if ((opt = opts->lookup("desc")))
+    query.reverse = (opt->object()->get_int() != 0);
+  if ((opt = opts->lookup("offset")))
+    query.offset = opt->object()->get_int();
+  if ((opt = opts->lookup("limit")))
+    query.limit = opt->object()->get_int();
+
+  return (query.offset >= 0);
+}
+
 //=========================================================================
 Article* Profile::load_article(int id, int pid, const std::string& link,
                                const std::string& type)
@@ -737,10 +1053,59 @@ Article* Profile::load_article(int id, int pid, const std::string& link,
 			     " " << link << " t=" << type);
   Article* art = new Article(*this,id,pid,link,type);
   // Article cache must be locked for writing before calling this method!
-  m_articles[id] = new Article::Ref(art);
+  m_lru.push_front(id);
+  CacheEntry& entry = m_articles[id];
+  entry.article = new Article::Ref(art);
+  entry.lru = m_lru.begin();
   return art;
 }
 
+//=========================================================================
+void Profile::purge_articles(const scx::Date& purge_time)
+{
+  if (!purge_time.valid()) return;
+
+  bool more = true;
+  while (more) {
+    // Take expired articles from the least recently used end of the list,
+    // stopping at the first one which is still in use
+    std::list<Article::Ref*> purged;
+    scx::RWLocker locker(m_cache_lock,true,scx::RWLock::Write);
+    while (!m_lru.empty() && purged.size() < PURGE_BATCH) {
+      ArticleMap::iterator it_a = m_articles.find(m_lru.back());
+      if (it_a->second.article->object()->get_access_time() >= purge_time) {
+        break;
+      }
+      purged.push_back(uncache_article(it_a));
+    }
+    more = (purged.size() == PURGE_BATCH);
+    locker.unlock();
+
+    for (std::list<Article::Ref*>::iterator it = purged.begin();
+         it != purged.end(); ++it) {
+      LOG("Purging article: /" + (*it)->object()->get_href_path());
+      delete *it;
+    }
+  }
+}
+
+//=========================================================================
+void Profile::touch_article(CacheEntry& entry)
+{
+  scx::MutexLocker locker(m_lru_mutex);
+  m_lru.splice(m_lru.begin(),m_lru,entry.lru);
+  entry.article->object()->reset_access_time();
+}
+
+//=========================================================================
+Article::Ref* Profile::uncache_article(ArticleMap::iterator it)
+{
+  Article::Ref* article = it->second.article;
+  m_lru.erase(it->second.lru);
+  m_articles.erase(it);
+  return article;
+}
+
 //=============================================================================
 void Profile::check_database()
 {
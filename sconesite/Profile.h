@@ -23,6 +23,7 @@ Free Software Foundation, Inc.,
 #define sconesiteProfile_h
 
 #include <sconesite/Article.h>
+#include <sconesite/ArticleMetaStore.h>
 #include <sconesite/TemplateManager.h>
 #include <http/Host.h>
 #include <sconex/Stream.h>
@@ -34,6 +35,9 @@ namespace scs {
   
 class SconesiteModule;
 
+// Default number of jobs used to warm up the article cache
+#define SCONESITE_WARMUP_JOBS 2
+
 //=========================================================================
 // Profile - A site profile for Sconesite, provides access to the templates
 // and articles associated with this site.
@@ -50,15 +54,30 @@ public:
 
   void refresh();
 
+  // Load up to count articles (or all if count < 0) into the cache in the
+  // background, using the specified number of jobs. Articles are chosen in
+  // descending order of the order property.
+  void warmup(int count, int jobs, const std::string& order);
+
+  // Load the next queued article for warm-up (used by the warm-up jobs).
+  // Returns false once the queue is empty.
+  bool warmup_next();
+
   SconesiteModule& get_module();
   const scx::FilePath& get_path();
 
-  // Find an article by id or name
-  // the article is loaded into the cache if it is not already cached
+  // Find an article by id or name, using the link index in the metadata
+  // store, or the database while the store isn't loaded. The article is
+  // loaded into the cache if it is not already cached.
   Article::Ref* lookup_article(int id);
   Article::Ref* lookup_article(const std::string& href,
 			       std::string& extra);
 
+  // Find articles matching a query using the metadata store, without
+  // loading them. Returns the total number of matching articles.
+  int query_articles(const ArticleQuery& query,
+                     std::vector<int>& ids) const;
+
   // Create a new article under the specified parent.
   // pid identifies the parent article.
   // name is used for the path component from parent.
@@ -85,6 +104,24 @@ public:
   // Find a template by name
   Template* lookup_template(const std::string& name);
 
+  // Remove any cached responses for pages under the specified article link,
+  // its parent's page and any pages which list articles from across the
+  // site (or for the whole site if link is empty), so edits become visible.
+  void invalidate_cache(const std::string& link);
+
+  // Note a request path prefix which the profile's articles are served
+  // under (the profile itself is mapped at the host root)
+  void add_mount(const std::string& mount);
+
+  // Note that the page at path has been rendered, and whether it made any
+  // site-wide article queries (see take_site_queries), in which case its
+  // cached copies are removed whenever an article changes
+  void rendered_page(const std::string& path, bool listing);
+
+  // Have any article queries not limited to the children of one article
+  // been made by the calling thread since this was last called
+  static bool take_site_queries();
+
   // ScriptObject methods
   virtual std::string get_string() const;
 
@@ -103,14 +140,36 @@ public:
 protected:  
 
   friend class Article;
+  friend class ArticleHandle;
+
+  // Read query options from a script map, returns false if invalid
+  bool read_query(const scx::ScriptMap* opts,
+                  ArticleQuery& query) const;
 
   // Article metadata
   bool set_meta(int id,
 		const std::string& property,
 		scx::ScriptRef* value);
 
+  // Get article metadata from the metadata store. If inherit is set and the
+  // article has no value, the value from its nearest ancestor is used.
   scx::ScriptRef* get_meta(int id,
-			   const std::string& property) const;
+			   const std::string& property,
+                           bool inherit=false);
+
+  // Query article metadata directly from the database
+  scx::ScriptRef* query_meta(int id,
+                             const std::string& property) const;
+
+  // Find an article's link and parent directly from the database
+  bool query_link(int id,
+                  std::string& link,
+                  int& pid) const;
+
+  // Find the deepest article whose link is a prefix of href directly from
+  // the database, returns its id with the remainder of href in extra
+  int query_link_id(const std::string& href,
+                    std::string& extra) const;
 
   Article* load_article(int id,
 			int pid,
@@ -118,6 +177,11 @@ protected:
                         const std::string& type="");
 
   void check_database();
+
+  // Remove articles which haven't been accessed since purge_time from the
+  // cache, least recently used first, a batch at a time so that lookups
+  // aren't held up
+  void purge_articles(const scx::Date& purge_time);
   
 private:
   
@@ -128,22 +192,54 @@ private:
 
   scx::Database::Ref* m_db;
 
+  // In-memory copy of the article metadata
+  ArticleMetaStore m_meta;
+
   // Lock for article cache
   scx::RWLock m_cache_lock;
 
-  // Caches loaded articles, accessed by article ID
-  typedef HASH_TYPE<int,Article::Ref*> ArticleMap;
+  // Caches loaded articles, accessed by article ID. The LRU list orders
+  // the cached article IDs by access, most recent first.
+  typedef std::list<int> LRUList;
+  struct CacheEntry {
+    Article::Ref* article;
+    LRUList::iterator lru;
+  };
+  typedef HASH_TYPE<int,CacheEntry> ArticleMap;
   ArticleMap m_articles;
+  LRUList m_lru;
+
+  // Lock for the LRU list, which is reordered by lookups while the cache is
+  // only locked for reading (lock after the cache lock)
+  scx::Mutex m_lru_mutex;
 
-  // Caches article link to ID mappings
-  typedef HASH_TYPE<std::string,int> ArticleLinkMap;
-  ArticleLinkMap m_article_links;
+  // Move a cached article to the front of the LRU list
+  // (cache must be locked)
+  void touch_article(CacheEntry& entry);
+
+  // Remove an article from the cache, returning its ref for the caller to
+  // delete (cache must be locked for writing)
+  Article::Ref* uncache_article(ArticleMap::iterator it);
 
   TemplateManager m_templates;
   bool m_use_default_templates;
   
   scx::Time m_purge_threshold;
-  
+
+  // Request path prefixes the profile is served under, and pages which
+  // list articles from across the site (see rendered_page). If there are
+  // too many listing pages to track, they are all treated as listings.
+  scx::Mutex m_pages_mutex;
+  std::set<std::string> m_mounts;
+  std::set<std::string> m_listing_pages;
+  bool m_all_listings;
+
+  // Articles waiting to be loaded by the warm-up jobs
+  scx::Mutex m_warmup_mutex;
+  std::list<int> m_warmup;
+  int m_warmup_jobs;
+  int m_warmup_loaded;
+
 };
 
 };
@@ -51,6 +51,7 @@ RenderMarkupContext::RenderMarkupContext(
 ) : m_profile(profile),
     m_stream(stream),
     m_output(output),
+    m_buffer(output),
     m_request(new http::Request::Ref(&request)),
     m_response(new http::Response::Ref(&response)),
     m_article(0),
@@ -99,6 +100,12 @@ const Article* RenderMarkupContext::get_article() const
   return 0;
 }
 
+//=========================================================================
+void RenderMarkupContext::flush()
+{
+  m_buffer.flush();
+}
+
 //=========================================================================
 bool RenderMarkupContext::in_template() const
 {
@@ -144,7 +151,7 @@ bool RenderMarkupContext::handle_start(const std::string& name,
     
   } else {
     
-    std::ostringstream oss;
+    std::string anchor;
 
     // Monkey about with some of the standard HTML tags!
     
@@ -173,11 +180,12 @@ bool RenderMarkupContext::handle_start(const std::string& name,
                name == "h4" || name == "h5" || name == "h6") {
       // Automatically insert anchors before headings
       if (data && m_article && !in_template()) { 
-        const Heading* headings = m_article->object()->get_headings();
+        Document::HeadingPtr headings =
+          m_article->object()->get_headings();
         const Heading* h = (const Heading*)(data);
         if (headings && h) {
           int index = h->index();
-          std::string anchor = headings->lookup_anchor(index);
+          anchor = headings->lookup_anchor(index);
           if (m_auto_number) {
             std::string href = "/" + m_article->object()->get_href_path() + 
 	                       "#" + anchor;
@@ -186,31 +194,43 @@ bool RenderMarkupContext::handle_start(const std::string& name,
               headings->lookup_section(index) +
               ".</a></span> ";
           }
-          
-          oss << "<a name='" << anchor << "'></a>";
         }
       }
       
     } else if (name == "html") {
       // Setup for valid HTML output
-      oss << HTML_DOCTYPE << "\n";
+      if (!m_inhibit) {
+        m_buffer.write(HTML_DOCTYPE);
+        m_buffer.write("\n");
+      }
     }
 
-    oss << "<" << name;
+    descend = !empty;
+    if (m_inhibit) return descend;
+
+    if (!anchor.empty()) {
+      m_buffer.write("<a name='");
+      m_buffer.write(anchor);
+      m_buffer.write("'></a>");
+    }
+    m_buffer.write("<");
+    m_buffer.write(name);
     for (NodeAttrs::const_iterator it = attrs.begin();
          it != attrs.end();
          ++it) {
-      oss << " " << (*it).first << "=\"" << (*it).second << "\"";
+      m_buffer.write(" ");
+      m_buffer.write((*it).first);
+      m_buffer.write("=\"");
+      m_buffer.write((*it).second);
+      m_buffer.write("\"");
     }
     
     if (!empty) {
-      oss << ">" << pre;
-      descend = true;
+      m_buffer.write(">");
+      m_buffer.write(pre);
     } else {
-      oss << "/>";
-      descend = false;
+      m_buffer.write("/>");
     }
-    if (!m_inhibit) m_output.write(oss.str());
   }
   return descend;
 }
@@ -238,10 +258,10 @@ bool RenderMarkupContext::handle_end(const std::string& name,
       }
     }
   
-  } else {
-    std::ostringstream oss;
-    oss << "</" << name << ">";
-    if (!m_inhibit) m_output.write(oss.str());
+  } else if (!m_inhibit) {
+    m_buffer.write("</");
+    m_buffer.write(name);
+    m_buffer.write(">");
   }
 
   return repeat;
@@ -273,7 +293,7 @@ void RenderMarkupContext::handle_process(const std::string& name,
       if (result) {
 	std::string str = result->object()->get_string();
 	if (!str.empty()) {
-	  m_output.write(str);
+	  m_buffer.write(str);
 	}
       }
     } catch (...) {
@@ -327,10 +347,17 @@ void RenderMarkupContext::handle_text(const char* text)
   const char* p = text;
   while (*p == '\n' || *p == '\r') ++p;
   if (*p != '\0') {
-    m_output.write(p);
+    m_buffer.write(p);
   }
 }
 
+//=========================================================================
+void RenderMarkupContext::handle_markup(const std::string& markup)
+{
+  if (m_inhibit) return;
+  m_buffer.write(markup);
+}
+
 //=========================================================================
 void RenderMarkupContext::handle_comment(const char* text)
 {
@@ -359,6 +386,7 @@ scx::ScriptRef* RenderMarkupContext::script_op(const scx::ScriptAuth& auth,
 	"edit_article" == name ||
 	"template" == name ||
 	"get_files" == name ||
+	"flush" == name ||
 	"abort" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
@@ -425,7 +453,7 @@ scx::ScriptRef* RenderMarkupContext::script_method(const scx::ScriptAuth& auth,
     for (int i=0; i<n; ++i) {
       std::string str = argsl->get(i)->object()->get_string();
       if (str.size() > 0) {
-        m_output.write(str);
+        m_buffer.write(str);
       }
     }
     return 0;
@@ -436,7 +464,7 @@ scx::ScriptRef* RenderMarkupContext::script_method(const scx::ScriptAuth& auth,
     for (int i=0; i<n; ++i) {
       std::string str = argsl->get(i)->object()->get_string();
       if (str.size() > 0) {
-        m_output.write(scx::escape_html(str));
+        m_buffer.write_escaped(str);
       }
     }
     return 0;
@@ -445,7 +473,7 @@ scx::ScriptRef* RenderMarkupContext::script_method(const scx::ScriptAuth& auth,
   if (name == "print_json") {
     const scx::ScriptObject* value = 
       scx::get_method_arg<scx::ScriptObject>(args,0,"value");
-    if (value) value->serialize(m_output);
+    if (value) value->serialize(m_buffer);
     return 0;
   }
 
@@ -481,6 +509,22 @@ scx::ScriptRef* RenderMarkupContext::script_method(const scx::ScriptAuth& auth,
     return scx::ScriptString::new_ref("");
   }
 
+  if (name == "get_articles") {
+    // Query the profile's articles, listing the children of the current
+    // article unless another parent is specified
+    const scx::ScriptMap* a_opts = 
+      scx::get_method_arg<scx::ScriptMap>(args,0,"opts");
+    scx::ScriptMap* opts = a_opts ?
+      dynamic_cast<scx::ScriptMap*>(a_opts->new_copy()) : new scx::ScriptMap();
+    if (m_article && !opts->lookup("parent") && !opts->lookup("where"))
+      opts->give("parent",scx::ScriptInt::new_ref(m_article->object()->get_id()));
+
+    scx::ScriptList::Ref qargs(new scx::ScriptList());
+    qargs.object()->give(new scx::ScriptRef(opts));
+    scx::ScriptRef profile(m_profile);
+    return m_profile->script_method(auth,profile,name,&qargs);
+  }
+
   if (name == "process_article") {
     if (!auth.trusted()) return scx::ScriptError::new_ref("Not permitted");
 
@@ -545,8 +589,7 @@ scx::ScriptRef* RenderMarkupContext::script_method(const scx::ScriptAuth& auth,
         char buffer[1024];
 	int na = 0;
         while (scx::Ok == file->read(buffer,1000,na)) {
-          std::string str(buffer,na);
-          m_output.write(scx::escape_html(str));
+          m_buffer.write_escaped(std::string(buffer,na));
         }
       }
       delete file;
@@ -572,9 +615,17 @@ scx::ScriptRef* RenderMarkupContext::script_method(const scx::ScriptAuth& auth,
     return 0;
   }
 
+  if (name == "flush") {
+    // Send the output rendered so far, i.e. to start streaming a long page
+    flush();
+    return 0;
+  }
+
   if (name == "abort") {
     if (!auth.trusted()) return scx::ScriptError::new_ref("Not permitted");
 
+    // Send what has been rendered so far
+    flush();
     //    m_output.close();
     throw std::exception();
     return 0;
@@ -24,6 +24,7 @@ Free Software Foundation, Inc.,
 
 #include <sconesite/Context.h>
 #include <sconesite/Article.h>
+#include <sconesite/RenderOutput.h>
 #include <http/Request.h>
 #include <http/Response.h>
 #include <sconex/ScriptBase.h>
@@ -61,6 +62,9 @@ public:
   const Article* get_article() const;
 
   bool in_template() const;
+
+  // Write out any buffered output
+  void flush();
   
   // Context methods
   virtual bool handle_start(const std::string& name, 
@@ -79,6 +83,8 @@ public:
 
   virtual void handle_text(const char* text);
 
+  virtual void handle_markup(const std::string& markup);
+
   virtual void handle_comment(const char* text);
 
 
@@ -103,6 +109,7 @@ protected:
   Profile* m_profile;
   SconesiteStream& m_stream;
   scx::Descriptor& m_output;
+  RenderOutput m_buffer;
   http::Request::Ref* m_request;
   http::Response::Ref* m_response;
 
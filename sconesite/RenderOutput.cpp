@@ -0,0 +1,103 @@
+/* SconeServer (http://www.sconemad.com)
+
+Sconesite render output buffer
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconesite/RenderOutput.h>
+#include <sconex/utils.h>
+namespace scs {
+
+//=========================================================================
+RenderOutput::RenderOutput(scx::Descriptor& output, int block_size)
+  : m_output(output),
+    m_block_size(block_size)
+{
+  m_buffer.reserve(m_block_size);
+}
+
+//=========================================================================
+RenderOutput::~RenderOutput()
+{
+
+}
+
+//=========================================================================
+void RenderOutput::write_escaped(const std::string& string)
+{
+  scx::escape_html(string,m_buffer);
+  check_flush();
+}
+
+//=========================================================================
+void RenderOutput::flush()
+{
+  if (m_buffer.empty()) return;
+  // Clear the buffer first, as the write throws if it fails
+  std::string data;
+  data.swap(m_buffer);
+  m_buffer.reserve(m_block_size);
+  m_output.write(data);
+}
+
+//=========================================================================
+int RenderOutput::buffered() const
+{
+  return m_buffer.size();
+}
+
+//=========================================================================
+scx::Condition RenderOutput::read(void* buffer,int n,int& na)
+{
+  na = 0;
+  return scx::Error;
+}
+
+//=========================================================================
+scx::Condition RenderOutput::write(const void* buffer,int n,int& na)
+{
+  m_buffer.append((const char*)buffer,n);
+  na = n;
+  check_flush();
+  return scx::Ok;
+}
+
+//=========================================================================
+int RenderOutput::write(const char* string)
+{
+  int n = strlen(string);
+  m_buffer.append(string,n);
+  check_flush();
+  return n;
+}
+
+//=========================================================================
+int RenderOutput::write(const std::string& string)
+{
+  m_buffer.append(string);
+  check_flush();
+  return string.size();
+}
+
+//=========================================================================
+void RenderOutput::check_flush()
+{
+  if (m_buffer.size() >= m_block_size) flush();
+}
+
+};
@@ -0,0 +1,70 @@
+/* SconeServer (http://www.sconemad.com)
+
+Sconesite render output buffer
+
+Collects the output from rendering a page into large blocks, so that the
+many small pieces of text produced while rendering are passed down the
+connection's stream chain in a few sizable writes.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef sconesiteRenderOutput_h
+#define sconesiteRenderOutput_h
+
+#include <sconex/IOBase.h>
+#include <sconex/Descriptor.h>
+namespace scs {
+
+//=========================================================================
+// RenderOutput - Buffers rendered output for a descriptor
+//
+class RenderOutput : public scx::IOBase {
+public:
+
+  // Output is written to the descriptor whenever block_size bytes have
+  // been collected, or when flushed
+  RenderOutput(scx::Descriptor& output, int block_size = 16384);
+  virtual ~RenderOutput();
+
+  // Escape html control characters in a string and add it to the output
+  void write_escaped(const std::string& string);
+
+  // Write any buffered output to the descriptor
+  void flush();
+
+  // Number of bytes waiting to be written
+  int buffered() const;
+
+  // IOBase methods
+  virtual scx::Condition read(void* buffer,int n,int& na);
+  virtual scx::Condition write(const void* buffer,int n,int& na);
+  virtual int write(const char* string);
+  virtual int write(const std::string& string);
+
+private:
+
+  void check_flush();
+
+  scx::Descriptor& m_output;
+  std::string m_buffer;
+  size_t m_block_size;
+
+};
+
+};
+#endif
@@ -0,0 +1,100 @@
+/* SconeServer (http://www.sconemad.com)
+
+UNIT TESTS for RenderOutput
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconesite/RenderOutput.h>
+#include <sconex/UnitTester.h>
+using namespace scs;
+
+// Descriptor recording each write made to it
+class TestDescriptor : public scx::Descriptor {
+public:
+  TestDescriptor() : fail(false) {}
+  virtual void close() {}
+  virtual int fd() { return -1; }
+
+  std::vector<std::string> writes;
+  bool fail;
+
+protected:
+  virtual scx::Condition endpoint_read(void* buffer,int n,int& na)
+  {
+    na = 0;
+    return scx::End;
+  }
+  virtual scx::Condition endpoint_write(const void* buffer,int n,int& na)
+  {
+    na = 0;
+    if (fail) return scx::Error;
+    writes.push_back(std::string((const char*)buffer,n));
+    na = n;
+    return scx::Ok;
+  }
+};
+
+void RenderOutput_ut()
+{
+  UTSEC("buffering");
+  TestDescriptor out;
+  RenderOutput* ro = new RenderOutput(out,16);
+  UTCOD(ro->write("<p>"));
+  UTCOD(ro->write(std::string("hello")));
+  UTEST(ro->buffered() == 8);
+  UTEST(out.writes.empty());
+  UTMSG("written as one block once the block size is reached");
+  UTCOD(ro->write(" world</p>"));
+  UTEST(out.writes.size() == 1);
+  UTEST(out.writes[0] == "<p>hello world</p>");
+  UTEST(ro->buffered() == 0);
+  UTMSG("a single write larger than a block");
+  UTCOD(ro->write(std::string(40,'x')));
+  UTEST(out.writes.size() == 2);
+  UTEST(out.writes[1].size() == 40);
+
+  UTSEC("flush");
+  UTCOD(ro->write("end"));
+  UTEST(out.writes.size() == 2);
+  UTCOD(ro->flush());
+  UTEST(out.writes.size() == 3);
+  UTEST(out.writes[2] == "end");
+  UTMSG("nothing is written when empty");
+  UTCOD(ro->flush());
+  UTEST(out.writes.size() == 3);
+
+  UTSEC("escaped");
+  UTCOD(ro->write_escaped("<i>"));
+  UTEST(ro->buffered() == 9);
+  UTCOD(ro->write_escaped("a & \"b\""));
+  UTEST(out.writes.size() == 4);
+  UTEST(out.writes[3] == "&lt;i&gt;a &amp; &quot;b&quot;");
+
+  UTSEC("failed write");
+  UTCOD(out.fail = true);
+  UTCOD(ro->write("lost"));
+  bool thrown = false;
+  try { ro->flush(); } catch (...) { thrown = true; }
+  UTEST(thrown);
+  UTMSG("the buffer is cleared so the output isn't retried");
+  UTEST(ro->buffered() == 0);
+  UTCOD(out.fail = false);
+  UTCOD(ro->flush());
+  UTEST(out.writes.size() == 4);
+  delete ro;
+}
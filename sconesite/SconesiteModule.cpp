@@ -29,6 +29,7 @@ Free Software Foundation, Inc.,
 #include <sconex/Stream.h>
 #include <sconex/Kernel.h>
 #include <sconex/File.h>
+#include <sconex/FileWatcher.h>
 #include <sconex/Log.h>
 namespace scs {
   
@@ -59,7 +60,10 @@ protected:
 
 //=========================================================================
 SconesiteModule::SconesiteModule()
-  : scx::Module("sconesite",scx::version())
+  : scx::Module("sconesite",scx::version()),
+    m_warmup_count(0),
+    m_warmup_jobs(SCONESITE_WARMUP_JOBS),
+    m_warmup_order("time")
 {
   http::Handler::register_handler(name(),this);
   Document::register_document_type("xml",this);
@@ -181,6 +185,22 @@ Template* SconesiteModule::lookup_template(const std::string& name)
 {
   return m_templates.lookup(name);
 }
+
+//=========================================================================
+std::string SconesiteModule::lookup_file_handler(const std::string& file) const
+{
+  std::string handler;
+  std::string::size_type len = 0;
+  for (FileHandlerMap::const_iterator it = m_file_handlers.begin();
+       it != m_file_handlers.end(); ++it) {
+    const std::string& prefix = it->first;
+    if (prefix.size() >= len && file.compare(0,prefix.size(),prefix) == 0) {
+      handler = it->second;
+      len = prefix.size();
+    }
+  }
+  return handler;
+}
   
 //=============================================================================
 scx::ScriptRef* SconesiteModule::script_op(const scx::ScriptAuth& auth,
@@ -193,7 +213,10 @@ scx::ScriptRef* SconesiteModule::script_op(const scx::ScriptAuth& auth,
 
     // Methods
     if ("add" == name ||
-        "add_templates" == name) {
+        "add_templates" == name ||
+        "map_file" == name ||
+        "set_check_interval" == name ||
+        "set_warmup" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }      
 
@@ -210,6 +233,10 @@ scx::ScriptRef* SconesiteModule::script_op(const scx::ScriptAuth& auth,
       }
       return list;
     }
+
+    if ("check_interval" == name)
+      return scx::ScriptInt::new_ref(
+        scx::FileWatcher::get()->get_poll_interval());
     
     // Sub-objects
     ProfileMap::const_iterator it = m_profiles.find(name);
@@ -258,6 +285,7 @@ scx::ScriptRef* SconesiteModule::script_method(const scx::ScriptAuth& auth,
     LOG("Adding profile '" + s_profile);
     Profile* profile = new Profile(*this,s_profile,host,a_db);
     m_profiles[s_profile] = new Profile::Ref(profile);
+    profile->warmup(m_warmup_count,m_warmup_jobs,m_warmup_order);
 
     return new Profile::Ref(profile);
   }
@@ -274,6 +302,65 @@ scx::ScriptRef* SconesiteModule::script_method(const scx::ScriptAuth& auth,
 
     return 0;
   }
+
+  if ("map_file" == name) {
+    // Map requests for article files starting with a prefix to a handler
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptString* a_prefix =
+      scx::get_method_arg<scx::ScriptString>(args,0,"prefix");
+    if (!a_prefix || a_prefix->get_string().empty())
+      return scx::ScriptError::new_ref("No prefix specified");
+
+    const scx::ScriptString* a_handler =
+      scx::get_method_arg<scx::ScriptString>(args,1,"handler");
+    if (!a_handler)
+      return scx::ScriptError::new_ref("No handler specified");
+
+    LOG("Mapping article files '" + a_prefix->get_string() +
+        "' to handler " + a_handler->get_string());
+    m_file_handlers[a_prefix->get_string()] = a_handler->get_string();
+    return 0;
+  }
+
+  if ("set_check_interval" == name) {
+    // Set how often document and template files are checked for changes
+    // where they can't be watched
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_secs =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"seconds");
+    if (!a_secs || a_secs->get_int() <= 0)
+      return scx::ScriptError::new_ref("Interval must be > 0");
+    scx::FileWatcher::get()->set_poll_interval(a_secs->get_int());
+
+    return 0;
+  }
+
+  if ("set_warmup" == name) {
+    // Set how many articles are loaded into the cache when profiles are
+    // added (-1 for all, 0 for none), how many jobs load them, and the
+    // property they are chosen by (highest first)
+    if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+    const scx::ScriptInt* a_count =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"count");
+    if (!a_count)
+      return scx::ScriptError::new_ref("Must specify count");
+
+    const scx::ScriptInt* a_jobs =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"jobs");
+    if (a_jobs && a_jobs->get_int() <= 0)
+      return scx::ScriptError::new_ref("Jobs must be > 0");
+
+    const scx::ScriptString* a_order =
+      scx::get_method_arg<scx::ScriptString>(args,2,"order");
+
+    m_warmup_count = a_count->get_int();
+    if (a_jobs) m_warmup_jobs = a_jobs->get_int();
+    if (a_order) m_warmup_order = a_order->get_string();
+    return 0;
+  }
   
   return scx::Module::script_method(auth,ref,name,args);
 }
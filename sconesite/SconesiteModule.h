@@ -49,6 +49,11 @@ public:
 
   // Lookup a template in the standard template stores
   Template* lookup_template(const std::string& name);
+
+  // Get the handler mapped for requests for files within articles, by the
+  // longest matching prefix of the file path. Returns an empty string if
+  // none is mapped (in which case the file is served directly).
+  std::string lookup_file_handler(const std::string& file) const;
   
   // Module methods
   virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
@@ -81,6 +86,16 @@ private:
   ProfileMap m_profiles;
 
   TemplateManager m_templates;
+
+  // Handlers for article files, by file path prefix
+  typedef std::map<std::string,std::string> FileHandlerMap;
+  FileHandlerMap m_file_handlers;
+
+  // Articles to load into the cache when a profile is added
+  // (see Profile::warmup)
+  int m_warmup_count;
+  int m_warmup_jobs;
+  std::string m_warmup_order;
   
   scx::JobID m_job;
   
@@ -92,7 +92,15 @@ scx::Condition SconesiteHandler::handle_message(http::MessageStream* message)
     return scx::Close;
   }
 
+  // Note where the profile is mounted, so cached pages can be found
   const scx::Uri& uri = req.get_uri();
+  const std::string& path = uri.get_path();
+  if (path.size() >= pathinfo.size() &&
+      path.compare(path.size() - pathinfo.size(), pathinfo.size(),
+                   pathinfo) == 0) {
+    m_profile->add_mount(path.substr(0, path.size() - pathinfo.size()));
+  }
+
   if (file.empty()) {
     // Article request, check if we need to redirect to correct the path
     std::string href = m_article->object()->get_href_path();
@@ -109,11 +117,26 @@ scx::Condition SconesiteHandler::handle_message(http::MessageStream* message)
     // File request, update the path in the request
     scx::FilePath path = m_article->object()->get_root() + file;
     req.set_path(path);
+    std::string mapped = m_module.object()->lookup_file_handler(file);
     if (file.find("article.") == 0) {
       // Don't allow any article source to be sent
       log(message, "Request for '" + pathinfo + "' - Forbidden (article source)");
       resp.set_status(http::Status::Forbidden);
       return scx::Close;
+
+    } else if (!mapped.empty()) {
+      // Pass on to the handler mapped for this file, which deals with the
+      // file not existing itself
+      log(message, "Request for '" + pathinfo +"' - Using " + mapped);
+      http::Handler* handler = http::Handler::create(mapped,0);
+      if (!handler) {
+        // Handler not available
+        resp.set_status(http::Status::ServiceUnavailable);
+        return scx::Close;
+      }
+      scx::Condition c = handler->handle_message(message);
+      delete handler;
+      return c;
       
     } else if (!scx::FileStat(path).is_file()) {
       log(message, "Request for '" + pathinfo + "' - NotFound");
@@ -217,8 +240,9 @@ scx::Condition SconesiteStream::event(scx::Stream::Event e)
 }
 
 //=========================================================================
-bool SconesiteStream::handle_section(const scx::MimeHeaderTable& headers,
-                                     const std::string& name)
+http::MultipartSink* SconesiteStream::handle_section(
+  const scx::MimeHeaderTable& headers,
+  const std::string& name)
 {
   // If the section name starts with "file_", treat as a file 
   const std::string file_pattern = "file_";
@@ -230,9 +254,10 @@ bool SconesiteStream::handle_section(const scx::MimeHeaderTable& headers,
 }
 
 //=========================================================================
-bool SconesiteStream::handle_file(const scx::MimeHeaderTable& headers,
-                                  const std::string& name,
-                                  const std::string& filename)
+http::MultipartSink* SconesiteStream::handle_file(
+  const scx::MimeHeaderTable& headers,
+  const std::string& name,
+  const std::string& filename)
 {
   http::Request& req = const_cast<http::Request&>(m_message->get_request());
   http::Response& resp = m_message->get_response();
@@ -240,7 +265,7 @@ bool SconesiteStream::handle_file(const scx::MimeHeaderTable& headers,
 
   if (!session || !session->has_permission("upload")) {
     resp.set_status(http::Status::Unauthorized);
-    return false;
+    return 0;
   }
 
   scx::FilePath path = "/tmp";
@@ -249,22 +274,11 @@ bool SconesiteStream::handle_file(const scx::MimeHeaderTable& headers,
   req.set_param(name,
                 new scx::ScriptRef(new scx::ScriptFile(path,filename)));
   
-  scx::File* file = new scx::File();
-  if (file->open(path.path(),
-                 scx::File::Write | scx::File::Create | 
-                 scx::File::Truncate,
-                 00660) == scx::Ok) {
-    //	endpoint().add_stream(new scx::StreamDebugger("https-file"));
-    scx::StreamTransfer* xfer = new scx::StreamTransfer(&endpoint());
-    file->add_stream(xfer);
-    scx::Kernel::get()->connect(file);
-    file = 0;
-    return true;
+  http::MultipartSink* sink = new_file_sink(path);
+  if (!sink) {
+    log("Error opening file '" + path.path() + "'");
   }
-      
-  log("Error opening file '" + path.path() + "'");
-  delete file;
-  return false;
+  return sink;
 }
 
 //=========================================================================
@@ -296,6 +310,7 @@ scx::Condition SconesiteStream::send_response()
   scx::Date start_time = scx::Date::now();
   
   // Render the page
+  Profile::take_site_queries();
   try {
     if (!tpl->process(*m_context->object())) {
       tpl->log_errors();
@@ -306,6 +321,13 @@ scx::Condition SconesiteStream::send_response()
     //DEBUG_LOG("EXCEPTION caught in SconesiteStream");
   }
 
+  // Send any output still buffered by the context
+  try {
+    m_context->object()->flush();
+  } catch (...) { }
+  m_profile->rendered_page(req.get_uri().get_path(),
+                           Profile::take_site_queries());
+
   // Unlock the session
   if (session) session->unlock();
 
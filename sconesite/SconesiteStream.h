@@ -66,11 +66,13 @@ public:
 protected:
 
   virtual scx::Condition event(scx::Stream::Event e);
-  virtual bool handle_section(const scx::MimeHeaderTable& headers,
-                              const std::string& name);
-  virtual bool handle_file(const scx::MimeHeaderTable& headers,
-                           const std::string& name,
-                           const std::string& filename);
+  virtual http::MultipartSink* handle_section(
+    const scx::MimeHeaderTable& headers,
+    const std::string& name);
+  virtual http::MultipartSink* handle_file(
+    const scx::MimeHeaderTable& headers,
+    const std::string& name,
+    const std::string& filename);
   virtual scx::Condition send_response();
 
 private:
@@ -45,4 +45,10 @@ Template::~Template()
 
 }
 
+//=========================================================================
+Document* Template::new_version() const
+{
+  return new Template(m_name,m_root);
+}
+
 };
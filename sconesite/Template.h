@@ -40,7 +40,11 @@ public:
   ~Template();
 
   typedef scx::ScriptRefTo<Template> Ref;
-  
+
+protected:
+
+  virtual Document* new_version() const;
+
 };
 
 };
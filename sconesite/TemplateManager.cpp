@@ -28,7 +28,8 @@ namespace scs {
 
 //=========================================================================
 TemplateStore::TemplateStore(const scx::FilePath& path)
-  : m_path(path)
+  : m_path(path),
+    m_watch(path)
 {
   refresh();
 }
@@ -51,6 +52,8 @@ const scx::FilePath& TemplateStore::get_path() const
 //=========================================================================
 void TemplateStore::refresh()
 {
+  if (!m_watch.changed()) return;
+  
   scx::RWLocker locker(m_lock, true, scx::RWLock::Write);
 
   // Add new templates
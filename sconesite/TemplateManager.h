@@ -24,6 +24,7 @@ Free Software Foundation, Inc.,
 
 #include <sconesite/Template.h>
 #include <sconex/FilePath.h>
+#include <sconex/FileWatcher.h>
 #include <sconex/ScriptBase.h>
 #include <sconex/Mutex.h>
 namespace scs {
@@ -42,7 +43,7 @@ public:
 
   const scx::FilePath& get_path() const;
   
-  // Refresh the templates
+  // Refresh the templates, if the store directory has changed
   void refresh();
 
   // Lookup template by name
@@ -53,6 +54,9 @@ private:
   // Store directory
   scx::FilePath m_path;
 
+  // Watches the directory for templates being added or removed
+  scx::FileWatch m_watch;
+
   // Lock
   scx::RWLock m_lock;
   
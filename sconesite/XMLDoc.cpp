@@ -108,7 +108,7 @@ static void xml_error_handler(void* vcx,const char* str,...)
 }
 
 //=========================================================================
-void XMLDoc::process_node(Context& context, xmlNode* start)
+void XMLDoc::compile_node(xmlNode* start, std::string& markup)
 {
   int line = start ? start->line : 0;
   for (xmlNode* node = start;
@@ -118,13 +118,23 @@ void XMLDoc::process_node(Context& context, xmlNode* start)
     switch (node->type) {
 
       case XML_TEXT_NODE: {
-	context.handle_text((char*)node->content);
+        // Leading newlines are dropped, as they are by the context
+        const char* p = (char*)node->content;
+        while (*p == '\n' || *p == '\r') ++p;
+        markup += p;
       } break;
 	
       case XML_PI_NODE: {
-	std::string name((char*)node->name);
-	context.handle_process(name,(char*)node->content,line,
-                               node->_private);
+        compile_markup(markup);
+        RenderOp op;
+        op.type = RenderOp::Process;
+        op.name = (char*)node->name;
+        op.text = (char*)node->content;
+        op.empty = true;
+        op.line = line;
+        op.data = node->_private;
+        op.jump = 0;
+        m_plan.push_back(op);
       } break;
 	
       case XML_ELEMENT_NODE: {
@@ -136,21 +146,30 @@ void XMLDoc::process_node(Context& context, xmlNode* start)
           attrs[(char*)attr->name] = (char*)attr->children->content;
         }
         bool empty = (node->content == 0 && node->children == 0);
-        if (context.handle_start(name,attrs,empty,node->_private)) {
-          do {
-            process_node(context,node->children);
-          } while (context.handle_end(name,attrs,node->_private));
+
+        if (!is_dynamic_element(name)) {
+          compile_start_tag(markup,name,attrs,empty);
+          if (!empty) {
+            compile_node(node->children,markup);
+            markup += "</" + name + ">";
+          }
+          break;
         }
+
+        compile_markup(markup);
+        size_t start_index =
+          compile_start(name,attrs,empty,node->line,node->_private);
+        compile_node(node->children,markup);
+        compile_markup(markup);
+        compile_end(start_index);
       } break;
 	
       case XML_ENTITY_REF_NODE: {
-	std::string name((char*)node->name);
-        name = "&" + name + ";";
-        context.handle_text(name.c_str());
+        markup += "&" + std::string((char*)node->name) + ";";
       } break;
 
       case XML_COMMENT_NODE: {
-	context.handle_comment((char*)node->content);
+        // Comments are not rendered
       } break;
 	
       case XML_CDATA_SECTION_NODE: {
@@ -166,6 +185,12 @@ void XMLDoc::process_node(Context& context, xmlNode* start)
   }
 }
 
+//=========================================================================
+Document* XMLDoc::new_version() const
+{
+  return new XMLDoc(m_name,m_root,m_file);
+}
+
 //=========================================================================
 bool XMLDoc::is_open() const
 {
@@ -196,6 +221,10 @@ bool XMLDoc::handle_open()
   int index = 0;
   scan_headings(xmlDocGetRootElement(m_xmldoc),index);
 
+  std::string markup;
+  compile_node(xmlDocGetRootElement(m_xmldoc),markup);
+  compile_markup(markup);
+
   return true;
 }
 
@@ -204,7 +233,7 @@ bool XMLDoc::handle_process(Context& context)
 {
   if (context.handle_doc_start(this)) {
     do {
-      process_node(context,xmlDocGetRootElement(m_xmldoc));
+      run_plan(context);
     } while (context.handle_doc_end(this));
   }
   return true;
@@ -218,6 +247,7 @@ void XMLDoc::handle_close()
     delete (*it);
   }
   m_scripts.clear();
+  m_plan.clear();
 
   if (m_xmldoc) {
     xmlFreeDoc(m_xmldoc);
@@ -35,6 +35,10 @@ bool XMLAttr_bool(NodeAttrs& attrs, const std::string& value, bool def=false);
 // XMLDoc - An article body implementation for XML-based documents, using
 // the libxml2 parser.
 //
+// When opened, the document is compiled into a linear render plan (see
+// Document), with scripts dispatched to the context as processing
+// instructions.
+//
 class XMLDoc : public Document {
 public:
 
@@ -52,12 +56,14 @@ public:
   
 protected:
 
+  virtual Document* new_version() const;
   virtual bool is_open() const;
   virtual bool handle_open();
   virtual bool handle_process(Context& context);
   virtual void handle_close();
 
-  void process_node(Context& context, xmlNode* node);
+  // Compile nodes into the render plan, accumulating rendered markup
+  void compile_node(xmlNode* start, std::string& markup);
 
   void scan_scripts(xmlNode* start);
   scx::ScriptStatement::Ref* parse_script(char* data, int line);
@@ -69,6 +75,7 @@ protected:
   typedef std::vector<scx::ScriptStatement::Ref*> Scripts;
   Scripts m_scripts;
 
+
 };
 
 };
@@ -272,6 +272,13 @@ int Descriptor::event_connecting()
   return 0;
 }
 
+//=============================================================================
+Condition Descriptor::endpoint_write_file(int fd,int n,int& na)
+{
+  na = 0;
+  return End;
+}
+
 //=============================================================================
 void Descriptor::link_streams()
 {
@@ -299,7 +306,7 @@ int Descriptor::get_event_mask() const
     std::list<Stream*>::const_iterator it = m_streams.begin();
     while (it != m_streams.end()) {
       const Stream* stream = (*it);
-      event_mask |= stream->m_events;
+      event_mask |= stream->m_events | stream->m_requested_events;
       ++it;
     }
   }
@@ -338,6 +345,13 @@ int Descriptor::dispatch(int events)
   // Add virtual events
   events |= m_virtual_events;
 
+  // Enable any events requested by other threads
+  for (std::list<Stream*>::iterator it = m_streams.begin();
+       it != m_streams.end(); ++it) {
+    Stream* stream = (*it);
+    stream->m_events |= stream->m_requested_events.exchange(0);
+  }
+
   // Decode individual events
   bool event_opened    = (state() == Connected || state() == Listening);
   bool event_readable  = events & (1<<Stream::Readable); 
@@ -138,6 +138,10 @@ protected:
   // Implement in derived classes to provide I/O direct to the
   // underlying stream.
 
+  virtual Condition endpoint_write_file(int fd,int n,int& na);
+  // Write data directly from a file descriptor, if supported by the
+  // underlying stream (see Stream::write_file). Returns End if not.
+
   //----------------------------
   // Data  
   
@@ -25,14 +25,18 @@ namespace scx {
 
 //=============================================================================
 FileStat::FileStat()
-  : m_mode(0)
+  : m_mode(0),
+    m_size(0),
+    m_inode(0)
 {
   DEBUG_COUNT_CONSTRUCTOR(FileStat);
 }
   
 //=============================================================================
 FileStat::FileStat(const FilePath& filepath)
-  : m_mode(0)
+  : m_mode(0),
+    m_size(0),
+    m_inode(0)
 {
   DEBUG_COUNT_CONSTRUCTOR(FileStat);
 
@@ -84,8 +88,17 @@ const Date& FileStat::time() const
   return m_time;
 }
 
+//=============================================================================
+ino_t FileStat::inode() const
+{
+  return m_inode;
+}
+
 //=============================================================================
 FileStat::FileStat(int filedes)
+  : m_mode(0),
+    m_size(0),
+    m_inode(0)
 {
   DEBUG_COUNT_CONSTRUCTOR(FileStat);
 
@@ -106,6 +119,7 @@ void FileStat::become(struct stat* a)
   m_mode = a->st_mode;      
   m_size = (long)a->st_size;
   m_time = Date(a->st_mtime);
+  m_inode = a->st_ino;
 }
 
 };
@@ -65,6 +65,9 @@ public:
   
   const Date& time() const;
   // Get last modification time
+
+  ino_t inode() const;
+  // Get the inode number
  
 private:
 
@@ -77,6 +80,7 @@ private:
   mode_t m_mode;
   long m_size;
   Date m_time;
+  ino_t m_inode;
   
 };
 
@@ -0,0 +1,480 @@
+/* SconeServer (http://www.sconemad.com)
+
+Sconex file watcher
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconex/FileWatcher.h>
+#include <sconex/FileStat.h>
+#include <sconex/Kernel.h>
+#include <sconex/Stream.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+namespace scx {
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define FILEWATCHER_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+                            IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+                            IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+FileWatcher* FileWatcher::s_watcher = 0;
+
+//=============================================================================
+FileWatch::FileWatch(const FilePath& path)
+  : m_path(path),
+    m_changed(true),
+    m_polled(false),
+    m_notified(false),
+    m_exists(false),
+    m_size(0)
+{
+  if (FileStat(path).is_dir()) {
+    m_dir = path.path();
+  } else {
+    FilePath dir(path);
+    m_name = dir.pop();
+    m_dir = dir.path();
+  }
+  FileWatcher::get()->add(this);
+}
+
+//=============================================================================
+FileWatch::~FileWatch()
+{
+  FileWatcher::get()->remove(this);
+}
+
+//=============================================================================
+const FilePath& FileWatch::get_path() const
+{
+  return m_path;
+}
+
+//=============================================================================
+bool FileWatch::changed()
+{
+  if (!monitored()) return true;
+  return m_changed.exchange(false);
+}
+
+//=============================================================================
+bool FileWatch::monitored() const
+{
+  return FileWatcher::get()->active();
+}
+
+
+//=============================================================================
+void FileWatcher::init()
+{
+  FileWatcher* watcher = get();
+  if (!watcher->active()) {
+    Kernel::get()->add_job(new FileWatcherJob(*watcher));
+  }
+}
+
+//=============================================================================
+FileWatcher* FileWatcher::get()
+{
+  if (!s_watcher) s_watcher = new FileWatcher();
+  return s_watcher;
+}
+
+//=============================================================================
+bool FileWatcher::active() const
+{
+  return m_active;
+}
+
+//=============================================================================
+bool FileWatcher::notify() const
+{
+  return (m_inotify >= 0);
+}
+
+//=============================================================================
+void FileWatcher::set_poll_interval(int seconds)
+{
+  MutexLocker locker(m_mutex);
+  m_poll_interval = seconds;
+  if (!m_polled.empty()) m_next_poll = Date::now() + Time(m_poll_interval);
+}
+
+//=============================================================================
+int FileWatcher::get_poll_interval() const
+{
+  return m_poll_interval;
+}
+
+//=============================================================================
+void FileWatcher::set_verify_interval(int seconds)
+{
+  MutexLocker locker(m_mutex);
+  m_verify_interval = seconds;
+  m_next_verify = (m_verify_interval > 0 && !m_dirs.empty()) ?
+    Date::now() + Time(m_verify_interval) : Date();
+}
+
+//=============================================================================
+int FileWatcher::get_verify_interval() const
+{
+  return m_verify_interval;
+}
+
+//=============================================================================
+int FileWatcher::num_watches() const
+{
+  MutexLocker locker(m_mutex);
+  int num = m_polled.size();
+  for (DirMap::const_iterator it = m_dirs.begin(); it != m_dirs.end(); ++it) {
+    num += it->second.watches.size();
+  }
+  return num;
+}
+
+//=============================================================================
+int FileWatcher::num_polled() const
+{
+  MutexLocker locker(m_mutex);
+  return m_polled.size();
+}
+
+//=============================================================================
+unsigned long FileWatcher::num_events() const
+{
+  return m_events;
+}
+
+//=============================================================================
+FileWatcher::FileWatcher()
+  : m_inotify(-1),
+    m_active(false),
+    m_poll_interval(1),
+    m_verify_interval(60),
+    m_events(0)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+//=============================================================================
+FileWatcher::~FileWatcher()
+{
+  if (m_inotify >= 0) ::close(m_inotify);
+}
+
+//=============================================================================
+void FileWatcher::add(FileWatch* watch)
+{
+  MutexLocker locker(m_mutex);
+  start_watch(watch);
+}
+
+//=============================================================================
+void FileWatcher::remove(FileWatch* watch)
+{
+  MutexLocker locker(m_mutex);
+  if (watch->m_polled) {
+    m_polled.remove(watch);
+    return;
+  }
+
+  DirMap::iterator it = m_dirs.find(watch->m_dir);
+  if (it == m_dirs.end()) return;
+  Dir& dir = it->second;
+  dir.watches.remove(watch);
+  if (dir.watches.empty()) {
+#ifdef HAVE_SYS_INOTIFY_H
+    inotify_rm_watch(m_inotify,dir.wd);
+#endif
+    m_wds.erase(dir.wd);
+    m_dirs.erase(it);
+  }
+}
+
+//=============================================================================
+void FileWatcher::start_watch(FileWatch* watch)
+{
+  // Record its current state for polling or verifying
+  FileStat stat(watch->m_path);
+  watch->m_exists = stat.exists();
+  watch->m_time = stat.time();
+  watch->m_size = stat.size();
+  watch->m_notified = false;
+
+#ifdef HAVE_SYS_INOTIFY_H
+  if (m_inotify >= 0) {
+    DirMap::iterator it = m_dirs.find(watch->m_dir);
+    if (it == m_dirs.end()) {
+      int wd = inotify_add_watch(m_inotify,watch->m_dir.c_str(),
+                                 FILEWATCHER_EVENTS);
+      if (wd >= 0) {
+        WdMap::iterator iw = m_wds.find(wd);
+        if (iw != m_wds.end()) {
+          // Already watching this directory under a different name
+          watch->m_dir = iw->second;
+          it = m_dirs.find(iw->second);
+        } else {
+          Dir dir;
+          dir.wd = wd;
+          it = m_dirs.insert(DirMap::value_type(watch->m_dir,dir)).first;
+          m_wds[wd] = watch->m_dir;
+        }
+      }
+    }
+    if (it != m_dirs.end()) {
+      it->second.watches.push_back(watch);
+      watch->m_polled = false;
+      if (m_verify_interval > 0 && !m_next_verify.valid()) {
+        m_next_verify = Date::now() + Time(m_verify_interval);
+      }
+      return;
+    }
+  }
+#endif
+
+  // Can't be watched, so poll it
+  watch->m_polled = true;
+  m_polled.push_back(watch);
+  if (!m_next_poll.valid()) {
+    m_next_poll = Date::now() + Time(m_poll_interval);
+  }
+}
+
+//=============================================================================
+void FileWatcher::restart_dir(const std::string& path)
+{
+  DirMap::iterator it = m_dirs.find(path);
+  if (it == m_dirs.end()) return;
+
+  WatchList watches;
+  watches.swap(it->second.watches);
+  m_wds.erase(it->second.wd);
+  m_dirs.erase(it);
+  for (WatchList::iterator iw = watches.begin(); iw != watches.end(); ++iw) {
+    (*iw)->m_changed = true;
+    start_watch(*iw);
+  }
+}
+
+//=============================================================================
+void FileWatcher::read_events()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if (m_inotify < 0) return;
+  MutexLocker locker(m_mutex);
+
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    int len = ::read(m_inotify,buffer,sizeof(buffer));
+    if (len <= 0) break;
+
+    for (char* p = buffer; p < buffer + len; ) {
+      const struct inotify_event* event = (const struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + event->len;
+      ++m_events;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, so treat everything as changed
+        for (DirMap::iterator it = m_dirs.begin(); it != m_dirs.end(); ++it) {
+          WatchList& watches = it->second.watches;
+          for (WatchList::iterator iw = watches.begin();
+               iw != watches.end(); ++iw) {
+            (*iw)->m_changed = true;
+            (*iw)->m_notified = true;
+          }
+        }
+        continue;
+      }
+
+      WdMap::iterator iw = m_wds.find(event->wd);
+      if (iw == m_wds.end()) continue;
+      DirMap::iterator it = m_dirs.find(iw->second);
+      if (it == m_dirs.end()) continue;
+      WatchList& watches = it->second.watches;
+
+      // Events without a name are for the directory itself
+      std::string name = (event->len ? event->name : "");
+      for (WatchList::iterator iwatch = watches.begin();
+           iwatch != watches.end(); ++iwatch) {
+        FileWatch* watch = *iwatch;
+        if (name.empty() || watch->m_name.empty() || name == watch->m_name) {
+          watch->m_changed = true;
+          watch->m_notified = true;
+        }
+      }
+
+      if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // The directory has been removed or moved elsewhere (where the
+        // watch would follow it), so watch whatever is now at its path,
+        // falling back to polling until it can be watched again
+        if (!(event->mask & IN_IGNORED)) {
+          inotify_rm_watch(m_inotify,event->wd);
+        }
+        std::string path = iw->second;
+        restart_dir(path);
+      }
+    }
+  }
+#endif
+}
+
+//=============================================================================
+void FileWatcher::poll()
+{
+  MutexLocker locker(m_mutex);
+  if (m_next_verify.valid() && !m_next_verify.future()) verify();
+  if (!m_next_poll.valid() || m_next_poll.future()) return;
+
+  WatchList polled;
+  polled.swap(m_polled);
+  m_next_poll = Date();
+  for (WatchList::iterator it = polled.begin(); it != polled.end(); ++it) {
+    FileWatch* watch = *it;
+    bool exists = watch->m_exists;
+    Date time = watch->m_time;
+    long size = watch->m_size;
+
+    start_watch(watch);
+    if (!watch->m_polled) {
+      // Now being watched, but may have changed since last polled
+      watch->m_changed = true;
+    } else if (watch->m_exists != exists ||
+               watch->m_time != time ||
+               watch->m_size != size) {
+      watch->m_changed = true;
+    }
+  }
+}
+
+//=============================================================================
+void FileWatcher::verify()
+{
+  for (DirMap::iterator it = m_dirs.begin(); it != m_dirs.end(); ++it) {
+    WatchList& watches = it->second.watches;
+    for (WatchList::iterator iw = watches.begin(); iw != watches.end(); ++iw) {
+      FileWatch* watch = *iw;
+      FileStat stat(watch->m_path);
+      if (!watch->m_notified &&
+          (stat.exists() != watch->m_exists ||
+           stat.time() != watch->m_time ||
+           stat.size() != watch->m_size)) {
+        watch->m_changed = true;
+      }
+      watch->m_exists = stat.exists();
+      watch->m_time = stat.time();
+      watch->m_size = stat.size();
+      watch->m_notified = false;
+    }
+  }
+
+  m_next_verify = (m_verify_interval > 0 && !m_dirs.empty()) ?
+    Date::now() + Time(m_verify_interval) : Date();
+}
+
+//=============================================================================
+Date FileWatcher::next_poll() const
+{
+  MutexLocker locker(m_mutex);
+  if (m_next_verify.valid() &&
+      (!m_next_poll.valid() || m_next_verify < m_next_poll)) {
+    return m_next_verify;
+  }
+  return m_next_poll;
+}
+
+//=============================================================================
+int FileWatcher::get_fd() const
+{
+  return m_inotify;
+}
+
+//=============================================================================
+void FileWatcher::set_active(bool active)
+{
+  m_active = active;
+}
+
+
+//=============================================================================
+FileWatcherJob::FileWatcherJob(FileWatcher& watcher)
+  : Job("sconex FileWatcher"),
+    m_watcher(watcher),
+    m_events(0)
+{
+  m_watcher.set_active(true);
+}
+
+//=============================================================================
+FileWatcherJob::~FileWatcherJob()
+{
+  m_watcher.set_active(false);
+}
+
+//=============================================================================
+bool FileWatcherJob::prepare(Date& timeout, int& mask)
+{
+  if (!Job::prepare(timeout, mask)) return false;
+
+  if (m_watcher.get_fd() >= 0) mask = (1<<Stream::Readable);
+  m_timeout = m_watcher.next_poll();
+  if (m_timeout.valid() && m_timeout < timeout) timeout = m_timeout;
+  return true;
+}
+
+//=============================================================================
+int FileWatcherJob::get_fd()
+{
+  return m_watcher.get_fd();
+}
+
+//=============================================================================
+bool FileWatcherJob::ready(int events)
+{
+  if (!Job::ready(events)) return false;
+  m_events = events;
+  return ((events & (1<<Stream::Readable)) ||
+          (m_timeout.valid() && !m_timeout.future()));
+}
+
+//=============================================================================
+bool FileWatcherJob::run()
+{
+  if (m_events & (1<<Stream::Readable)) {
+    m_watcher.read_events();
+  }
+  m_watcher.poll();
+  return false;
+}
+
+//=============================================================================
+std::string FileWatcherJob::describe() const
+{
+  std::ostringstream oss;
+  oss << (m_watcher.notify() ? "inotify" : "polling")
+      << " watches:" << m_watcher.num_watches()
+      << " polled:" << m_watcher.num_polled()
+      << " events:" << m_watcher.num_events();
+  return oss.str();
+}
+
+};
@@ -0,0 +1,216 @@
+/* SconeServer (http://www.sconemad.com)
+
+Sconex file watcher
+
+Notifies subscribers when files or directories change, so that anything
+loaded from a file can be kept up to date without checking the file each
+time it is used. Changes are detected using inotify where available, by
+watching the directory containing each file, so that files which are
+replaced (as most editors do) are noticed. Where a path can't be watched,
+its modification time and size are checked periodically instead.
+
+Events are read by a job run by the kernel. If the job isn't running, all
+watches report changes whenever asked, so the caller falls back to checking
+the file itself.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef scxFileWatcher_h
+#define scxFileWatcher_h
+
+#include <sconex/sconex.h>
+#include <sconex/FilePath.h>
+#include <sconex/Date.h>
+#include <sconex/Mutex.h>
+#include <sconex/Job.h>
+#include <atomic>
+namespace scx {
+
+class FileWatcher;
+
+//=============================================================================
+// FileWatch - A subscription to changes to a file or directory. For a
+// directory, files being added, removed or changed within it count as
+// changes to the directory.
+//
+class SCONEX_API FileWatch {
+public:
+
+  FileWatch(const FilePath& path);
+  ~FileWatch();
+
+  const FilePath& get_path() const;
+
+  // Has the path changed since this was last called. Always returns true
+  // the first time it is called, or if changes aren't being monitored.
+  bool changed();
+
+  // Are changes being monitored, i.e. can changed() be relied upon
+  bool monitored() const;
+
+private:
+
+  friend class FileWatcher;
+
+  FilePath m_path;
+
+  // Directory being watched, and the name within it (empty if the path
+  // itself is a directory)
+  std::string m_dir;
+  std::string m_name;
+
+  std::atomic<bool> m_changed;
+
+  // Is the path being polled, as the directory could not be watched
+  bool m_polled;
+
+  // Has an event been received since the path was last verified
+  bool m_notified;
+
+  // State when last polled or verified
+  bool m_exists;
+  Date m_time;
+  long m_size;
+};
+
+//=============================================================================
+// FileWatcher - Singleton which tracks file watches and delivers changes
+//
+class SCONEX_API FileWatcher {
+public:
+
+  // Start monitoring for changes, adding the watcher job to the kernel
+  static void init();
+
+  // Get the file watcher singleton
+  static FileWatcher* get();
+
+  // Is the watcher job running
+  bool active() const;
+
+  // Is inotify being used
+  bool notify() const;
+
+  // How often paths which can't be watched are polled (seconds)
+  void set_poll_interval(int seconds);
+  int get_poll_interval() const;
+
+  // How often watched paths are also checked for changes by their
+  // modification time and size, in case events are missed (seconds, or 0
+  // to disable)
+  void set_verify_interval(int seconds);
+  int get_verify_interval() const;
+
+  // Statistics
+  int num_watches() const;
+  int num_polled() const;
+  unsigned long num_events() const;
+
+protected:
+
+  FileWatcher();
+  ~FileWatcher();
+
+  friend class FileWatch;
+  friend class FileWatcherJob;
+
+  void add(FileWatch* watch);
+  void remove(FileWatch* watch);
+
+  // Try to watch a path using inotify, otherwise set it up for polling
+  // (watcher must be locked)
+  void start_watch(FileWatch* watch);
+
+  // Watch the paths in a directory afresh, i.e. once it has been removed or
+  // moved, so that whatever is now at each path is watched (watcher must be
+  // locked)
+  void restart_dir(const std::string& path);
+
+  // Read any pending inotify events
+  void read_events();
+
+  // Poll paths which aren't being watched, if the poll interval has passed
+  // since they were last polled, and verify those which are if the verify
+  // interval has passed
+  void poll();
+
+  // Check each watched path for changes which weren't notified (watcher
+  // must be locked)
+  void verify();
+
+  // Time of the next poll or verify, or an invalid date if there is nothing
+  // to check
+  Date next_poll() const;
+
+  int get_fd() const;
+  void set_active(bool active);
+
+private:
+
+  mutable Mutex m_mutex;
+
+  int m_inotify;
+  std::atomic<bool> m_active;
+
+  typedef std::list<FileWatch*> WatchList;
+  struct Dir {
+    int wd;
+    WatchList watches;
+  };
+  typedef std::map<std::string,Dir> DirMap;
+  DirMap m_dirs;
+
+  typedef std::map<int,std::string> WdMap;
+  WdMap m_wds;
+
+  WatchList m_polled;
+  int m_poll_interval;
+  Date m_next_poll;
+
+  int m_verify_interval;
+  Date m_next_verify;
+
+  unsigned long m_events;
+
+  static FileWatcher* s_watcher;
+};
+
+//=============================================================================
+// FileWatcherJob - Reads events for the file watcher when the inotify
+// descriptor is readable, and polls unwatched paths when they are due
+//
+class SCONEX_API FileWatcherJob : public Job {
+public:
+
+  FileWatcherJob(FileWatcher& watcher);
+  virtual ~FileWatcherJob();
+
+  virtual bool prepare(Date& timeout, int& mask);
+  virtual int get_fd();
+  virtual bool ready(int events);
+  virtual bool run();
+  virtual std::string describe() const;
+
+private:
+
+  FileWatcher& m_watcher;
+  int m_events;
+};
+
+};
+#endif
@@ -0,0 +1,122 @@
+/* SconeServer (http://www.sconemad.com)
+
+UNIT TESTS for FileWatcher
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconex/FileWatcher.h>
+#include <sconex/FileStat.h>
+#include <sconex/Stream.h>
+#include <sconex/UnitTester.h>
+#include <fstream>
+using namespace scx;
+
+static void write_file(const FilePath& path, const std::string& content)
+{
+  std::ofstream file(path.path().c_str());
+  file << content;
+}
+
+// Deliver any pending changes, as the kernel would run the watcher job
+static void pump(FileWatcherJob& job)
+{
+  job.ready(1<<Stream::Readable);
+  job.run();
+}
+
+void FileWatcher_ut()
+{
+  FilePath dir("/tmp/sconex_ut_filewatcher");
+  FilePath::rmdir(dir,true);
+  FilePath::mkdir(dir,true,0700);
+  FilePath file = dir + "file.txt";
+  write_file(file,"one");
+
+  FileWatcherJob* job = new FileWatcherJob(*FileWatcher::get());
+  FileWatch* watch = new FileWatch(file);
+
+  UTSEC("watch");
+  UTEST(watch->monitored());
+  UTEST(watch->changed());
+  UTEST(!watch->changed());
+
+  UTSEC("modify");
+  UTCOD(write_file(file,"two"));
+  UTCOD(pump(*job));
+  UTEST(watch->changed());
+  UTEST(!watch->changed());
+  UTMSG("other files in the directory");
+  UTCOD(write_file(dir + "other.txt","other"));
+  UTCOD(pump(*job));
+  UTEST(!watch->changed());
+
+  UTSEC("rename-replace");
+  UTCOD(write_file(dir + "file.txt.new","three"));
+  UTCOD(pump(*job));
+  UTEST(!watch->changed());
+  UTCOD(FilePath::move(dir + "file.txt.new",file));
+  UTCOD(pump(*job));
+  UTEST(watch->changed());
+  UTEST(!watch->changed());
+
+  UTSEC("delete");
+  UTCOD(FilePath::rmfile(file));
+  UTCOD(pump(*job));
+  UTEST(watch->changed());
+  UTCOD(write_file(file,"four"));
+  UTCOD(pump(*job));
+  UTEST(watch->changed());
+
+  UTSEC("directory replaced");
+  FilePath sub = dir + "sub";
+  FilePath sub_file = sub + "file.txt";
+  FilePath::mkdir(sub,false,0700);
+  write_file(sub_file,"one");
+  FileWatch* sub_watch = new FileWatch(sub_file);
+  UTEST(sub_watch->changed());
+  UTMSG("moved away, the new directory at the path is watched");
+  UTCOD(FilePath::move(sub,dir + "old"));
+  UTCOD(FilePath::mkdir(sub,false,0700));
+  UTCOD(write_file(sub_file,"two"));
+  UTCOD(pump(*job));
+  UTEST(sub_watch->changed());
+  UTCOD(write_file(dir + "old/file.txt","three"));
+  UTCOD(pump(*job));
+  UTEST(!sub_watch->changed());
+  UTCOD(write_file(sub_file,"four"));
+  UTCOD(pump(*job));
+  UTEST(sub_watch->changed());
+  UTMSG("removed and created again");
+  UTCOD(FilePath::rmdir(sub,true));
+  UTCOD(pump(*job));
+  UTEST(sub_watch->changed());
+  UTCOD(FilePath::mkdir(sub,false,0700));
+  UTCOD(write_file(sub_file,"five"));
+  UTMSG("polled until it can be watched again");
+  UTCOD(usleep(1100000));
+  UTCOD(pump(*job));
+  UTEST(sub_watch->changed());
+  UTCOD(write_file(sub_file,"six"));
+  UTCOD(pump(*job));
+  UTEST(sub_watch->changed());
+
+  delete sub_watch;
+  delete watch;
+  delete job;
+  FilePath::rmdir(dir,true);
+}
@@ -25,6 +25,7 @@ Free Software Foundation, Inc.,
 #include <sconex/TermBuffer.h>
 #include <sconex/Console.h>
 #include <sconex/Logger.h>
+#include <sconex/FileWatcher.h>
 #include <sconex/Debug.h>
 #include <sconex/User.h>
 #include <sconex/Process.h>
@@ -84,6 +85,7 @@ std::string Kernel::info() const
 int Kernel::init() 
 {
   Logger::init(get_var_path());
+  FileWatcher::init();
 
   // Install signal handlers for restart and shutdown
   struct sigaction sa;
@@ -219,6 +221,12 @@ bool Kernel::end_job(JobID jobid)
   return m_spinner.end_job(jobid);
 }
 
+//=============================================================================
+void Kernel::wakeup()
+{
+  m_spinner.wakeup();
+}
+
 //=============================================================================
 void Kernel::restart()
 {
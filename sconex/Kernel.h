@@ -69,6 +69,10 @@ public:
   // End a job
   bool end_job(JobID jobid);
 
+  // Wake the event loop, so that changes to the events a descriptor is
+  // waiting for (made from another thread) take effect immediately
+  void wakeup();
+
   // Is the server running multi-threaded
   bool is_threaded();
   
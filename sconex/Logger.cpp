@@ -22,8 +22,44 @@ Free Software Foundation, Inc.,
 #include <sconex/Logger.h>
 #include <sconex/Mutex.h>
 #include <sconex/ScriptTypes.h>
+#include <algorithm>
 namespace scx {
 
+// Number of entries in each thread's ring (a power of two, so the ring
+// positions can wrap around)
+const unsigned int LOG_RING_SIZE = 256;
+
+// Size at which file channels write out buffered entries before the end of
+// a batch
+const std::string::size_type LOG_BUFFER_SIZE = 65536;
+
+// How long the log thread waits for wakeups when entries are to be written
+// as soon as possible, in case a wakeup arrives while it is busy
+const int LOG_WAKEUP_INTERVAL = 1000;
+
+//=============================================================================
+// LogRingHolder - Holds the ring for the current thread, marking it closed
+// when the thread exits so the logger can discard it
+//
+struct LogRingHolder {
+  LogRingHolder() : serial(0) {}
+  ~LogRingHolder() { if (ring) ring->close(); }
+
+  std::shared_ptr<LogRing> ring;
+  unsigned int serial;
+};
+
+static thread_local LogRingHolder s_thread_ring;
+
+static unsigned int s_logger_serial = 0;
+
+//=============================================================================
+// Order entries by the time they were logged
+static bool log_entry_earlier(const LogEntry* a, const LogEntry* b)
+{
+  return timercmp(&a->m_time, &b->m_time, <);
+}
+
 //=============================================================================
 LogEntry::LogEntry()
   : m_data(0)
@@ -32,12 +68,19 @@ LogEntry::LogEntry()
 
 //=============================================================================
 LogEntry::~LogEntry()
+{
+  clear();
+}
+
+//=============================================================================
+void LogEntry::clear()
 {
   if (m_data) {
     for (LogData::iterator it = m_data->begin(); it != m_data->end(); ++it) {
       delete it->second;
     }
     delete m_data;
+    m_data = 0;
   }
 }
 
@@ -54,7 +97,8 @@ LogChannel::Ref* LogChannel::create(const std::string& type,
 
 //=============================================================================
 LogChannel::LogChannel(const std::string& name)
-  : m_name(name)
+  : m_name(name),
+    m_time_sec(0)
 {
   DEBUG_COUNT_CONSTRUCTOR(LogChannel);
 }
@@ -65,6 +109,12 @@ LogChannel::~LogChannel()
   DEBUG_COUNT_DESTRUCTOR(LogChannel);
 }
 
+//=============================================================================
+void LogChannel::flush()
+{
+
+}
+
 //=============================================================================
 std::string LogChannel::get_string() const
 {
@@ -128,6 +178,25 @@ void LogChannel::init()
   }
 }
 
+//=========================================================================
+void LogChannel::append_time(std::string& str, const timeval& time)
+{
+  if (m_time_code.empty() || time.tv_sec != m_time_sec) {
+    timeval sec = { time.tv_sec, 0 };
+    m_time_code = Date(sec, true).code() + " ";
+    m_time_sec = time.tv_sec;
+  }
+  str += m_time_code;
+
+  char usec[6];
+  long u = time.tv_usec;
+  for (int i=5; i>=0; --i) {
+    usec[i] = '0' + (u % 10);
+    u /= 10;
+  }
+  str.append(usec,6);
+}
+
 
 //=============================================================================
 FileLogChannel::FileLogChannel(const std::string& name,
@@ -150,7 +219,7 @@ FileLogChannel::FileLogChannel(const std::string& name,
 //=============================================================================
 FileLogChannel::~FileLogChannel()
 {
-
+  flush();
 }
 
 //=============================================================================
@@ -158,40 +227,50 @@ void FileLogChannel::log_entry(LogEntry* entry)
 {
   if (!m_file.is_open() && !m_fallback) return;
 
-  Date date(entry->m_time, true);
-  std::ostringstream oss;
-  oss << date.code() << " " 
-      << std::setfill('0') << std::setw(6) << date.microsecond() << " "
-      << "[" << entry->m_category;
+  append_time(m_buffer, entry->m_time);
+  m_buffer += " [";
+  m_buffer += entry->m_category;
 
   if (entry->m_data) {
     LogData::const_iterator it = entry->m_data->find("id");
     if (it != entry->m_data->end()) {
-      oss << "/" << it->second->object()->get_string();
+      m_buffer += "/";
+      m_buffer += it->second->object()->get_string();
     }
   }
   
-  oss << "] " << entry->m_message;
+  m_buffer += "] ";
+  m_buffer += entry->m_message;
 
   if (entry->m_data) {
     for (LogData::const_iterator it = entry->m_data->begin();
          it != entry->m_data->end(); ++it) {
       if (it->first != "id") {
-        oss << "\n  " << it->first << ": "
-            << it->second->object()->get_string() << "";
+        m_buffer += "\n  ";
+        m_buffer += it->first;
+        m_buffer += ": ";
+        m_buffer += it->second->object()->get_string();
       }
     }
   }
 
-  oss << "\n";
+  m_buffer += "\n";
+
+  if (m_buffer.size() >= LOG_BUFFER_SIZE) flush();
+}
+
+//=============================================================================
+void FileLogChannel::flush()
+{
+  if (m_buffer.empty()) return;
 
   if (m_file.is_open()) {
     int na=0;
-    std::string str = oss.str();
-    m_file.write(str.c_str(),str.size(),na);
+    m_file.write(m_buffer.c_str(),m_buffer.size(),na);
   } else if (m_fallback) {
-    std::cout << oss.str();
+    std::cout << m_buffer;
   }
+  m_buffer.clear();
 }
 
 
@@ -210,39 +289,42 @@ CacheLogChannel::~CacheLogChannel()
 //=============================================================================
 void CacheLogChannel::log_entry(LogEntry* entry)
 {
-  Date date(entry->m_time, true);
-  std::ostringstream oss;
-  oss << date.code() << " " 
-      << std::setfill('0') << std::setw(6) << date.microsecond() << " "
-      << "[" << entry->m_category;
+  std::string str;
+  append_time(str, entry->m_time);
+  str += " [";
+  str += entry->m_category;
 
   if (entry->m_data) {
     LogData::const_iterator it = entry->m_data->find("id");
     if (it != entry->m_data->end()) {
-      oss << "/" << it->second->object()->get_string();
+      str += "/";
+      str += it->second->object()->get_string();
     }
   }
   
-  oss << "] " << entry->m_message;
+  str += "] ";
+  str += entry->m_message;
 
   if (entry->m_data) {
-    oss << " {";
+    str += " {";
     bool first = true;
     for (LogData::const_iterator it = entry->m_data->begin();
          it != entry->m_data->end(); ++it) {
-      oss << (first ? "" : ", ")
-          << it->first << ":\""
-          << it->second->object()->get_string() << "\"";
+      str += (first ? "" : ", ");
+      str += it->first;
+      str += ":\"";
+      str += it->second->object()->get_string();
+      str += "\"";
       first = false;
     }
-    oss << "}";
+    str += "}";
   }
 
   if ((int)m_cache.size() == m_max) {
     m_cache.erase(m_cache.begin());
   }
 
-  m_cache.push_back(oss.str());
+  m_cache.push_back(str);
 }
 
 //=============================================================================
@@ -270,6 +352,76 @@ ScriptRef* CacheLogChannel::script_op(const ScriptAuth& auth,
 }
 
 
+//=============================================================================
+LogRing::LogRing(unsigned int size)
+  : m_entries(new LogEntry[size]),
+    m_size(size),
+    m_head(0),
+    m_tail(0),
+    m_closed(false)
+{
+}
+
+//=============================================================================
+LogRing::~LogRing()
+{
+  delete[] m_entries;
+}
+
+//=============================================================================
+LogEntry* LogRing::reserve()
+{
+  unsigned int head = m_head.load(std::memory_order_relaxed);
+  if (head - m_tail.load(std::memory_order_acquire) >= m_size) return 0;
+  return &m_entries[head % m_size];
+}
+
+//=============================================================================
+void LogRing::commit()
+{
+  m_head.store(m_head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+}
+
+//=============================================================================
+unsigned int LogRing::pending() const
+{
+  return m_head.load(std::memory_order_acquire) -
+    m_tail.load(std::memory_order_acquire);
+}
+
+//=============================================================================
+unsigned int LogRing::size() const
+{
+  return m_size;
+}
+
+//=============================================================================
+LogEntry* LogRing::peek(unsigned int index)
+{
+  return &m_entries[(m_tail.load(std::memory_order_relaxed) + index) % m_size];
+}
+
+//=============================================================================
+void LogRing::release(unsigned int num)
+{
+  m_tail.store(m_tail.load(std::memory_order_relaxed) + num,
+               std::memory_order_release);
+}
+
+//=============================================================================
+void LogRing::close()
+{
+  m_closed = true;
+}
+
+//=============================================================================
+bool LogRing::closed() const
+{
+  return m_closed;
+}
+
+
 ScriptRefTo<Logger>* Logger::s_logger = 0;
 
 //=============================================================================
@@ -292,10 +444,12 @@ Logger::~Logger()
     m_thread->stop();
     delete m_thread;
   }
+  process_queue();
   for (ChannelMap::const_iterator it = m_channels.begin();
        it != m_channels.end(); ++it) {
     delete it->second;
   }
+  delete m_write_mutex;
   delete m_mutex;
 }
 
@@ -304,18 +458,30 @@ void Logger::log(const std::string& category,
                  const std::string& message,
                  LogData* data)
 {
-  LogEntry* entry = new LogEntry();
+  // Use the next entry in this thread's ring, or queue a new entry if the
+  // log thread hasn't caught up
+  LogRing* ring = thread_ring();
+  LogEntry* entry = ring->reserve();
+  bool queued = (entry == 0);
+  if (queued) entry = new LogEntry();
+
   ::gettimeofday(&entry->m_time,0);
   entry->m_category = category;
   entry->m_message = message;
   entry->m_data = data;
 
-  m_mutex->lock();
-  m_queue.push_back(entry);
-  m_mutex->unlock();
+  bool wakeup = true;
+  if (queued) {
+    m_mutex->lock();
+    m_overflow.push_back(entry);
+    m_mutex->unlock();
+  } else {
+    ring->commit();
+    wakeup = (m_flush_interval == 0 || ring->pending() >= ring->size()/2);
+  }
 
   if (m_thread) {
-    m_thread->wakeup();
+    if (wakeup) m_thread->wakeup();
   } else {
     process_queue();
   }
@@ -336,6 +502,19 @@ void Logger::set_async(bool async)
   }
 }
 
+//=============================================================================
+void Logger::set_flush_interval(int ms)
+{
+  m_flush_interval = ms;
+  if (m_thread) m_thread->wakeup();
+}
+
+//=============================================================================
+int Logger::get_flush_interval() const
+{
+  return m_flush_interval;
+}
+
 //=============================================================================
 LogChannel* Logger::find_channel(const std::string& name)
 {
@@ -366,7 +545,8 @@ ScriptRef* Logger::script_op(const ScriptAuth& auth,
     // Methods
     if ("add" == name ||
 	"remove" == name ||
-        "set_async" == name) {
+        "set_async" == name ||
+        "set_flush_interval" == name) {
       return new ScriptMethodRef(ref,name);
     }      
 
@@ -384,6 +564,10 @@ ScriptRef* Logger::script_op(const ScriptAuth& auth,
     if ("async" == name) {
       return ScriptInt::new_ref(m_thread != 0);
     }
+
+    if ("flush_interval" == name) {
+      return ScriptInt::new_ref(m_flush_interval);
+    }
     
     // Sub-objects
     LogChannel* channel = find_channel(name);
@@ -424,6 +608,7 @@ ScriptRef* Logger::script_method(const ScriptAuth& auth,
     if (!channel) 
       return ScriptError::new_ref("Failed to create log channel");
 
+    MutexLocker locker(*m_write_mutex);
     m_channels[s_name] = channel;
     return channel->ref_copy();
   }
@@ -436,6 +621,7 @@ ScriptRef* Logger::script_method(const ScriptAuth& auth,
     std::string s_name = a_name->get_string();
 
     // Find and remove channel
+    MutexLocker locker(*m_write_mutex);
     ChannelMap::iterator it = m_channels.find(s_name);
     if (it == m_channels.end())
       return ScriptError::new_ref("Channel '" + s_name + 
@@ -456,6 +642,15 @@ ScriptRef* Logger::script_method(const ScriptAuth& auth,
     set_async(async);
     return 0;
   }
+
+  if ("set_flush_interval" == name) {
+    const ScriptInt* a_ms = 
+      get_method_arg<ScriptInt>(args,0,"ms");
+    if (!a_ms || a_ms->get_int() < 0) 
+      return ScriptError::new_ref("Interval must be >= 0");
+    set_flush_interval(a_ms->get_int());
+    return 0;
+  }
   
   return ScriptObject::script_method(auth,ref,name,args);
 }
@@ -498,8 +693,11 @@ void Logger::provide(const std::string& type,
 //=============================================================================
 Logger::Logger(const FilePath& path)
   : m_path(path),
+    m_thread(0),
     m_mutex(new Mutex()),
-    m_thread(0)
+    m_write_mutex(new Mutex()),
+    m_flush_interval(100),
+    m_serial(++s_logger_serial)
 {
   LogChannel::register_provider("file", this);
   LogChannel::register_provider("cache", this);
@@ -513,19 +711,66 @@ Logger::Logger(const FilePath& path)
 //=============================================================================
 void Logger::process_queue()
 {
-  // If logging in a separate thread, then we only need to protect access to
-  // the queue, otherwise we need to protect the log_entry calls too.
-  bool separate_thread = (0 != m_thread);
-  MutexLocker locker(*m_mutex, !separate_thread);
-  while (true) {
-    if (separate_thread) locker.lock();
-    if (m_queue.empty()) break;
-    LogEntry* entry = m_queue.front();
-    m_queue.pop_front();
-    if (separate_thread) locker.unlock();
+  MutexLocker writer(*m_write_mutex);
+
+  RingList rings;
+  LogQueue overflow;
+  m_mutex->lock();
+  rings = m_rings;
+  overflow.swap(m_overflow);
+  m_mutex->unlock();
 
-    log_entry(entry);
-    delete entry;
+  // Collect the entries waiting in each ring, ordering them by time so
+  // entries from different threads are interleaved correctly
+  std::vector<LogEntry*> entries(overflow.begin(), overflow.end());
+  std::vector<unsigned int> counts;
+  bool closed = false;
+  for (RingList::iterator it = rings.begin(); it != rings.end(); ++it) {
+    LogRing* ring = it->get();
+    unsigned int count = ring->pending();
+    for (unsigned int i=0; i<count; ++i) {
+      entries.push_back(ring->peek(i));
+    }
+    counts.push_back(count);
+    closed |= ring->closed();
+  }
+  std::stable_sort(entries.begin(), entries.end(), log_entry_earlier);
+
+  if (!entries.empty()) {
+    for (std::vector<LogEntry*>::iterator it = entries.begin();
+         it != entries.end(); ++it) {
+      log_entry(*it);
+    }
+    for (ChannelMap::const_iterator it = m_channels.begin();
+         it != m_channels.end(); ++it) {
+      it->second->object()->flush();
+    }
+  }
+
+  // Return the entries to the rings for reuse
+  std::vector<unsigned int>::const_iterator it_count = counts.begin();
+  for (RingList::iterator it = rings.begin(); it != rings.end(); ++it) {
+    LogRing* ring = it->get();
+    unsigned int count = *it_count++;
+    for (unsigned int i=0; i<count; ++i) {
+      ring->peek(i)->clear();
+    }
+    ring->release(count);
+  }
+  for (LogQueue::iterator it = overflow.begin(); it != overflow.end(); ++it) {
+    delete *it;
+  }
+
+  if (closed) {
+    // Discard the rings of threads which have exited, once they are empty
+    MutexLocker locker(*m_mutex);
+    for (RingList::iterator it = m_rings.begin(); it != m_rings.end(); ) {
+      if ((*it)->closed() && (*it)->pending() == 0) {
+        it = m_rings.erase(it);
+      } else {
+        ++it;
+      }
+    }
   }
 }
 
@@ -538,6 +783,21 @@ void Logger::log_entry(LogEntry* entry)
   }
 }
 
+//=============================================================================
+LogRing* Logger::thread_ring()
+{
+  if (s_thread_ring.serial != m_serial) {
+    // First entry logged by this thread (since the logger was created)
+    if (s_thread_ring.ring) s_thread_ring.ring->close();
+    s_thread_ring.ring.reset(new LogRing(LOG_RING_SIZE));
+    s_thread_ring.serial = m_serial;
+
+    MutexLocker locker(*m_mutex);
+    m_rings.push_back(s_thread_ring.ring);
+  }
+  return s_thread_ring.ring.get();
+}
+
 
 //=============================================================================
 LogThread::LogThread(Logger& logger)
@@ -553,7 +813,13 @@ LogThread::~LogThread()
 //=============================================================================
 void* LogThread::run()
 {
-  while (await_wakeup()) {
+  while (true) {
+    // Wait until woken because entries need writing, or for the flush
+    // interval to pass
+    int ms = m_logger.get_flush_interval();
+    if (ms <= 0) ms = LOG_WAKEUP_INTERVAL;
+    timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    if (!await_wakeup(Time(tv))) break;
 
     try {
       m_logger.process_queue();
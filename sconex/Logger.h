@@ -29,6 +29,8 @@ Free Software Foundation, Inc.,
 #include <sconex/Provider.h>
 #include <sconex/File.h>
 #include <deque>
+#include <atomic>
+#include <memory>
 namespace scx {
 
 class Mutex;
@@ -42,6 +44,9 @@ class SCONEX_API LogEntry {
 public:
   LogEntry();
   ~LogEntry();
+
+  // Release any attached data, so the entry can be reused
+  void clear();
   
   timeval m_time;
   std::string m_category;
@@ -67,6 +72,10 @@ public:
 
   // LogChannel interface
   virtual void log_entry(LogEntry* entry) = 0;
+
+  // Output anything buffered by log_entry, called after each batch of
+  // entries has been logged
+  virtual void flush();
   
   // ScriptObject methods
   virtual std::string get_string() const;
@@ -87,6 +96,12 @@ public:
   static void unregister_provider(const std::string& type,
                                   Provider<LogChannel::Ref>* factory);
 
+protected:
+
+  // Append the time of an entry, formatted as "<date code> <microseconds>",
+  // the date code is only formatted once per second
+  void append_time(std::string& str, const timeval& time);
+
 private:
 
   static void init();
@@ -94,6 +109,9 @@ private:
   static ProviderScheme<LogChannel::Ref>* s_providers;
 
   std::string m_name;
+
+  time_t m_time_sec;
+  std::string m_time_code;
   
 };
 
@@ -110,11 +128,15 @@ public:
   ~FileLogChannel();
 
   virtual void log_entry(LogEntry* entry);
+  virtual void flush();
 
 protected:  
 
   File m_file;
   bool m_fallback;
+
+  // Formatted entries waiting to be written
+  std::string m_buffer;
   
 };
 
@@ -143,6 +165,49 @@ protected:
 };
 
   
+//=============================================================================
+// LogRing - Fixed size ring of log entries, filled by one thread and emptied
+// by the logger without locking. The entries are reused, so logging doesn't
+// normally need to allocate.
+//
+class SCONEX_API LogRing {
+public:
+
+  LogRing(unsigned int size);
+  ~LogRing();
+
+  // Get the next free entry to fill in, or 0 if the ring is full
+  // (producer only)
+  LogEntry* reserve();
+
+  // Make the reserved entry available to the logger (producer only)
+  void commit();
+
+  // Number of entries waiting to be logged
+  unsigned int pending() const;
+  unsigned int size() const;
+
+  // Get a waiting entry, index 0 being the oldest (consumer only)
+  LogEntry* peek(unsigned int index);
+
+  // Free the oldest num entries for reuse (consumer only)
+  void release(unsigned int num);
+
+  // Mark the ring as no longer used by its thread
+  void close();
+  bool closed() const;
+
+private:
+
+  LogEntry* m_entries;
+  unsigned int m_size;
+
+  std::atomic<unsigned int> m_head;
+  std::atomic<unsigned int> m_tail;
+  std::atomic<bool> m_closed;
+};
+
+  
 //=============================================================================
 // Logger - Manages queuing of log entries and sending to channels for output
 //
@@ -165,6 +230,12 @@ public:
 
   // Enable asynchronous logging
   void set_async(bool async);
+
+  // Set the maximum time entries wait before being written when logging
+  // asynchronously (milliseconds). If 0, entries are written as soon as
+  // possible.
+  void set_flush_interval(int ms);
+  int get_flush_interval() const;
   
   // Find log channel by name
   LogChannel* find_channel(const std::string& name);
@@ -197,14 +268,32 @@ protected:
   void process_queue();
   void log_entry(LogEntry* entry);
 
+  // Get the ring used by the calling thread, creating it if required
+  LogRing* thread_ring();
+
 private:
 
   FilePath m_path;
-  Mutex* m_mutex;
   LogThread* m_thread;
 
+  // Protects the ring list and overflow queue
+  Mutex* m_mutex;
+
+  // Held while entries are being written, and while changing channels
+  Mutex* m_write_mutex;
+
+  // Rings for each thread which has logged
+  typedef std::list<std::shared_ptr<LogRing> > RingList;
+  RingList m_rings;
+
+  // Entries logged while their thread's ring was full
   typedef std::deque<LogEntry*> LogQueue;
-  LogQueue m_queue;
+  LogQueue m_overflow;
+
+  std::atomic<int> m_flush_interval;
+
+  // Identifies this logger to the per-thread rings
+  unsigned int m_serial;
 
   typedef std::map<std::string,LogChannel::Ref*> ChannelMap;
   ChannelMap m_channels;
@@ -0,0 +1,68 @@
+/* SconeServer (http://www.sconemad.com)
+
+UNIT TESTS for Logger
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include <sconex/Logger.h>
+#include <sconex/Date.h>
+#include <sconex/UnitTester.h>
+using namespace scx;
+
+// Channel which formats entry times into a string
+class TimeLogChannel : public LogChannel {
+public:
+  TimeLogChannel() : LogChannel("time") {};
+  virtual void log_entry(LogEntry* entry) {};
+  std::string format(long sec, long usec) {
+    timeval time = { sec, usec };
+    std::string str;
+    append_time(str,time);
+    return str;
+  };
+};
+
+static std::string time_code(long sec)
+{
+  timeval time = { sec, 0 };
+  return Date(time,true).code() + " ";
+}
+
+void Logger_ut()
+{
+  UTSEC("time format");
+
+  TimeLogChannel* ch = new TimeLogChannel();
+  ScriptRef ref(ch);
+
+  UTMSG("microseconds");
+  UTEST(ch->format(1000000000,0) == time_code(1000000000) + "000000");
+  UTEST(ch->format(1000000000,42) == time_code(1000000000) + "000042");
+
+  UTMSG("crossing a second boundary");
+  UTEST(ch->format(1000000000,999999) == time_code(1000000000) + "999999");
+  UTEST(ch->format(1000000001,1) == time_code(1000000001) + "000001");
+  UTEST(time_code(1000000000) != time_code(1000000001));
+
+  UTMSG("earlier second, i.e. from another thread's ring");
+  UTEST(ch->format(1000000000,500000) == time_code(1000000000) + "500000");
+
+  UTMSG("crossing a day boundary");
+  UTEST(ch->format(1000079999,999999) == time_code(1000079999) + "999999");
+  UTEST(ch->format(1000080000,0) == time_code(1000080000) + "000000");
+}
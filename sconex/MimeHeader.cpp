@@ -313,7 +313,24 @@ void MimeHeaderTable::set(
   const std::string& value
 )
 {
-  m_headers[normalize(name)]=value;
+  std::string nname = normalize(name);
+  m_headers[nname]=value;
+  m_repeats.erase(nname);
+}
+
+//===========================================================================
+void MimeHeaderTable::add(
+  const std::string& name,
+  const std::string& value
+)
+{
+  std::string nname = normalize(name);
+  HeaderMap::iterator it = m_headers.find(nname);
+  if (it == m_headers.end()) {
+    m_headers[nname]=value;
+  } else {
+    m_repeats.insert(RepeatMap::value_type(nname,value));
+  }
 }
 
 //===========================================================================
@@ -334,7 +351,9 @@ std::string MimeHeaderTable::parse_line(const std::string& line)
     }
   }
  
-  m_headers[normalize(name)]=value;
+  std::string nname = normalize(name);
+  m_headers[nname]=value;
+  m_repeats.erase(nname);
   return name;
 }
 
@@ -345,6 +364,7 @@ bool MimeHeaderTable::erase(const std::string& name)
   if (it == m_headers.end()) {
     return false;
   }
+  m_repeats.erase(it->first);
   m_headers.erase(it);
   return false;
 }
@@ -381,6 +401,11 @@ std::string MimeHeaderTable::get_all() const
        it != m_headers.end();
        ++it) {
     oss << (*it).first << ": " << (*it).second << "\r\n";
+    std::pair<RepeatMap::const_iterator,RepeatMap::const_iterator> r =
+      m_repeats.equal_range((*it).first);
+    for (RepeatMap::const_iterator itr = r.first; itr != r.second; ++itr) {
+      oss << (*itr).first << ": " << (*itr).second << "\r\n";
+    }
   }
   return oss.str();
 }
@@ -87,6 +87,11 @@ public:
   void set(const std::string& name,const std::string& value);
   std::string parse_line(const std::string& line);
 
+  // Add a further value for a header which can be repeated (e.g.
+  // Set-Cookie), which is output as a separate header line. Setting or
+  // erasing the header removes any further values.
+  void add(const std::string& name,const std::string& value);
+
   bool erase(const std::string& name);
   std::string get(const std::string& name) const;
   MimeHeader get_parsed(const std::string& name) const;
@@ -100,6 +105,9 @@ private:
   typedef std::map<std::string,std::string> HeaderMap;
   HeaderMap m_headers;
 
+  typedef std::multimap<std::string,std::string> RepeatMap;
+  RepeatMap m_repeats;
+
 };
 
 };
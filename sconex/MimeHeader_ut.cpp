@@ -44,5 +44,20 @@ void MimeHeader_ut()
   UTEST(pdonkey == "aminal");
 
   std::cout << mh1.get_string() << "\n";
+
+  UTSEC("table");
+
+  UTCOD(MimeHeaderTable mht1);
+  UTCOD(mht1.set("content-length","10"));
+  UTCOD(mht1.add("Set-Cookie","a=1"));
+  UTCOD(mht1.add("set-cookie","b=2"));
+  UTEST(mht1.get("Set-Cookie") == "a=1");
+  UTEST(mht1.get_all() ==
+        "Content-Length: 10\r\nSet-Cookie: a=1\r\nSet-Cookie: b=2\r\n");
+  UTCOD(mht1.set("Set-Cookie","c=3"));
+  UTEST(mht1.get_all() == "Content-Length: 10\r\nSet-Cookie: c=3\r\n");
+  UTCOD(mht1.add("Set-Cookie","d=4"));
+  UTCOD(mht1.erase("Set-Cookie"));
+  UTEST(mht1.get_all() == "Content-Length: 10\r\n");
   
 }
@@ -72,11 +72,11 @@ public:
 
   void enable_jobs(bool yesno);
 
-protected:
-
   // Wakeup the main thread
   void wakeup();
 
+protected:
+
   void update_stats(const Time& dispatch_time);
   
 private:
@@ -38,6 +38,7 @@ Stream* Stream::create_new(const std::string& type,
 Stream::Stream(const std::string& stream_name)
   : m_stream_name(stream_name),
     m_events(0),
+    m_requested_events(0),
     m_chain(0),
     m_endpoint(0)
 {
@@ -104,6 +105,23 @@ Condition Stream::write(Buffer& buffer, int n)
   return c;
 }
  
+//=============================================================================
+Condition Stream::write_file(int fd,int n,int& na)
+{
+  na = 0;
+  return End;
+}
+
+//=============================================================================
+Condition Stream::chain_write_file(int fd,int n,int& na)
+{
+  DEBUG_ASSERT(m_chain || m_endpoint,"write_file() Unconnected stream");
+  if (m_chain) {
+    return m_chain->write_file(fd,n,na);
+  }
+  return m_endpoint->endpoint_write_file(fd,n,na);
+}
+
 //=============================================================================
 // Write adaptor for zero terminated string
 //
@@ -218,6 +236,12 @@ void Stream::enable_event(Event e, bool onoff)
   }
 }
 
+//=============================================================================
+void Stream::request_event(Event e)
+{
+  m_requested_events.fetch_or(1 << e);
+}
+
 //=============================================================================
 Stream* Stream::find_stream(const std::string& stream_name)
 {
@@ -231,6 +255,12 @@ Stream* Stream::find_stream(const std::string& stream_name)
   return m_chain->find_stream(stream_name);
 }
 
+//=============================================================================
+bool Stream::is_first_stream() const
+{
+  return (m_chain == 0);
+}
+
 //=============================================================================
 Descriptor& Stream::endpoint()
 {
@@ -26,6 +26,7 @@ Free Software Foundation, Inc.,
 #include <sconex/IOBase.h>
 #include <sconex/Descriptor.h>
 #include <sconex/Provider.h>
+#include <atomic>
 namespace scx {
 
 class Module;
@@ -62,6 +63,12 @@ public:
   virtual int write(const char* string);
   virtual int write(const std::string& string);
 
+  // Write up to n bytes from the current position of the file descriptor fd
+  // without copying the data through user space, advancing the position.
+  // This is only supported by streams which pass data through unchanged,
+  // others return End to indicate that write() must be used instead.
+  virtual Condition write_file(int fd,int n,int& na);
+
   // Event types
   enum Event {
     Opening, Closing,
@@ -154,9 +161,22 @@ protected:
   //
   void enable_event(Event e, bool onoff);
 
+  // Request that an event is enabled, from a thread other than the one
+  // dispatching this stream (which is the only one that may call
+  // enable_event). The owning job enables it the next time it runs, so
+  // call Kernel::wakeup() afterwards for this to happen promptly.
+  void request_event(Event e);
+
   // Try and find named stream in the chain of preceeding streams
   Stream* find_stream(const std::string& stream_name);
 
+  // Pass write_file on to the preceeding stream or the endpoint, for use by
+  // streams which support it
+  Condition chain_write_file(int fd,int n,int& na);
+
+  // Is this stream attached directly to the endpoint
+  bool is_first_stream() const;
+
   // Allow access to the endpoint
   Descriptor& endpoint();
 
@@ -168,6 +188,9 @@ private:
   // Event status
   int m_events;
 
+  // Events requested from other threads, see request_event()
+  std::atomic<int> m_requested_events;
+
   // Upstream pointer
   Stream* m_chain;
 
@@ -20,6 +20,9 @@ Free Software Foundation, Inc.,
 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
 
 #include <sconex/StreamSocket.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
 namespace scx {
 
 // Uncomment to enable debug logging
@@ -236,6 +239,47 @@ Condition StreamSocket::endpoint_write(
   return scx::Error;
 }
 
+//=============================================================================
+Condition StreamSocket::endpoint_write_file(
+  int fd,
+  int n,
+  int& na
+)
+{
+  na = 0;
+#ifdef HAVE_SYS_SENDFILE_H
+  if (state()!=Descriptor::Connected &&
+      state()!=Descriptor::Closing) {
+    STREAMSOCKET_DEBUG_LOG("write_file() attempted on closed socket");
+    return scx::Error;
+  }
+
+  ssize_t ret = ::sendfile(m_socket,fd,0,n);
+
+  if (ret >= 0) {
+    // Sent some or all of the data ok (or reached the end of the file)
+    na = (int)ret;
+    return scx::Ok;
+
+  } else if (errno == EINVAL || errno == ENOSYS) {
+    // Not supported for this file
+    return scx::End;
+
+  } else if (error() == Descriptor::Wait) {
+    // Cannot send right now
+    return scx::Wait;
+  }
+
+  // Fatal error occured
+  STREAMSOCKET_DEBUG_LOG("write_file() error: " << error() << " errno: "
+                         << errno);
+  m_state = Socket::Closed;
+  return scx::Error;
+#else
+  return scx::End;
+#endif
+}
+
 //=============================================================================
 int StreamSocket::accept(
   SOCKET sock,
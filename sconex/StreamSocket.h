@@ -59,6 +59,7 @@ protected:
 
   virtual Condition endpoint_read(void* buffer,int n,int& na);
   virtual Condition endpoint_write(const void* buffer,int n,int& na);
+  virtual Condition endpoint_write_file(int fd,int n,int& na);
   // Socket I/O
 
   friend class ListenerSocket;
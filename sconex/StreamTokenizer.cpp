@@ -146,6 +146,12 @@ Condition StreamTokenizer::read(void* buffer,int n,int& na)
   return c;
 }
 
+//=============================================================================
+Condition StreamTokenizer::write_file(int fd,int n,int& na)
+{
+  return chain_write_file(fd,n,na);
+}
+
 //=============================================================================
 bool StreamTokenizer::has_readable() const
 {
@@ -46,6 +46,9 @@ public:
   
   virtual Condition read(void* buffer,int n,int& na);
 
+  // Writes are passed through unchanged
+  virtual Condition write_file(int fd,int n,int& na);
+
   virtual bool has_readable() const;
 
   virtual std::string stream_status() const;
@@ -37,7 +37,8 @@ StreamTransfer::StreamTransfer(
 ) : Stream("transfer"),
     m_status(StreamTransfer::Transfer),
     m_buffer(buffer_size),
-    m_close_when_finished(false)
+    m_close_when_finished(false),
+    m_zero_copy(true)
 {
   DEBUG_COUNT_CONSTRUCTOR(StreamTransfer);
 
@@ -114,6 +115,7 @@ std::string StreamTransfer::stream_status() const
   std::ostringstream oss;
   oss << "<-[" << m_manager->get_uid() << "] buf:" << m_buffer.status_string();
   if (m_close_when_finished) oss << " AUTOCLOSE";
+  if (m_zero_copy) oss << " ZEROCOPY";
   return oss.str();
 }
 
@@ -127,6 +129,14 @@ StreamTransfer::Status StreamTransfer::transfer()
   int bytes_buffered = m_buffer.used();
 
   StreamTransferSource* source = m_manager->get_source();
+
+  if (bytes_buffered==0 && source && m_zero_copy) {
+    if (transfer_direct(source)) {
+      return m_status;
+    }
+    // Not possible, use the buffer from now on
+    m_zero_copy = false;
+  }
   
   if (bytes_buffered==0 && source) {
     Condition c_in = source->read(
@@ -173,12 +183,55 @@ StreamTransfer::Status StreamTransfer::transfer()
   return m_status;
 }
 
+//=============================================================================
+bool StreamTransfer::transfer_direct(StreamTransferSource* source)
+{
+  int fd = source->direct_fd();
+  if (fd < 0) {
+    return false;
+  }
+
+  int bytes_written=0;
+  Condition c_out = chain_write_file(fd,m_buffer.size(),bytes_written);
+  switch (c_out) {
+    case scx::End:
+      TRANSFER_DEBUG_LOG("direct transfer not supported");
+      return false;
+
+    case scx::Error:
+      m_status = StreamTransfer::Write_error;
+      STREAM_DEBUG_LOG("write_file ERROR c_out=" << c_out);
+      return true;
+
+    case scx::Ok:
+      if (bytes_written==0) {
+        m_status = StreamTransfer::Finished;
+        TRANSFER_DEBUG_LOG("write_file END");
+        return true;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  endpoint().reset_timeout();
+  TRANSFER_DEBUG_LOG("write_file " << bytes_written << " bytes");
+  return true;
+}
+
 //=============================================================================
 void StreamTransfer::set_close_when_finished(bool onoff)
 {
   m_close_when_finished = onoff;
 }
 
+//=============================================================================
+void StreamTransfer::set_zero_copy(bool onoff)
+{
+  m_zero_copy = onoff;
+}
+
 //=============================================================================
 void StreamTransfer::source_event(Event e)
 {
@@ -250,6 +303,21 @@ std::string StreamTransferSource::stream_status() const
   return oss.str();
 }
 
+//=============================================================================
+int StreamTransferSource::direct_fd()
+{
+  if (!is_first_stream()) {
+    return -1;
+  }
+  // Only regular files can be sent directly
+  int fd = endpoint().fd();
+  struct stat st;
+  if (fd < 0 || fstat(fd,&st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  return fd;
+}
+
 //=============================================================================
 void StreamTransferSource::dest_event(Event e)
 {
@@ -66,11 +66,20 @@ public:
 
   void set_close_when_finished(bool onoff);
 
+  // Allow data to be sent directly from the source descriptor, where the
+  // source and destination streams support it (see Stream::write_file).
+  // This is enabled by default.
+  void set_zero_copy(bool onoff);
+
 protected:
 
   friend class StreamTransferManager;
   void source_event(Event e);
 
+  // Transfer directly from the source descriptor, returns false if this
+  // is not possible and the data must be read into the buffer instead
+  bool transfer_direct(StreamTransferSource* source);
+
   Status m_status;
   
   StreamTransferManager* m_manager;
@@ -78,6 +87,8 @@ protected:
   Buffer m_buffer;
 
   bool m_close_when_finished;
+
+  bool m_zero_copy;
   
 };
 
@@ -92,6 +103,10 @@ public:
   virtual Condition event(Event e);
 
   virtual std::string stream_status() const;
+
+  // Get the source file descriptor, if data can be read directly from it
+  // (i.e. there are no other streams on the source), otherwise -1
+  int direct_fd();
   
 protected:
 
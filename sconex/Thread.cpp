@@ -140,6 +140,19 @@ bool Thread::await_wakeup()
   }
   return (m_state == Running);
 }
+
+//=============================================================================
+bool Thread::await_wakeup(const Time& timeout)
+{
+  if (m_state == Stopped) {
+    m_mutex.lock();
+    m_state = Running;
+  }
+  if (m_state == Running) {
+    m_wakeup.wait_timeout(m_mutex,timeout);
+  }
+  return (m_state == Running);
+}
   
 //=============================================================================
 bool Thread::should_exit() const
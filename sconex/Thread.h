@@ -63,6 +63,9 @@ protected:
   // Returns false if the the thread should stop, true otherwise.
   bool await_wakeup();
 
+  // Wait to be woken up, or until the timeout has passed
+  bool await_wakeup(const Time& timeout);
+
   // Shoule the thread exit
   bool should_exit() const;
 
@@ -27,7 +27,9 @@ int main(int argc,char* argv[])
 {
   UTRUN(Buffer);
   UTRUN(FilePath);
+  UTRUN(FileWatcher);
   UTRUN(LineBuffer);
+  UTRUN(Logger);
   UTRUN(MemFile);
   UTRUN(MimeHeader);
   UTRUN(MimeType);
@@ -86,18 +86,30 @@ std::string escape_quotes(const std::string& s)
 std::string escape_html(const std::string& s)
 {
   std::string r;
-  int n = s.length();
-  for (int i=0; i<n; ++i) {
-    char c = s[i];
-    switch (c) {
-      case '&': r += "&amp;"; break;
-      case '<': r += "&lt;"; break;
-      case '>': r += "&gt;"; break;
-      case '\"': r += "&quot;"; break;
-      default: r += c; break;
+  escape_html(s,r);
+  return r;
+}
+
+//============================================================================
+void escape_html(const std::string& s, std::string& out)
+{
+  // Copy runs of characters which don't need escaping in one go
+  const char* run = s.data();
+  const char* end = run + s.length();
+  for (const char* p = run; p != end; ++p) {
+    const char* esc = 0;
+    switch (*p) {
+      case '&': esc = "&amp;"; break;
+      case '<': esc = "&lt;"; break;
+      case '>': esc = "&gt;"; break;
+      case '\"': esc = "&quot;"; break;
+      default: continue;
     }
+    out.append(run, p - run);
+    out.append(esc);
+    run = p + 1;
   }
-  return r;
+  out.append(run, end - run);
 }
 
 //============================================================================
@@ -37,6 +37,9 @@ std::string SCONEX_API escape_quotes(const std::string& s);
 // Escape string to remove html control chars
 std::string SCONEX_API escape_html(const std::string& s);
 
+// Escape string to remove html control chars, appending the result to out
+void SCONEX_API escape_html(const std::string& s, std::string& out);
+
 // New up a c style string from a c++ string
 char* SCONEX_API new_c_str(const std::string& str);
 
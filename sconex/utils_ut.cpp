@@ -85,6 +85,10 @@ void utils_ut()
 
   UTEST(escape_html("One & One & One is > two, but < four") == "One &amp; One &amp; One is &gt; two, but &lt; four");
 
+  std::string esc = "<p>";
+  escape_html("\"Fish\" & <chips>",esc);
+  UTEST(esc == "<p>&quot;Fish&quot; &amp; &lt;chips&gt;");
+
 
   UTSEC("random_hex_string");
 
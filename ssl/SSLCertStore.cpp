@@ -0,0 +1,487 @@
+/* SconeServer (http://www.sconemad.com)
+
+SSL certificate store
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include "SSLCertStore.h"
+#include "SSLChannel.h"
+#include "SSLModule.h"
+
+#include <sconex/ScriptTypes.h>
+#include <sconex/Kernel.h>
+#include <sconex/FileDir.h>
+#include <sconex/FileStat.h>
+#include <sconex/Log.h>
+#include <sconex/utils.h>
+
+//=============================================================================
+// Get the modification time of a file, or 0 if it doesn't exist
+//
+static time_t file_mtime(const scx::FilePath& path)
+{
+  scx::FileStat stat(path);
+  if (!stat.exists()) return 0;
+  return stat.time().epoch_seconds();
+}
+
+//=============================================================================
+SSLCertStore::SSLCertStore(SSLModule& module)
+  : m_module(module),
+    m_max_loaded(0),
+    m_check_interval(60),
+    m_hits(0),
+    m_misses(0),
+    m_loads(0),
+    m_reloads(0),
+    m_failures(0),
+    m_evictions(0)
+{
+  m_parent = &m_module;
+}
+
+//=============================================================================
+SSLCertStore::~SSLCertStore()
+{
+  for (EntryMap::iterator it = m_entries.begin();
+       it != m_entries.end();
+       ++it) {
+    if (it->second.ctx) SSL_CTX_free(it->second.ctx);
+  }
+}
+
+//=============================================================================
+void SSLCertStore::add(const std::string& pattern,
+                       const scx::FilePath& key,
+                       const scx::FilePath& cert)
+{
+  std::string name = pattern;
+  scx::strlow(name);
+
+  scx::MutexLocker locker(m_mutex);
+  EntryMap::iterator it = m_entries.find(name);
+  if (it != m_entries.end()) {
+    unload(it->second);
+  }
+
+  Entry& entry = m_entries[name];
+  entry.key = key;
+  entry.cert = cert;
+  entry.ctx = 0;
+  entry.key_mtime = 0;
+  entry.cert_mtime = 0;
+  entry.checked = 0;
+  entry.failed = false;
+  entry.listed = false;
+}
+
+//=============================================================================
+bool SSLCertStore::remove(const std::string& pattern)
+{
+  std::string name = pattern;
+  scx::strlow(name);
+
+  scx::MutexLocker locker(m_mutex);
+  EntryMap::iterator it = m_entries.find(name);
+  if (it == m_entries.end()) return false;
+
+  // Connections using the context keep their own reference to it
+  unload(it->second);
+  m_entries.erase(it);
+  return true;
+}
+
+//=============================================================================
+int SSLCertStore::add_dir(const scx::FilePath& dir)
+{
+  if (!scx::FileStat(dir).is_dir()) return -1;
+
+  const std::string ext = ".pub";
+  int count = 0;
+  scx::FileDir files(dir);
+  while (files.next()) {
+    const std::string& file = files.name();
+    if (file.size() <= ext.size() ||
+        file.compare(file.size() - ext.size(), ext.size(), ext) != 0) {
+      continue;
+    }
+
+    std::string host = file.substr(0, file.size() - ext.size());
+    scx::FilePath key = dir + host;
+    if (!scx::FileStat(key).is_file()) continue;
+
+    if (host[0] == '_') host[0] = '*';
+    add(host, key, files.path());
+    ++count;
+  }
+  return count;
+}
+
+//=============================================================================
+SSL_CTX* SSLCertStore::lookup(const std::string& host, std::string& pattern)
+{
+  std::string name = host;
+  scx::strlow(name);
+  if (!name.empty() && name[name.size()-1] == '.') {
+    name.erase(name.size()-1);
+  }
+
+  scx::MutexLocker locker(m_mutex);
+  EntryMap::iterator it = find(name);
+  if (it == m_entries.end()) {
+    ++m_misses;
+    return 0;
+  }
+  pattern = it->first;
+
+  refresh(locker, pattern, time(0), false);
+
+  // The entry may have been removed while it was being loaded
+  it = m_entries.find(pattern);
+  if (it == m_entries.end() || !it->second.ctx) {
+    ++m_misses;
+    return 0;
+  }
+
+  Entry& entry = it->second;
+  SSL_CTX_up_ref(entry.ctx);
+  touch(pattern, entry);
+  ++m_hits;
+  return entry.ctx;
+}
+
+//=============================================================================
+int SSLCertStore::reload()
+{
+  time_t now = time(0);
+  scx::MutexLocker locker(m_mutex);
+
+  std::list<std::string> patterns;
+  for (EntryMap::const_iterator it = m_entries.begin();
+       it != m_entries.end();
+       ++it) {
+    if (it->second.ctx || it->second.failed) patterns.push_back(it->first);
+  }
+
+  int count = 0;
+  for (std::list<std::string>::const_iterator it = patterns.begin();
+       it != patterns.end();
+       ++it) {
+    if (refresh(locker, *it, now, true)) ++count;
+  }
+  return count;
+}
+
+//=============================================================================
+std::string SSLCertStore::wildcard(const std::string& host)
+{
+  std::string::size_type dot = host.find('.');
+  if (dot == std::string::npos || dot == 0) return "";
+  return "*" + host.substr(dot);
+}
+
+//=============================================================================
+std::string SSLCertStore::get_string() const
+{
+  return "SSLCertStore";
+}
+
+//=============================================================================
+scx::ScriptRef* SSLCertStore::script_op(const scx::ScriptAuth& auth,
+                                        const scx::ScriptRef& ref,
+                                        const scx::ScriptOp& op,
+                                        const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("add" == name ||
+        "remove" == name ||
+        "add_dir" == name ||
+        "reload" == name ||
+        "set_max_loaded" == name ||
+        "set_check_interval" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("list" == name) {
+      scx::ScriptList* list = new scx::ScriptList();
+      for (EntryMap::const_iterator it = m_entries.begin();
+           it != m_entries.end();
+           ++it) {
+        list->give(scx::ScriptString::new_ref(it->first));
+      }
+      return new scx::ScriptRef(list);
+    }
+    if ("entries" == name)
+      return scx::ScriptInt::new_ref(m_entries.size());
+    if ("loaded" == name)
+      return scx::ScriptInt::new_ref(m_lru.size());
+    if ("max_loaded" == name)
+      return scx::ScriptInt::new_ref(m_max_loaded);
+    if ("check_interval" == name)
+      return scx::ScriptInt::new_ref(m_check_interval);
+    if ("hits" == name)
+      return scx::ScriptInt::new_ref(m_hits);
+    if ("misses" == name)
+      return scx::ScriptInt::new_ref(m_misses);
+    if ("loads" == name)
+      return scx::ScriptInt::new_ref(m_loads);
+    if ("reloads" == name)
+      return scx::ScriptInt::new_ref(m_reloads);
+    if ("failures" == name)
+      return scx::ScriptInt::new_ref(m_failures);
+    if ("evictions" == name)
+      return scx::ScriptInt::new_ref(m_evictions);
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=============================================================================
+scx::ScriptRef* SSLCertStore::script_method(const scx::ScriptAuth& auth,
+                                            const scx::ScriptRef& ref,
+                                            const std::string& name,
+                                            const scx::ScriptRef* args)
+{
+  if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+  scx::FilePath conf = scx::Kernel::get()->get_conf_path();
+
+  if ("add" == name) {
+    const scx::ScriptString* a_host =
+      scx::get_method_arg<scx::ScriptString>(args,0,"host");
+    if (!a_host || a_host->get_string().empty())
+      return scx::ScriptError::new_ref("Host pattern must be specified");
+
+    const scx::ScriptString* a_key =
+      scx::get_method_arg<scx::ScriptString>(args,1,"key");
+    if (!a_key)
+      return scx::ScriptError::new_ref("Key name must be supplied");
+    scx::FilePath key = conf + a_key->get_string();
+
+    const scx::ScriptString* a_cert =
+      scx::get_method_arg<scx::ScriptString>(args,2,"cert");
+    scx::FilePath cert = conf;
+    if (a_cert) {
+      cert = cert + a_cert->get_string();
+    } else {
+      cert = cert + std::string(a_key->get_string() + ".pub");
+    }
+
+    add(a_host->get_string(), key, cert);
+    return 0;
+  }
+
+  if ("remove" == name) {
+    const scx::ScriptString* a_host =
+      scx::get_method_arg<scx::ScriptString>(args,0,"host");
+    if (!a_host)
+      return scx::ScriptError::new_ref("Host pattern must be specified");
+    if (!remove(a_host->get_string()))
+      return scx::ScriptError::new_ref("No certificate for '" +
+                                       a_host->get_string() + "'");
+    return 0;
+  }
+
+  if ("add_dir" == name) {
+    const scx::ScriptString* a_dir =
+      scx::get_method_arg<scx::ScriptString>(args,0,"dir");
+    if (!a_dir)
+      return scx::ScriptError::new_ref("Directory must be specified");
+    int count = add_dir(conf + a_dir->get_string());
+    if (count < 0)
+      return scx::ScriptError::new_ref("Cannot read certificate directory");
+    return scx::ScriptInt::new_ref(count);
+  }
+
+  if ("reload" == name) {
+    return scx::ScriptInt::new_ref(reload());
+  }
+
+  if ("set_max_loaded" == name) {
+    const scx::ScriptInt* a_max =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"max");
+    if (!a_max || a_max->get_int() < 0)
+      return scx::ScriptError::new_ref("Maximum must be specified");
+    scx::MutexLocker locker(m_mutex);
+    m_max_loaded = a_max->get_int();
+    while (m_max_loaded > 0 && (int)m_lru.size() > m_max_loaded) {
+      unload(m_entries[m_lru.back()]);
+      ++m_evictions;
+    }
+    return 0;
+  }
+
+  if ("set_check_interval" == name) {
+    const scx::ScriptInt* a_interval =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"interval");
+    if (!a_interval || a_interval->get_int() < 0)
+      return scx::ScriptError::new_ref("Interval must be specified");
+    scx::MutexLocker locker(m_mutex);
+    m_check_interval = a_interval->get_int();
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+//=============================================================================
+SSLCertStore::EntryMap::iterator SSLCertStore::find(const std::string& host)
+{
+  EntryMap::iterator it = m_entries.find(host);
+  if (it != m_entries.end()) return it;
+
+  std::string pattern = wildcard(host);
+  if (pattern.empty()) return m_entries.end();
+  return m_entries.find(pattern);
+}
+
+//=============================================================================
+SSL_CTX* SSLCertStore::load(const scx::FilePath& key,
+                            const scx::FilePath& cert,
+                            std::string& error)
+{
+  SSL_CTX* ctx = SSL_CTX_new( SSLv23_server_method() );
+  if (!ctx) {
+    error = "Cannot create context";
+    return 0;
+  }
+
+  // Disallow old SSL protocols
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
+
+  SSLChannel::set_alpn_callback(ctx);
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert.path().c_str()) <= 0) {
+    error = "Error loading certificate";
+  } else if (SSL_CTX_use_PrivateKey_file(ctx, key.path().c_str(),
+                                         SSL_FILETYPE_PEM) <= 0) {
+    error = "Error loading private key";
+  } else if (!SSL_CTX_check_private_key(ctx)) {
+    error = "Loaded keys do not match";
+  } else {
+    return ctx;
+  }
+
+  ERR_clear_error();
+  SSL_CTX_free(ctx);
+  return 0;
+}
+
+//=============================================================================
+bool SSLCertStore::refresh(scx::MutexLocker& locker,
+                           const std::string& pattern,
+                           time_t now,
+                           bool force)
+{
+  EntryMap::iterator it = m_entries.find(pattern);
+  if (it == m_entries.end()) return false;
+  Entry& entry = it->second;
+
+  bool first = (!entry.ctx && !entry.failed);
+  if (!first && !force && now < entry.checked + m_check_interval) {
+    return false;
+  }
+  entry.checked = now;
+
+  time_t key_mtime = file_mtime(entry.key);
+  time_t cert_mtime = file_mtime(entry.cert);
+  if (!first &&
+      key_mtime == entry.key_mtime &&
+      cert_mtime == entry.cert_mtime) {
+    return false;
+  }
+
+  // Load the files without holding the lock, so that lookups for other
+  // hosts aren't held up
+  scx::FilePath key = entry.key;
+  scx::FilePath cert = entry.cert;
+  locker.unlock();
+  std::string error;
+  SSL_CTX* ctx = load(key, cert, error);
+  locker.lock();
+
+  it = m_entries.find(pattern);
+  if (it == m_entries.end() ||
+      it->second.key.path() != key.path() ||
+      it->second.cert.path() != cert.path() ||
+      (it->second.ctx &&
+       it->second.key_mtime == key_mtime &&
+       it->second.cert_mtime == cert_mtime)) {
+    // Removed, replaced or already loaded by another thread meanwhile
+    if (ctx) SSL_CTX_free(ctx);
+    return false;
+  }
+  Entry& current = it->second;
+  current.key_mtime = key_mtime;
+  current.cert_mtime = cert_mtime;
+
+  if (!ctx) {
+    // Keep using the previous context if there is one, and don't try again
+    // until the files change
+    ++m_failures;
+    if (!current.ctx) current.failed = true;
+    scx::Log("ssl").submit(error + " for '" + pattern + "'");
+    return false;
+  }
+
+  if (current.ctx) {
+    SSL_CTX_free(current.ctx);
+    ++m_reloads;
+  } else {
+    ++m_loads;
+  }
+  current.ctx = ctx;
+  current.failed = false;
+  return true;
+}
+
+//=============================================================================
+void SSLCertStore::unload(Entry& entry)
+{
+  if (entry.listed) {
+    m_lru.erase(entry.lru);
+    entry.listed = false;
+  }
+  if (entry.ctx) {
+    SSL_CTX_free(entry.ctx);
+    entry.ctx = 0;
+  }
+  entry.failed = false;
+}
+
+//=============================================================================
+void SSLCertStore::touch(const std::string& pattern, Entry& entry)
+{
+  if (entry.listed) {
+    m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+  } else {
+    entry.lru = m_lru.insert(m_lru.begin(), pattern);
+    entry.listed = true;
+  }
+
+  while (m_max_loaded > 0 && (int)m_lru.size() > m_max_loaded) {
+    unload(m_entries[m_lru.back()]);
+    ++m_evictions;
+  }
+}
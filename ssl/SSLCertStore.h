@@ -0,0 +1,157 @@
+/* SconeServer (http://www.sconemad.com)
+
+SSL certificate store
+
+Holds certificates for SNI host names, so that a single channel can serve
+any number of domains. Certificates are registered by host name or wildcard
+pattern ("*.example.com") and are only loaded when a client first asks for
+them. Loaded certificates are checked for changes periodically, and changed
+files are loaded into a new context which replaces the old one, so existing
+connections (which hold a reference to the old context) are unaffected.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef sslCertStore_h
+#define sslCertStore_h
+
+#include <sconex/ScriptBase.h>
+#include <sconex/Mutex.h>
+#include <sconex/FilePath.h>
+
+#include <openssl/ssl.h>
+
+class SSLModule;
+
+//=============================================================================
+// SSLCertStore - Lazily loaded certificates for SNI host names
+//
+class SSLCertStore : public scx::ScriptObject {
+public:
+
+  SSLCertStore(SSLModule& module);
+  virtual ~SSLCertStore();
+
+  // Register a certificate for a host name or wildcard pattern, replacing
+  // any existing certificate for the same pattern
+  void add(const std::string& pattern,
+           const scx::FilePath& key,
+           const scx::FilePath& cert);
+
+  // Remove the certificate for a pattern, returns false if there isn't one
+  bool remove(const std::string& pattern);
+
+  // Register each certificate in a directory, where files are named after
+  // the host, with the key in "host" and the certificate in "host.pub".
+  // A leading "_" in the name stands for a wildcard. Returns the number of
+  // certificates registered, or -1 if the directory could not be read.
+  int add_dir(const scx::FilePath& dir);
+
+  // Find the context to use for a host name, loading the certificate if
+  // required. Returns a new reference to the context, which the caller must
+  // release using SSL_CTX_free(), or NULL if there is no certificate for
+  // the host. The matching pattern is returned in pattern.
+  SSL_CTX* lookup(const std::string& host, std::string& pattern);
+
+  // Check loaded certificates for changes now, rather than waiting for the
+  // check interval to pass. Returns the number of certificates reloaded.
+  int reload();
+
+  // Get the wildcard pattern which would match a host name, or an empty
+  // string if there isn't one (i.e. "www.example.com" -> "*.example.com")
+  static std::string wildcard(const std::string& host);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<SSLCertStore> Ref;
+
+private:
+
+  typedef std::list<std::string> LRUList;
+
+  struct Entry {
+    scx::FilePath key;
+    scx::FilePath cert;
+    SSL_CTX* ctx;           // Loaded context, or NULL
+    time_t key_mtime;       // File times when last loaded (or attempted)
+    time_t cert_mtime;
+    time_t checked;         // When the files were last checked
+    bool failed;            // Files could not be loaded
+    bool listed;            // Entry is in the LRU list
+    LRUList::iterator lru;
+  };
+  typedef HASH_TYPE<std::string,Entry> EntryMap;
+
+  // Find the entry for a host name, trying an exact match then a wildcard
+  // (store must be locked)
+  EntryMap::iterator find(const std::string& host);
+
+  // Create a context using the specified key and certificate files,
+  // returns NULL and sets error on failure
+  SSL_CTX* load(const scx::FilePath& key,
+                const scx::FilePath& cert,
+                std::string& error);
+
+  // Load or reload an entry if it is not loaded or its files have changed
+  // since it was loaded. If force is not set, the files are only checked
+  // when the check interval has passed. Returns true if a new context was
+  // loaded. (store must be locked, but is unlocked while loading)
+  bool refresh(scx::MutexLocker& locker,
+               const std::string& pattern,
+               time_t now,
+               bool force);
+
+  // Release the context for an entry (store must be locked)
+  void unload(Entry& entry);
+
+  // Move an entry to the front of the LRU list, and unload the least
+  // recently used contexts if there are too many (store must be locked)
+  void touch(const std::string& pattern, Entry& entry);
+
+  SSLModule& m_module;
+  mutable scx::Mutex m_mutex;
+
+  EntryMap m_entries;
+  LRUList m_lru;
+
+  // Maximum number of contexts to keep loaded (0 for no limit)
+  int m_max_loaded;
+
+  // How often to check loaded certificates for changes (seconds)
+  int m_check_interval;
+
+  // Statistics
+  unsigned long m_hits;
+  unsigned long m_misses;
+  unsigned long m_loads;
+  unsigned long m_reloads;
+  unsigned long m_failures;
+  unsigned long m_evictions;
+};
+
+#endif
@@ -26,16 +26,117 @@ Free Software Foundation, Inc.,
 #include "SSLStream.h"
 #include <sconex/ScriptTypes.h>
 #include <sconex/Kernel.h>
+#include <sconex/File.h>
+#include <sconex/Log.h>
+
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
+
+// Indexes for storing the originating context in SSL objects, and the
+// channel in SSL contexts
+static int s_ssl_ctx_index = -1;
+static int s_ctx_channel_index = -1;
+
+//=========================================================================
+// Session ticket key callback, sets the HMAC key for the ticket
+//
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_key_cb(SSL* ssl,
+                         unsigned char* key_name,
+                         unsigned char* iv,
+                         EVP_CIPHER_CTX* cipher_ctx,
+                         EVP_MAC_CTX* mac_ctx,
+                         int enc)
+{
+  SSLChannel* channel = SSLChannel::get_channel(ssl);
+  if (!channel) return enc ? 0 : -1;
+
+  const unsigned char* hmac_key = 0;
+  int ret = channel->ticket_key(key_name,iv,cipher_ctx,hmac_key,enc);
+  if (ret > 0) {
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(
+      OSSL_MAC_PARAM_KEY,(void*)hmac_key,32);
+    params[1] = OSSL_PARAM_construct_utf8_string(
+      OSSL_MAC_PARAM_DIGEST,(char*)"sha256",0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (!EVP_MAC_CTX_set_params(mac_ctx,params)) return -1;
+  }
+  return ret;
+}
+#else
+static int ticket_key_cb(SSL* ssl,
+                         unsigned char* key_name,
+                         unsigned char* iv,
+                         EVP_CIPHER_CTX* cipher_ctx,
+                         HMAC_CTX* hmac_ctx,
+                         int enc)
+{
+  SSLChannel* channel = SSLChannel::get_channel(ssl);
+  if (!channel) return enc ? 0 : -1;
+
+  const unsigned char* hmac_key = 0;
+  int ret = channel->ticket_key(key_name,iv,cipher_ctx,hmac_key,enc);
+  if (ret > 0) {
+    HMAC_Init_ex(hmac_ctx,hmac_key,32,EVP_sha256(),0);
+  }
+  return ret;
+}
+#endif
+
+//=========================================================================
+// ALPN callback, selects the protocol for the connection
+//
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+static int alpn_select_cb(SSL* ssl,
+                          const unsigned char** out,
+                          unsigned char* outlen,
+                          const unsigned char* in,
+                          unsigned int inlen,
+                          void* arg)
+{
+  SSLChannel* channel = SSLChannel::get_channel(ssl);
+  if (channel && channel->select_alpn(*out,*outlen,in,inlen)) {
+    return SSL_TLSEXT_ERR_OK;
+  }
+  return SSL_TLSEXT_ERR_NOACK;
+}
+#endif
 
 //=========================================================================
 SSLChannel::SSLChannel(SSLModule& mod,
 		       const std::string& name,
 		       bool client
 ) : m_mod(mod),
-    m_name(name)
+    m_name(name),
+    m_client(client),
+    m_ktls(false),
+    m_cache_size(SSL_SESSION_CACHE_MAX_SIZE_DEFAULT),
+    m_timeout(7200),
+    m_tickets(true),
+    m_rotate(3600),
+    m_num_keys(0),
+    m_handshakes(0),
+    m_resumed(0),
+    m_direct(0),
+    m_ktls_send(0),
+    m_ktls_recv(0),
+    m_tickets_issued(0),
+    m_tickets_accepted(0),
+    m_tickets_renewed(0),
+    m_tickets_rejected(0),
+    m_rotations(0)
 {
   m_parent = &m_mod;
 
+  if (s_ssl_ctx_index < 0) {
+    s_ssl_ctx_index = SSL_get_ex_new_index(0,0,0,0,0);
+    s_ctx_channel_index = SSL_CTX_get_ex_new_index(0,0,0,0,0);
+  }
+
   if (client) {
     m_ctx = SSL_CTX_new( SSLv23_client_method() );
     DEBUG_ASSERT(0 != m_ctx,"SSLChannel() Bad SSL context");
@@ -48,18 +149,43 @@ SSLChannel::SSLChannel(SSLModule& mod,
   // Disallow old SSL protocols
   SSL_CTX_set_options(m_ctx, SSL_OP_NO_SSLv2);
   SSL_CTX_set_options(m_ctx, SSL_OP_NO_SSLv3);
+
+  SSL_CTX_set_ex_data(m_ctx, s_ctx_channel_index, this);
+  if (!client) {
+    SSL_CTX_set_session_id_context(
+      m_ctx,
+      (const unsigned char*)m_name.data(),
+      std::min((unsigned int)m_name.size(),
+               (unsigned int)SSL_MAX_SID_CTX_LENGTH));
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(m_ctx, ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(m_ctx, ticket_key_cb);
+#endif
+    setup_sessions();
+    set_alpn_callback(m_ctx);
+  }
 }
 
 //=========================================================================
 SSLChannel::~SSLChannel()
 {
+  // Connections may still hold a reference to the context
+  SSL_CTX_set_ex_data(m_ctx, s_ctx_channel_index, 0);
   SSL_CTX_free(m_ctx);
+  OPENSSL_cleanse(m_keys, sizeof(m_keys));
 }
 
 //=========================================================================
 SSL* SSLChannel::new_ssl()
 {
-  return SSL_new(m_ctx);
+  SSL* ssl = SSL_new(m_ctx);
+  if (ssl) {
+    // The session cache and ticket keys always belong to the context the
+    // connection was created with, even if SNI changes its context
+    SSL_set_ex_data(ssl, s_ssl_ctx_index, m_ctx);
+  }
+  return ssl;
 }
 
 //=========================================================================
@@ -68,6 +194,213 @@ void SSLChannel::change_ssl(SSL* ssl)
   SSL_set_SSL_CTX(ssl, m_ctx);
 }
 
+//=========================================================================
+void SSLChannel::change_ssl(SSL* ssl, SSL_CTX* ctx)
+{
+  SSL_set_SSL_CTX(ssl, ctx);
+
+  // Keep the session id context, so that sessions can still be resumed
+  // from this channel's cache
+  SSL_set_session_id_context(
+    ssl,
+    (const unsigned char*)m_name.data(),
+    std::min((unsigned int)m_name.size(),
+             (unsigned int)SSL_MAX_SID_CTX_LENGTH));
+}
+
+//=========================================================================
+void SSLChannel::set_alpn_callback(SSL_CTX* ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  SSL_CTX_set_alpn_select_cb(ctx, alpn_select_cb, 0);
+#endif
+}
+
+//=========================================================================
+bool SSLChannel::select_alpn(const unsigned char*& out,
+                             unsigned char& outlen,
+                             const unsigned char* in,
+                             unsigned int inlen)
+{
+  scx::MutexLocker locker(m_mutex);
+
+  // Use the first of our protocols offered by the client, pointing into the
+  // client's list as ours could be changed once the lock is released
+  const unsigned char* ours = (const unsigned char*)m_alpn.data();
+  unsigned int ours_len = m_alpn.size();
+  for (unsigned int i = 0; i < ours_len; i += 1 + ours[i]) {
+    for (unsigned int j = 0; j < inlen && j + 1 + in[j] <= inlen;
+         j += 1 + in[j]) {
+      if (ours[i] == in[j] && 0 == memcmp(ours+i+1, in+j+1, in[j])) {
+        out = in + j + 1;
+        outlen = in[j];
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+//=========================================================================
+SSLChannel* SSLChannel::get_channel(SSL* ssl)
+{
+  SSL_CTX* ctx = (SSL_CTX*)SSL_get_ex_data(ssl, s_ssl_ctx_index);
+  if (!ctx) return 0;
+  return (SSLChannel*)SSL_CTX_get_ex_data(ctx, s_ctx_channel_index);
+}
+
+//=========================================================================
+void SSLChannel::handshake_done(SSL* ssl, bool direct)
+{
+  SSLChannel* channel = get_channel(ssl);
+  if (channel) {
+    scx::MutexLocker locker(channel->m_mutex);
+    ++channel->m_handshakes;
+    if (SSL_session_reused(ssl)) ++channel->m_resumed;
+
+    if (direct) ++channel->m_direct;
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) ++channel->m_ktls_send;
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) ++channel->m_ktls_recv;
+#endif
+  }
+}
+
+//=========================================================================
+bool SSLChannel::get_ktls() const
+{
+  return m_ktls;
+}
+
+//=========================================================================
+int SSLChannel::ticket_key(unsigned char* key_name,
+                           unsigned char* iv,
+                           EVP_CIPHER_CTX* cipher_ctx,
+                           const unsigned char*& hmac_key,
+                           int enc)
+{
+  scx::MutexLocker locker(m_mutex);
+  check_ticket_keys();
+
+  if (enc) {
+    // Issue a new ticket using the current key
+    if (m_num_keys == 0) return 0;
+    const TicketKey& key = m_keys[0];
+    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) <= 0) return -1;
+    memcpy(key_name, key.name, TicketKeyNameLen);
+    if (!EVP_EncryptInit_ex(cipher_ctx, cipher, 0, key.aes_key, iv)) {
+      return -1;
+    }
+    hmac_key = key.hmac_key;
+    ++m_tickets_issued;
+    return 1;
+  }
+
+  // Find the key used to issue the ticket
+  for (int i=0; i<m_num_keys; ++i) {
+    const TicketKey& key = m_keys[i];
+    if (0 == memcmp(key_name, key.name, TicketKeyNameLen)) {
+      if (!EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), 0,
+                              key.aes_key, iv)) {
+        return -1;
+      }
+      hmac_key = key.hmac_key;
+      ++m_tickets_accepted;
+      if (i == 0) return 1;
+      // Issued using the previous key, so renew the ticket
+      ++m_tickets_renewed;
+      return 2;
+    }
+  }
+
+  // Unknown or expired key, fall back to a full handshake
+  ++m_tickets_rejected;
+  return 0;
+}
+
+//=========================================================================
+void SSLChannel::setup_sessions()
+{
+  if (m_cache_size > 0) {
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(m_ctx, m_cache_size);
+  } else {
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_OFF);
+  }
+  SSL_CTX_set_timeout(m_ctx, m_timeout);
+
+  if (m_tickets) {
+    SSL_CTX_clear_options(m_ctx, SSL_OP_NO_TICKET);
+  } else {
+    SSL_CTX_set_options(m_ctx, SSL_OP_NO_TICKET);
+  }
+}
+
+//=========================================================================
+bool SSLChannel::make_ticket_key(TicketKey& key, time_t period)
+{
+  key.period = period;
+
+  if (m_key_secret.empty()) {
+    return (RAND_bytes(key.name, TicketKeyNameLen) > 0 &&
+            RAND_bytes(key.aes_key, TicketKeyLen) > 0 &&
+            RAND_bytes(key.hmac_key, TicketKeyLen) > 0);
+  }
+
+  // Derive the key from the secret and the rotation period, so that other
+  // processes using the same secret generate the same keys
+  std::ostringstream oss;
+  oss << "sconeserver ticket key " << m_rotate << " " << period;
+  std::string label = oss.str();
+
+  unsigned char buffer[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  if (!HMAC(EVP_sha512(),
+            m_key_secret.data(), m_key_secret.size(),
+            (const unsigned char*)label.data(), label.size(),
+            buffer, &len) || len < 2*TicketKeyLen) {
+    return false;
+  }
+  memcpy(key.aes_key, buffer, TicketKeyLen);
+  memcpy(key.hmac_key, buffer + TicketKeyLen, TicketKeyLen);
+
+  label = "name " + label;
+  if (!HMAC(EVP_sha256(),
+            m_key_secret.data(), m_key_secret.size(),
+            (const unsigned char*)label.data(), label.size(),
+            buffer, &len) || len < TicketKeyNameLen) {
+    return false;
+  }
+  memcpy(key.name, buffer, TicketKeyNameLen);
+  OPENSSL_cleanse(buffer, sizeof(buffer));
+  return true;
+}
+
+//=========================================================================
+void SSLChannel::check_ticket_keys()
+{
+  time_t period = time(0) / m_rotate;
+  if (m_num_keys > 0 && m_keys[0].period == period) return;
+
+  // Keep the current key as the previous key, unless it has expired
+  if (m_num_keys > 0 && m_keys[0].period == period - 1) {
+    m_keys[1] = m_keys[0];
+    m_num_keys = 2;
+  } else {
+    m_num_keys = 0;
+  }
+
+  if (make_ticket_key(m_keys[0], period)) {
+    if (m_num_keys == 0) m_num_keys = 1;
+    ++m_rotations;
+  } else {
+    scx::Log("ssl").submit("Unable to generate session ticket key for "
+                           "channel '" + m_name + "'");
+    m_num_keys = 0;
+  }
+}
+
 //=============================================================================
 std::string SSLChannel::get_string() const
 {
@@ -84,9 +417,83 @@ scx::ScriptRef* SSLChannel::script_op(const scx::ScriptAuth& auth,
     const std::string name = right->object()->get_string();
 
     // Methods
-    if ("load_key" == name) {
+    if ("load_key" == name ||
+        "set_session_cache" == name ||
+        "set_tickets" == name ||
+        "set_ticket_key_file" == name ||
+        "flush_sessions" == name ||
+        "set_ktls" == name ||
+        "set_alpn" == name) {
       return new scx::ScriptMethodRef(ref,name);
     }
+
+    // Properties
+    if ("client" == name) return scx::ScriptInt::new_ref(m_client);
+
+    if (!m_client) {
+      // Session cache
+      if ("session_cache_size" == name)
+        return scx::ScriptInt::new_ref(m_cache_size);
+      if ("session_timeout" == name)
+        return scx::ScriptInt::new_ref(m_timeout);
+      if ("sessions" == name)
+        return scx::ScriptInt::new_ref(SSL_CTX_sess_number(m_ctx));
+      if ("hits" == name)
+        return scx::ScriptInt::new_ref(SSL_CTX_sess_hits(m_ctx));
+      if ("misses" == name)
+        return scx::ScriptInt::new_ref(SSL_CTX_sess_misses(m_ctx));
+      if ("timeouts" == name)
+        return scx::ScriptInt::new_ref(SSL_CTX_sess_timeouts(m_ctx));
+      if ("cache_full" == name)
+        return scx::ScriptInt::new_ref(SSL_CTX_sess_cache_full(m_ctx));
+
+      // Application protocols
+      scx::MutexLocker locker(m_mutex);
+      if ("alpn" == name) {
+        scx::ScriptList* list = new scx::ScriptList();
+        for (std::string::size_type i = 0; i < m_alpn.size();
+             i += 1 + (unsigned char)m_alpn[i]) {
+          list->give(scx::ScriptString::new_ref(
+                       m_alpn.substr(i+1, (unsigned char)m_alpn[i])));
+        }
+        return new scx::ScriptRef(list);
+      }
+
+      // Session tickets
+      if ("tickets" == name)
+        return scx::ScriptInt::new_ref(m_tickets);
+      if ("ticket_rotate" == name)
+        return scx::ScriptInt::new_ref(m_rotate);
+      if ("ticket_key_shared" == name)
+        return scx::ScriptInt::new_ref(!m_key_secret.empty());
+      if ("tickets_issued" == name)
+        return scx::ScriptInt::new_ref(m_tickets_issued);
+      if ("tickets_accepted" == name)
+        return scx::ScriptInt::new_ref(m_tickets_accepted);
+      if ("tickets_renewed" == name)
+        return scx::ScriptInt::new_ref(m_tickets_renewed);
+      if ("tickets_rejected" == name)
+        return scx::ScriptInt::new_ref(m_tickets_rejected);
+      if ("ticket_rotations" == name)
+        return scx::ScriptInt::new_ref(m_rotations);
+    }
+
+    // Handshakes
+    scx::MutexLocker locker(m_mutex);
+    if ("handshakes" == name)
+      return scx::ScriptInt::new_ref(m_handshakes);
+    if ("resumed" == name)
+      return scx::ScriptInt::new_ref(m_resumed);
+
+    // Kernel TLS
+    if ("ktls" == name)
+      return scx::ScriptInt::new_ref(m_ktls);
+    if ("direct" == name)
+      return scx::ScriptInt::new_ref(m_direct);
+    if ("ktls_send" == name)
+      return scx::ScriptInt::new_ref(m_ktls_send);
+    if ("ktls_recv" == name)
+      return scx::ScriptInt::new_ref(m_ktls_recv);
   }
 
   return scx::ScriptObject::script_op(auth,ref,op,right);
@@ -137,6 +544,125 @@ scx::ScriptRef* SSLChannel::script_method(const scx::ScriptAuth& auth,
     
     return 0;
   }
+
+  if ("set_ktls" == name) {
+    const scx::ScriptInt* a_enable =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"enable");
+    if (!a_enable)
+      return scx::ScriptError::new_ref("Enable must be specified");
+
+#ifdef SSL_OP_ENABLE_KTLS
+    scx::MutexLocker locker(m_mutex);
+    m_ktls = (0 != a_enable->get_int());
+    if (m_ktls) {
+      SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    } else {
+      SSL_CTX_clear_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    }
+    return 0;
+#else
+    if (a_enable->get_int())
+      return scx::ScriptError::new_ref("Kernel TLS is not supported");
+    return 0;
+#endif
+  }
+
+  if (m_client) {
+    return scx::ScriptObject::script_method(auth,ref,name,args);
+  }
+
+  if ("set_alpn" == name) {
+    // Protocols are given in order of preference, no arguments disables ALPN
+    std::string alpn;
+    for (int i=0; ; ++i) {
+      const scx::ScriptString* a_proto =
+        scx::get_method_arg<scx::ScriptString>(args,i,"");
+      if (!a_proto) break;
+      std::string proto = a_proto->get_string();
+      if (proto.empty() || proto.size() > 255)
+        return scx::ScriptError::new_ref("Invalid protocol name");
+      alpn += (char)proto.size();
+      alpn += proto;
+    }
+
+    scx::MutexLocker locker(m_mutex);
+    m_alpn = alpn;
+    return 0;
+  }
+
+  if ("set_session_cache" == name) {
+    const scx::ScriptInt* a_size =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"size");
+    if (!a_size || a_size->get_int() < 0)
+      return scx::ScriptError::new_ref("Cache size must be specified");
+
+    const scx::ScriptInt* a_timeout =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"timeout");
+    if (a_timeout && a_timeout->get_int() <= 0)
+      return scx::ScriptError::new_ref("Timeout must be positive");
+
+    scx::MutexLocker locker(m_mutex);
+    m_cache_size = a_size->get_int();
+    if (a_timeout) m_timeout = a_timeout->get_int();
+    setup_sessions();
+    return 0;
+  }
+
+  if ("set_tickets" == name) {
+    const scx::ScriptInt* a_enable =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"enable");
+    if (!a_enable)
+      return scx::ScriptError::new_ref("Enable must be specified");
+
+    const scx::ScriptInt* a_rotate =
+      scx::get_method_arg<scx::ScriptInt>(args,1,"rotate");
+    if (a_rotate && a_rotate->get_int() <= 0)
+      return scx::ScriptError::new_ref("Rotation interval must be positive");
+
+    scx::MutexLocker locker(m_mutex);
+    m_tickets = (0 != a_enable->get_int());
+    if (a_rotate && a_rotate->get_int() != m_rotate) {
+      m_rotate = a_rotate->get_int();
+      m_num_keys = 0;
+    }
+    setup_sessions();
+    return 0;
+  }
+
+  if ("set_ticket_key_file" == name) {
+    // Read a secret from which ticket keys are derived, or revert to
+    // random keys if no file is given
+    std::string secret;
+    const scx::ScriptString* a_file =
+      scx::get_method_arg<scx::ScriptString>(args,0,"file");
+    if (a_file && !a_file->get_string().empty()) {
+      scx::FilePath path =
+        scx::Kernel::get()->get_conf_path() + a_file->get_string();
+      scx::File file;
+      if (scx::Ok != file.open(path,scx::File::Read))
+        return scx::ScriptError::new_ref("Cannot open key file");
+      char buffer[1024];
+      int na = 0;
+      while (scx::Ok == file.read(buffer,sizeof(buffer),na)) {
+        secret.append(buffer,na);
+      }
+      OPENSSL_cleanse(buffer,sizeof(buffer));
+      if (secret.size() < 32)
+        return scx::ScriptError::new_ref("Key file must contain at least "
+                                         "32 bytes");
+    }
+
+    scx::MutexLocker locker(m_mutex);
+    m_key_secret = secret;
+    m_num_keys = 0;
+    return 0;
+  }
+
+  if ("flush_sessions" == name) {
+    // Remove expired sessions from the cache
+    SSL_CTX_flush_sessions(m_ctx, time(0));
+    return 0;
+  }
   
   return scx::ScriptObject::script_method(auth,ref,name,args);
 }
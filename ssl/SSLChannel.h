@@ -25,6 +25,8 @@ Free Software Foundation, Inc.,
 #include <sconex/Stream.h>
 #include <sconex/Module.h>
 #include <sconex/ScriptBase.h>
+#include <sconex/Mutex.h>
+#include <sconex/FilePath.h>
 
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
@@ -36,6 +38,15 @@ class SSLModule;
 //=========================================================================
 // SSLChannel - A wrapper for an OpenSSL context
 //
+// Server channels keep a cache of sessions, and issue session tickets
+// encrypted with keys that are rotated periodically, so that returning
+// clients can resume a session using an abbreviated handshake. Ticket keys
+// are normally random, but can be derived from a secret in a key file,
+// allowing tickets to be shared between server processes which use the
+// same file.
+//
+// Server channels can also advertise application protocols using ALPN.
+//
 class SSLChannel : public scx::ScriptObject {
 public:
 
@@ -50,7 +61,40 @@ public:
 
   // Modify an existing SSL connection object to use this channel
   void change_ssl(SSL* ssl);
-  
+
+  // Modify an existing SSL connection object created by this channel to use
+  // another context (i.e. one holding the certificate for an SNI host name)
+  void change_ssl(SSL* ssl, SSL_CTX* ctx);
+
+  // Set the ALPN callback on a context, the protocol is selected from the
+  // list for the channel which created the connection
+  static void set_alpn_callback(SSL_CTX* ctx);
+
+  // Select the preferred ALPN protocol which is also offered by the client,
+  // returns false if there is no protocol in common
+  bool select_alpn(const unsigned char*& out,
+                   unsigned char& outlen,
+                   const unsigned char* in,
+                   unsigned int inlen);
+
+  // Get the channel which created an SSL connection object
+  static SSLChannel* get_channel(SSL* ssl);
+
+  // Record the completion of a handshake on a connection, direct indicates
+  // that the connection is attached directly to the socket
+  static void handshake_done(SSL* ssl, bool direct);
+
+  // Should connections attach directly to the socket, allowing the
+  // encryption to be offloaded to the kernel (kTLS) if available
+  bool get_ktls() const;
+
+  // Session ticket key callback
+  int ticket_key(unsigned char* key_name,
+                 unsigned char* iv,
+                 EVP_CIPHER_CTX* cipher_ctx,
+                 const unsigned char*& hmac_key,
+                 int enc);
+
   // ScriptObject methods
   virtual std::string get_string() const;
 
@@ -70,12 +114,61 @@ protected:
 
 private:
 
+  // Configure the session cache and tickets on the context
+  void setup_sessions();
+
+  enum { TicketKeyNameLen = 16, TicketKeyLen = 32 };
+  struct TicketKey {
+    unsigned char name[TicketKeyNameLen];
+    unsigned char aes_key[TicketKeyLen];
+    unsigned char hmac_key[TicketKeyLen];
+    time_t period;
+  };
+
+  // Generate a ticket key for the specified rotation period
+  // (channel must be locked)
+  bool make_ticket_key(TicketKey& key, time_t period);
+
+  // Rotate the ticket keys if the current key has expired
+  // (channel must be locked)
+  void check_ticket_keys();
+
   SSLModule& m_mod;
   
   std::string m_name;
+  bool m_client;
 
   SSL_CTX* m_ctx;
-  
+  bool m_ktls;
+
+  // ALPN protocols in order of preference (in wire format)
+  std::string m_alpn;
+
+  mutable scx::Mutex m_mutex;
+
+  // Session cache settings
+  long m_cache_size;
+  long m_timeout;
+
+  // Session ticket settings and keys, the current key is used to issue
+  // new tickets, and tickets using the previous key are still accepted.
+  bool m_tickets;
+  long m_rotate;
+  std::string m_key_secret;
+  TicketKey m_keys[2];
+  int m_num_keys;
+
+  // Statistics
+  unsigned long m_handshakes;
+  unsigned long m_resumed;
+  unsigned long m_direct;
+  unsigned long m_ktls_send;
+  unsigned long m_ktls_recv;
+  unsigned long m_tickets_issued;
+  unsigned long m_tickets_accepted;
+  unsigned long m_tickets_renewed;
+  unsigned long m_tickets_rejected;
+  unsigned long m_rotations;
 };
 
 #endif
@@ -0,0 +1,265 @@
+/* SconeServer (http://www.sconemad.com)
+
+SSL handshake worker pool
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#include "SSLHandshake.h"
+#include "SSLModule.h"
+#include "SSLStream.h"
+
+#include <sconex/ScriptTypes.h>
+
+#include <openssl/ssl.h>
+#include <algorithm>
+
+//=============================================================================
+SSLHandshakeThread::SSLHandshakeThread(SSLHandshakePool& pool)
+  : m_pool(pool),
+    m_retired(false)
+{
+
+}
+
+//=============================================================================
+SSLHandshakeThread::~SSLHandshakeThread()
+{
+
+}
+
+//=============================================================================
+void* SSLHandshakeThread::run()
+{
+  while (await_wakeup()) {
+    m_pool.process(*this);
+  }
+  return 0;
+}
+
+//=============================================================================
+void SSLHandshakeThread::wake()
+{
+  // The thread holds its mutex except while waiting, so this ensures the
+  // wakeup cannot be missed
+  scx::MutexLocker locker(m_mutex);
+  wakeup();
+}
+
+
+//=============================================================================
+SSLHandshakePool::SSLHandshakePool(SSLModule& module)
+  : m_module(module),
+    m_max_queued(0),
+    m_steps(0),
+    m_handshakes(0),
+    m_failed(0),
+    m_rate_time(0),
+    m_rate_count(0),
+    m_rate(0)
+{
+  m_parent = &m_module;
+}
+
+//=============================================================================
+SSLHandshakePool::~SSLHandshakePool()
+{
+  set_threads(0);
+}
+
+//=============================================================================
+bool SSLHandshakePool::enabled() const
+{
+  scx::MutexLocker locker(m_mutex);
+  return !m_threads.empty();
+}
+
+//=============================================================================
+void SSLHandshakePool::submit(SSLStream* stream)
+{
+  scx::MutexLocker locker(m_mutex);
+  m_queue.push_back(stream);
+  if (m_queue.size() > m_max_queued) m_max_queued = m_queue.size();
+
+  if (m_idle.empty()) {
+    // All threads are busy, the stream will be picked up when one finishes
+    return;
+  }
+  SSLHandshakeThread* thread = m_idle.front();
+  m_idle.pop_front();
+  locker.unlock();
+
+  thread->wake();
+}
+
+//=============================================================================
+void SSLHandshakePool::cancel(SSLStream* stream)
+{
+  scx::MutexLocker locker(m_mutex);
+  m_queue.remove(stream);
+  while (std::find(m_active.begin(),m_active.end(),stream) !=
+         m_active.end()) {
+    m_finished.wait(m_mutex);
+  }
+}
+
+//=============================================================================
+void SSLHandshakePool::set_threads(int threads)
+{
+  ThreadList stopping;
+
+  scx::MutexLocker locker(m_mutex);
+  while ((int)m_threads.size() < threads) {
+    SSLHandshakeThread* thread = new SSLHandshakeThread(*this);
+    thread->start();
+    m_threads.push_back(thread);
+    m_idle.push_back(thread);
+  }
+  while ((int)m_threads.size() > threads) {
+    SSLHandshakeThread* thread = m_threads.back();
+    m_threads.pop_back();
+    m_idle.remove(thread);
+    thread->m_retired = true;
+    stopping.push_back(thread);
+  }
+
+  if (m_threads.empty() && !m_queue.empty()) {
+    // Hand any queued streams back to be run inline
+    for (StreamList::iterator it = m_queue.begin();
+         it != m_queue.end();
+         ++it) {
+      (*it)->handshake_cancelled();
+    }
+    m_queue.clear();
+  }
+  locker.unlock();
+
+  // Wait for the threads to finish what they are doing and exit
+  for (ThreadList::iterator it = stopping.begin();
+       it != stopping.end();
+       ++it) {
+    (*it)->stop();
+    delete (*it);
+  }
+}
+
+//=============================================================================
+std::string SSLHandshakePool::get_string() const
+{
+  return "SSLHandshakePool";
+}
+
+//=============================================================================
+scx::ScriptRef* SSLHandshakePool::script_op(const scx::ScriptAuth& auth,
+					    const scx::ScriptRef& ref,
+					    const scx::ScriptOp& op,
+					    const scx::ScriptRef* right)
+{
+  if (op.type() == scx::ScriptOp::Lookup) {
+    const std::string name = right->object()->get_string();
+
+    // Methods
+    if ("set_threads" == name) {
+      return new scx::ScriptMethodRef(ref,name);
+    }
+
+    // Properties
+    scx::MutexLocker locker(m_mutex);
+    if ("threads" == name)
+      return scx::ScriptInt::new_ref(m_threads.size());
+    if ("idle" == name)
+      return scx::ScriptInt::new_ref(m_idle.size());
+    if ("queued" == name)
+      return scx::ScriptInt::new_ref(m_queue.size());
+    if ("active" == name)
+      return scx::ScriptInt::new_ref(m_active.size());
+    if ("max_queued" == name)
+      return scx::ScriptInt::new_ref(m_max_queued);
+    if ("steps" == name)
+      return scx::ScriptInt::new_ref(m_steps);
+    if ("handshakes" == name)
+      return scx::ScriptInt::new_ref(m_handshakes);
+    if ("failed" == name)
+      return scx::ScriptInt::new_ref(m_failed);
+    if ("rate" == name) {
+      count_rate(time(0));
+      return scx::ScriptInt::new_ref(m_rate);
+    }
+  }
+
+  return scx::ScriptObject::script_op(auth,ref,op,right);
+}
+
+//=============================================================================
+scx::ScriptRef* SSLHandshakePool::script_method(const scx::ScriptAuth& auth,
+						const scx::ScriptRef& ref,
+						const std::string& name,
+						const scx::ScriptRef* args)
+{
+  if (!auth.admin()) return scx::ScriptError::new_ref("Not permitted");
+
+  if ("set_threads" == name) {
+    const scx::ScriptInt* a_threads =
+      scx::get_method_arg<scx::ScriptInt>(args,0,"threads");
+    if (!a_threads || a_threads->get_int() < 0)
+      return scx::ScriptError::new_ref("Number of threads must be specified");
+    set_threads(a_threads->get_int());
+    return 0;
+  }
+
+  return scx::ScriptObject::script_method(auth,ref,name,args);
+}
+
+//=============================================================================
+void SSLHandshakePool::process(SSLHandshakeThread& thread)
+{
+  scx::MutexLocker locker(m_mutex);
+  while (!thread.m_retired && !m_queue.empty()) {
+    SSLStream* stream = m_queue.front();
+    m_queue.pop_front();
+    m_active.push_back(stream);
+    locker.unlock();
+
+    int err = stream->run_handshake();
+
+    locker.lock();
+    m_active.remove(stream);
+    ++m_steps;
+    if (err == SSL_ERROR_NONE) {
+      ++m_handshakes;
+      count_rate(time(0));
+      ++m_rate_count;
+    } else if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+      ++m_failed;
+    }
+    m_finished.broadcast();
+  }
+
+  if (!thread.m_retired) {
+    m_idle.push_back(&thread);
+  }
+}
+
+//=============================================================================
+void SSLHandshakePool::count_rate(time_t now)
+{
+  if (now != m_rate_time) {
+    m_rate = (now == m_rate_time + 1) ? m_rate_count : 0;
+    m_rate_time = now;
+    m_rate_count = 0;
+  }
+}
@@ -0,0 +1,138 @@
+/* SconeServer (http://www.sconemad.com)
+
+SSL handshake worker pool
+
+Handshakes (which involve expensive private key operations) can be run on a
+separate pool of threads, rather than on the kernel thread which dispatched
+the connection's events, so that the kernel threads remain available to
+serve established connections when many new connections arrive at once.
+
+Copyright (c) 2000-2016 Andrew Wedgbury <wedge@sconemad.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2, or (at your option)
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program (see the file COPYING); if not, write to the
+Free Software Foundation, Inc.,
+59 Temple Place - Suite 330, Boston, MA  02111-1307, USA */
+
+#ifndef sslHandshake_h
+#define sslHandshake_h
+
+#include <sconex/ScriptBase.h>
+#include <sconex/Thread.h>
+#include <sconex/Mutex.h>
+
+class SSLModule;
+class SSLStream;
+class SSLHandshakePool;
+
+//=============================================================================
+// SSLHandshakeThread - A thread which runs queued handshake steps
+//
+class SSLHandshakeThread : public scx::Thread {
+public:
+
+  SSLHandshakeThread(SSLHandshakePool& pool);
+  virtual ~SSLHandshakeThread();
+
+  virtual void* run();
+
+  // Wake up the thread to process the queue
+  void wake();
+
+protected:
+
+  friend class SSLHandshakePool;
+
+  SSLHandshakePool& m_pool;
+
+  // Set when the thread is being removed from the pool
+  bool m_retired;
+};
+
+//=============================================================================
+// SSLHandshakePool - Queue of SSL streams waiting for a handshake step to be
+// run, and the threads which run them.
+//
+class SSLHandshakePool : public scx::ScriptObject {
+public:
+
+  SSLHandshakePool(SSLModule& module);
+  virtual ~SSLHandshakePool();
+
+  // Are handshakes being run by the pool, this is the case if it has any
+  // threads
+  bool enabled() const;
+
+  // Queue a stream to have its next handshake step run
+  void submit(SSLStream* stream);
+
+  // Remove a stream from the queue, waiting for its handshake step to
+  // finish if it is currently running
+  void cancel(SSLStream* stream);
+
+  // Set the number of threads (0 to run handshakes inline)
+  void set_threads(int threads);
+
+  // ScriptObject methods
+  virtual std::string get_string() const;
+
+  virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
+				    const scx::ScriptRef& ref,
+				    const scx::ScriptOp& op,
+				    const scx::ScriptRef* right=0);
+
+  virtual scx::ScriptRef* script_method(const scx::ScriptAuth& auth,
+					const scx::ScriptRef& ref,
+					const std::string& name,
+					const scx::ScriptRef* args);
+
+  typedef scx::ScriptRefTo<SSLHandshakePool> Ref;
+
+protected:
+
+  friend class SSLHandshakeThread;
+
+  // Run queued handshake steps until the queue is empty
+  void process(SSLHandshakeThread& thread);
+
+private:
+
+  // Count a completed handshake towards the rate (pool must be locked)
+  void count_rate(time_t now);
+
+  SSLModule& m_module;
+
+  mutable scx::Mutex m_mutex;
+  scx::ConditionEvent m_finished;
+
+  typedef std::list<SSLStream*> StreamList;
+  StreamList m_queue;
+  StreamList m_active;
+
+  typedef std::list<SSLHandshakeThread*> ThreadList;
+  ThreadList m_threads;
+  ThreadList m_idle;
+
+  // Statistics
+  unsigned long m_max_queued;
+  unsigned long m_steps;
+  unsigned long m_handshakes;
+  unsigned long m_failed;
+
+  // Handshakes completed in the current and previous second
+  time_t m_rate_time;
+  unsigned long m_rate_count;
+  unsigned long m_rate;
+};
+
+#endif
@@ -37,7 +37,9 @@ SCONEX_MODULE(SSLModule);
 
 //=========================================================================
 SSLModule::SSLModule()
-  : scx::Module("ssl",scx::version())
+  : scx::Module("ssl",scx::version()),
+    m_handshakes(0),
+    m_certs(0)
 {
   scx::Stream::register_stream("ssl",this);
 
@@ -90,6 +92,9 @@ int SSLModule::init()
 
   init_openssl_threading();
 
+  m_handshakes = new SSLHandshakePool::Ref(new SSLHandshakePool(*this));
+  m_certs = new SSLCertStore::Ref(new SSLCertStore(*this));
+
   return Module::init();
 }
 
@@ -104,6 +109,9 @@ bool SSLModule::close()
     delete it->second;
   }
   m_channels.clear();
+
+  delete m_handshakes; m_handshakes=0;
+  delete m_certs; m_certs=0;
   return true;
 }
 
@@ -123,12 +131,27 @@ SSLChannel* SSLModule::find_channel(const std::string& name)
 SSLChannel* SSLModule::lookup_channel_for_host(const std::string& host)
 {
   HostMap::const_iterator it = m_hostmap.find(host);
+  if (it == m_hostmap.end()) {
+    it = m_hostmap.find(SSLCertStore::wildcard(host));
+  }
   if (it != m_hostmap.end()) {
     return find_channel(it->second);
   }
   return 0;
 }
 
+//=============================================================================
+SSLHandshakePool& SSLModule::get_handshake_pool()
+{
+  return *m_handshakes->object();
+}
+
+//=============================================================================
+SSLCertStore& SSLModule::get_cert_store()
+{
+  return *m_certs->object();
+}
+
 //=============================================================================
 scx::ScriptRef* SSLModule::script_op(const scx::ScriptAuth& auth,
 				     const scx::ScriptRef& ref,
@@ -157,6 +180,9 @@ scx::ScriptRef* SSLModule::script_op(const scx::ScriptAuth& auth,
     }
 
     // Sub-objects
+    if ("handshakes" == name) return m_handshakes->ref_copy(ref.reftype());
+    if ("certs" == name) return m_certs->ref_copy(ref.reftype());
+
     SSLChannel* channel = find_channel(name);
     if (channel) {
       return new scx::ScriptRef(channel);
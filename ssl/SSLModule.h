@@ -23,6 +23,8 @@ Free Software Foundation, Inc.,
 #define sslModule_h
 
 #include "SSLChannel.h"
+#include "SSLHandshake.h"
+#include "SSLCertStore.h"
 #include <sconex/Module.h>
 #include <sconex/Descriptor.h>
 #include <sconex/Stream.h>
@@ -46,6 +48,10 @@ public:
 
   SSLChannel* find_channel(const std::string& name);
   SSLChannel* lookup_channel_for_host(const std::string& host);
+
+  SSLHandshakePool& get_handshake_pool();
+
+  SSLCertStore& get_cert_store();
   
   virtual scx::ScriptRef* script_op(const scx::ScriptAuth& auth,
 				    const scx::ScriptRef& ref,
@@ -74,8 +80,12 @@ private:
   typedef std::map<std::string,SSLChannel::Ref*> ChannelMap;
   ChannelMap m_channels;
 
-  typedef std::map<std::string,std::string> HostMap;
+  typedef HASH_TYPE<std::string,std::string> HostMap;
   HostMap m_hostmap;
+
+  SSLHandshakePool::Ref* m_handshakes;
+
+  SSLCertStore::Ref* m_certs;
   
 };
 
@@ -22,10 +22,13 @@ Free Software Foundation, Inc.,
 #include "SSLStream.h"
 #include "SSLModule.h"
 #include "SSLChannel.h"
+#include "SSLHandshake.h"
 
 #include <sconex/StreamSocket.h>
 #include <sconex/ScriptTypes.h>
 #include <sconex/Log.h>
+#include <sconex/Kernel.h>
+#include <sconex/utils.h>
 
 // Uncomment to enable debug info for the SSL Stream
 //#define SSLStream_DEBUG_LOG(m) DEBUG_LOG(m)
@@ -55,8 +58,12 @@ SSLStream::SSLStream(SSLModule* module,
     m_channel(channel),
     m_client(false),
     m_ssl(0),
+    m_bio(0),
+    m_direct(false),
     m_seq(0),
     m_init_retries(0),
+    m_async(AsyncIdle),
+    m_async_err(0),
     m_last_read_cond(scx::Ok),
     m_last_write_cond(scx::Ok)
 {
@@ -66,6 +73,9 @@ SSLStream::SSLStream(SSLModule* module,
 //=============================================================================
 SSLStream::~SSLStream()
 {
+  if (m_async != AsyncIdle) {
+    m_module.object()->get_handshake_pool().cancel(this);
+  }
   if (m_ssl) {
     SSL_free(m_ssl);
   }
@@ -87,6 +97,13 @@ scx::Condition SSLStream::read(void* buffer,
   SSLStream_DEBUG_LOG("read() SSLStream::read(buff," << n << ") read " << na
                       << " error=" << e);
 
+  if (m_direct && n>0 && na<=0) {
+    // There's no BIO callback to report the socket condition in direct
+    // mode, so it has to be worked out from the SSL error.
+    na=0;
+    return direct_condition(e);
+  }
+
   if (na<0 || e == SSL_ERROR_ZERO_RETURN) {
     na=0;
     return scx::End;
@@ -114,6 +131,12 @@ scx::Condition SSLStream::write(const void* buffer,
   SSLStream_DEBUG_LOG("read() SSLStream::write(buff," << n << ") wrote "
                       << na);
 
+  if (m_direct && n>0 && na<=0) {
+    int e = SSL_get_error(m_ssl,na);
+    na=0;
+    return direct_condition(e);
+  }
+
   if (na<0) {
     na=0;
     return scx::Error;
@@ -126,6 +149,57 @@ scx::Condition SSLStream::write(const void* buffer,
   return scx::Ok;
 }
 
+//=============================================================================
+scx::Condition SSLStream::direct_condition(int ssl_error) const
+{
+  switch (ssl_error) {
+    case SSL_ERROR_NONE:
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return scx::Wait;
+    case SSL_ERROR_ZERO_RETURN:
+      return scx::End;
+    default:
+      // SSL_ERROR_SYSCALL, SSL_ERROR_SSL, etc
+      return scx::Error;
+  }
+}
+
+//=============================================================================
+scx::Condition SSLStream::write_file(int fd,
+				     int n,
+				     int& na)
+{
+  na=0;
+#ifndef OPENSSL_NO_KTLS
+  if (m_seq != Connected || !m_direct ||
+      !BIO_get_ktls_send(SSL_get_wbio(m_ssl))) {
+    return scx::End;
+  }
+
+  // SSL_sendfile takes an explicit offset, so use and then update the
+  // current file position
+  off_t pos = lseek(fd,0,SEEK_CUR);
+  if (pos < 0) {
+    return scx::End;
+  }
+
+  ossl_ssize_t ret = SSL_sendfile(m_ssl,fd,pos,n,0);
+  if (ret >= 0) {
+    na = (int)ret;
+    lseek(fd,pos+ret,SEEK_SET);
+    return scx::Ok;
+  }
+
+  int e = SSL_get_error(m_ssl,(int)ret);
+  if (e == SSL_ERROR_WANT_WRITE || e == SSL_ERROR_WANT_READ) {
+    return scx::Wait;
+  }
+  return scx::Error;
+#else
+  return scx::End;
+#endif
+}
 
 //=============================================================================
 scx::Condition SSLStream::event(scx::Stream::Event e)
@@ -159,6 +233,16 @@ scx::Condition SSLStream::event(scx::Stream::Event e)
     } break;
 
     case scx::Stream::Closing: { // CLOSING
+      if (m_async != AsyncIdle) {
+        // Make sure the handshake pool has finished with this stream
+        m_module.object()->get_handshake_pool().cancel(this);
+        m_async = AsyncIdle;
+      }
+      if (m_seq == Connected) {
+        // Send close notify, otherwise OpenSSL treats the session as bad
+        // and removes it from the session cache
+        SSL_shutdown(m_ssl);
+      }
       SSL_free(m_ssl);
       m_ssl=0;
     } break;
@@ -206,10 +290,24 @@ scx::Condition SSLStream::init_ssl()
     return scx::Error;
   }
   
-  m_bio = BIO_new_scxsp(this,0);
-  SSL_set_bio(m_ssl,m_bio,m_bio);
-  BIO_set_ssl(m_bio,m_ssl,BIO_CLOSE);
-  BIO_set_nbio(m_bio,1);
+  SSL_set_app_data(m_ssl,this);
+
+  // If kTLS is enabled and this is the first stream on a socket, OpenSSL
+  // can use the socket directly, otherwise go through the preceeding stream
+  scx::StreamSocket* socket =
+    dynamic_cast<scx::StreamSocket*>(&endpoint());
+  m_direct = (channel->get_ktls() && socket && is_first_stream() &&
+              socket->fd() >= 0);
+
+  if (m_direct) {
+    m_bio = BIO_new_socket(socket->fd(),BIO_NOCLOSE);
+    SSL_set_bio(m_ssl,m_bio,m_bio);
+  } else {
+    m_bio = BIO_new_scxsp(this,0);
+    SSL_set_bio(m_ssl,m_bio,m_bio);
+    BIO_set_ssl(m_bio,m_ssl,BIO_CLOSE);
+    BIO_set_nbio(m_bio,1);
+  }
 
   m_seq = Connecting;
   return scx::Wait;
@@ -217,6 +315,55 @@ scx::Condition SSLStream::init_ssl()
 
 //=============================================================================
 scx::Condition SSLStream::connect_ssl(scx::Stream::Event e)
+{
+  switch (m_async.load(std::memory_order_acquire)) {
+    case AsyncQueued:
+      // Still waiting for the handshake pool
+      return scx::Wait;
+
+    case AsyncDone:
+      m_async = AsyncIdle;
+      return handshake_result(m_async_err,e);
+
+    default:
+      break;
+  }
+
+  SSLHandshakePool& pool = m_module.object()->get_handshake_pool();
+  if (pool.enabled()) {
+    // Run the handshake step in the pool, which will request a writeable
+    // event for this stream when it is done
+    enable_event(scx::Stream::Readable,false);
+    enable_event(scx::Stream::Writeable,false);
+    m_async = AsyncQueued;
+    pool.submit(this);
+    return scx::Wait;
+  }
+
+  return handshake_result(handshake_step(),e);
+}
+
+//=============================================================================
+int SSLStream::run_handshake()
+{
+  int err = handshake_step();
+  m_async_err = err;
+  m_async.store(AsyncDone,std::memory_order_release);
+  request_event(scx::Stream::Writeable);
+  scx::Kernel::get()->wakeup();
+  return err;
+}
+
+//=============================================================================
+void SSLStream::handshake_cancelled()
+{
+  m_async.store(AsyncIdle,std::memory_order_release);
+  request_event(scx::Stream::Writeable);
+  scx::Kernel::get()->wakeup();
+}
+
+//=============================================================================
+int SSLStream::handshake_step()
 {
   int ret = 0;
   if (m_client) {
@@ -240,7 +387,12 @@ scx::Condition SSLStream::connect_ssl(scx::Stream::Event e)
       SSLStream_DEBUG_LOG("ERR " << e << ": " << buf);
     }
   }
-  
+  return err;
+}
+
+//=============================================================================
+scx::Condition SSLStream::handshake_result(int err, scx::Stream::Event e)
+{
   if (++m_init_retries > 10) {    
     DEBUG_LOG("connect_ssl aborted after 10 retries");
     return scx::Error;
@@ -255,6 +407,7 @@ scx::Condition SSLStream::connect_ssl(scx::Stream::Event e)
   }
   
   SSLStream_DEBUG_LOG("Opened secure connection using " << SSL_get_cipher(m_ssl));
+  SSLChannel::handshake_done(m_ssl,m_direct);
 
   m_seq = Connected;
   enable_event(scx::Stream::Opening,true);
@@ -268,6 +421,8 @@ std::string SSLStream::stream_status() const
 {
   std::ostringstream oss;
   oss << m_channel 
+      << (m_cert.empty() ? "" : " cert:" + m_cert)
+      << (m_direct ? " direct" : "")
       << " seq:";
   switch (m_seq) {
   case Start: oss << "START"; break;
@@ -280,6 +435,19 @@ std::string SSLStream::stream_status() const
     if (cipher) {
       oss << " cipher:" << SSL_CIPHER_get_name(cipher);
     }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    const unsigned char* alpn = 0;
+    unsigned int alpn_len = 0;
+    SSL_get0_alpn_selected(m_ssl, &alpn, &alpn_len);
+    if (alpn_len > 0) {
+      oss << " alpn:" << std::string((const char*)alpn, alpn_len);
+    }
+#endif
+#ifndef OPENSSL_NO_KTLS
+    if (m_direct && BIO_get_ktls_send(SSL_get_wbio(m_ssl))) {
+      oss << " ktls";
+    }
+#endif
   }
   return oss.str();
 }
@@ -302,8 +470,7 @@ int SSLStream::sni_callback(SSL *ssl, int *ad, void *arg)
   const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
   SSLStream_DEBUG_LOG("SSL SNI hostname=" << (host ? host : "NULL"));
   if (host) {
-    BIO* b = SSL_get_rbio(ssl);
-    SSLStream* scxsp = (SSLStream*)BIO_get_data(b);
+    SSLStream* scxsp = (SSLStream*)SSL_get_app_data(ssl);
     scxsp->got_hostname(host);
   }
   return SSL_TLSEXT_ERR_OK;
@@ -312,7 +479,11 @@ int SSLStream::sni_callback(SSL *ssl, int *ad, void *arg)
 //=============================================================================
 void SSLStream::got_hostname(const std::string& host)
 {
-  SSLChannel* c = m_module.object()->lookup_channel_for_host(host);
+  std::string name = host;
+  scx::strlow(name);
+
+  SSLModule* module = m_module.object();
+  SSLChannel* c = module->lookup_channel_for_host(name);
   if (c) {
     std::string cn = c->get_string();
     if (cn != m_channel) {
@@ -322,6 +493,15 @@ void SSLStream::got_hostname(const std::string& host)
       m_channel = cn;
       c->change_ssl(m_ssl);
     }
+    return;
+  }
+
+  // Use the certificate for the host from the store, if there is one
+  SSL_CTX* ctx = module->get_cert_store().lookup(name,m_cert);
+  if (ctx) {
+    c = module->find_channel(m_channel);
+    if (c) c->change_ssl(m_ssl,ctx);
+    SSL_CTX_free(ctx);
   }
 }
 
@@ -30,6 +30,8 @@ Free Software Foundation, Inc.,
 #include <openssl/x509.h>
 #include <openssl/pem.h>
 
+#include <atomic>
+
 class SSLModule;
 
 //=============================================================================
@@ -50,6 +52,10 @@ public:
   virtual scx::Condition read(void* buffer,int n,int& na);
   virtual scx::Condition write(const void* buffer,int n,int& na);
 
+  // Files can be sent directly if the encryption has been offloaded to the
+  // kernel (kTLS)
+  virtual scx::Condition write_file(int fd,int n,int& na);
+
   virtual scx::Condition event(scx::Stream::Event e);
   virtual bool has_readable() const;
   
@@ -58,6 +64,14 @@ public:
   scx::Condition init_ssl();
   scx::Condition connect_ssl(scx::Stream::Event e);
 
+  // Run the next handshake step from the handshake pool, returning the
+  // SSL error code
+  int run_handshake();
+
+  // The handshake pool is no longer running handshakes, so the handshake
+  // must continue inline
+  void handshake_cancelled();
+
   void set_last_read_cond(scx::Condition c);
   void set_last_write_cond(scx::Condition c);
   
@@ -69,18 +83,41 @@ protected:
   scx::ScriptRefTo<SSLModule> m_module;
   std::string m_channel;
   bool m_client;
+
+  // Certificate store pattern matching the SNI host name, if in use
+  std::string m_cert;
   
   SSL* m_ssl;
   X509* m_client_cert;
   BIO* m_bio;
 
+  // Is OpenSSL attached directly to the socket, rather than reading and
+  // writing through the preceeding stream
+  bool m_direct;
+
   int m_seq;
   int m_init_retries;
+
+  // State of a handshake step run by the handshake pool. The pool thread
+  // sets m_async_err before publishing AsyncDone, so it is only read once
+  // AsyncDone has been seen.
+  enum AsyncState { AsyncIdle, AsyncQueued, AsyncDone };
+  std::atomic<AsyncState> m_async;
+  int m_async_err;
   scx::Condition m_last_read_cond;
   scx::Condition m_last_write_cond;
 
 private:
 
+  // Run a handshake step, returning the SSL error code
+  int handshake_step();
+
+  // Continue according to the result of a handshake step
+  scx::Condition handshake_result(int err, scx::Stream::Event e);
+
+  // Condition for a failed read or write in direct mode, from the SSL error
+  scx::Condition direct_condition(int ssl_error) const;
+
 };
 
 #endif
@@ -138,6 +138,9 @@ void BIO_set_shutdown(BIO *a, int shut)
 int BIO_get_shutdown(BIO *a)
 { return a->shutdown; }
 
+int SSL_CTX_up_ref(SSL_CTX *ctx)
+{ return CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX) > 1; }
+
 #else
 
 // OpenSSL>=1.1 handles threading itself
@@ -54,6 +54,8 @@ int BIO_get_init(BIO *a);
 void BIO_set_shutdown(BIO *a, int shut);
 int BIO_get_shutdown(BIO *a);
 
+int SSL_CTX_up_ref(SSL_CTX *ctx);
+
 #endif
 
 }
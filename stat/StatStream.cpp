@@ -62,6 +62,16 @@ scx::Condition StatStream::write(const void* buffer,int n,int& na)
   return c;
 }
 
+//=========================================================================
+scx::Condition StatStream::write_file(int fd,int n,int& na)
+{
+  scx::Condition c = chain_write_file(fd,n,na);
+  if (c == scx::End) return c;
+  inc_stat(c == scx::Error ? Stats::Errors : Stats::Writes, 1);
+  inc_stat(Stats::BytesWritten, na);
+  return c;
+}
+
 //=========================================================================
 std::string StatStream::stream_status() const
 {
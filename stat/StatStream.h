@@ -43,6 +43,7 @@ protected:
 
   virtual scx::Condition read(void* buffer,int n,int& na);
   virtual scx::Condition write(const void* buffer,int n,int& na);
+  virtual scx::Condition write_file(int fd,int n,int& na);
 
   virtual std::string stream_status() const;
   